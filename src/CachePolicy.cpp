@@ -0,0 +1,85 @@
+#include "CachePolicy.h"
+#include "HTTPResponse.h"  // for HTTPResponse
+#include "PathResolver.h"  // for PathResolver
+
+#include <algorithm>       // for sort
+#include <cstdlib>         // for strtol
+#include <cstring>         // for memcmp
+#include <ctime>           // for time, gmtime_r, strftime
+#include <utility>         // for move
+
+/**
+ * @param rules "PREFIX=DIRECTIVES" strings, already checked by ServerConfig
+ */
+CachePolicy::CachePolicy(const std::vector<std::string>& rules)
+{
+    for (const std::string& text : rules)
+    {
+        size_t equals = text.find('=');
+        Rule rule;
+        rule.prefix = text.substr(0, equals);
+        // "/static/" and "/static" both mean the /static subtree
+        while (rule.prefix.size() > 1 && rule.prefix.back() == '/')
+            rule.prefix.pop_back();
+        rule.cache_control = text.substr(equals + 1);
+        rule.max_age = -1;
+        // "s-maxage=" doesn't contain "max-age="
+        size_t max_age = rule.cache_control.find("max-age=");
+        if (max_age != std::string::npos)
+        {
+            rule.max_age = std::strtol(rule.cache_control.c_str() + max_age + 8,
+                                       nullptr, 10);
+        }
+        rules_.push_back(std::move(rule));
+    }
+    std::sort(rules_.begin(), rules_.end(),
+              [](const Rule& a, const Rule& b)
+              {
+                  return a.prefix.size() > b.prefix.size();
+              });
+}
+
+/**
+ * @summary Adds the caching headers of the rule matching `path` (a request
+ * path, normalized here) to a response, if any rule matches
+ */
+void CachePolicy::apply(const std::string& path, HTTPResponse& response) const
+{
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(path, normalized, length))
+        return;
+    for (const Rule& rule : rules_)
+    {
+        const std::string& prefix = rule.prefix;
+        if (length < prefix.size() ||
+            std::memcmp(normalized, prefix.data(), prefix.size()) != 0 ||
+            (prefix.back() != '/' && length != prefix.size() &&
+             normalized[prefix.size()] != '/'))
+        {
+            continue;
+        }
+        response.set_header("Cache-Control", rule.cache_control);
+        if (rule.max_age < 0)
+            return;
+        // The last Expires this thread formatted, reused within the second
+        thread_local long last_max_age = -1;
+        thread_local time_t last_now = 0;
+        thread_local std::string expires;
+        time_t now = std::time(nullptr);
+        if (last_max_age != rule.max_age || last_now != now)
+        {
+            time_t when = now + rule.max_age;
+            struct tm tm;
+            char date[64];
+            gmtime_r(&when, &tm);
+            expires.assign(date, std::strftime(date, sizeof(date),
+                                               "%a, %d %b %Y %H:%M:%S GMT",
+                                               &tm));
+            last_max_age = rule.max_age;
+            last_now = now;
+        }
+        response.set_header("Expires", expires);
+        return;
+    }
+}
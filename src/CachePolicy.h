@@ -0,0 +1,42 @@
+#ifndef CACHEPOLICY_H
+#define CACHEPOLICY_H
+
+#include <string>       // for string
+#include <vector>       // for vector
+
+class HTTPResponse;
+
+/**
+ * @summary Caching headers for files, by path prefix, so browsers and CDNs
+ * can keep assets instead of revalidating them. Rules are given as
+ * "PREFIX=DIRECTIVES" (e.g. "/static=public, max-age=31536000, immutable")
+ * and the longest prefix matching the normalized path wins; a prefix
+ * matches whole path segments, as proxy routes do.
+ *
+ * The directives are sent as Cache-Control, and when they include max-age
+ * an Expires header that many seconds ahead is added for HTTP/1.0 caches.
+ * Header values are built once, when the rules are parsed. Each thread
+ * keeps the last Expires it formatted, which is reused within the same
+ * second for the same max-age.
+ */
+class CachePolicy
+{
+public:
+    explicit CachePolicy(const std::vector<std::string>& rules);
+    CachePolicy(const CachePolicy&) = delete; // prevent copy
+    CachePolicy& operator=(const CachePolicy&) = delete; // prevent assignment
+
+    void apply(const std::string& path, HTTPResponse& response) const;
+
+private:
+    struct Rule
+    {
+        std::string prefix;
+        std::string cache_control;
+        long        max_age;  // -1 if the directives have none
+    };
+
+    std::vector<Rule> rules_; // longest prefix first
+};
+
+#endif
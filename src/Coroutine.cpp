@@ -0,0 +1,261 @@
+#include "Coroutine.h"
+#include "Metrics.h"    // for Metrics
+#include "logging.h"    // for LOG_END, LOG_ERROR
+
+#include <cerrno>       // for errno, EAGAIN, EWOULDBLOCK, EINTR, ETIMEDOUT
+#include <cstring>      // for strerror
+
+Reactor::Waiter::Waiter(Reactor& reactor, int fd, short events, int timeout_s,
+                        bool idle) :
+    reactor_(reactor), fd_(fd), events_(events), timeout_s_(timeout_s),
+    idle_(idle), result_(Reactor::READY), deadline_ns_(0)
+{
+}
+
+/**
+ * @summary Called by co_await once attempt() would block: parks the
+ * coroutine until the Reactor has finished the operation
+ */
+void Reactor::Waiter::await_suspend(std::coroutine_handle<> handle)
+{
+    handle_ = handle;
+    if (timeout_s_ > 0)
+        deadline_ns_ = Metrics::now_ns() + timeout_s_ * 1000000000ull;
+    reactor_.suspend(*this);
+}
+
+Reactor::Reactor(Poller::Backend backend) :
+    poller_(backend), waiters_(256, nullptr), watching_(256, 0),
+    next_expire_ns_(0)
+{
+}
+
+/**
+ * @summary Destroys the coroutines still waiting, which runs their
+ * destructors (closing their connections)
+ */
+Reactor::~Reactor()
+{
+    for (size_t fd = 0; fd < waiters_.size(); fd++)
+    {
+        Waiter* waiter = waiters_[fd];
+        if (!waiter)
+            continue;
+        waiters_[fd] = nullptr;
+        waiter->handle_.destroy();
+    }
+}
+
+void Reactor::suspend(Waiter& waiter)
+{
+    int fd = waiter.fd_;
+    // resize if we have to
+    if (waiters_.size() <= (unsigned)fd)
+    {
+        waiters_.resize(fd + 64, nullptr);
+        watching_.resize(fd + 64, 0);
+    }
+    waiters_[fd] = &waiter;
+    watch(fd, waiter.events_);
+}
+
+/**
+ * @summary Makes the poller watch `fd` for `events`. An fd stays in the
+ * poller between waits, so a connection alternating reads and writes only
+ * changes its events, and one that keeps reading costs nothing.
+ */
+void Reactor::watch(int fd, short events)
+{
+    if (watching_[fd] == events)
+        return;
+    if (watching_[fd] == 0)
+        poller_.add(fd, events);
+    else
+        poller_.modify(fd, events);
+    watching_[fd] = events;
+}
+
+/**
+ * @summary Stops watching `fd`; must be called before `fd` is closed
+ */
+void Reactor::forget(int fd)
+{
+    if ((unsigned)fd < watching_.size() && watching_[fd] != 0)
+    {
+        poller_.remove(fd);
+        watching_[fd] = 0;
+    }
+}
+
+void Reactor::resume(Waiter& waiter, Result result)
+{
+    waiters_[waiter.fd_] = nullptr;
+    waiter.result_ = result;
+    waiter.handle_.resume();
+}
+
+/**
+ * @summary Waits up to `timeout_ms` (-1 = until something is ready) for
+ * fds to become ready, retrying the operations waiting on them and resuming
+ * the coroutines whose operations are done. Waits with a timeout are
+ * checked every TIMER_MS, so they can end up to that much late.
+ *
+ * @return what Poller::wait returned
+ */
+int Reactor::poll(int timeout_ms)
+{
+    if (timeout_ms < 0 || timeout_ms > TIMER_MS)
+        timeout_ms = TIMER_MS;
+    int ret = poller_.wait(timeout_ms);
+    if (ret == -1 && errno != EINTR)
+    {
+        LOG_ERROR << "poll(): " << std::strerror(errno) << LOG_END;
+    }
+    for (const Poller::Event& event : poller_.ready())
+    {
+        // Resuming one coroutine may have ended the wait of another one in
+        // this batch, or started a new wait on a reused fd; retrying the
+        // operation finds out whether it is really ready
+        Waiter* waiter = (unsigned)event.fd < waiters_.size()
+                         ? waiters_[event.fd] : nullptr;
+        // Nobody is waiting on it (its coroutine is waiting on another fd),
+        // so stop watching it rather than be woken for it over and over
+        if (!waiter)
+        {
+            forget(event.fd);
+            continue;
+        }
+        if (waiter->attempt())
+            resume(*waiter, READY);
+        else
+            watch(event.fd, waiter->events_);
+    }
+    uint64_t now = Metrics::now_ns();
+    if (now >= next_expire_ns_)
+    {
+        expire();
+        next_expire_ns_ = now + TIMER_MS * 1000000ull;
+    }
+    return ret;
+}
+
+/**
+ * @summary Resumes the waits whose deadline has passed, with TIMEOUT
+ */
+void Reactor::expire()
+{
+    uint64_t now = Metrics::now_ns();
+    // A resumed coroutine may start a new wait on any fd, so look each one
+    // up again
+    for (size_t fd = 0; fd < waiters_.size(); fd++)
+    {
+        Waiter* waiter = waiters_[fd];
+        if (waiter && waiter->deadline_ns_ != 0 && waiter->deadline_ns_ <= now)
+            resume(*waiter, TIMEOUT);
+    }
+}
+
+/**
+ * @summary Resumes every wait marked idle, with CANCELLED
+ */
+void Reactor::cancel_idle()
+{
+    for (size_t fd = 0; fd < waiters_.size(); fd++)
+    {
+        Waiter* waiter = waiters_[fd];
+        if (waiter && waiter->idle_)
+            resume(*waiter, CANCELLED);
+    }
+}
+
+ssize_t IOWaiter::await_resume() const
+{
+    if (result_ == Reactor::TIMEOUT)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (result_ == Reactor::CANCELLED)
+    {
+        errno = ECANCELED;
+        return -1;
+    }
+    return ret_;
+}
+
+/**
+ * @return whether a failed operation should wait and try again
+ */
+static bool would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+bool Recv::attempt()
+{
+    ret_ = TLSConnection::recv(tls_, fd_, buf_, len_);
+    return ret_ >= 0 || !would_block();
+}
+
+bool Send::attempt()
+{
+    const char* data = static_cast<const char*>(buf_);
+    while (len_ > 0)
+    {
+        ssize_t bytes_written = TLSConnection::send(tls_, fd_, data, len_,
+                                                    flags_);
+        if (bytes_written < 0)
+        {
+            if (would_block())
+                return false;
+            ret_ = -1;
+            return true;
+        }
+        data += bytes_written;
+        len_ -= bytes_written;
+        ret_ += bytes_written;
+        buf_ = data;
+    }
+    return true;
+}
+
+bool SendFile::attempt()
+{
+    while (count_ > 0)
+    {
+        ssize_t bytes_written = TLSConnection::sendfile(tls_, fd_, file_,
+                                                        offset_, count_);
+        if (bytes_written < 0)
+        {
+            if (would_block())
+                return false;
+            ret_ = -1;
+            return true;
+        }
+        // The file is shorter than it was
+        if (bytes_written == 0)
+            break;
+        count_ -= bytes_written;
+        ret_ += bytes_written;
+    }
+    return true;
+}
+
+bool Handshake::attempt()
+{
+    switch (tls_.handshake())
+    {
+        case TLSConnection::OK:
+            ok_ = true;
+            return true;
+        case TLSConnection::WANT_READ:
+            events_ = POLLIN;
+            return false;
+        case TLSConnection::WANT_WRITE:
+            events_ = POLLOUT;
+            return false;
+        case TLSConnection::FAILED:
+            break;
+    }
+    return true;
+}
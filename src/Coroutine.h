@@ -0,0 +1,229 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "Poller.h"     // for Poller
+#include "TLS.h"        // for TLSConnection
+
+#include <sys/types.h>  // for off_t, ssize_t
+
+#include <coroutine>    // for coroutine_handle, suspend_never
+#include <cstdint>      // for uint64_t
+#include <exception>    // for terminate
+#include <vector>       // for vector
+
+/**
+ * @summary A detached coroutine: it starts running as soon as it is called,
+ * runs until its first co_await that has to wait, and frees its own frame
+ * when it returns. Nothing waits for it to finish; whatever it owns is
+ * cleaned up by its locals' destructors, which also run if the Reactor
+ * destroys it while it is suspended.
+ */
+struct Task
+{
+    struct promise_type
+    {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * @summary Resumes coroutines once the socket they wait on is ready, on top
+ * of a Poller. At most one coroutine waits on each fd at a time, which is
+ * all one connection needs.
+ *
+ * Each awaitable first tries its operation right away and only suspends if
+ * it would block. While suspended it stays registered as a Waiter, and the
+ * Reactor retries the operation each time the fd is ready, so the coroutine
+ * is only resumed once the operation is done (or failed), with no
+ * allocation per operation. A wait can have a timeout, and waits marked
+ * idle (a connection between requests) can all be cancelled at once, for
+ * a graceful shutdown.
+ */
+class Reactor
+{
+public:
+    enum Result
+    {
+        READY,
+        TIMEOUT,
+        CANCELLED
+    };
+
+    /**
+     * @summary The part of every awaitable that the Reactor sees
+     */
+    class Waiter
+    {
+    public:
+        Waiter(Reactor& reactor, int fd, short events, int timeout_s,
+               bool idle);
+        virtual ~Waiter() = default;
+
+        bool await_ready() { return attempt(); }
+        void await_suspend(std::coroutine_handle<> handle);
+
+    protected:
+        // Tries the operation; false if it has to wait for `events_`
+        virtual bool attempt() = 0;
+
+        Reactor&                reactor_;
+        int                     fd_;
+        short                   events_;
+        int                     timeout_s_;
+        bool                    idle_;
+        Result                  result_;
+        uint64_t                deadline_ns_;
+        std::coroutine_handle<> handle_;
+
+        friend class Reactor;
+    };
+
+    explicit Reactor(Poller::Backend backend);
+    Reactor(const Reactor&) = delete; // prevent copy
+    Reactor& operator=(const Reactor&) = delete; // prevent assignment
+    ~Reactor();
+
+    int    poll(int timeout_ms);
+    void   forget(int fd);
+    void   cancel_idle();
+
+private:
+    void suspend(Waiter& waiter);
+    void watch(int fd, short events);
+    void resume(Waiter& waiter, Result result);
+    void expire();
+
+    // How often waits are checked for timeouts, in milliseconds
+    static const int TIMER_MS = 1000;
+
+    Poller               poller_;
+    std::vector<Waiter*> waiters_;   // indexed by fd
+    std::vector<short>   watching_;  // events in poller_, indexed by fd
+    uint64_t             next_expire_ns_;
+};
+
+/**
+ * @summary Waits for `fd` to become readable (POLLIN) or writable
+ * (POLLOUT); co_await gives the Reactor's Result
+ */
+class Ready : public Reactor::Waiter
+{
+public:
+    Ready(Reactor& reactor, int fd, short events, int timeout_s = 0,
+          bool idle = false) :
+        Waiter(reactor, fd, events, timeout_s, idle) {}
+
+    bool await_ready() { return false; }
+    Reactor::Result await_resume() const { return result_; }
+
+protected:
+    bool attempt() override { return true; }
+};
+
+/**
+ * @summary The socket operations: each completes like its TLSConnection
+ * counterpart on a blocking socket, returning -1 with errno set on failure
+ * (ETIMEDOUT after `timeout_s` seconds, ECANCELED if cancelled while idle)
+ */
+class IOWaiter : public Reactor::Waiter
+{
+public:
+    IOWaiter(Reactor& reactor, TLSConnection* tls, int fd, short events,
+             int timeout_s, bool idle) :
+        Waiter(reactor, fd, events, timeout_s, idle), tls_(tls), ret_(0) {}
+
+    ssize_t await_resume() const;
+
+protected:
+    TLSConnection* tls_;
+    ssize_t        ret_;
+};
+
+/**
+ * @summary Reads whatever has arrived, up to `len` bytes; 0 means the peer
+ * closed the connection
+ */
+class Recv : public IOWaiter
+{
+public:
+    Recv(Reactor& reactor, TLSConnection* tls, int fd, void* buf, size_t len,
+         int timeout_s = 0, bool idle = false) :
+        IOWaiter(reactor, tls, fd, POLLIN, timeout_s, idle), buf_(buf),
+        len_(len) {}
+
+protected:
+    bool attempt() override;
+
+private:
+    void*  buf_;
+    size_t len_;
+};
+
+/**
+ * @summary Sends all `len` bytes, however many writes that takes
+ *
+ * @param flags for send(), e.g. MSG_MORE when a body follows
+ */
+class Send : public IOWaiter
+{
+public:
+    Send(Reactor& reactor, TLSConnection* tls, int fd, const void* buf,
+         size_t len, int timeout_s = 0, int flags = 0) :
+        IOWaiter(reactor, tls, fd, POLLOUT, timeout_s, false), buf_(buf),
+        len_(len), flags_(flags) {}
+
+protected:
+    bool attempt() override;
+
+private:
+    const void* buf_;
+    size_t      len_;
+    int         flags_;
+};
+
+/**
+ * @summary Sends `count` bytes of `file` from `*offset` with sendfile(),
+ * advancing `*offset`; stops early if the file turns out to be shorter
+ */
+class SendFile : public IOWaiter
+{
+public:
+    SendFile(Reactor& reactor, TLSConnection* tls, int fd, int file,
+             off_t* offset, size_t count, int timeout_s = 0) :
+        IOWaiter(reactor, tls, fd, POLLOUT, timeout_s, false), file_(file),
+        offset_(offset), count_(count) {}
+
+protected:
+    bool attempt() override;
+
+private:
+    int    file_;
+    off_t* offset_;
+    size_t count_;
+};
+
+/**
+ * @summary Completes a TLS handshake; co_await gives true if it succeeded
+ */
+class Handshake : public Reactor::Waiter
+{
+public:
+    Handshake(Reactor& reactor, TLSConnection& tls, int fd, int timeout_s) :
+        Waiter(reactor, fd, POLLIN, timeout_s, false), tls_(tls),
+        ok_(false) {}
+
+    bool await_resume() const { return result_ == Reactor::READY && ok_; }
+
+protected:
+    bool attempt() override;
+
+private:
+    TLSConnection& tls_;
+    bool           ok_;
+};
+
+#endif
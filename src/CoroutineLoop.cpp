@@ -0,0 +1,358 @@
+#include "CoroutineLoop.h"
+#include "HTTPRequest.h"   // for HTTPRequest
+#include "HTTPResponse.h"  // for HTTPResponse
+#include "Metrics.h"       // for Metrics
+#include "RateLimiter.h"   // for RateLimiter
+#include "ResponseBody.h"  // for ResponseBody
+#include "TLS.h"           // for TLSConnection, TLSContext
+#include "Tracing.h"       // for RequestTrace, Tracer
+#include "Upload.h"        // for Upload
+#include "logging.h"       // for LOG_END, LOG_ERROR, LOG_INFO
+
+#include <sys/socket.h>    // for MSG_MORE
+#include <unistd.h>        // for close, dup
+
+#include <cerrno>          // for errno, EINTR, ETIMEDOUT, ECANCELED
+#include <cstring>         // for strerror
+#include <exception>       // for exception
+#include <memory>          // for unique_ptr
+#include <string>          // for string
+#include <utility>         // for move
+
+HTTPServer::CoroutineLoop::CoroutineLoop(HTTPServer& server,
+                                         Poller::Backend backend) :
+    server_(server), open_clients_(0), draining_(false), reactor_(backend)
+{
+}
+
+/**
+ * @summary Starts accepting on every listener and runs the Reactor until
+ * the server shuts down and its connections have drained
+ */
+void HTTPServer::CoroutineLoop::run()
+{
+    for (int fd : server_.listeners_)
+        accept_clients(fd);
+    wait_for_shutdown();
+    uint64_t deadline = 0;
+    while (!draining_ ||
+           (open_clients_ > 0 && Metrics::now_ns() < deadline))
+    {
+        if (!draining_ && !keep_running_)
+        {
+            // Stops the accepting Tasks, and closes the idle connections
+            draining_ = true;
+            deadline = Metrics::now_ns()
+                       + server_.config_.shutdown_timeout * 1000000000ull;
+            reactor_.cancel_idle();
+        }
+        // While draining, wake up now and then to check the deadline
+        reactor_.poll(draining_ ? 100 : -1);
+        Tracer::dump_if_requested();
+    }
+    if (open_clients_ > 0)
+    {
+        LOG_ERROR << open_clients_ << " connections still open at shutdown"
+                  << LOG_END;
+    }
+}
+
+/**
+ * @summary Returns once the shutdown pipe becomes readable, which wakes up
+ * run() to start draining
+ */
+Task HTTPServer::CoroutineLoop::wait_for_shutdown()
+{
+    co_await Ready(reactor_, shutdown_pipe_[0], POLLIN);
+    reactor_.forget(shutdown_pipe_[0]);
+}
+
+/**
+ * @summary Accepts connections from `listener` (up to ACCEPT_BATCH at a
+ * time, so clients aren't starved) and starts a serve_client Task for each,
+ * until the server starts shutting down
+ */
+Task HTTPServer::CoroutineLoop::accept_clients(int listener)
+{
+    while (!draining_)
+    {
+        for (int i = 0; i < ACCEPT_BATCH; i++)
+        {
+            int limit_slot;
+            int fd = server_.accept_connection(listener, true, limit_slot);
+            if (fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                if (errno != EWOULDBLOCK && errno != EAGAIN)
+                {
+                    LOG_ERROR << "accept(): " << std::strerror(errno) << LOG_END;
+                }
+                break;
+            }
+            open_clients_++;
+            // Runs until it first has to wait
+            serve_client(fd, limit_slot);
+        }
+        // An idle wait, so shutting down ends it
+        if (co_await Ready(reactor_, listener, POLLIN, 0, true) != Reactor::READY)
+            break;
+    }
+    reactor_.forget(listener);
+}
+
+/**
+ * @summary Reads and responds to the requests on `fd`, like
+ * process_request, handling keep-alive and pipelining; every wait for the
+ * socket suspends this Task instead of blocking
+ */
+Task HTTPServer::CoroutineLoop::serve_client(int fd, int limit_slot)
+{
+    // Closes the connection and updates the statistics however this Task
+    // ends, including being destroyed at shutdown
+    struct Connection
+    {
+        CoroutineLoop& loop_;
+        int fd_;
+        int limit_slot_;
+        std::unique_ptr<TLSConnection> tls_;
+        uint64_t requests_;
+        ~Connection()
+        {
+            loop_.reactor_.forget(fd_);
+            if (tls_)
+                tls_->shutdown();
+            close(fd_);
+            Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+            Metrics::observe_requests_per_connection(requests_);
+            loop_.server_.release_client(limit_slot_);
+            loop_.open_clients_--;
+        }
+    } connection{*this, fd, limit_slot, nullptr, 0};
+    const int timeout = server_.config_.timeout;
+    if (server_.tls_)
+    {
+        connection.tls_ = server_.tls_->accept(fd);
+        if (!connection.tls_ ||
+            !co_await Handshake(reactor_, *connection.tls_, fd, timeout))
+        {
+            co_return;
+        }
+    }
+    TLSConnection* tls = connection.tls_.get();
+    // What was read after the previous request
+    std::string remainder;
+    while (true)
+    {
+        // Connections are closed between requests while draining
+        if (draining_ && remainder.empty())
+            co_return;
+        RequestTrace trace;
+        trace.mark(RequestTrace::START);
+        // Read until the request's headers are complete
+        std::string buf = std::move(remainder);
+        remainder.clear();
+        size_t pos = buf.size();
+        while (buf.find("\r\n\r\n") == std::string::npos)
+        {
+            // A whole TLS record for HTTPS, so OpenSSL isn't left holding
+            // data poll() can't see
+            buf.resize(pos + (tls ? TLSConnection::RECORD_SIZE : 256));
+            // Waiting for a new request is idle; shutting down cancels it
+            ssize_t bytes_read = co_await Recv(reactor_, tls, fd, &buf[pos],
+                                               buf.size() - pos, timeout,
+                                               pos == 0);
+            if (bytes_read == 0)
+            {
+                LOG_INFO << "Connection closed by peer" << LOG_END;
+                co_return;
+            }
+            if (bytes_read < 0)
+            {
+                if (errno == ETIMEDOUT)
+                {
+                    LOG_INFO << "Keepalive timeout, closing connection" << LOG_END;
+                }
+                else if (errno == ECANCELED)
+                {
+                    LOG_INFO << "Shutting down, closing idle connection" << LOG_END;
+                }
+                else
+                {
+                    LOG_ERROR << "recv(): " << std::strerror(errno) << LOG_END;
+                }
+                co_return;
+            }
+            pos += bytes_read;
+            buf.resize(pos);
+        }
+        uint64_t start_ns = Metrics::now_ns();
+        connection.requests_++;
+        Metrics::add(Metrics::REQUESTS);
+        // Try to parse the request
+        bool file_ok = false;
+        ResponseBody body;
+        HTTPRequest request;
+        HTTPResponse response;
+        response.set_version("HTTP/1.1");
+        std::unique_ptr<Upload> upload;
+        const Proxy::Route* upstream = nullptr;
+        bool keep_alive = false;
+        ResponseCache::Lookup cached;
+        try
+        {
+            HTTPRequest _request(buf, &remainder);
+            request = std::move(_request);
+            trace.mark(RequestTrace::PARSED);
+            if (server_.allow_request(limit_slot, response))
+            {
+                keep_alive = server_.set_conn_type(request, response);
+                // Proxied requests are answered by the upstream, below
+                if (server_.proxy_)
+                    upstream = server_.proxy_->match(request.path());
+                if (!upstream && is_upload(request))
+                {
+                    upload = server_.start_upload(request, response);
+                    if (!upload)
+                        response.set_header("Connection", "close");
+                }
+                else if (!upstream)
+                {
+                    file_ok = server_.prepare_response(request, response, body);
+                }
+            }
+        } catch (const std::exception& ex)
+        {
+            LOG_ERROR << "HTTPRequest construction failed: " << ex.what() << LOG_END;
+            response.make_400();
+            response.set_header("Connection", keep_running_ ? "keep-alive" : "close");
+        }
+        // Proxied responses may be in the cache, or on their way into it
+        if (upstream && server_.cache_)
+        {
+            ResponseCache::Status found = server_.lookup_cache(
+                request, cached, true, response, body, file_ok);
+            // The Reactor takes one waiter per fd, so each waits on a dup
+            int wait_fd = found == ResponseCache::WAIT ? dup(cached.wait_fd())
+                                                       : -1;
+            if (wait_fd >= 0)
+            {
+                co_await Ready(reactor_, wait_fd, POLLIN,
+                               server_.config_.proxy_timeout);
+                reactor_.forget(wait_fd);
+                close(wait_fd);
+            }
+            if (found == ResponseCache::WAIT)
+            {
+                found = server_.lookup_cache(request, cached, false, response,
+                                             body, file_ok);
+            }
+            if (found == ResponseCache::HIT || found == ResponseCache::STALE)
+                upstream = nullptr;
+        }
+        if (upstream)
+        {
+            send_continue(fd, tls, request, remainder);
+            ProxyExchange exchange(*server_.proxy_, *upstream, fd, tls,
+                                   request, remainder, keep_alive, &cached);
+            ProxyExchange::Result result = exchange.step();
+            while (result == ProxyExchange::WAIT)
+            {
+                int wait_fd = exchange.fd();
+                Reactor::Result ready = co_await Ready(
+                    reactor_, wait_fd, exchange.events(),
+                    server_.config_.proxy_timeout);
+                // The upstream's socket may be pooled or closed by the next
+                // step, so it mustn't stay registered
+                if (wait_fd != fd)
+                    reactor_.forget(wait_fd);
+                result = ready == Reactor::READY ? exchange.step()
+                                                 : exchange.timed_out();
+            }
+            Metrics::record_status(exchange.status());
+            Metrics::observe_latency(Metrics::now_ns() - start_ns);
+            trace.finish(fd, request.path(), exchange.status());
+            if (result != ProxyExchange::DONE)
+                co_return;
+            continue;
+        }
+        // Move the upload's body into its file as it arrives
+        if (upload)
+        {
+            send_continue(fd, tls, request, remainder);
+            Upload::Status status = upload->consume(remainder);
+            while (status == Upload::MORE)
+            {
+                status = upload->receive(fd, tls, remainder);
+                if (status == Upload::MORE &&
+                    co_await Ready(reactor_, fd, POLLIN, timeout) != Reactor::READY)
+                {
+                    LOG_ERROR << "Timed out receiving upload" << LOG_END;
+                    co_return;
+                }
+            }
+            server_.finish_upload(*upload, status, response);
+            upload.reset();
+        }
+        trace.mark(RequestTrace::OPENED);
+        Metrics::record_status(response.status());
+        std::string response_text = response.to_string();
+        // Hold the headers back until the body fills the packet
+        ssize_t sent = co_await Send(reactor_, tls, fd, response_text.data(),
+                                     response_text.size(), timeout,
+                                     file_ok ? MSG_MORE : 0);
+        if (sent < 0)
+        {
+            LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+            co_return;
+        }
+        Metrics::add(Metrics::HEADER_BYTES_SENT, sent);
+        trace.mark(RequestTrace::HEADERS_SENT);
+        // Bodies already in memory (mapped files, cached listings) are sent
+        // straight from it
+        if (file_ok && body.memory())
+        {
+            sent = co_await Send(reactor_, tls, fd, body.memory(), body.size,
+                                 timeout);
+        }
+        // Listings are sent a chunk at a time as they are generated
+        else if (file_ok && body.listing)
+        {
+            std::string chunk;
+            while (sent >= 0 && body.listing->next(chunk))
+            {
+                sent = co_await Send(reactor_, tls, fd, chunk.data(),
+                                     chunk.size(), timeout);
+                if (sent > 0)
+                    Metrics::add(Metrics::BODY_BYTES_SENT, sent);
+                chunk.clear();
+            }
+            // Already counted
+            sent = sent < 0 ? sent : 0;
+        }
+        // Files go out with sendfile (pread and SSL_write for TLS without
+        // kernel encryption)
+        else if (file_ok)
+        {
+            off_t offset = 0;
+            sent = co_await SendFile(reactor_, tls, fd, body.fd, &offset,
+                                     body.size, timeout);
+        }
+        if (file_ok)
+        {
+            if (sent < 0)
+            {
+                LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+                co_return;
+            }
+            Metrics::add(Metrics::BODY_BYTES_SENT, sent);
+            trace.mark(RequestTrace::BODY_SENT);
+        }
+        body.clear();
+        Metrics::observe_latency(Metrics::now_ns() - start_ns);
+        trace.finish(fd, request.path(), response.status());
+        // Close the connection if we should
+        if (*response.header_value("Connection") == "close")
+            co_return;
+    }
+}
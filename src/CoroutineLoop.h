@@ -0,0 +1,42 @@
+#ifndef COROUTINELOOP_H
+#define COROUTINELOOP_H
+
+#include "Coroutine.h"   // for Reactor, Task
+#include "HTTPServer.h"  // for HTTPServer
+#include "Poller.h"      // for Poller
+
+#include <cstdint>       // for uint64_t
+
+/**
+ * @summary The coroutine engine: every connection is a Task written
+ * straight-line, like process_request, but its socket operations are
+ * awaited on one non-blocking Reactor instead of blocking a thread. An idle
+ * connection costs its coroutine frame and buffers rather than a thread and
+ * its stack.
+ *
+ * Each listening socket has an accepting Task of its own. On shutdown they
+ * stop, connections idle between requests are closed, and the rest are
+ * closed as their responses finish, or once `shutdown_timeout` passes.
+ */
+class HTTPServer::CoroutineLoop
+{
+public:
+    CoroutineLoop(HTTPServer& server, Poller::Backend backend);
+
+    void run();
+
+private:
+    Task wait_for_shutdown();
+    Task accept_clients(int listener);
+    Task serve_client(int fd, int limit_slot);
+
+    static const int ACCEPT_BATCH = 64;
+
+    HTTPServer& server_;
+    int         open_clients_;
+    bool        draining_;
+    // Last, so the coroutines it destroys at the end can still use the rest
+    Reactor     reactor_;
+};
+
+#endif
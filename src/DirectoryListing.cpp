@@ -0,0 +1,241 @@
+#include "DirectoryListing.h"
+#include "logging.h"        // for LOG_END, LOG_ERROR
+
+#include <dirent.h>         // for DIR, fdopendir, readdir, closedir, DT_DIR
+#include <fcntl.h>          // for AT_SYMLINK_NOFOLLOW
+#include <unistd.h>         // for close
+
+#ifdef __linux__
+#include <sys/syscall.h>    // for SYS_getdents64
+#endif
+
+#include <cerrno>           // for errno
+#include <cstdint>          // for uint64_t, int64_t
+#include <cstdio>           // for snprintf
+#include <cstring>          // for strerror, strcmp
+
+std::mutex DirectoryListing::mutex_;
+std::unordered_map<DirectoryListing::Key, DirectoryListing::CacheEntry,
+                   DirectoryListing::KeyHash> DirectoryListing::cache_;
+
+namespace
+{
+#ifdef __linux__
+// Layout of the records filled in by getdents64
+struct linux_dirent64
+{
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[256];
+};
+#endif
+
+std::string html_escape(const char* str)
+{
+    std::string result;
+    for (; *str; str++)
+    {
+        switch (*str)
+        {
+            case '&': result += "&amp;"; break;
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '"': result += "&quot;"; break;
+            case '\'': result += "&#39;"; break;
+            default: result += *str;
+        }
+    }
+    return result;
+}
+
+void append_entry(std::string& html, int dirfd, const char* name,
+                  unsigned char type)
+{
+    if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0)
+        return;
+    bool is_dir = type == DT_DIR;
+    // Symlinks are followed when requested, so list them as what they
+    // point to; some filesystems don't report types at all
+    if (type == DT_UNKNOWN || type == DT_LNK)
+    {
+        struct stat st;
+        is_dir = fstatat(dirfd, name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+    }
+    std::string escaped = html_escape(name);
+    if (is_dir)
+        escaped += '/';
+    html += "<li><a href=\"" + escaped + "\">" + escaped + "</a></li>\n";
+}
+}
+
+/**
+ * @param dirfd the open directory; owned (and closed) by the listing
+ * @param st the result of fstat on `dirfd`
+ * @param path the request path of the directory, ending with '/'
+ * @param chunked whether next() frames its output as HTTP/1.1 chunks
+ */
+DirectoryListing::DirectoryListing(int dirfd, const struct stat& st,
+                                   const std::string& path, bool chunked) :
+    dirfd_(dirfd), dir_(nullptr), key_{st.st_dev, st.st_ino},
+    mtime_ns_(mtime_ns(st)), path_(path), started_(false), finished_(false),
+    chunked_(chunked)
+{
+#ifdef __linux__
+    buf_.resize(65536);
+#else
+    dir_ = fdopendir(dirfd_);
+    if (dir_ == nullptr)
+    {
+        LOG_ERROR << "fdopendir(): " << std::strerror(errno) << LOG_END;
+    }
+#endif
+}
+
+DirectoryListing::~DirectoryListing()
+{
+    if (dir_ != nullptr)
+        closedir(static_cast<DIR*>(dir_));
+    else
+        close(dirfd_);
+}
+
+/**
+ * @summary Appends the next part of the listing to `out` as an HTTP/1.1
+ * chunk (if chunked); the last call appends the terminating empty chunk
+ *
+ * @return false once the whole listing has been returned
+ */
+bool DirectoryListing::next(std::string& out)
+{
+    if (finished_)
+        return false;
+    std::string html;
+    if (!started_)
+    {
+        started_ = true;
+        std::string title = "Index of " + html_escape(path_.c_str());
+        html = "<!DOCTYPE html>\n<html><head><title>" + title
+               + "</title></head>\n<body><h1>" + title + "</h1><ul>\n";
+        if (path_ != "/")
+            html += "<li><a href=\"../\">../</a></li>\n";
+    }
+    bool more = read_entries(html);
+    if (!more)
+        html += "</ul></body></html>\n";
+    html_ += html;
+    if (!chunked_)
+    {
+        out += html;
+    }
+    else
+    {
+        char size[32];
+        std::snprintf(size, sizeof(size), "%zx\r\n", html.size());
+        out += size;
+        out += html;
+        out += "\r\n";
+        if (!more)
+            out += "0\r\n\r\n";
+    }
+    if (!more)
+        finish();
+    return true;
+}
+
+/**
+ * @summary Returns the cached listing of a directory, if it hasn't changed
+ * since it was generated
+ */
+std::shared_ptr<const std::string> DirectoryListing::cached(const struct stat& st)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = cache_.find(Key{st.st_dev, st.st_ino});
+    if (it == cache_.end() || it->second.mtime_ns != mtime_ns(st))
+        return nullptr;
+    return it->second.html;
+}
+
+/**
+ * @summary Generates a whole listing at once, for clients that can't receive
+ * chunked responses
+ *
+ * @param dirfd the open directory; closed once the listing is generated
+ */
+std::shared_ptr<const std::string> DirectoryListing::generate(int dirfd,
+                                                              const struct stat& st,
+                                                              const std::string& path)
+{
+    DirectoryListing listing(dirfd, st, path);
+    std::string chunk;
+    while (listing.next(chunk))
+        chunk.clear();
+    return listing.result_;
+}
+
+/**
+ * @summary Reads one batch of directory entries and appends them to `html`
+ *
+ * @return false once there are no more entries
+ */
+bool DirectoryListing::read_entries(std::string& html)
+{
+#ifdef __linux__
+    long bytes = syscall(SYS_getdents64, dirfd_, &buf_[0], buf_.size());
+    if (bytes < 0)
+    {
+        LOG_ERROR << "getdents64(): " << std::strerror(errno) << LOG_END;
+    }
+    if (bytes <= 0)
+        return false;
+    for (long pos = 0; pos < bytes;)
+    {
+        const linux_dirent64* ent =
+            reinterpret_cast<const linux_dirent64*>(&buf_[pos]);
+        append_entry(html, dirfd_, ent->d_name, ent->d_type);
+        pos += ent->d_reclen;
+    }
+    return true;
+#else
+    if (dir_ == nullptr)
+        return false;
+    for (int i = 0; i < 1024; i++)
+    {
+        struct dirent* ent = readdir(static_cast<DIR*>(dir_));
+        if (ent == nullptr)
+            return i > 0;
+        append_entry(html, dirfd_, ent->d_name, ent->d_type);
+    }
+    return true;
+#endif
+}
+
+/**
+ * @summary Caches the finished listing, unless the directory changed while
+ * it was being read
+ */
+void DirectoryListing::finish()
+{
+    finished_ = true;
+    result_ = std::make_shared<const std::string>(std::move(html_));
+    struct stat st;
+    if (fstat(dirfd_, &st) == -1 || mtime_ns(st) != mtime_ns_)
+        return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Crude, but listings are cheap to regenerate
+    if (cache_.size() >= MAX_CACHED)
+        cache_.clear();
+    cache_[key_] = CacheEntry{mtime_ns_, result_};
+}
+
+long long DirectoryListing::mtime_ns(const struct stat& st)
+{
+#if defined(__linux__)
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    return st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtime * 1000000000LL;
+#endif
+}
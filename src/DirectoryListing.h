@@ -0,0 +1,84 @@
+#ifndef DIRECTORYLISTING_H
+#define DIRECTORYLISTING_H
+
+#include <sys/stat.h>     // for stat
+#include <sys/types.h>    // for dev_t, ino_t
+
+#include <cstddef>        // for size_t
+#include <functional>     // for hash
+#include <memory>         // for shared_ptr
+#include <mutex>          // for mutex
+#include <string>         // for string
+#include <unordered_map>  // for unordered_map
+#include <vector>         // for vector
+
+/**
+ * @summary Generates an HTML listing of a directory a batch of entries at a
+ * time, as HTTP/1.1 chunks (or plain, for HTTP/2's DATA frames), so the
+ * first entries are sent before the rest
+ * have been read and a huge directory never holds up an event loop for
+ * long. On Linux entries are read with getdents64 into a 64 KiB buffer
+ * (over a thousand names per syscall).
+ * Complete listings are cached per directory until its mtime changes.
+ */
+class DirectoryListing
+{
+public:
+    DirectoryListing(int dirfd, const struct stat& st, const std::string& path,
+                     bool chunked = true);
+    DirectoryListing(const DirectoryListing&) = delete; // prevent copy
+    DirectoryListing& operator=(const DirectoryListing&) = delete; // prevent assignment
+    ~DirectoryListing();
+
+    bool next(std::string& out);
+
+    static std::shared_ptr<const std::string> cached(const struct stat& st);
+    static std::shared_ptr<const std::string> generate(int dirfd,
+                                                       const struct stat& st,
+                                                       const std::string& path);
+
+private:
+    struct Key
+    {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const Key& other) const
+        {
+            return dev == other.dev && ino == other.ino;
+        }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<ino_t>()(key.ino) ^ std::hash<dev_t>()(key.dev);
+        }
+    };
+    struct CacheEntry
+    {
+        long long mtime_ns;
+        std::shared_ptr<const std::string> html;
+    };
+
+    bool read_entries(std::string& html);
+    void finish();
+    static long long mtime_ns(const struct stat& st);
+
+    int               dirfd_;
+    void*             dir_;      // DIR* where getdents64 isn't available
+    Key               key_;
+    long long         mtime_ns_;
+    std::string       path_;
+    bool              started_;
+    bool              finished_;
+    bool              chunked_;
+    std::vector<char> buf_;      // getdents64 buffer
+    std::string       html_;     // everything generated so far, for the cache
+    std::shared_ptr<const std::string> result_; // html_, once complete
+
+    static const size_t MAX_CACHED = 256;
+    static std::mutex mutex_;
+    static std::unordered_map<Key, CacheEntry, KeyHash> cache_;
+};
+
+#endif
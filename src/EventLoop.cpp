@@ -0,0 +1,972 @@
+#include "EventLoop.h"
+#include "HTTPRequest.h"   // for HTTPRequest, operator<<
+#include "HTTPResponse.h"  // for HTTPResponse
+#include "Metrics.h"       // for Metrics
+#include "logging.h"       // for LOG_END, LOG_ERROR, LOG_INFO
+
+#include <netinet/in.h>    // for IPPROTO_TCP
+#include <netinet/tcp.h>   // for TCP_NODELAY
+#ifndef __APPLE__
+#include <sys/sendfile.h>  // for sendfile
+#endif
+#include <sys/socket.h>    // for recv, send, setsockopt
+#include <sys/uio.h>       // for iovec, preadv2, RWF_NOWAIT
+#include <unistd.h>        // for close, dup, pread
+
+#include <algorithm>       // for min
+#include <cerrno>          // for errno, EAGAIN, EINTR, EWOULDBLOCK, EOPNOTSUPP
+#include <cstring>         // for strerror
+#include <exception>       // for exception
+#include <limits>          // for numeric_limits
+#include <memory>          // for make_shared, shared_ptr
+#include <utility>         // for move, swap
+
+HTTPServer::EventLoop::EventLoop(HTTPServer& server, Poller::Backend backend) :
+    server_(server), poller_(backend), clients_(256), open_clients_(0),
+    draining_(false), drain_deadline_ns_(0), helper_tasks_(0)
+{
+    if (server_.helpers_)
+        completions_ = std::make_shared<HelperPool::Completions>();
+}
+
+/**
+ * @summary Waits for sockets to become ready for read or write and services
+ * them. Once the server starts shutting down, stops accepting and keeps going
+ * until every open response has been sent or `shutdown_timeout` passes.
+ */
+void HTTPServer::EventLoop::run()
+{
+    // Several loops may share the listening sockets; only wake one of them
+    // per connection
+    for (int fd : server_.listeners_)
+        poller_.add(fd, POLLIN, true);
+    // The shutdown pipe is never read, so it wakes every loop
+    poller_.add(shutdown_pipe_[0], POLLIN);
+    if (completions_)
+        poller_.add(completions_->fd(), POLLIN);
+    while (!draining_ ||
+           (open_clients_ > 0 && Metrics::now_ns() < drain_deadline_ns_))
+    {
+        if (!draining_ && !keep_running_)
+            start_drain();
+        // Wait until an fd is ready for read or write; while draining, wake
+        // up now and then to check the deadline
+        int ret = draining_ ? 0 : spin();
+        if (ret == 0)
+            ret = poller_.wait(draining_ ? 100 : -1);
+        if (ret == -1)
+        {
+            if (errno == EINTR)
+            {
+                Tracer::dump_if_requested();
+                continue;
+            }
+            LOG_ERROR << "poll(): " << std::strerror(errno) << LOG_END;
+        }
+        // Iterate over all ready sockets
+        for (const Poller::Event& event : poller_.ready())
+        {
+            if (event.fd == shutdown_pipe_[0])
+            {
+                if (!draining_)
+                    start_drain();
+            }
+            else if (completions_ && event.fd == completions_->fd())
+            {
+                completions_->run();
+            }
+            // it's one of the listening sockets
+            else if (server_.is_listener(event.fd))
+            {
+                if (!draining_)
+                    accept_client(event.fd);
+            }
+            // the client was closed earlier in this batch (by start_drain),
+            // or is waiting for a helper
+            else if (!client(event.fd).open_ ||
+                     client(event.fd).state_ == ClientState::HELPER)
+            {
+                continue;
+            }
+            else if (client(event.fd).state_ == ClientState::HANDSHAKE)
+            {
+                handle_handshake(event.fd);
+            }
+            else if (client(event.fd).state_ == ClientState::HTTP2)
+            {
+                handle_http2(event.fd, event.events);
+            }
+            // socket is ready for read (or was closed, which recv reports)
+            else if (client(event.fd).state_ == ClientState::READ)
+            {
+                if (event.events & (POLLIN | POLLHUP | POLLERR))
+                    handle_read(event.fd);
+            }
+            else if (client(event.fd).state_ == ClientState::READ_BODY)
+            {
+                if (event.events & (POLLIN | POLLHUP | POLLERR))
+                    handle_body(event.fd);
+            }
+            // Bulk transfers go after the rest of the batch
+            else if (is_bulk(client(event.fd)))
+            {
+                bulk_.push_back(event.fd);
+            }
+            // A client is ready to receive data from us
+            else if (event.events & (POLLOUT | POLLHUP | POLLERR))
+            {
+                handle_write(event.fd);
+            }
+        }
+        // so that small responses and new requests that were ready at the
+        // same time didn't wait behind their quanta
+        for (int fd : bulk_)
+        {
+            if (client(fd).open_ && client(fd).state_ == ClientState::WRITE_FILE)
+                handle_write(fd);
+        }
+        bulk_.clear();
+    }
+    // Whatever is still open missed the deadline
+    for (size_t fd = 0; fd < clients_.size(); fd++)
+    {
+        if (clients_[fd].open_)
+            close_client(fd);
+    }
+}
+
+/**
+ * @summary With --busy-poll, checks the poller without blocking until
+ * something is ready or the budget runs out, trading a CPU for not paying a
+ * sleep and wakeup when the next event comes soon
+ *
+ * @return what the last Poller::wait returned, 0 if nothing became ready
+ */
+int HTTPServer::EventLoop::spin()
+{
+    if (server_.config_.busy_poll <= 0)
+        return 0;
+    uint64_t deadline = Metrics::now_ns() + server_.config_.busy_poll * 1000;
+    int ret;
+    do
+    {
+        ret = poller_.wait(0);
+    } while (ret == 0 && Metrics::now_ns() < deadline);
+    return ret;
+}
+
+/**
+ * @summary Stops accepting connections and closes the ones that are idle
+ * between requests; the rest are closed as their responses finish
+ */
+void HTTPServer::EventLoop::start_drain()
+{
+    draining_ = true;
+    drain_deadline_ns_ = Metrics::now_ns()
+                         + server_.config_.shutdown_timeout * 1000000000ull;
+    for (int fd : server_.listeners_)
+        poller_.remove(fd);
+    poller_.remove(shutdown_pipe_[0]);
+    for (size_t fd = 0; fd < clients_.size(); fd++)
+    {
+        const ClientState& state = clients_[fd];
+        // HTTP/2 clients get GOAWAY, and are closed once their open
+        // streams are answered
+        if (state.open_ && state.state_ == ClientState::HTTP2)
+        {
+            state.h2_->shutdown();
+            handle_http2(fd, 0);
+        }
+        else if (state.open_ && ((state.state_ == ClientState::READ &&
+                             state.remainder_.empty()) ||
+                            state.state_ == ClientState::HANDSHAKE))
+        {
+            close_client(fd);
+        }
+    }
+}
+
+ClientState& HTTPServer::EventLoop::client(int fd)
+{
+    // resize if we have to
+    if (clients_.size() <= (unsigned)fd)
+    {
+        clients_.resize(fd + 64);
+    }
+    return clients_[fd];
+}
+
+/**
+ * @summary Accepts the connections waiting on `listener` (up to
+ * ACCEPT_BATCH, so one busy loop doesn't starve its clients or take every
+ * connection from the other loops) and starts watching them for a request
+ */
+void HTTPServer::EventLoop::accept_client(int listener)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        int limit_slot;
+        int temp_fd = server_.accept_connection(listener, true, limit_slot);
+        if (temp_fd < 0)
+        {
+            // The queue is empty, or another event loop (or process) took
+            // the connection first
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+            {
+                LOG_ERROR << "accept(): " << std::strerror(errno) << LOG_END;
+            }
+            return;
+        }
+        client(temp_fd) = ClientState();
+        client(temp_fd).open_ = true;
+        client(temp_fd).limit_slot_ = limit_slot;
+        open_clients_++;
+        // POLLIN so we know when to read from that socket
+        poller_.add(temp_fd, POLLIN);
+        if (server_.tls_)
+        {
+            client(temp_fd).tls_ = server_.tls_->accept(temp_fd);
+            if (!client(temp_fd).tls_)
+            {
+                close_client(temp_fd);
+                continue;
+            }
+            client(temp_fd).state_ = ClientState::HANDSHAKE;
+        }
+    }
+}
+
+/**
+ * @summary Advances a new HTTPS client's handshake, waiting for whichever
+ * of read or write it needs next, and moves on to READ once it is done
+ */
+void HTTPServer::EventLoop::handle_handshake(int fd)
+{
+    ClientState& state = client(fd);
+    switch (state.tls_->handshake())
+    {
+        case TLSConnection::OK:
+            state.state_ = ClientState::READ;
+            poller_.modify(fd, POLLIN);
+            if (state.tls_->http2())
+            {
+                std::string none;
+                start_http2(fd, nullptr, none);
+            }
+            break;
+        case TLSConnection::WANT_READ:
+            poller_.modify(fd, POLLIN);
+            break;
+        case TLSConnection::WANT_WRITE:
+            poller_.modify(fd, POLLOUT);
+            break;
+        case TLSConnection::FAILED:
+            close_client(fd);
+            break;
+    }
+}
+
+/**
+ * @summary Reads from a client in READ mode, and once a complete request has
+ * arrived prepares the response and switches to WRITE_RESPONSE
+ */
+void HTTPServer::EventLoop::handle_read(int fd)
+{
+    // Use 'state' as local variable to avoid long typing
+    ClientState& state = client(fd);
+    // Get the remainder of a incomplete request, if necessary
+    state.buf_ = std::move(state.remainder_);
+    // Start writing where we left off
+    state.pos_ = state.buf_.size();
+    // Nothing buffered means this is the start of a request
+    if (state.buf_.empty())
+    {
+        state.trace_.reset();
+        state.trace_.mark(RequestTrace::START);
+    }
+    if (state.buf_.find("\r\n\r\n") == std::string::npos)
+    {
+        // Make sure we have some room to read; a whole TLS record for
+        // HTTPS, since poll() can't see what OpenSSL is left holding
+        state.buf_.resize((state.tls_ ? TLSConnection::RECORD_SIZE : 256) +
+                          state.buf_.size());
+        // Read as much as we can
+        ssize_t bytes_read = TLSConnection::recv(state.tls_.get(), fd,
+                                                 &state.buf_[state.pos_],
+                                                 state.buf_.size() - state.pos_);
+        // If recv returned 0, the client disconnected
+        if (bytes_read == 0)
+        {
+            LOG_INFO << "Connection closed by peer" << LOG_END;
+            close_client(fd);
+            return;
+        }
+        // Error check
+        if (bytes_read < 0)
+        {
+            // EWOULDBLOCK means the client wasn't actually ready
+            // so try again later
+            if (errno == EWOULDBLOCK)
+            {
+                LOG_INFO << "Read would block" << LOG_END;
+                state.buf_.resize(state.pos_);
+                state.remainder_ = std::move(state.buf_);
+                return;
+            }
+            LOG_ERROR << "read(): " << std::strerror(errno) << LOG_END;
+            close_client(fd);
+            return;
+        }
+        state.pos_ += bytes_read;
+    }
+    state.buf_.resize(state.pos_);
+    // Check if we've read a full request in now
+    if (state.buf_.find("\r\n\r\n") == std::string::npos)
+    {
+        // We don't have a full request yet, so save what we have and
+        // continue next cycle
+        state.remainder_ = std::move(state.buf_);
+        return;
+    }
+    // A client speaking HTTP/2 with prior knowledge starts with its preface
+    if (server_.config_.http2 && HTTP2Session::is_preface(state.buf_))
+    {
+        start_http2(fd, nullptr, state.buf_);
+        return;
+    }
+    // If so, try to parse it
+    state.start_ns_ = Metrics::now_ns();
+    state.requests_++;
+    Metrics::add(Metrics::REQUESTS);
+    HTTPRequest request;
+    HTTPResponse response;
+    response.set_version("HTTP/1.1");
+    try
+    {
+        HTTPRequest _request(state.buf_, &state.remainder_);
+        request = std::move(_request);
+        state.trace_.mark(RequestTrace::PARSED);
+        if (Tracer::enabled())
+            state.trace_path_ = request.path();
+    } catch (const std::exception& ex)
+    {
+        LOG_ERROR << "HTTPRequest construction failed: "
+                  << ex.what() << LOG_END;
+        response.make_400();
+        state.keep_alive_ = keep_running_;
+        response.set_header("Connection", keep_running_ ? "keep-alive" : "close");
+        state.file_ok_ = false;
+        queue_response(fd, response);
+        return;
+    }
+    if (!server_.allow_request(state.limit_slot_, response))
+    {
+        state.keep_alive_ = false;
+        state.file_ok_ = false;
+        queue_response(fd, response);
+        return;
+    }
+    // A plaintext request may ask to continue in HTTP/2 (h2c), which then
+    // answers it as stream 1
+    if (server_.config_.http2 && !state.tls_ &&
+        HTTP2Session::wants_upgrade(request) && !HTTPServer::is_upload(request) &&
+        start_http2(fd, &request, state.remainder_))
+    {
+        // Counted again as stream 1
+        client(fd).requests_--;
+        Metrics::add(Metrics::REQUESTS, -1);
+        return;
+    }
+    // Set persistent connection as necessary
+    state.keep_alive_ = server_.set_conn_type(request, response);
+    if (HTTPServer::is_upload(request))
+    {
+        state.file_ok_ = false;
+        state.upload_ = server_.start_upload(request, response);
+        if (!state.upload_)
+        {
+            state.keep_alive_ = false;
+            response.set_header("Connection", "close");
+            queue_response(fd, response);
+            return;
+        }
+        HTTPServer::send_continue(fd, state.tls_.get(), request,
+                                  state.remainder_);
+        state.state_ = ClientState::READ_BODY;
+        finish_body(fd, state.upload_->consume(state.remainder_));
+        return;
+    }
+    if (server_.helpers_ && server_.needs_disk(request))
+    {
+        prepare_on_helper(fd, request, response);
+        return;
+    }
+    state.file_ok_ = server_.prepare_response(request, response, state.body_);
+    queue_response(fd, response);
+}
+
+/**
+ * @summary Switches a client to HTTP/2, with each stream answered by
+ * prepare_response
+ *
+ * @param upgrade the HTTP/1.1 request that asked for h2c, if any
+ * @param buffered what has been read from the client and not yet handled
+ * @return false, leaving the client as it was, if the upgrade is refused
+ */
+bool HTTPServer::EventLoop::start_http2(int fd, const HTTPRequest* upgrade,
+                                        std::string& buffered)
+{
+    ClientState& state = client(fd);
+    HTTP2Session::Handler handler = [this, fd](const HTTPRequest& request,
+                                               HTTPResponse& response,
+                                               ResponseBody& body)
+    {
+        ClientState& state = client(fd);
+        state.requests_++;
+        Metrics::add(Metrics::REQUESTS);
+        bool has_body = false;
+        if (server_.allow_request(state.limit_slot_, response))
+        {
+            // Request bodies aren't read over HTTP/2
+            if (HTTPServer::is_upload(request))
+                response.make_501();
+            else
+                has_body = server_.prepare_response(request, response, body);
+        }
+        Metrics::record_status(response.status());
+        return has_body;
+    };
+    std::unique_ptr<HTTP2Session> session(new HTTP2Session(handler,
+                                                            HTTP2_STREAMS));
+    if (upgrade)
+    {
+        if (!session->upgrade(*upgrade))
+            return false;
+    }
+    else
+    {
+        session->start();
+    }
+    state.h2_ = std::move(session);
+    state.state_ = ClientState::HTTP2;
+    // Each DATA frame is a small write of its own, which Nagle's algorithm
+    // would hold until the previous one is acknowledged; frame headers are
+    // sent with MSG_MORE instead, so packets still fill up
+    const int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int)) == -1 &&
+        errno != EOPNOTSUPP) // a Unix socket
+    {
+        LOG_ERROR << "setsockopt(TCP_NODELAY): " << std::strerror(errno) << LOG_END;
+    }
+    state.h2_->feed(buffered.data(), buffered.size());
+    buffered.clear();
+    state.buf_.clear();
+    state.remainder_.clear();
+    handle_http2(fd, 0);
+    return true;
+}
+
+/**
+ * @summary Services an HTTP/2 client: reads and processes its frames, then
+ * writes as much of the queued output as the socket takes, watching for
+ * POLLOUT only while some is left, and for POLLIN only while not too much is
+ */
+void HTTPServer::EventLoop::handle_http2(int fd, short events)
+{
+    ClientState& state = client(fd);
+    if ((events & (POLLIN | POLLHUP | POLLERR)) && state.h2_->want_read() &&
+        !state.h2_->receive(fd, state.tls_.get()))
+    {
+        close_client(fd);
+        return;
+    }
+    if (!state.h2_->send(fd, state.tls_.get()) || state.h2_->finished())
+    {
+        close_client(fd);
+        return;
+    }
+    short polling = (state.h2_->want_read() ? POLLIN : 0) |
+                    (state.h2_->want_write() ? POLLOUT : 0);
+    if (polling != state.polling_)
+    {
+        poller_.modify(fd, polling);
+        state.polling_ = polling;
+    }
+}
+
+/**
+ * @summary Moves the next piece of an upload's body from a client in
+ * READ_BODY mode into its file
+ */
+void HTTPServer::EventLoop::handle_body(int fd)
+{
+    ClientState& state = client(fd);
+    finish_body(fd, state.upload_->receive(fd, state.tls_.get(),
+                                           state.remainder_));
+}
+
+/**
+ * @summary Once an upload's body has been received (or has failed), sends
+ * the response to it
+ */
+void HTTPServer::EventLoop::finish_body(int fd, Upload::Status status)
+{
+    if (status == Upload::MORE)
+        return;
+    ClientState& state = client(fd);
+    HTTPResponse response;
+    response.set_version("HTTP/1.1");
+    response.set_header("Connection", state.keep_alive_ ? "keep-alive" : "close");
+    server_.finish_upload(*state.upload_, status, response);
+    if (status == Upload::FAILED)
+        state.keep_alive_ = false;
+    state.upload_.reset();
+    queue_response(fd, response);
+}
+
+/**
+ * @return whether the client's file body goes out with sendfile(): always
+ * with kernel TLS, which can't encrypt what user space writes, and for
+ * plaintext unless `helpers` take reads that would block off the loop,
+ * which sendfile() can't tell in advance
+ */
+static bool use_sendfile(const ClientState& state, bool helpers)
+{
+#ifdef __APPLE__
+    (void)state;
+    (void)helpers;
+    return false;
+#else
+    if (state.body_.fd == -1)
+        return false;
+    if (state.tls_)
+        return state.tls_->kernel_send();
+    return !helpers;
+#endif
+}
+
+/**
+ * @summary Reads the next part of a client's file into its buffer
+ *
+ * @param cached_only only read what is in the page cache, failing with
+ *                    EAGAIN if none of it is
+ */
+static ssize_t read_file(ClientState& state, bool cached_only)
+{
+    if (cached_only)
+    {
+#ifdef RWF_NOWAIT
+        struct iovec iov = { &state.buf_[0], state.buf_.size() };
+        ssize_t bytes_read = preadv2(state.body_.fd, &iov, 1, state.file_pos_,
+                                     RWF_NOWAIT);
+        // Without RWF_NOWAIT support (older kernels, some filesystems)
+        // there's no telling whether a read would block
+        if (bytes_read >= 0 || errno != EOPNOTSUPP)
+            return bytes_read;
+#endif
+        errno = EAGAIN;
+        return -1;
+    }
+    return pread(state.body_.fd, &state.buf_[0], state.buf_.size(),
+                 state.file_pos_);
+}
+
+/**
+ * @summary Writes the pending response headers (WRITE_RESPONSE) or the next
+ * piece of the file (WRITE_FILE) to a client
+ */
+void HTTPServer::EventLoop::handle_write(int fd)
+{
+    ClientState& state = client(fd);
+    // If we are currently writing the response headers
+    if (state.state_ == ClientState::WRITE_RESPONSE)
+    {
+        // Send from the buffer, keeping track of how much has been
+        // sent so we can continue next cycle, if necessary
+        ssize_t bytes_written = TLSConnection::send(state.tls_.get(), fd,
+                                                    &state.buf_[state.pos_],
+                                                    state.buf_.size() - state.pos_);
+        if (bytes_written < 0)
+        {
+            // Again, EWOULDBLOCK means client wasn't ready, so try
+            // again later
+            if (errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+            close_client(fd);
+            return;
+        }
+        state.pos_ += bytes_written;
+        Metrics::add(Metrics::HEADER_BYTES_SENT, bytes_written);
+        // If there's nothing else to write, now we can start
+        // writing the file instead (if there is one)
+        if (bytes_written == 0 || state.pos_ == (off_t)state.buf_.size())
+        {
+            state.trace_.mark(RequestTrace::HEADERS_SENT);
+            if (state.file_ok_)
+            {
+                // Set state to WRITE_FILE, and get ready to write
+                // the file
+                state.state_ = ClientState::WRITE_FILE;
+                state.pos_ = 0;
+                state.buf_end_ = 0;
+                state.file_pos_ = 0;
+                state.buf_.clear();
+                // A body in memory is sent straight from there, and a file
+                // usually with sendfile()
+                if (state.body_.memory())
+                    state.buf_end_ = state.body_.size;
+                else if (state.body_.fd != -1 &&
+                         !use_sendfile(state, server_.helpers_ != nullptr))
+                    state.buf_.resize(server_.config_.file_buffer_size);
+            }
+            else // No file to be sent, just finish up now
+            {
+                finish_response(fd);
+            }
+        }
+    }
+    // Deficit round robin: each wakeup grants the client another quantum
+    // of body bytes, which it sends until it is used up or the socket is
+    // full. What a full socket leaves unused carries over, up to a quantum,
+    // so no client gets more than its share of a round
+    else if (state.state_ == ClientState::WRITE_FILE)
+    {
+        const off_t quantum = server_.config_.write_quantum;
+        if (quantum > 0)
+            state.deficit_ = std::min(state.deficit_, quantum) + quantum;
+        else
+            state.deficit_ = std::numeric_limits<off_t>::max();
+        while (write_body(fd))
+            ;
+    }
+}
+
+/**
+ * @summary Whether a client is sending a body bigger than a quantum, which
+ * takes it more than one round
+ */
+bool HTTPServer::EventLoop::is_bulk(const ClientState& state) const
+{
+    return state.state_ == ClientState::WRITE_FILE &&
+           server_.config_.write_quantum > 0 &&
+           state.body_.size > (off_t)server_.config_.write_quantum;
+}
+
+/**
+ * @summary Sends the next piece of a client's body, up to its deficit
+ *
+ * @return true if it should go on sending now: the piece was sent, and
+ *         there is more body and deficit left
+ */
+bool HTTPServer::EventLoop::write_body(int fd)
+{
+    ClientState& state = client(fd);
+#ifndef __APPLE__
+    // The file never passes through user space (kernel TLS encrypts
+    // sendfile() output); `pos_` is the file offset
+    if (use_sendfile(state, server_.helpers_ != nullptr))
+    {
+        off_t size = std::min(state.body_.size - state.pos_, state.deficit_);
+        ssize_t bytes_written = sendfile(fd, state.body_.fd, &state.pos_, size);
+        if (bytes_written < 0)
+        {
+            if (errno == EWOULDBLOCK)
+            {
+                return false;
+            }
+            LOG_ERROR << "sendfile(): " << std::strerror(errno) << LOG_END;
+            close_client(fd);
+            return false;
+        }
+        Metrics::add(Metrics::BODY_BYTES_SENT, bytes_written);
+        state.deficit_ -= bytes_written;
+        if (bytes_written == 0 || state.pos_ == state.body_.size)
+        {
+            finish_response(fd);
+            return false;
+        }
+        // A short write means the socket is full
+        return bytes_written == size && state.deficit_ > 0;
+    }
+#endif
+    const char* memory = state.body_.memory();
+    // Generate the next chunk of a listing once everything in the
+    // buffer has been sent
+    if (state.body_.listing && state.pos_ == state.buf_end_)
+    {
+        state.buf_.clear();
+        if (!state.body_.listing->next(state.buf_))
+        {
+            finish_response(fd);
+            return false;
+        }
+        state.pos_ = 0;
+        state.buf_end_ = state.buf_.size();
+    }
+    // Refill the buffer once everything in it has been sent
+    else if (!memory && state.pos_ == state.buf_end_)
+    {
+        ssize_t bytes_read = read_file(state, server_.helpers_ != nullptr);
+        if (bytes_read < 0 && errno == EAGAIN)
+        {
+            read_on_helper(fd);
+            return false;
+        }
+        if (bytes_read < 0)
+        {
+            LOG_ERROR << "read(): " << std::strerror(errno) << LOG_END;
+            close_client(fd);
+            return false;
+        }
+        // If there's nothing else to read from the file
+        if (bytes_read == 0)
+        {
+            finish_response(fd);
+            return false;
+        }
+        state.pos_ = 0;
+        state.buf_end_ = bytes_read;
+        state.file_pos_ += bytes_read;
+    }
+    // Then write it to the client, keeping whatever doesn't fit in the
+    // socket buffer (or the deficit) for later
+    const char* data = memory ? memory : state.buf_.data();
+    off_t size = std::min(state.buf_end_ - state.pos_, state.deficit_);
+    ssize_t bytes_written = TLSConnection::send(state.tls_.get(), fd,
+                                                data + state.pos_, size);
+    if (bytes_written < 0)
+    {
+        if (errno == EWOULDBLOCK)
+        {
+            return false;
+        }
+        LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+        close_client(fd);
+        return false;
+    }
+    state.pos_ += bytes_written;
+    state.deficit_ -= bytes_written;
+    Metrics::add(Metrics::BODY_BYTES_SENT, bytes_written);
+    // The whole body has been sent
+    if (memory && state.pos_ == state.buf_end_)
+    {
+        finish_response(fd);
+        return false;
+    }
+    return bytes_written == size && state.deficit_ > 0;
+}
+
+/**
+ * @summary Takes a client out of the poller until the helper task it is
+ * about to wait for is done
+ *
+ * @return the task's number, for resume()
+ */
+uint64_t HTTPServer::EventLoop::wait_for_helper(int fd)
+{
+    ClientState& state = client(fd);
+    poller_.remove(fd);
+    state.state_ = ClientState::HELPER;
+    state.helper_task_ = ++helper_tasks_;
+    return state.helper_task_;
+}
+
+/**
+ * @summary Called back on the loop when a client's helper task is done;
+ * polls it again, for writing
+ *
+ * @return false if the client has gone (closed when the drain timed out)
+ *         and its task's result must be dropped
+ */
+bool HTTPServer::EventLoop::resume(int fd, uint64_t task)
+{
+    ClientState& state = client(fd);
+    if (!state.open_ || state.state_ != ClientState::HELPER ||
+        state.helper_task_ != task)
+    {
+        return false;
+    }
+    poller_.add(fd, POLLOUT);
+    return true;
+}
+
+/**
+ * @summary What a helper works on for one client: it is handed over whole,
+ * so the client's own state is never touched off the loop, and anything it
+ * still holds is closed if the client is gone before it is done
+ */
+struct HelperTask
+{
+    HTTPRequest  request;
+    HTTPResponse response;
+    ResponseBody body;
+    bool         send_body = false;
+    int          file = -1;       // a dup of the body's fd, to read
+    off_t        offset = 0;
+    std::string  buffer;
+    ssize_t      bytes_read = 0;
+    int          error = 0;
+
+    ~HelperTask()
+    {
+        body.clear();
+        if (file != -1)
+            close(file);
+    }
+};
+
+/**
+ * @summary Has a helper run prepare_response for a request that needs the
+ * disk, then queues the response back on the loop
+ */
+void HTTPServer::EventLoop::prepare_on_helper(int fd, HTTPRequest& request,
+                                              HTTPResponse& response)
+{
+    std::shared_ptr<HelperTask> task = std::make_shared<HelperTask>();
+    task->request = std::move(request);
+    task->response = std::move(response);
+    uint64_t number = wait_for_helper(fd);
+    Metrics::add(Metrics::HELPER_OPENS);
+    const HTTPServer& server = server_;
+    std::shared_ptr<HelperPool::Completions> completions = completions_;
+    server_.helpers_->submit([this, &server, completions, task, fd, number]()
+    {
+        task->send_body = server.prepare_response(task->request,
+                                                  task->response, task->body);
+        completions->push([this, task, fd, number]()
+        {
+            if (!resume(fd, number))
+                return;
+            ClientState& state = client(fd);
+            std::swap(state.body_, task->body);
+            state.file_ok_ = task->send_body;
+            queue_response(fd, task->response);
+        });
+    });
+}
+
+/**
+ * @summary Has a helper read the next part of a client's file, which isn't
+ * in the page cache, then goes on sending it from the loop
+ */
+void HTTPServer::EventLoop::read_on_helper(int fd)
+{
+    ClientState& state = client(fd);
+    std::shared_ptr<HelperTask> task = std::make_shared<HelperTask>();
+    // The client may be closed while the helper reads, and its fd reused
+    task->file = dup(state.body_.fd);
+    if (task->file == -1)
+    {
+        LOG_ERROR << "dup(): " << std::strerror(errno) << LOG_END;
+        close_client(fd);
+        return;
+    }
+    task->offset = state.file_pos_;
+    task->buffer.swap(state.buf_);
+    uint64_t number = wait_for_helper(fd);
+    Metrics::add(Metrics::HELPER_READS);
+    std::shared_ptr<HelperPool::Completions> completions = completions_;
+    server_.helpers_->submit([this, completions, task, fd, number]()
+    {
+        task->bytes_read = pread(task->file, &task->buffer[0],
+                                 task->buffer.size(), task->offset);
+        task->error = errno;
+        completions->push([this, task, fd, number]()
+        {
+            if (!resume(fd, number))
+                return;
+            ClientState& state = client(fd);
+            state.state_ = ClientState::WRITE_FILE;
+            state.buf_.swap(task->buffer);
+            if (task->bytes_read < 0)
+            {
+                LOG_ERROR << "read(): " << std::strerror(task->error)
+                          << LOG_END;
+                close_client(fd);
+                return;
+            }
+            if (task->bytes_read == 0)
+            {
+                finish_response(fd);
+                return;
+            }
+            state.pos_ = 0;
+            state.buf_end_ = task->bytes_read;
+            state.file_pos_ += task->bytes_read;
+        });
+    });
+}
+
+/**
+ * @summary Stores a prepared response to send on our next cycle, and sets the
+ * state to WRITE_RESPONSE so we know what to do
+ */
+void HTTPServer::EventLoop::queue_response(int fd, const HTTPResponse& response)
+{
+    ClientState& state = client(fd);
+    Metrics::record_status(response.status());
+    state.trace_.mark(RequestTrace::OPENED);
+    if (Tracer::enabled())
+        state.trace_status_ = response.status();
+    state.buf_ = response.to_string();
+    state.pos_ = 0;
+    state.state_ = ClientState::WRITE_RESPONSE;
+    // We want to be notified when the client is ready to receive data
+    poller_.modify(fd, POLLOUT);
+}
+
+/**
+ * @summary Called once a response has been sent in full; goes back into READ
+ * mode if keep-alive, otherwise closes the connection
+ */
+void HTTPServer::EventLoop::finish_response(int fd)
+{
+    ClientState& state = client(fd);
+    Metrics::observe_latency(Metrics::now_ns() - state.start_ns_);
+    if (state.file_ok_)
+        state.trace_.mark(RequestTrace::BODY_SENT);
+    state.trace_.finish(fd, state.trace_path_, state.trace_status_);
+    state.body_.clear();
+    state.deficit_ = 0;
+    if (state.keep_alive_ && !draining_)
+    {
+        poller_.modify(fd, POLLIN);
+        state.state_ = ClientState::READ;
+        state.pos_ = 0;
+        state.file_ok_ = true;
+        // The client may have pipelined another request behind this one,
+        // in which case no more data (and so no POLLIN) may be coming
+        if (state.remainder_.find("\r\n\r\n") != std::string::npos)
+        {
+            handle_read(fd);
+        }
+    }
+    else
+    {
+        close_client(fd);
+    }
+}
+
+/**
+ * @summary Closes a client's connection (and file, if open) and resets its
+ * state
+ */
+void HTTPServer::EventLoop::close_client(int fd)
+{
+    ClientState& state = client(fd);
+    poller_.remove(fd);
+    if (state.tls_)
+        state.tls_->shutdown();
+    close(fd);
+    state.body_.clear();
+    Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+    Metrics::observe_requests_per_connection(state.requests_);
+    server_.release_client(state.limit_slot_);
+    state = ClientState();
+    open_clients_--;
+}
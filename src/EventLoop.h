@@ -0,0 +1,113 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include "HTTP2.h"       // for HTTP2Session
+#include "HTTPServer.h"  // for HTTPServer
+#include "Poller.h"      // for Poller
+#include "RateLimiter.h" // for RateLimiter
+#include "ResponseBody.h" // for ResponseBody
+#include "TLS.h"         // for TLSConnection
+#include "Tracing.h"     // for RequestTrace
+#include "Upload.h"      // for Upload
+
+#include <sys/types.h>   // for off_t
+
+#include <cstdint>       // for uint64_t
+#include <memory>        // for shared_ptr, unique_ptr
+#include <string>        // for string
+#include <vector>        // for vector
+
+/**
+ * @summary struct used by the event loop to keep track of each client's
+ * connection
+ */
+struct ClientState
+{
+    enum {
+        HANDSHAKE,
+        READ,
+        READ_BODY,
+        WRITE_RESPONSE,
+        WRITE_FILE,
+        HELPER,        // waiting for a HelperPool task, not polled
+        HTTP2          // everything is up to h2_
+    }           state_ = READ;
+    std::string buf_;
+    std::string remainder_;
+    off_t       pos_ = 0;
+    off_t       buf_end_ = 0;
+    off_t       file_pos_ = 0;  // where the next read of body_.fd starts
+    off_t       deficit_ = 0;   // body bytes it may send this round
+    uint64_t    helper_task_ = 0; // the HELPER task to resume with
+    ResponseBody body_;
+    std::unique_ptr<Upload> upload_;
+    std::unique_ptr<TLSConnection> tls_; // null for plaintext
+    std::unique_ptr<HTTP2Session> h2_;
+    short       polling_ = POLLIN;  // HTTP/2: the events polled for
+    bool        file_ok_ = true;
+    bool        keep_alive_ = false;
+    bool        open_ = false;
+    int         limit_slot_ = RateLimiter::NO_SLOT;
+    uint64_t    start_ns_ = 0;
+    uint64_t    requests_ = 0;
+    RequestTrace trace_;
+    std::string trace_path_;
+    std::string trace_status_;
+};
+
+/**
+ * @summary One non-blocking event loop serving clients accepted from the
+ * server's listening socket. run_async and run_epoll run a single loop on the
+ * calling thread; run_multi_reactor runs several, one per thread. Every loop
+ * watches the server's shutdown pipe, and drains its connections once it
+ * becomes readable. With --helper-threads, opening files and reading parts
+ * of them that aren't in the page cache are left to the server's
+ * HelperPool; a client waits in HELPER, unpolled, until its task is done.
+ */
+class HTTPServer::EventLoop
+{
+public:
+    EventLoop(HTTPServer& server, Poller::Backend backend);
+
+    void run();
+
+private:
+    ClientState& client(int fd);
+    void accept_client(int listener);
+    void handle_handshake(int fd);
+    void handle_read(int fd);
+    void handle_body(int fd);
+    void finish_body(int fd, Upload::Status status);
+    bool start_http2(int fd, const HTTPRequest* upgrade, std::string& buffered);
+    void handle_http2(int fd, short events);
+    void handle_write(int fd);
+    bool write_body(int fd);
+    bool is_bulk(const ClientState& state) const;
+    void prepare_on_helper(int fd, HTTPRequest& request,
+                           HTTPResponse& response);
+    void read_on_helper(int fd);
+    uint64_t wait_for_helper(int fd);
+    bool resume(int fd, uint64_t task);
+    void queue_response(int fd, const HTTPResponse& response);
+    void finish_response(int fd);
+    void close_client(int fd);
+    int  spin();
+    void start_drain();
+
+    static const int ACCEPT_BATCH = 64;
+    static const uint32_t HTTP2_STREAMS = 100; // concurrent streams per client
+
+    HTTPServer&              server_;
+    Poller                   poller_;
+    std::vector<ClientState> clients_; // indexed by fd
+    std::vector<int>         bulk_;    // ready bulk senders, served last
+    int                      open_clients_;
+    bool                     draining_;
+    uint64_t                 drain_deadline_ns_;
+    // Where the server's helpers send finished tasks back; shared with
+    // them, since they may still hold it once the loop has returned
+    std::shared_ptr<HelperPool::Completions> completions_;
+    uint64_t                 helper_tasks_; // HELPER tasks started
+};
+
+#endif
@@ -0,0 +1,660 @@
+#include "FileIndex.h"
+#include "SharedFileTable.h" // for SharedFileTable
+#include "Upload.h"         // for Upload
+#include "logging.h"        // for LOG_END, LOG_ERROR, LOG_INFO
+
+#include <dirent.h>         // for opendir, readdir, closedir, dirfd
+#include <fcntl.h>          // for openat, posix_fadvise, O_RDONLY
+#include <poll.h>           // for poll
+#include <unistd.h>         // for close, read
+
+#ifdef __linux__
+#include <sys/inotify.h>    // for inotify_init1, inotify_add_watch, etc
+#endif
+
+#include <algorithm>        // for max
+#include <cerrno>           // for errno
+#include <condition_variable> // for condition_variable
+#include <cstdint>          // for int8_t, uint32_t
+#include <cstdio>           // for snprintf
+#include <cstdlib>          // for realpath, free
+#include <cstring>          // for strerror, strcmp
+#include <functional>       // for hash
+#include <string_view>      // for string_view
+#include <unordered_set>    // for unordered_set
+
+namespace
+{
+struct MimeType
+{
+    std::string_view extension; // lowercase, without the dot
+    const char*      type;
+};
+
+constexpr MimeType MIME_TYPES[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"csv", "text/csv; charset=utf-8"},
+    {"md", "text/markdown; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"ico", "image/x-icon"},
+    {"pdf", "application/pdf"},
+    {"wasm", "application/wasm"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"mp3", "audio/mpeg"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+};
+constexpr size_t MIME_COUNT = sizeof(MIME_TYPES) / sizeof(MIME_TYPES[0]);
+constexpr size_t MIME_TABLE_SIZE = 64;
+constexpr size_t MAX_EXTENSION = 8;
+
+// FNV-1a, starting from `seed`
+constexpr uint32_t extension_hash(std::string_view extension, uint32_t seed)
+{
+    uint32_t hash = seed;
+    for (char c : extension)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV's low bits only depend on the input's low bits, so fold in the high
+// ones before taking a slot
+constexpr size_t mime_slot(std::string_view extension, uint32_t seed)
+{
+    uint32_t hash = extension_hash(extension, seed);
+    return (hash ^ (hash >> 16)) % MIME_TABLE_SIZE;
+}
+
+/**
+ * @summary The first seed that sends every extension to its own slot,
+ * found by the compiler; 0 if there is none
+ */
+constexpr uint32_t find_mime_seed()
+{
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + 100000; seed++)
+    {
+        bool used[MIME_TABLE_SIZE] = {};
+        bool collision = false;
+        for (const MimeType& type : MIME_TYPES)
+        {
+            size_t slot = mime_slot(type.extension, seed);
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision)
+            return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t MIME_SEED = find_mime_seed();
+static_assert(MIME_SEED != 0, "no perfect hash seed for MIME_TYPES");
+
+// Each slot's index into MIME_TYPES, or -1
+struct MimeSlots
+{
+    int8_t index[MIME_TABLE_SIZE];
+
+    constexpr MimeSlots() : index()
+    {
+        for (size_t i = 0; i < MIME_TABLE_SIZE; i++)
+            index[i] = -1;
+        for (size_t i = 0; i < MIME_COUNT; i++)
+        {
+            static_assert(MIME_COUNT < 128, "indexes must fit in int8_t");
+            index[mime_slot(MIME_TYPES[i].extension, MIME_SEED)] =
+                static_cast<int8_t>(i);
+        }
+    }
+
+    constexpr int operator[](size_t slot) const { return index[slot]; }
+};
+constexpr MimeSlots MIME_SLOTS;
+
+bool ends_with(const std::string& str, const std::string& suffix)
+{
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+FileIndex::Entry make_entry(const std::string& path, const struct stat& st,
+                            bool has_gzip, bool has_brotli)
+{
+    FileIndex::Entry entry;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.mime = FileIndex::mime_type(path);
+    entry.etag = FileIndex::make_etag(st);
+    entry.has_gzip = has_gzip;
+    entry.has_brotli = has_brotli;
+    return entry;
+}
+
+bool is_regular(const std::string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/**
+ * @summary Whether the absolute, resolved `path` is `root` or under it
+ */
+bool beneath(const std::string& root, const std::string& path)
+{
+    if (root == "/")
+        return true;
+    return path.compare(0, root.size(), root) == 0 &&
+           (path.size() == root.size() || path[root.size()] == '/');
+}
+}
+
+/**
+ * @param threads number of threads for the startup scan, 0 for one per CPU
+ * @param prewarm_max files up to this size are read into the page cache
+ *                    during the scan (0 = off)
+ * @param shared_slots if not 0, keep the entries in a shared memory table
+ *                     of this many slots, for forked workers to read
+ */
+FileIndex::FileIndex(int threads, off_t prewarm_max, size_t shared_slots) :
+    threads_(threads), prewarm_max_(prewarm_max), inotify_fd_(-1),
+    watching_(false), rebuilding_(false), incomplete_(false)
+{
+    if (shared_slots > 0)
+        shared_.reset(new SharedFileTable(shared_slots));
+    // The serving directory, to tell where symlinks lead
+    if (char* root = realpath(".", nullptr))
+    {
+        root_ = root;
+        std::free(root);
+    }
+    if (threads_ <= 0)
+    {
+        threads_ = std::max(1u, std::thread::hardware_concurrency());
+    }
+#ifdef __linux__
+    // Created first, so that directories are watched as they are scanned and
+    // no change made during the scan is missed
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ == -1)
+    {
+        LOG_ERROR << "inotify_init1(): " << std::strerror(errno) << LOG_END;
+    }
+#endif
+}
+
+FileIndex::~FileIndex()
+{
+    if (watch_thread_.joinable())
+    {
+        watching_ = false;
+        watch_thread_.join();
+    }
+    if (inotify_fd_ != -1)
+        close(inotify_fd_);
+}
+
+/**
+ * @summary Scans the current directory tree into the index. Directories are
+ * handed out to `threads_` threads from a shared queue, so wide and deep
+ * trees are both scanned in parallel.
+ */
+void FileIndex::build()
+{
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<std::string> queue(1, "");
+    int busy = 0;
+    auto worker = [&]()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            // Done once nothing is queued and nobody can queue more
+            cond.wait(lock, [&]() { return !queue.empty() || busy == 0; });
+            if (queue.empty())
+                return;
+            std::string dir = std::move(queue.back());
+            queue.pop_back();
+            busy++;
+            lock.unlock();
+            std::vector<std::string> subdirs;
+            scan(dir, subdirs);
+            lock.lock();
+            busy--;
+            for (std::string& subdir : subdirs)
+                queue.push_back(std::move(subdir));
+            cond.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threads_; i++)
+        threads.emplace_back(worker);
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+    LOG_INFO << "Indexed " << size() << " files and directories" << LOG_END;
+}
+
+/**
+ * @summary Starts applying filesystem changes to the index as they happen
+ */
+void FileIndex::watch()
+{
+    if (inotify_fd_ == -1)
+        return;
+    watching_ = true;
+    watch_thread_ = std::thread(&FileIndex::watch_loop, this);
+}
+
+/**
+ * @summary Looks up the file for a request path
+ *
+ * @return false if there is no such regular file
+ */
+bool FileIndex::lookup(const std::string& path, Entry& entry) const
+{
+    if (shared_)
+        return shared_->lookup(path, entry);
+    const Shard& s = shard(path);
+    std::lock_guard<std::mutex> lock(s.mutex_);
+    auto it = s.entries_.find(path);
+    if (it == s.entries_.end())
+        return false;
+    entry = it->second;
+    return true;
+}
+
+size_t FileIndex::size() const
+{
+    if (shared_)
+        return shared_->size();
+    size_t total = 0;
+    for (const Shard& s : shards_)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex_);
+        total += s.entries_.size();
+    }
+    return total;
+}
+
+/**
+ * @summary Whether every file is in the index, so that a path missing from
+ * it is a 404; not while it is being rebuilt, nor once a full shared table
+ * or a symlinked directory has left files out
+ */
+bool FileIndex::complete() const
+{
+    if (shared_)
+        return !rebuilding_ && shared_->complete();
+    return !rebuilding_ && !incomplete_;
+}
+
+/**
+ * @summary Content-Type for a file, from its extension (case-insensitive),
+ * found with a single probe of the compile-time perfect hash table above
+ */
+const char* FileIndex::mime_type(const std::string& path)
+{
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || path.size() - dot - 1 > MAX_EXTENSION ||
+        path.find('/', dot) != std::string::npos)
+    {
+        return "application/octet-stream";
+    }
+    char lower[MAX_EXTENSION];
+    size_t length = path.size() - dot - 1;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = path[dot + 1 + i];
+        lower[i] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    std::string_view extension(lower, length);
+    int index = MIME_SLOTS[mime_slot(extension, MIME_SEED)];
+    if (index < 0 || MIME_TYPES[index].extension != extension)
+        return "application/octet-stream";
+    return MIME_TYPES[index].type;
+}
+
+/**
+ * @summary Strong validator for a file's current contents, built from its
+ * inode, size and mtime
+ */
+std::string FileIndex::make_etag(const struct stat& st)
+{
+    char etag[64];
+    std::snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx\"",
+                  (unsigned long)st.st_ino, (unsigned long)st.st_size,
+                  (unsigned long)st.st_mtime);
+    return etag;
+}
+
+FileIndex::Shard& FileIndex::shard(const std::string& path)
+{
+    return shards_[std::hash<std::string>()(path) % NUM_SHARDS];
+}
+
+const FileIndex::Shard& FileIndex::shard(const std::string& path) const
+{
+    return shards_[std::hash<std::string>()(path) % NUM_SHARDS];
+}
+
+void FileIndex::store(const std::string& path, Entry entry)
+{
+    if (shared_)
+    {
+        shared_->store(path, entry);
+        return;
+    }
+    Shard& s = shard(path);
+    std::lock_guard<std::mutex> lock(s.mutex_);
+    s.entries_[path] = std::move(entry);
+}
+
+void FileIndex::erase(const std::string& path)
+{
+    if (shared_)
+    {
+        shared_->erase(path);
+        return;
+    }
+    Shard& s = shard(path);
+    std::lock_guard<std::mutex> lock(s.mutex_);
+    s.entries_.erase(path);
+}
+
+void FileIndex::clear()
+{
+    if (shared_)
+    {
+        shared_->clear();
+        return;
+    }
+    for (Shard& s : shards_)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex_);
+        s.entries_.clear();
+    }
+    incomplete_ = false;
+}
+
+/**
+ * @summary Notes that files were left out of the index, so misses can no
+ * longer be answered 404 from it
+ */
+void FileIndex::mark_incomplete()
+{
+    if (shared_)
+        shared_->mark_incomplete();
+    else
+        incomplete_ = true;
+}
+
+/**
+ * @summary Whether the symlink at request path `path` leads to something
+ * under the serving directory
+ */
+bool FileIndex::leads_inside(const std::string& path) const
+{
+    char* target = realpath(("." + path).c_str(), nullptr);
+    if (target == nullptr)
+        return false;
+    bool inside = !root_.empty() && beneath(root_, target);
+    std::free(target);
+    return inside;
+}
+
+/**
+ * @summary Indexes one directory and the regular files in it, and returns
+ * its subdirectories through `subdirs`
+ *
+ * @param dir the directory as a request path prefix ("" for the root)
+ */
+void FileIndex::scan(const std::string& dir, std::vector<std::string>& subdirs)
+{
+    add_watch(dir);
+    DIR* dirp = opendir(("." + dir).c_str());
+    if (dirp == nullptr)
+    {
+        LOG_ERROR << "opendir(): " << std::strerror(errno) << ": ." << dir
+                  << LOG_END;
+        return;
+    }
+    // Directories are entered with a trailing '/', so that a request for
+    // one without it can be redirected without a stat()
+    struct stat dir_st;
+    if (!dir.empty() && fstat(dirfd(dirp), &dir_st) == 0)
+        store(dir + '/', make_entry(dir, dir_st, false, false));
+    std::vector<std::string> names;
+    while (struct dirent* ent = readdir(dirp))
+    {
+        if (std::strcmp(ent->d_name, ".") != 0 &&
+            std::strcmp(ent->d_name, "..") != 0)
+        {
+            names.push_back(ent->d_name);
+        }
+    }
+    std::unordered_set<std::string> present(names.begin(), names.end());
+    for (const std::string& name : names)
+    {
+        if (Upload::is_temp_name(name))
+            continue;
+        std::string path = dir + '/' + name;
+        struct stat st;
+        if (fstatat(dirfd(dirp), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        // Symlinks are neither indexed nor descended into (they can lead
+        // back up the tree, or out of it); requests through one that stays
+        // inside are left to the disk path, which confines them itself
+        if (S_ISLNK(st.st_mode))
+        {
+            if (leads_inside(path))
+                mark_incomplete();
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            subdirs.push_back(std::move(path));
+            continue;
+        }
+        if (!S_ISREG(st.st_mode))
+            continue;
+        if (st.st_size > 0 && st.st_size <= prewarm_max_)
+        {
+            int fd = openat(dirfd(dirp), name.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd != -1)
+            {
+#ifdef POSIX_FADV_WILLNEED
+                posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED);
+#endif
+                close(fd);
+            }
+        }
+        store(path, make_entry(path, st, present.count(name + ".gz") > 0,
+                               present.count(name + ".br") > 0));
+    }
+    closedir(dirp);
+}
+
+/**
+ * @summary Indexes a directory tree on the calling thread; used for
+ * directories created or moved in after startup
+ */
+void FileIndex::scan_tree(const std::string& dir)
+{
+    std::vector<std::string> queue(1, dir);
+    while (!queue.empty())
+    {
+        std::string next = std::move(queue.back());
+        queue.pop_back();
+        scan(next, queue);
+    }
+}
+
+/**
+ * @summary Re-reads one directory entry after a change, adding, updating or
+ * removing it from the index
+ */
+void FileIndex::refresh(const std::string& dir, const std::string& name)
+{
+    std::string path = dir + '/' + name;
+    struct stat st;
+    bool found = lstat(("." + path).c_str(), &st) == 0;
+    if (found && S_ISLNK(st.st_mode) && leads_inside(path))
+        mark_incomplete();
+    if (found && S_ISREG(st.st_mode))
+    {
+        store(path, make_entry(path, st, is_regular("." + path + ".gz"),
+                               is_regular("." + path + ".br")));
+    }
+    else
+        erase(path);
+    // A compressed variant changed, so the original's flags may have too
+    if (ends_with(name, ".gz") || ends_with(name, ".br"))
+    {
+        refresh(dir, name.substr(0, name.size() - 3));
+    }
+}
+
+/**
+ * @summary Removes every file under `dir` from the index, and stops
+ * watching its directories
+ */
+void FileIndex::erase_tree(const std::string& dir)
+{
+    std::string prefix = dir + '/';
+    if (shared_)
+        shared_->erase_prefix(prefix);
+    for (Shard& s : shards_)
+    {
+        std::lock_guard<std::mutex> lock(s.mutex_);
+        for (auto it = s.entries_.begin(); it != s.entries_.end();)
+        {
+            if (it->first.compare(0, prefix.size(), prefix) == 0)
+                it = s.entries_.erase(it);
+            else
+                ++it;
+        }
+    }
+#ifdef __linux__
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    for (auto it = watches_.begin(); it != watches_.end();)
+    {
+        if (it->second == dir ||
+            it->second.compare(0, prefix.size(), prefix) == 0)
+        {
+            inotify_rm_watch(inotify_fd_, it->first);
+            it = watches_.erase(it);
+        }
+        else
+            ++it;
+    }
+#endif
+}
+
+void FileIndex::add_watch(const std::string& dir)
+{
+#ifdef __linux__
+    if (inotify_fd_ == -1)
+        return;
+    int wd = inotify_add_watch(inotify_fd_, ("." + dir).c_str(),
+                               IN_CREATE | IN_DELETE | IN_CLOSE_WRITE |
+                               IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_ONLYDIR);
+    if (wd == -1)
+    {
+        LOG_ERROR << "inotify_add_watch(): " << std::strerror(errno)
+                  << ": ." << dir << LOG_END;
+        return;
+    }
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    watches_[wd] = dir;
+#else
+    (void)dir;
+#endif
+}
+
+/**
+ * @summary Applies inotify events to the index; wakes up every second to
+ * check whether it should stop
+ */
+void FileIndex::watch_loop()
+{
+#ifdef __linux__
+    alignas(struct inotify_event) char buf[65536];
+    while (watching_)
+    {
+        struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+        for (ssize_t pos = 0; pos < len;)
+        {
+            const struct inotify_event* event =
+                reinterpret_cast<const struct inotify_event*>(buf + pos);
+            pos += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost; start over. Until the scan is done,
+                // lookups that miss are looked up on disk.
+                LOG_ERROR << "inotify queue overflowed, rebuilding index"
+                          << LOG_END;
+                rebuilding_ = true;
+                if (shared_)
+                    shared_->set_rebuilding(true);
+                clear();
+                build();
+                if (shared_)
+                    shared_->set_rebuilding(false);
+                rebuilding_ = false;
+                continue;
+            }
+            std::string dir;
+            {
+                std::lock_guard<std::mutex> lock(watch_mutex_);
+                auto it = watches_.find(event->wd);
+                if (it == watches_.end())
+                    continue;
+                if (event->mask & IN_IGNORED)
+                {
+                    watches_.erase(it);
+                    continue;
+                }
+                dir = it->second;
+            }
+            // Events about the watched directory itself are also reported
+            // (with a name) by its parent
+            if (event->len == 0)
+                continue;
+            std::string name = event->name;
+            // Uploads in progress aren't files yet
+            if (Upload::is_temp_name(name))
+                continue;
+            if (!(event->mask & IN_ISDIR))
+                refresh(dir, name);
+            else if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                scan_tree(dir + '/' + name);
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                erase_tree(dir + '/' + name);
+        }
+    }
+#endif
+}
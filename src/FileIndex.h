@@ -0,0 +1,94 @@
+#ifndef FILEINDEX_H
+#define FILEINDEX_H
+
+#include <sys/stat.h>     // for stat
+#include <sys/types.h>    // for ino_t, off_t, time_t
+
+#include <atomic>         // for atomic
+#include <cstddef>        // for size_t
+#include <memory>         // for unique_ptr
+#include <mutex>          // for mutex
+#include <string>         // for string
+#include <thread>         // for thread
+#include <unordered_map>  // for unordered_map
+#include <vector>         // for vector
+
+class SharedFileTable;
+
+/**
+ * @summary In-memory index of every regular file and directory under the
+ * serving directory, keyed by request path ("/dir/file", or "/dir/"). Built at startup by a parallel scan
+ * and kept up to date with inotify, so a request needs one hash lookup to
+ * find its file (or to be answered 404) and its validators. Symlinks are
+ * left out; one that leads to somewhere under the serving directory makes
+ * the index incomplete, so misses are looked up on disk.
+ * The index is sharded, each shard behind its own mutex, so lookups from
+ * different threads rarely contend. With `shared_slots`, the entries are
+ * kept in a SharedFileTable instead, which processes forked after the index
+ * is built read without locking while this process keeps it up to date.
+ */
+class FileIndex
+{
+public:
+    struct Entry
+    {
+        ino_t       ino = 0;
+        off_t       size = 0;
+        time_t      mtime = 0;
+        const char* mime = nullptr;
+        std::string etag;
+        bool        has_gzip = false; // "<path>.gz" exists
+        bool        has_brotli = false; // "<path>.br" exists
+    };
+
+    FileIndex(int threads, off_t prewarm_max, size_t shared_slots = 0);
+    FileIndex(const FileIndex&) = delete; // prevent copy
+    FileIndex& operator=(const FileIndex&) = delete; // prevent assignment
+    ~FileIndex();
+
+    void build();
+    void watch();
+    bool lookup(const std::string& path, Entry& entry) const;
+    size_t size() const;
+    bool complete() const;
+
+    static const char* mime_type(const std::string& path);
+    static std::string make_etag(const struct stat& st);
+
+private:
+    static const int NUM_SHARDS = 16;
+    struct Shard
+    {
+        mutable std::mutex mutex_;
+        std::unordered_map<std::string, Entry> entries_;
+    };
+
+    Shard& shard(const std::string& path);
+    const Shard& shard(const std::string& path) const;
+    void store(const std::string& path, Entry entry);
+    void erase(const std::string& path);
+    void clear();
+    void mark_incomplete();
+    bool leads_inside(const std::string& path) const;
+    void scan(const std::string& dir, std::vector<std::string>& subdirs);
+    void scan_tree(const std::string& dir);
+    void refresh(const std::string& dir, const std::string& name);
+    void erase_tree(const std::string& dir);
+    void add_watch(const std::string& dir);
+    void watch_loop();
+
+    int                     threads_;
+    off_t                   prewarm_max_;
+    Shard                   shards_[NUM_SHARDS];
+    std::unique_ptr<SharedFileTable> shared_; // replaces the shards
+    int                     inotify_fd_;
+    std::mutex              watch_mutex_;
+    std::unordered_map<int, std::string> watches_; // inotify wd -> directory
+    std::atomic<bool>       watching_;
+    std::atomic<bool>       rebuilding_; // emptied and being scanned again
+    std::atomic<bool>       incomplete_; // files were left out (no shared_)
+    std::string             root_;       // the serving directory, resolved
+    std::thread             watch_thread_;
+};
+
+#endif
@@ -0,0 +1,539 @@
+#include "HPACK.h"
+
+#include <cstdint>    // for int16_t, uint64_t
+
+namespace
+{
+struct StaticEntry
+{
+    const char* name;
+    const char* value;
+};
+
+// RFC 7541, Appendix A
+const StaticEntry STATIC_TABLE[HeaderTable::STATIC_SIZE] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+    {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+    {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+    {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+    {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+    {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""},
+    {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+    {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+    {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+    {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+    {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+    {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+    {"via", ""}, {"www-authenticate", ""}
+};
+
+struct HuffmanCode
+{
+    uint32_t code;
+    int      bits;
+};
+
+// RFC 7541, Appendix B; symbol 256 is EOS
+const HuffmanCode HUFFMAN_CODES[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+const int EOS = 256;
+
+struct HuffmanNode
+{
+    int16_t child[2];  // 0 = none (the root is never a child)
+    int16_t symbol;    // -1 for inner nodes
+};
+
+/**
+ * @summary The decoding tree for HUFFMAN_CODES, built on first use
+ */
+const std::vector<HuffmanNode>& huffman_tree()
+{
+    static const std::vector<HuffmanNode> tree = []
+    {
+        std::vector<HuffmanNode> nodes(1, HuffmanNode{{0, 0}, -1});
+        for (int symbol = 0; symbol <= EOS; symbol++)
+        {
+            const HuffmanCode& code = HUFFMAN_CODES[symbol];
+            size_t node = 0;
+            for (int bit = code.bits - 1; bit >= 0; bit--)
+            {
+                int branch = (code.code >> bit) & 1;
+                if (nodes[node].child[branch] == 0)
+                {
+                    nodes[node].child[branch] = nodes.size();
+                    nodes.push_back(HuffmanNode{{0, 0}, -1});
+                }
+                node = nodes[node].child[branch];
+            }
+            nodes[node].symbol = symbol;
+        }
+        return nodes;
+    }();
+    return tree;
+}
+
+/**
+ * @summary Decodes an integer with an N-bit prefix (RFC 7541, 5.1)
+ */
+bool decode_integer(const uint8_t*& pos, const uint8_t* end, int prefix_bits,
+                    uint32_t& value)
+{
+    if (pos == end)
+        return false;
+    uint32_t mask = (1u << prefix_bits) - 1;
+    uint64_t result = *pos++ & mask;
+    if (result < mask)
+    {
+        value = result;
+        return true;
+    }
+    for (int shift = 0; pos != end && shift <= 28; shift += 7)
+    {
+        uint8_t byte = *pos++;
+        result += uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            if (result > UINT32_MAX)
+                return false;
+            value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+void encode_integer(uint32_t value, int prefix_bits, uint8_t first_byte,
+                    std::string& out)
+{
+    uint32_t mask = (1u << prefix_bits) - 1;
+    if (value < mask)
+    {
+        out += char(first_byte | value);
+        return;
+    }
+    out += char(first_byte | mask);
+    value -= mask;
+    while (value >= 128)
+    {
+        out += char(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+/**
+ * @summary Decodes a Huffman coded string; fails on EOS, and on padding
+ * that is longer than 7 bits or isn't a prefix of EOS (all ones)
+ */
+bool huffman_decode(const uint8_t* data, size_t size, std::string& out)
+{
+    const std::vector<HuffmanNode>& tree = huffman_tree();
+    size_t node = 0;
+    int padding_bits = 0;
+    bool padding_ones = true;
+    for (size_t i = 0; i < size; i++)
+    {
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            int branch = (data[i] >> bit) & 1;
+            node = tree[node].child[branch];
+            if (node == 0)
+                return false;
+            padding_bits++;
+            padding_ones = padding_ones && branch;
+            if (tree[node].symbol != -1)
+            {
+                if (tree[node].symbol == EOS)
+                    return false;
+                out += char(tree[node].symbol);
+                node = 0;
+                padding_bits = 0;
+                padding_ones = true;
+            }
+        }
+    }
+    return padding_bits <= 7 && padding_ones;
+}
+
+size_t huffman_length(const std::string& text)
+{
+    size_t bits = 0;
+    for (unsigned char c : text)
+        bits += HUFFMAN_CODES[c].bits;
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(const std::string& text, std::string& out)
+{
+    uint64_t buffer = 0;
+    int bits = 0;
+    for (unsigned char c : text)
+    {
+        const HuffmanCode& code = HUFFMAN_CODES[c];
+        buffer = (buffer << code.bits) | code.code;
+        bits += code.bits;
+        while (bits >= 8)
+        {
+            bits -= 8;
+            out += char(buffer >> bits);
+        }
+    }
+    // Pad with the most significant bits of EOS, i.e. ones
+    if (bits > 0)
+        out += char((buffer << (8 - bits)) | (0xff >> bits));
+}
+
+/**
+ * @summary Appends a string literal, Huffman coded if that is shorter
+ */
+void encode_string(const std::string& text, std::string& out)
+{
+    size_t coded = huffman_length(text);
+    if (coded < text.size())
+    {
+        encode_integer(coded, 7, 0x80, out);
+        huffman_encode(text, out);
+    }
+    else
+    {
+        encode_integer(text.size(), 7, 0x00, out);
+        out += text;
+    }
+}
+}
+
+HeaderTable::HeaderTable(size_t max_size)
+    : size_(0),
+      max_size_(max_size)
+{
+}
+
+/**
+ * @param index 1-based, across the static table and then the dynamic one
+ * @return false if there is no such entry
+ */
+bool HeaderTable::get(size_t index, HeaderField& field) const
+{
+    if (index == 0)
+        return false;
+    if (index <= STATIC_SIZE)
+    {
+        field.first = STATIC_TABLE[index - 1].name;
+        field.second = STATIC_TABLE[index - 1].value;
+        return true;
+    }
+    index -= STATIC_SIZE + 1;
+    if (index >= entries_.size())
+        return false;
+    field = entries_[index];
+    return true;
+}
+
+/**
+ * @summary Looks a field up, preferring an entry with the same value
+ *
+ * @param value_matched set to whether the returned entry's value matches
+ * @return the entry's index, or 0 if not even the name is in the table
+ */
+size_t HeaderTable::find(const std::string& name, const std::string& value,
+                         bool& value_matched) const
+{
+    size_t name_index = 0;
+    value_matched = false;
+    for (size_t i = 0; i < STATIC_SIZE; i++)
+    {
+        if (name != STATIC_TABLE[i].name)
+            continue;
+        if (value == STATIC_TABLE[i].value)
+        {
+            value_matched = true;
+            return i + 1;
+        }
+        if (name_index == 0)
+            name_index = i + 1;
+    }
+    for (size_t i = 0; i < entries_.size(); i++)
+    {
+        if (entries_[i].first != name)
+            continue;
+        if (entries_[i].second == value)
+        {
+            value_matched = true;
+            return STATIC_SIZE + 1 + i;
+        }
+        if (name_index == 0)
+            name_index = STATIC_SIZE + 1 + i;
+    }
+    return name_index;
+}
+
+void HeaderTable::add(const std::string& name, const std::string& value)
+{
+    size_t entry_size = name.size() + value.size() + 32;
+    // An entry bigger than the whole table just empties it
+    evict(entry_size);
+    if (entry_size > max_size_)
+        return;
+    entries_.emplace_front(name, value);
+    size_ += entry_size;
+}
+
+void HeaderTable::set_max_size(size_t max_size)
+{
+    max_size_ = max_size;
+    evict(0);
+}
+
+/**
+ * @summary Drops the oldest entries until `needed` more bytes fit
+ */
+void HeaderTable::evict(size_t needed)
+{
+    while (!entries_.empty() && size_ + needed > max_size_)
+    {
+        size_ -= entries_.back().first.size() + entries_.back().second.size() + 32;
+        entries_.pop_back();
+    }
+}
+
+HPACKDecoder::HPACKDecoder(size_t max_table_size, size_t max_list_size)
+    : table_(max_table_size),
+      max_table_size_(max_table_size),
+      max_list_size_(max_list_size)
+{
+}
+
+/**
+ * @summary Decodes a complete header block, appending its fields to
+ * `headers`
+ *
+ * @return false if the block is malformed or too big; the connection can't
+ *         be used after that, since its table may be out of sync
+ */
+bool HPACKDecoder::decode(const uint8_t* data, size_t size, HeaderList& headers)
+{
+    const uint8_t* pos = data;
+    const uint8_t* end = data + size;
+    size_t list_size = 0;
+    bool first = true;
+    while (pos != end)
+    {
+        uint8_t byte = *pos;
+        uint32_t index;
+        HeaderField field;
+        if (byte & 0x80)
+        {
+            // Indexed field
+            if (!decode_integer(pos, end, 7, index) || !table_.get(index, field))
+                return false;
+        }
+        else if ((byte & 0xe0) == 0x20)
+        {
+            // Dynamic table size update, only allowed before the fields
+            if (!first || !decode_integer(pos, end, 5, index) ||
+                index > max_table_size_)
+            {
+                return false;
+            }
+            table_.set_max_size(index);
+            continue;
+        }
+        else
+        {
+            // Literal field: with incremental indexing (01), or without
+            // (0000) or never (0001) indexed
+            bool indexing = byte & 0x40;
+            if (!decode_integer(pos, end, indexing ? 6 : 4, index))
+                return false;
+            if (index == 0 ? !read_string(pos, end, field.first)
+                           : !table_.get(index, field))
+            {
+                return false;
+            }
+            field.second.clear();
+            if (!read_string(pos, end, field.second))
+                return false;
+            if (indexing)
+                table_.add(field.first, field.second);
+        }
+        first = false;
+        list_size += field.first.size() + field.second.size() + 32;
+        if (list_size > max_list_size_)
+            return false;
+        headers.push_back(std::move(field));
+    }
+    return true;
+}
+
+bool HPACKDecoder::read_string(const uint8_t*& pos, const uint8_t* end,
+                               std::string& out) const
+{
+    if (pos == end)
+        return false;
+    bool huffman = *pos & 0x80;
+    uint32_t length;
+    if (!decode_integer(pos, end, 7, length) || length > size_t(end - pos) ||
+        length > max_list_size_)
+    {
+        return false;
+    }
+    const uint8_t* text = pos;
+    pos += length;
+    if (huffman)
+        return huffman_decode(text, length, out);
+    out.assign(reinterpret_cast<const char*>(text), length);
+    return true;
+}
+
+HPACKEncoder::HPACKEncoder()
+    : table_(4096),
+      pending_size_(4096),
+      smallest_size_(4096),
+      size_changed_(false)
+{
+}
+
+/**
+ * @summary Appends the header block for `headers` to `out`
+ */
+void HPACKEncoder::encode(const HeaderList& headers, std::string& out)
+{
+    if (size_changed_)
+    {
+        // If the size dipped below where it ended up, the peer must see the
+        // smallest one too, since entries were evicted down to it
+        if (smallest_size_ < pending_size_)
+            encode_integer(smallest_size_, 5, 0x20, out);
+        encode_integer(pending_size_, 5, 0x20, out);
+        size_changed_ = false;
+    }
+    for (const HeaderField& field : headers)
+    {
+        bool value_matched;
+        size_t index = table_.find(field.first, field.second, value_matched);
+        if (value_matched)
+        {
+            encode_integer(index, 7, 0x80, out);
+            continue;
+        }
+        bool indexing = !is_volatile(field.first);
+        if (index != 0)
+        {
+            encode_integer(index, indexing ? 6 : 4, indexing ? 0x40 : 0x00, out);
+        }
+        else
+        {
+            out += char(indexing ? 0x40 : 0x00);
+            encode_string(field.first, out);
+        }
+        encode_string(field.second, out);
+        if (indexing)
+            table_.add(field.first, field.second);
+    }
+}
+
+/**
+ * @summary Applies the peer's SETTINGS_HEADER_TABLE_SIZE; we never use more
+ * than the default 4096 bytes, even if allowed to. Several changes before
+ * the next header block are announced as the smallest size and then the
+ * last one (RFC 7541, section 4.2).
+ */
+void HPACKEncoder::set_max_size(size_t max_size)
+{
+    if (max_size > 4096)
+        max_size = 4096;
+    if (max_size == table_.max_size() && !size_changed_)
+        return;
+    if (!size_changed_ || max_size < smallest_size_)
+        smallest_size_ = max_size;
+    table_.set_max_size(max_size);
+    pending_size_ = max_size;
+    size_changed_ = true;
+}
+
+/**
+ * @summary Fields whose values differ from one response to the next; adding
+ * them to the table would only evict the ones worth keeping
+ */
+bool HPACKEncoder::is_volatile(const std::string& name)
+{
+    return name == "content-length" || name == "etag" ||
+           name == "last-modified" || name == "date" || name == "location" ||
+           name == "content-range" || name == ":status";
+}
@@ -0,0 +1,90 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>  // for size_t
+#include <cstdint>  // for uint8_t, uint32_t
+#include <deque>    // for deque
+#include <string>   // for string
+#include <utility>  // for pair
+#include <vector>   // for vector
+
+typedef std::pair<std::string, std::string> HeaderField;
+typedef std::vector<HeaderField> HeaderList;
+
+/**
+ * @summary HPACK's (RFC 7541) index space: the 61-entry static table
+ * followed by a dynamic table of recently seen fields, newest first, which
+ * evicts the oldest entries to stay within its size limit. An entry's size
+ * is its name and value lengths plus 32.
+ */
+class HeaderTable
+{
+public:
+    explicit HeaderTable(size_t max_size);
+
+    bool   get(size_t index, HeaderField& field) const;
+    size_t find(const std::string& name, const std::string& value,
+                bool& value_matched) const;
+    void   add(const std::string& name, const std::string& value);
+    void   set_max_size(size_t max_size);
+    size_t max_size() const { return max_size_; }
+
+    static const size_t STATIC_SIZE = 61;
+
+private:
+    void evict(size_t needed);
+
+    std::deque<HeaderField> entries_;
+    size_t size_;
+    size_t max_size_;
+};
+
+/**
+ * @summary Decodes header blocks from one peer. Every block on a connection
+ * must be decoded in order, since each can change the dynamic table the
+ * next one refers to.
+ */
+class HPACKDecoder
+{
+public:
+    // The table size we advertise (SETTINGS_HEADER_TABLE_SIZE's default)
+    // and the most header data one block may decode to
+    explicit HPACKDecoder(size_t max_table_size = 4096,
+                          size_t max_list_size = 65536);
+
+    bool decode(const uint8_t* data, size_t size, HeaderList& headers);
+
+private:
+    bool read_string(const uint8_t*& pos, const uint8_t* end,
+                     std::string& out) const;
+
+    HeaderTable table_;
+    size_t      max_table_size_;
+    size_t      max_list_size_;
+};
+
+/**
+ * @summary Encodes header blocks for one peer: exact matches become table
+ * indexes, names that repeat across responses are added to the dynamic
+ * table, and per-response values (lengths, dates, ETags) are sent as
+ * literals that don't displace them. Strings are Huffman coded when that
+ * makes them shorter.
+ */
+class HPACKEncoder
+{
+public:
+    HPACKEncoder();
+
+    void encode(const HeaderList& headers, std::string& out);
+    void set_max_size(size_t max_size);
+
+private:
+    static bool is_volatile(const std::string& name);
+
+    HeaderTable table_;
+    size_t      pending_size_;     // table size to announce, if changed
+    size_t      smallest_size_;    // smallest size set since the last block
+    bool        size_changed_;
+};
+
+#endif
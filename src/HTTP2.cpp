@@ -0,0 +1,1041 @@
+#include "HTTP2.h"
+#include "HTTPRequest.h"   // for HTTPRequest
+#include "HTTPResponse.h"  // for HTTPResponse
+#include "Metrics.h"       // for Metrics
+#include "TLS.h"           // for TLSConnection
+#include "logging.h"       // for LOG_END, LOG_ERROR
+
+#include <sys/socket.h>    // for MSG_MORE
+
+#include <algorithm>       // for min, transform
+#include <cctype>          // for isupper, tolower, toupper
+#include <cerrno>          // for errno, EAGAIN, EINTR
+#include <cstring>         // for strerror
+#include <memory>          // for make_shared
+
+const char HTTP2Session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+namespace
+{
+uint32_t read32(const uint8_t* data)
+{
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) |
+           (uint32_t(data[2]) << 8) | data[3];
+}
+
+void append32(std::string& out, uint32_t value)
+{
+    out += char(value >> 24);
+    out += char(value >> 16);
+    out += char(value >> 8);
+    out += char(value);
+}
+
+/**
+ * @summary Turns an HTTP/2 (lowercase) field name into the capitalization
+ * HTTPRequest's lookups use, e.g. "if-none-match" to "If-None-Match"
+ */
+std::string canonical_name(const std::string& name)
+{
+    std::string result = name;
+    bool word_start = true;
+    for (char& c : result)
+    {
+        if (word_start)
+            c = std::toupper(static_cast<unsigned char>(c));
+        word_start = c == '-';
+    }
+    return result;
+}
+
+/**
+ * @summary Decodes the base64url (without padding) of HTTP2-Settings
+ */
+bool base64url_decode(const std::string& text, std::string& out)
+{
+    uint32_t bits = 0;
+    int count = 0;
+    for (char c : text)
+    {
+        int value;
+        if (c >= 'A' && c <= 'Z')
+            value = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            value = c - '0' + 52;
+        else if (c == '-')
+            value = 62;
+        else if (c == '_')
+            value = 63;
+        else if (c == '=')
+            break;
+        else
+            return false;
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8)
+        {
+            count -= 8;
+            out += char(bits >> count);
+        }
+    }
+    return true;
+}
+
+/**
+ * @summary HTTP/1.1 connection-level fields, which HTTP/2 forbids
+ */
+bool is_connection_header(const std::string& name)
+{
+    return name == "connection" || name == "keep-alive" ||
+           name == "proxy-connection" || name == "transfer-encoding" ||
+           name == "upgrade";
+}
+}
+
+/**
+ * @param handler prepares the response to each request
+ * @param max_streams requests the peer may have open at once
+ */
+HTTP2Session::HTTP2Session(Handler handler, uint32_t max_streams)
+    : handler_(handler),
+      max_streams_(max_streams),
+      got_preface_(false),
+      header_stream_(0),
+      header_flags_(0),
+      header_parent_(0),
+      header_weight_(16),
+      last_stream_(0),
+      window_(DEFAULT_WINDOW),
+      initial_window_(DEFAULT_WINDOW),
+      peer_frame_size_(MAX_FRAME_SIZE),
+      vtime_(0),
+      out_pos_(0),
+      control_frames_(0),
+      slice_fd_(-1),
+      slice_offset_(0),
+      slice_left_(0),
+      slice_stream_(0),
+      goaway_(false),
+      closing_(false)
+{
+}
+
+HTTP2Session::~HTTP2Session()
+{
+    for (auto& entry : streams_)
+        entry.second.body.clear();
+}
+
+/**
+ * @return whether `data` starts like a client's connection preface, i.e.
+ * the client speaks HTTP/2 with prior knowledge
+ */
+bool HTTP2Session::is_preface(const std::string& data)
+{
+    return data.compare(0, 16, PREFACE, 16) == 0;
+}
+
+/**
+ * @return whether an HTTP/1.1 request asks to upgrade to h2c
+ */
+bool HTTP2Session::wants_upgrade(const HTTPRequest& request)
+{
+    const std::string* upgrade = request.header_value("Upgrade");
+    if (!upgrade || !request.header_value("HTTP2-Settings") ||
+        request.version() != "HTTP/1.1")
+    {
+        return false;
+    }
+    std::string value = *upgrade;
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    return value.find("h2c") != std::string::npos;
+}
+
+/**
+ * @summary Queues the server's connection preface, our SETTINGS
+ */
+void HTTP2Session::start()
+{
+    write_frame_header(6, SETTINGS, 0, 0);
+    // SETTINGS_MAX_CONCURRENT_STREAMS
+    std::string& out = output();
+    out += '\0';
+    out += '\x03';
+    append32(out, max_streams_);
+}
+
+/**
+ * @summary Takes over a connection whose HTTP/1.1 `request` asked to
+ * upgrade to h2c: queues the 101 response and our preface, applies the
+ * client's HTTP2-Settings, and answers the request as stream 1
+ *
+ * @return false, having queued nothing, if HTTP2-Settings is invalid; the
+ *         request should then be answered over HTTP/1.1
+ */
+bool HTTP2Session::upgrade(const HTTPRequest& request)
+{
+    std::string settings;
+    if (!base64url_decode(*request.header_value("HTTP2-Settings"), settings) ||
+        apply_settings(reinterpret_cast<const uint8_t*>(settings.data()),
+                       settings.size()) != NO_ERROR)
+    {
+        return false;
+    }
+    out_ = "HTTP/1.1 101 Switching Protocols\r\n"
+           "Connection: Upgrade\r\n"
+           "Upgrade: h2c\r\n\r\n";
+    start();
+    last_stream_ = 1;
+    Stream& stream = streams_[1];
+    stream.window = initial_window_;
+    stream.remote_closed = true;
+    HTTPRequest h2_request = request;
+    h2_request.set_version("HTTP/2");
+    respond(1, h2_request);
+    return true;
+}
+
+/**
+ * @summary Reads what the client has sent and processes it
+ *
+ * @return false if the connection should be closed now
+ */
+bool HTTP2Session::receive(int socket, TLSConnection* tls)
+{
+    char buffer[TLSConnection::RECORD_SIZE];
+    ssize_t bytes_read = TLSConnection::recv(tls, socket, buffer, sizeof(buffer));
+    if (bytes_read == 0)
+        return false;
+    if (bytes_read < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return true;
+        LOG_ERROR << "recv(): " << std::strerror(errno) << LOG_END;
+        return false;
+    }
+    feed(buffer, bytes_read);
+    return true;
+}
+
+/**
+ * @summary Processes every complete frame in the data received so far,
+ * starting with the client's connection preface
+ */
+void HTTP2Session::feed(const char* data, size_t size)
+{
+    if (closing_)
+        return;
+    in_.append(data, size);
+    size_t pos = 0;
+    if (!got_preface_)
+    {
+        size_t have = std::min(in_.size(), PREFACE_SIZE);
+        if (in_.compare(0, have, PREFACE, have) != 0)
+        {
+            LOG_ERROR << "Invalid HTTP/2 connection preface" << LOG_END;
+            closing_ = true;
+            return;
+        }
+        if (have < PREFACE_SIZE)
+            return;
+        got_preface_ = true;
+        pos = PREFACE_SIZE;
+    }
+    while (!closing_ && in_.size() - pos >= 9)
+    {
+        const uint8_t* header = reinterpret_cast<const uint8_t*>(&in_[pos]);
+        size_t length = (size_t(header[0]) << 16) | (header[1] << 8) | header[2];
+        if (length > MAX_FRAME_SIZE)
+        {
+            connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (in_.size() - pos - 9 < length)
+            break;
+        process_frame(header[3], header[4], read32(header + 5) & 0x7fffffff,
+                      header + 9, length);
+        pos += 9 + length;
+    }
+    in_.erase(0, pos);
+}
+
+void HTTP2Session::process_frame(uint8_t type, uint8_t flags, uint32_t id,
+                                 const uint8_t* payload, size_t length)
+{
+    // A header block's CONTINUATION frames must follow it immediately
+    if (header_stream_ != 0 && (type != CONTINUATION || id != header_stream_))
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    switch (type)
+    {
+        case DATA:
+            if (id == 0)
+                connection_error(PROTOCOL_ERROR);
+            else if ((flags & PADDED) && (length == 0 || payload[0] >= length))
+                connection_error(PROTOCOL_ERROR);
+            else
+                on_data(flags, id, length);
+            break;
+        case HEADERS:
+            if (id == 0 || id % 2 == 0)
+                connection_error(PROTOCOL_ERROR);
+            else
+                on_headers(flags, id, payload, length);
+            break;
+        case CONTINUATION:
+            if (header_stream_ == 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+                break;
+            }
+            header_block_.append(reinterpret_cast<const char*>(payload), length);
+            if (header_block_.size() > MAX_HEADER_BLOCK)
+                connection_error(ENHANCE_YOUR_CALM);
+            else if (flags & END_HEADERS)
+                complete_headers();
+            break;
+        case PRIORITY:
+            if (id == 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+            }
+            else if (length != 5)
+            {
+                reset_stream(id, FRAME_SIZE_ERROR);
+            }
+            else
+            {
+                auto it = streams_.find(id);
+                if (it != streams_.end())
+                    set_priority(it->second, id, read32(payload) & 0x7fffffff,
+                                 payload[4] + 1);
+            }
+            break;
+        case RST_STREAM:
+            if (id == 0 || id > last_stream_)
+                connection_error(PROTOCOL_ERROR);
+            else if (length != 4)
+                connection_error(FRAME_SIZE_ERROR);
+            else
+                close_stream(id);
+            break;
+        case SETTINGS:
+        {
+            if (id != 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+                break;
+            }
+            if (flags & ACK)
+            {
+                if (length != 0)
+                    connection_error(FRAME_SIZE_ERROR);
+                break;
+            }
+            ErrorCode error = apply_settings(payload, length);
+            if (error != NO_ERROR)
+                connection_error(error);
+            else if (queue_control())
+                write_frame_header(0, SETTINGS, ACK, 0);
+            break;
+        }
+        case PING:
+            if (id != 0)
+            {
+                connection_error(PROTOCOL_ERROR);
+            }
+            else if (length != 8)
+            {
+                connection_error(FRAME_SIZE_ERROR);
+            }
+            else if (!(flags & ACK) && queue_control())
+            {
+                write_frame_header(8, PING, ACK, 0);
+                output().append(reinterpret_cast<const char*>(payload), 8);
+            }
+            break;
+        case GOAWAY:
+            if (id != 0)
+                connection_error(PROTOCOL_ERROR);
+            else
+                goaway_ = true;
+            break;
+        case WINDOW_UPDATE:
+            on_window_update(id, payload, length);
+            break;
+        case PUSH_PROMISE:
+            // Clients can't push
+            connection_error(PROTOCOL_ERROR);
+            break;
+        default:
+            // Unknown frame types are ignored
+            break;
+    }
+}
+
+/**
+ * @summary Starts a header block: a request, or trailers after a request's
+ * body. Padding and priority fields are stripped; the block is decoded
+ * once its last CONTINUATION arrives.
+ */
+void HTTP2Session::on_headers(uint8_t flags, uint32_t id,
+                              const uint8_t* payload, size_t length)
+{
+    size_t padding = 0;
+    if (flags & PADDED)
+    {
+        if (length < 1)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        padding = payload[0];
+        payload++;
+        length--;
+    }
+    header_parent_ = 0;
+    header_weight_ = 16;
+    if (flags & PRIORITY_FLAG)
+    {
+        if (length < 5)
+        {
+            connection_error(PROTOCOL_ERROR);
+            return;
+        }
+        header_parent_ = read32(payload) & 0x7fffffff;
+        header_weight_ = payload[4] + 1;
+        payload += 5;
+        length -= 5;
+    }
+    if (padding > length)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    header_block_.assign(reinterpret_cast<const char*>(payload), length - padding);
+    header_stream_ = id;
+    header_flags_ = flags;
+    if (flags & END_HEADERS)
+        complete_headers();
+}
+
+/**
+ * @summary Decodes a complete header block (always, to keep the decoder's
+ * table in sync) and starts the request it opens
+ */
+void HTTP2Session::complete_headers()
+{
+    uint32_t id = header_stream_;
+    header_stream_ = 0;
+    HeaderList headers;
+    bool decoded = decoder_.decode(
+        reinterpret_cast<const uint8_t*>(header_block_.data()),
+        header_block_.size(), headers);
+    header_block_.clear();
+    if (!decoded)
+    {
+        connection_error(COMPRESSION_ERROR);
+        return;
+    }
+    bool end_stream = header_flags_ & END_STREAM;
+    if (id <= last_stream_)
+    {
+        // Trailers end the request body; for streams we have already
+        // finished with there is nothing to do
+        auto it = streams_.find(id);
+        if (it != streams_.end() && end_stream)
+            it->second.remote_closed = true;
+        return;
+    }
+    last_stream_ = id;
+    // After GOAWAY, new streams are ignored
+    if (goaway_)
+        return;
+    if (streams_.size() >= max_streams_)
+    {
+        reset_stream(id, REFUSED_STREAM);
+        return;
+    }
+    dispatch(id, headers, end_stream);
+}
+
+/**
+ * @summary Turns a request's header fields into an HTTPRequest and answers
+ * it; malformed requests (RFC 7540, 8.1.2) get RST_STREAM
+ */
+void HTTP2Session::dispatch(uint32_t id, const HeaderList& headers,
+                            bool end_stream)
+{
+    HTTPRequest request;
+    request.set_version("HTTP/2");
+    std::string authority;
+    std::string cookie;
+    bool regular = false;
+    bool malformed = false;
+    for (const HeaderField& field : headers)
+    {
+        const std::string& name = field.first;
+        if (!name.empty() && name[0] == ':')
+        {
+            // Pseudo-header fields come first
+            if (regular)
+                malformed = true;
+            else if (name == ":method")
+                request.set_verb(field.second);
+            else if (name == ":path")
+                request.set_path(field.second);
+            else if (name == ":authority")
+                authority = field.second;
+            else if (name != ":scheme")
+                malformed = true;
+            continue;
+        }
+        regular = true;
+        if (std::any_of(name.begin(), name.end(), [](char c)
+                        { return std::isupper(static_cast<unsigned char>(c)); }) ||
+            is_connection_header(name) ||
+            (name == "te" && field.second != "trailers"))
+        {
+            malformed = true;
+        }
+        else if (name == "cookie")
+        {
+            // Cookies may be split into several fields
+            cookie += (cookie.empty() ? "" : "; ") + field.second;
+        }
+        else
+        {
+            std::string key = canonical_name(name);
+            const std::string* existing = request.header_value(key);
+            request.set_header(key, existing ? *existing + ", " + field.second
+                                             : field.second);
+        }
+    }
+    if (malformed || request.verb().empty() || request.path().empty())
+    {
+        reset_stream(id, PROTOCOL_ERROR);
+        return;
+    }
+    if (!authority.empty() && !request.header_value("Host"))
+        request.set_header("Host", authority);
+    if (!cookie.empty())
+        request.set_header("Cookie", cookie);
+    Stream& stream = streams_[id];
+    stream.window = initial_window_;
+    stream.remote_closed = end_stream;
+    stream.vtime = vtime_;
+    set_priority(stream, id, header_parent_, header_weight_);
+    if (streams_.count(id))
+        respond(id, request);
+}
+
+/**
+ * @summary Prepares the response to stream `id`'s request and queues its
+ * headers; the body follows as schedule() gets to it
+ */
+void HTTP2Session::respond(uint32_t id, const HTTPRequest& request)
+{
+    Stream& stream = streams_[id];
+    HTTPResponse response;
+    response.set_version("HTTP/2");
+    bool has_body = handler_(request, response, stream.body);
+    if (!has_body)
+    {
+        stream.body.clear();
+        // Error pages and the like are in the response itself
+        if (!response.body().empty())
+        {
+            stream.body.text = std::make_shared<std::string>(response.body());
+            stream.body.size = response.body().size();
+            has_body = true;
+        }
+    }
+    else if (!stream.body.listing && stream.body.size == 0)
+    {
+        stream.body.clear();
+        has_body = false;
+    }
+    stream.has_body = has_body;
+    HeaderList headers;
+    headers.emplace_back(":status", response.status());
+    for (const auto& header : response.headers())
+    {
+        std::string name = header.first;
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (!is_connection_header(name))
+            headers.emplace_back(name, header.second);
+    }
+    std::string block;
+    encoder_.encode(headers, block);
+    // HEADERS, then CONTINUATIONs if the block doesn't fit in one frame
+    size_t pos = 0;
+    do
+    {
+        size_t length = std::min(block.size() - pos, peer_frame_size_);
+        uint8_t flags = pos + length == block.size() ? END_HEADERS : 0;
+        if (pos == 0 && !has_body)
+            flags |= END_STREAM;
+        write_frame_header(length, pos == 0 ? HEADERS : CONTINUATION, flags, id);
+        output().append(block, pos, length);
+        pos += length;
+        Metrics::add(Metrics::HEADER_BYTES_SENT, 9 + length);
+    } while (pos < block.size());
+    if (!has_body)
+        finish_stream(id);
+}
+
+/**
+ * @summary Request body data; we accept none, so it is only accounted for
+ * and its flow control credit returned
+ */
+void HTTP2Session::on_data(uint8_t flags, uint32_t id, size_t length)
+{
+    auto it = streams_.find(id);
+    if (it == streams_.end() && id > last_stream_)
+    {
+        connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    // Padding counts against the windows too
+    if (length > 0 && queue_control())
+    {
+        write_frame_header(4, WINDOW_UPDATE, 0, 0);
+        append32(output(), length);
+    }
+    if (it == streams_.end())
+        return;
+    if (it->second.remote_closed)
+    {
+        reset_stream(id, STREAM_CLOSED);
+        return;
+    }
+    if (flags & END_STREAM)
+    {
+        it->second.remote_closed = true;
+    }
+    else if (length > 0 && queue_control())
+    {
+        write_frame_header(4, WINDOW_UPDATE, 0, id);
+        append32(output(), length);
+    }
+}
+
+/**
+ * @summary Applies a SETTINGS payload from the peer
+ *
+ * @return NO_ERROR, or the connection error it calls for
+ */
+HTTP2Session::ErrorCode HTTP2Session::apply_settings(const uint8_t* payload,
+                                                     size_t length)
+{
+    if (length % 6 != 0)
+        return FRAME_SIZE_ERROR;
+    for (size_t pos = 0; pos < length; pos += 6)
+    {
+        int setting = (payload[pos] << 8) | payload[pos + 1];
+        uint32_t value = read32(payload + pos + 2);
+        switch (setting)
+        {
+            case 0x1: // SETTINGS_HEADER_TABLE_SIZE
+                encoder_.set_max_size(value);
+                break;
+            case 0x2: // SETTINGS_ENABLE_PUSH
+                if (value > 1)
+                    return PROTOCOL_ERROR;
+                break;
+            case 0x4: // SETTINGS_INITIAL_WINDOW_SIZE
+            {
+                if (value > MAX_WINDOW)
+                    return FLOW_CONTROL_ERROR;
+                // Changes apply to the windows of open streams too
+                int64_t delta = int64_t(value) - initial_window_;
+                for (auto& entry : streams_)
+                {
+                    entry.second.window += delta;
+                    if (entry.second.window > MAX_WINDOW)
+                        return FLOW_CONTROL_ERROR;
+                }
+                initial_window_ = value;
+                break;
+            }
+            case 0x5: // SETTINGS_MAX_FRAME_SIZE
+                if (value < 16384 || value > 16777215)
+                    return PROTOCOL_ERROR;
+                // Bigger frames only save headers; smaller ones keep
+                // streams interleaved
+                peer_frame_size_ = std::min<size_t>(value, 65536);
+                break;
+            default:
+                break;
+        }
+    }
+    return NO_ERROR;
+}
+
+void HTTP2Session::on_window_update(uint32_t id, const uint8_t* payload,
+                                    size_t length)
+{
+    if (length != 4)
+    {
+        connection_error(FRAME_SIZE_ERROR);
+        return;
+    }
+    uint32_t increment = read32(payload) & 0x7fffffff;
+    if (id == 0)
+    {
+        window_ += increment;
+        if (increment == 0)
+            connection_error(PROTOCOL_ERROR);
+        else if (window_ > MAX_WINDOW)
+            connection_error(FLOW_CONTROL_ERROR);
+        return;
+    }
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+    {
+        if (id > last_stream_)
+            connection_error(PROTOCOL_ERROR);
+        return;
+    }
+    it->second.window += increment;
+    if (increment == 0)
+        reset_stream(id, PROTOCOL_ERROR);
+    else if (it->second.window > MAX_WINDOW)
+        reset_stream(id, FLOW_CONTROL_ERROR);
+}
+
+/**
+ * @summary Makes `stream` depend on `parent` with `weight`. A stream can't
+ * depend on itself, and if `parent` depends on `stream`, it first takes
+ * over `stream`'s place in the tree, so no cycle forms.
+ */
+void HTTP2Session::set_priority(Stream& stream, uint32_t id, uint32_t parent,
+                                int weight)
+{
+    if (parent == id)
+    {
+        reset_stream(id, PROTOCOL_ERROR);
+        return;
+    }
+    for (uint32_t ancestor = parent; ancestor != 0;)
+    {
+        auto it = streams_.find(ancestor);
+        if (it == streams_.end())
+            break;
+        if (it->second.parent == id)
+        {
+            streams_[parent].parent = stream.parent;
+            break;
+        }
+        ancestor = it->second.parent;
+    }
+    stream.parent = parent;
+    stream.weight = weight;
+}
+
+/**
+ * @return whether `stream` has a DATA frame it can send now
+ */
+bool HTTP2Session::sendable(const Stream& stream) const
+{
+    if (!stream.has_body || stream.closed)
+        return false;
+    return window_ > 0 && stream.window > 0;
+}
+
+/**
+ * @summary Queues the next DATA frame: from the stream with the least
+ * weighted data sent, among those that can send and don't depend on a
+ * stream that can. File data is left for send() to sendfile().
+ *
+ * @return false if no stream can send anything
+ */
+bool HTTP2Session::schedule()
+{
+    // After an upgrade, clients expect only the 101 and our SETTINGS (and
+    // here stream 1's HEADERS) until they have sent their own preface;
+    // some don't buffer more than that
+    if (!got_preface_)
+        return false;
+    Stream* best = nullptr;
+    uint32_t best_id = 0;
+    for (auto& entry : streams_)
+    {
+        Stream& stream = entry.second;
+        if (!sendable(stream))
+            continue;
+        bool blocked = false;
+        for (uint32_t ancestor = stream.parent; ancestor != 0 && !blocked;)
+        {
+            auto it = streams_.find(ancestor);
+            if (it == streams_.end())
+                break;
+            blocked = sendable(it->second);
+            ancestor = it->second.parent;
+        }
+        if (!blocked && (!best || stream.vtime < best->vtime))
+        {
+            best = &stream;
+            best_id = entry.first;
+        }
+    }
+    if (!best)
+        return false;
+    Stream& stream = *best;
+    size_t limit = std::min<int64_t>(peer_frame_size_,
+                                     std::min(window_, stream.window));
+    size_t length;
+    bool last;
+    const char* memory = stream.body.memory();
+    if (stream.body.listing)
+    {
+        // Listings are generated a batch at a time, as they are sent
+        if (stream.chunk_pos == stream.chunk.size())
+        {
+            stream.chunk.clear();
+            stream.chunk_pos = 0;
+            stream.body.listing->next(stream.chunk);
+        }
+        length = std::min(limit, stream.chunk.size() - stream.chunk_pos);
+        last = stream.chunk.empty();
+        write_frame_header(length, DATA, last ? END_STREAM : 0, best_id);
+        out_.append(stream.chunk, stream.chunk_pos, length);
+        stream.chunk_pos += length;
+    }
+    else
+    {
+        length = std::min<off_t>(limit, stream.body.size - stream.sent);
+        last = stream.sent + off_t(length) == stream.body.size;
+        write_frame_header(length, DATA, last ? END_STREAM : 0, best_id);
+        if (memory)
+        {
+            out_.append(memory + stream.sent, length);
+        }
+        else
+        {
+            slice_fd_ = stream.body.fd;
+            slice_offset_ = stream.sent;
+            slice_left_ = length;
+            slice_stream_ = best_id;
+        }
+    }
+    Metrics::add(Metrics::BODY_BYTES_SENT, length);
+    stream.sent += length;
+    stream.window -= length;
+    window_ -= length;
+    vtime_ = stream.vtime;
+    stream.vtime += (uint64_t(length) + 9) * 256 / stream.weight;
+    if (last)
+    {
+        stream.has_body = false;
+        finish_stream(best_id);
+    }
+    return true;
+}
+
+/**
+ * @summary Writes out queued frames, then file data, then as many further
+ * DATA frames as the socket and flow control allow
+ *
+ * @return false if the connection failed
+ */
+bool HTTP2Session::send(int socket, TLSConnection* tls)
+{
+    while (true)
+    {
+        ssize_t bytes_written;
+        if (out_pos_ < out_.size())
+        {
+            // Keep a DATA frame's header in the same packet as its file data
+            bytes_written = TLSConnection::send(tls, socket, &out_[out_pos_],
+                                                out_.size() - out_pos_,
+                                                slice_left_ > 0 ? MSG_MORE : 0);
+            if (bytes_written > 0)
+                out_pos_ += bytes_written;
+        }
+        else if (slice_left_ > 0)
+        {
+            bytes_written = TLSConnection::sendfile(tls, socket, slice_fd_,
+                                                    &slice_offset_, slice_left_);
+            if (bytes_written == 0)
+            {
+                LOG_ERROR << "sendfile(): file shrank while being sent" << LOG_END;
+                return false;
+            }
+            if (bytes_written > 0)
+            {
+                slice_left_ -= bytes_written;
+                if (slice_left_ == 0)
+                    finish_slice();
+            }
+        }
+        else
+        {
+            out_.clear();
+            out_pos_ = 0;
+            control_frames_ = 0;
+            if (closing_ || !schedule())
+                return true;
+            continue;
+        }
+        if (bytes_written < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return true;
+            LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+            return false;
+        }
+    }
+}
+
+/**
+ * @summary Once a DATA frame's file data is out, frames queued behind it
+ * can go, and its stream can be closed if it has finished
+ */
+void HTTP2Session::finish_slice()
+{
+    uint32_t id = slice_stream_;
+    slice_stream_ = 0;
+    slice_fd_ = -1;
+    out_.swap(next_);
+    out_pos_ = 0;
+    next_.clear();
+    auto it = streams_.find(id);
+    if (it != streams_.end() && it->second.closed)
+        close_stream(id);
+}
+
+/**
+ * @summary Starts a graceful shutdown: GOAWAY, then the connection closes
+ * once the open streams have been answered
+ */
+void HTTP2Session::shutdown()
+{
+    if (goaway_ || closing_)
+        return;
+    goaway_ = true;
+    write_frame_header(8, GOAWAY, 0, 0);
+    append32(output(), last_stream_);
+    append32(output(), NO_ERROR);
+}
+
+bool HTTP2Session::want_write() const
+{
+    return out_pos_ < out_.size() || slice_left_ > 0 || !next_.empty();
+}
+
+/**
+ * @return whether more should be read from the peer: not while the frames
+ * already queued for it (responses' HEADERS, replies to its control frames)
+ * exceed MAX_QUEUED bytes, so a peer that doesn't read can't make them grow
+ */
+bool HTTP2Session::want_read() const
+{
+    return !closing_ && out_.size() - out_pos_ + next_.size() <= MAX_QUEUED;
+}
+
+/**
+ * @return whether the connection has nothing more to do and can be closed
+ */
+bool HTTP2Session::finished() const
+{
+    return (closing_ || (goaway_ && streams_.empty())) && !want_write();
+}
+
+/**
+ * @summary Called once a stream's END_STREAM has been queued. A client that
+ * is still sending a body we won't read is told to stop.
+ */
+void HTTP2Session::finish_stream(uint32_t id)
+{
+    auto it = streams_.find(id);
+    if (it != streams_.end() && !it->second.remote_closed)
+        reset_stream(id, NO_ERROR);
+    else
+        close_stream(id);
+}
+
+/**
+ * @summary Forgets a stream, once any of its file data that has been
+ * promised in a DATA frame is out
+ */
+void HTTP2Session::close_stream(uint32_t id)
+{
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+        return;
+    if (slice_left_ > 0 && slice_stream_ == id)
+    {
+        it->second.closed = true;
+        return;
+    }
+    it->second.body.clear();
+    streams_.erase(it);
+}
+
+void HTTP2Session::reset_stream(uint32_t id, ErrorCode code)
+{
+    if (queue_control())
+    {
+        write_frame_header(4, RST_STREAM, 0, id);
+        append32(output(), code);
+    }
+    close_stream(id);
+}
+
+/**
+ * @summary Counts a control frame about to be queued in reply to the peer.
+ * A peer that provokes them faster than it reads them (a PING, SETTINGS or
+ * RST_STREAM flood, CVE-2019-9512/9514) would have them pile up without
+ * limit, so past MAX_CONTROL_FRAMES it gets ENHANCE_YOUR_CALM instead.
+ *
+ * @return false if the frame mustn't be queued
+ */
+bool HTTP2Session::queue_control()
+{
+    if (closing_)
+        return false;
+    if (++control_frames_ <= MAX_CONTROL_FRAMES)
+        return true;
+    connection_error(ENHANCE_YOUR_CALM);
+    return false;
+}
+
+/**
+ * @summary Ends the connection with GOAWAY, closing it once that's sent
+ */
+void HTTP2Session::connection_error(ErrorCode code)
+{
+    if (closing_)
+        return;
+    LOG_ERROR << "HTTP/2 connection error " << code << LOG_END;
+    write_frame_header(8, GOAWAY, 0, 0);
+    append32(output(), last_stream_);
+    append32(output(), code);
+    closing_ = true;
+}
+
+/**
+ * @return where frames go: behind the file data of the DATA frame being
+ * sent, if there is one
+ */
+std::string& HTTP2Session::output()
+{
+    return slice_left_ > 0 ? next_ : out_;
+}
+
+void HTTP2Session::write_frame_header(size_t length, uint8_t type,
+                                      uint8_t flags, uint32_t id)
+{
+    std::string& out = output();
+    out += char(length >> 16);
+    out += char(length >> 8);
+    out += char(length);
+    out += char(type);
+    out += char(flags);
+    append32(out, id);
+}
@@ -0,0 +1,176 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "HPACK.h"         // for HPACKDecoder, HPACKEncoder, HeaderList
+#include "ResponseBody.h"  // for ResponseBody
+
+#include <sys/types.h>     // for off_t
+
+#include <cstddef>         // for size_t
+#include <cstdint>         // for uint8_t, uint32_t, int64_t, uint64_t
+#include <functional>      // for function
+#include <map>             // for map
+#include <string>          // for string
+
+class HTTPRequest;
+class HTTPResponse;
+class TLSConnection;
+
+/**
+ * @summary The server side of one HTTP/2 connection (RFC 7540): frames are
+ * parsed from whatever the socket delivers, each request stream is answered
+ * through `Handler` (i.e. prepare_response), and the responses' DATA frames
+ * are interleaved by priority within the peer's flow control windows.
+ *
+ * File bodies are sent with sendfile() straight after each DATA frame's
+ * header, so many concurrent responses share one connection without their
+ * files passing through user space. Request bodies aren't accepted; such
+ * requests get whatever the handler answers, and the rest of their body is
+ * discarded.
+ *
+ * Priorities follow RFC 7540's dependency tree, simplified: a stream
+ * doesn't send while a stream it depends on can, and streams that can send
+ * share the connection in proportion to their weights. Dependencies on
+ * streams that are already gone (or never existed) count as dependencies on
+ * the root, and the exclusive flag is ignored.
+ */
+class HTTP2Session
+{
+public:
+    typedef std::function<bool(const HTTPRequest&, HTTPResponse&,
+                               ResponseBody&)> Handler;
+
+    static const char   PREFACE[];
+    static constexpr size_t PREFACE_SIZE = 24;
+
+    HTTP2Session(Handler handler, uint32_t max_streams);
+    HTTP2Session(const HTTP2Session&) = delete; // prevent copy
+    HTTP2Session& operator=(const HTTP2Session&) = delete; // prevent assignment
+    ~HTTP2Session();
+
+    void start();
+    bool upgrade(const HTTPRequest& request);
+    void feed(const char* data, size_t size);
+    bool receive(int socket, TLSConnection* tls);
+    bool send(int socket, TLSConnection* tls);
+    void shutdown();
+
+    bool want_write() const;
+    bool want_read() const;
+    bool finished() const;
+
+    static bool is_preface(const std::string& data);
+    static bool wants_upgrade(const HTTPRequest& request);
+
+private:
+    enum FrameType
+    {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum Flags
+    {
+        END_STREAM = 0x1,
+        ACK = 0x1,
+        END_HEADERS = 0x4,
+        PADDED = 0x8,
+        PRIORITY_FLAG = 0x20
+    };
+
+    enum ErrorCode
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        COMPRESSION_ERROR = 0x9,
+        ENHANCE_YOUR_CALM = 0xb
+    };
+
+    struct Stream
+    {
+        ResponseBody body;
+        off_t        sent = 0;          // body bytes sent so far
+        bool         has_body = false;  // DATA frames still to send
+        std::string  chunk;             // listing text not yet sent
+        size_t       chunk_pos = 0;
+        int64_t      window = 0;        // peer's flow control window
+        bool         remote_closed = false;
+        bool         closed = false;    // forget once its file data is sent
+        uint32_t     parent = 0;
+        int          weight = 16;
+        uint64_t     vtime = 0;         // bytes sent, scaled by 1/weight
+    };
+
+    static const size_t  MAX_FRAME_SIZE = 16384;   // what we accept
+    static const int64_t DEFAULT_WINDOW = 65535;
+    static const int64_t MAX_WINDOW = 0x7fffffff;
+    static const size_t  MAX_HEADER_BLOCK = 65536;
+    static const size_t  MAX_QUEUED = 65536;       // before reads pause
+    static const size_t  MAX_CONTROL_FRAMES = 1000; // queued replies
+
+    void process_frame(uint8_t type, uint8_t flags, uint32_t id,
+                       const uint8_t* payload, size_t length);
+    void on_headers(uint8_t flags, uint32_t id, const uint8_t* payload,
+                    size_t length);
+    void complete_headers();
+    void on_data(uint8_t flags, uint32_t id, size_t length);
+    ErrorCode apply_settings(const uint8_t* payload, size_t length);
+    void on_window_update(uint32_t id, const uint8_t* payload, size_t length);
+    void set_priority(Stream& stream, uint32_t id, uint32_t parent, int weight);
+    void dispatch(uint32_t id, const HeaderList& headers, bool end_stream);
+    void respond(uint32_t id, const HTTPRequest& request);
+    bool schedule();
+    bool sendable(const Stream& stream) const;
+    void finish_slice();
+    void finish_stream(uint32_t id);
+    void close_stream(uint32_t id);
+    std::string& output();
+    void write_frame_header(size_t length, uint8_t type, uint8_t flags,
+                            uint32_t id);
+    void reset_stream(uint32_t id, ErrorCode code);
+    bool queue_control();
+    void connection_error(ErrorCode code);
+
+    Handler       handler_;
+    uint32_t      max_streams_;
+    HPACKDecoder  decoder_;
+    HPACKEncoder  encoder_;
+    std::map<uint32_t, Stream> streams_;
+    std::string   in_;               // received bytes not yet parsed
+    bool          got_preface_;
+    std::string   header_block_;     // HEADERS + CONTINUATION so far
+    uint32_t      header_stream_;    // stream of header_block_, 0 = none
+    uint8_t       header_flags_;
+    uint32_t      header_parent_;    // the block's priority fields
+    int           header_weight_;
+    uint32_t      last_stream_;      // highest stream the peer opened
+    int64_t       window_;           // peer's connection-level window
+    int64_t       initial_window_;   // peer's SETTINGS_INITIAL_WINDOW_SIZE
+    size_t        peer_frame_size_;  // peer's SETTINGS_MAX_FRAME_SIZE
+    uint64_t      vtime_;            // vtime of the last stream scheduled
+    std::string   out_;              // frames waiting to be sent
+    size_t        out_pos_;
+    size_t        control_frames_;   // queued since out_ was last empty
+    std::string   next_;             // frames queued behind the file data
+    int           slice_fd_;         // file data following out_, if any
+    off_t         slice_offset_;
+    size_t        slice_left_;
+    uint32_t      slice_stream_;
+    bool          goaway_;           // no new streams; close once idle
+    bool          closing_;          // close once out_ is sent
+};
+
+#endif
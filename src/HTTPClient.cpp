@@ -0,0 +1,580 @@
+#include "HTTPClient.h"
+#include "HTTPRequest.h"          // for HTTPRequest
+#include "HTTPResponse.h"         // for HTTPResponse
+#include "logging.h"              // for LOG_END, LOG_ERROR
+
+#include <fcntl.h>                // for fcntl, F_GETFL, F_SETFL, O_NONBLOCK
+#include <netdb.h>                // for addrinfo, freeaddrinfo, getaddrinfo
+#include <poll.h>                 // for poll, pollfd, POLLIN, POLLOUT
+#include <sys/time.h>             // for timeval
+#include <unistd.h>               // for close
+
+#include <algorithm>              // for max, transform
+#include <cctype>                 // for tolower
+#include <cerrno>                 // for errno, EINPROGRESS, EINTR, EAGAIN
+#include <chrono>                 // for steady_clock
+#include <cstring>                // for memcpy, memset, strerror
+#include <exception>              // for exception
+
+// Apple doesn't have MSG_NOSIGNAL for some reason...
+#ifdef __APPLE__
+#define MSG_NOSIGNAL SO_NOSIGPIPE
+#endif
+
+namespace
+{
+const size_t RECEIVE_SIZE = 16384;
+const size_t MAX_HEADER = 65536;
+const size_t MAX_LINE = 1024;
+
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string lower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    return text;
+}
+
+/**
+ * @summary Looks up a response header whatever its case, without the
+ * whitespace HTTPResponse leaves around the value
+ */
+bool find_header(const HTTPResponse& response, const std::string& name,
+                 std::string& value)
+{
+    for (const auto& header : response.headers())
+    {
+        if (lower(header.first) != name)
+            continue;
+        size_t start = header.second.find_first_not_of(" \t");
+        size_t end = header.second.find_last_not_of(" \t\r");
+        value = start == std::string::npos
+                ? std::string() : header.second.substr(start, end - start + 1);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @summary Parses a non-negative decimal (Content-Length) or hexadecimal
+ * (chunk size) number, ignoring anything after its digits
+ *
+ * @return false if there are no digits or the number exceeds `max`
+ */
+bool parse_size(const std::string& text, int base, size_t max, size_t& size)
+{
+    size = 0;
+    size_t digits = 0;
+    for (; digits < text.size(); digits++)
+    {
+        char c = std::tolower(text[digits]);
+        int digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else
+            break;
+        if (static_cast<size_t>(digit) > max || size > (max - digit) / base)
+            return false;
+        size = size * base + digit;
+    }
+    return digits > 0;
+}
+
+bool is_idempotent(const std::string& verb)
+{
+    return verb == "GET" || verb == "HEAD" || verb == "OPTIONS" ||
+           verb == "PUT" || verb == "DELETE";
+}
+}
+
+HTTPClient::HTTPClient() : HTTPClient(Options())
+{
+}
+
+HTTPClient::HTTPClient(const Options& options) : options_(options)
+{
+}
+
+HTTPClient::~HTTPClient()
+{
+    close_idle();
+}
+
+/**
+ * @summary Sends `request` to `host`:`port` and reads the whole response,
+ * on a pooled connection if there is one. Host, Connection and (with a
+ * body) Content-Length headers are filled in if the request lacks them.
+ *
+ * @param body the request body, sent after the headers
+ * @return OK once `response` holds the response, body included
+ */
+HTTPClient::Status HTTPClient::fetch(const std::string& host,
+                                     const std::string& port,
+                                     HTTPRequest request,
+                                     HTTPResponse& response,
+                                     const std::string& body)
+{
+    std::string origin = host + ':' + port;
+    if (request.version().empty())
+        request.set_version("HTTP/1.1");
+    if (!request.header_value("Host"))
+        request.set_header("Host", port == "80" ? host : origin);
+    if (!request.header_value("Connection"))
+        request.set_header("Connection", "keep-alive");
+    if (!body.empty() && !request.header_value("Content-Length"))
+        request.set_header("Content-Length", std::to_string(body.size()));
+    std::string message = request.to_string() + body;
+    bool head = request.verb() == "HEAD";
+
+    bool reusable = false;
+    bool got_response = false;
+    int fd = take_idle(origin);
+    if (fd != -1)
+    {
+        Status status = exchange(fd, message, head, response, reusable,
+                                 got_response);
+        if (status == OK && reusable)
+        {
+            put_idle(origin, fd);
+            return OK;
+        }
+        close(fd);
+        // The server may have closed the connection while it was idle, so
+        // nothing came back; that is worth one more try on a new connection,
+        // unless repeating the request could do something twice
+        if (status == OK || got_response || status == TIMEOUT ||
+            !is_idempotent(request.verb()))
+        {
+            return status;
+        }
+    }
+
+    std::vector<Address> addresses;
+    Status status = resolve(host, port, addresses);
+    if (status != OK)
+        return status;
+    status = connect_to(addresses, fd);
+    if (status != OK)
+    {
+        // Perhaps the host has moved; look it up again next time
+        forget_address(origin);
+        return status;
+    }
+    status = exchange(fd, message, head, response, reusable, got_response);
+    if (status == OK && reusable)
+        put_idle(origin, fd);
+    else
+        close(fd);
+    return status;
+}
+
+/**
+ * @summary Closes every pooled connection
+ */
+void HTTPClient::close_idle()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : idle_)
+    {
+        for (const Idle& idle : entry.second)
+            close(idle.fd);
+    }
+    idle_.clear();
+}
+
+const char* HTTPClient::describe(Status status)
+{
+    switch (status)
+    {
+        case OK:                return "OK";
+        case RESOLVE_ERROR:     return "could not resolve host";
+        case CONNECT_ERROR:     return "could not connect to host";
+        case SOCKET_ERROR:      return "socket error";
+        case CONNECTION_CLOSED: return "connection closed by server";
+        case BAD_RESPONSE:      return "invalid response";
+        case TIMEOUT:           return "connection to server timed out";
+    }
+    return "unknown error";
+}
+
+/**
+ * @summary The addresses of `host`, from the cache while they are younger
+ * than `dns_ttl` seconds
+ */
+HTTPClient::Status HTTPClient::resolve(const std::string& host,
+                                       const std::string& port,
+                                       std::vector<Address>& addresses)
+{
+    std::string origin = host + ':' + port;
+    uint64_t now = now_ns();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = resolved_.find(origin);
+        if (it != resolved_.end() && it->second.expires_ns > now)
+        {
+            addresses = it->second.addresses;
+            return OK;
+        }
+    }
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
+    hints.ai_socktype = SOCK_STREAM; // Streaming socket
+    hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG; // Port is a number
+
+    struct addrinfo* res;
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (ret != 0)
+    {
+        LOG_ERROR << host << ": " << gai_strerror(ret) << LOG_END;
+        return RESOLVE_ERROR;
+    }
+    addresses.clear();
+    for (auto ptr = res; ptr != nullptr; ptr = ptr->ai_next)
+    {
+        Address address;
+        std::memcpy(&address.addr, ptr->ai_addr, ptr->ai_addrlen);
+        address.length = ptr->ai_addrlen;
+        address.family = ptr->ai_family;
+        addresses.push_back(address);
+    }
+    freeaddrinfo(res);
+    if (options_.dns_ttl > 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        resolved_[origin] = {addresses,
+                             now + options_.dns_ttl * 1000000000ull};
+    }
+    return OK;
+}
+
+void HTTPClient::forget_address(const std::string& origin)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    resolved_.erase(origin);
+}
+
+/**
+ * @summary Connects to the first of `addresses` that accepts within
+ * `timeout_ms`, and sets the timeouts for everything sent and received on
+ * the socket afterwards
+ */
+HTTPClient::Status HTTPClient::connect_to(const std::vector<Address>& addresses,
+                                          int& fd) const
+{
+    for (const Address& address : addresses)
+    {
+        fd = socket(address.family, SOCK_STREAM, 0);
+        if (fd == -1)
+        {
+            LOG_ERROR << "socket(): " << std::strerror(errno) << LOG_END;
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        // Connect without blocking, so the wait can be bounded
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int ret = connect(fd, reinterpret_cast<const sockaddr*>(&address.addr),
+                          address.length);
+        if (ret == -1 && errno == EINPROGRESS)
+        {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            ret = poll(&pfd, 1, options_.timeout_ms);
+            if (ret == 0)
+            {
+                errno = ETIMEDOUT;
+                ret = -1;
+            }
+            else if (ret > 0)
+            {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                errno = error;
+                ret = error == 0 ? 0 : -1;
+            }
+        }
+        if (ret == -1)
+        {
+            LOG_ERROR << "connect(): " << std::strerror(errno) << LOG_END;
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, flags);
+        struct timeval timeout;
+        timeout.tv_sec = options_.timeout_ms / 1000;
+        timeout.tv_usec = (options_.timeout_ms % 1000) * 1000;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0)
+        {
+            LOG_ERROR << "Could not set receive timeout: " << std::strerror(errno) << LOG_END;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+        {
+            LOG_ERROR << "Could not set send timeout: " << std::strerror(errno) << LOG_END;
+        }
+        return OK;
+    }
+    fd = -1;
+    LOG_ERROR << "Client failed to connect to host" << LOG_END;
+    return CONNECT_ERROR;
+}
+
+/**
+ * @summary Takes the most recently used idle connection to `origin` that is
+ * still healthy: not idle for longer than `idle_timeout`, and with nothing
+ * to read, since a server that has closed it (or sent something unasked)
+ * makes it readable
+ *
+ * @return the connection, or -1 if there is none
+ */
+int HTTPClient::take_idle(const std::string& origin)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = idle_.find(origin);
+    if (it == idle_.end())
+        return -1;
+    std::vector<Idle>& pool = it->second;
+    uint64_t oldest = now_ns() - options_.idle_timeout * 1000000000ull;
+    while (!pool.empty())
+    {
+        Idle idle = pool.back();
+        pool.pop_back();
+        struct pollfd pfd = {idle.fd, POLLIN, 0};
+        if (idle.since_ns >= oldest && poll(&pfd, 1, 0) == 0)
+            return idle.fd;
+        close(idle.fd);
+    }
+    return -1;
+}
+
+void HTTPClient::put_idle(const std::string& origin, int fd)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Idle>& pool = idle_[origin];
+    if (pool.size() >= options_.max_idle_per_origin)
+    {
+        close(fd);
+        return;
+    }
+    pool.push_back({fd, now_ns()});
+}
+
+/**
+ * @summary Sends one request and reads its response
+ *
+ * @param head whether the request was HEAD, whose response has no body
+ * @param reusable set to whether another request can follow on `fd`
+ * @param got_response set to whether any of the response arrived
+ */
+HTTPClient::Status HTTPClient::exchange(int fd, const std::string& message,
+                                        bool head, HTTPResponse& response,
+                                        bool& reusable,
+                                        bool& got_response) const
+{
+    reusable = false;
+    got_response = false;
+    size_t pos = 0;
+    while (pos < message.size())
+    {
+        ssize_t bytes_written = send(fd, &message[pos], message.size() - pos,
+                                     MSG_NOSIGNAL);
+        if (bytes_written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE || errno == ECONNRESET)
+                return CONNECTION_CLOSED;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return TIMEOUT;
+            LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+            return SOCKET_ERROR;
+        }
+        pos += bytes_written;
+    }
+
+    std::string buffer;
+    size_t end;
+    while (true)
+    {
+        // Read until the end of the headers
+        while ((end = buffer.find("\r\n\r\n")) == std::string::npos)
+        {
+            if (buffer.size() > MAX_HEADER)
+                return BAD_RESPONSE;
+            Status status = receive(fd, buffer);
+            if (status != OK)
+                return status;
+            got_response = true;
+        }
+        try
+        {
+            // The body is read below, straight from `buffer`
+            std::string none;
+            response = HTTPResponse(buffer.substr(0, end + 4), &none);
+        } catch (const std::exception&)
+        {
+            return BAD_RESPONSE;
+        }
+        // Interim responses (100 Continue) are followed by the real one
+        if (response.status().size() == 3 && response.status()[0] == '1' &&
+            response.status() != "101")
+        {
+            buffer.erase(0, end + 4);
+            continue;
+        }
+        break;
+    }
+    return read_body(fd, buffer, end + 4, response, head, reusable);
+}
+
+/**
+ * @summary Reads the body that follows the headers (starting at `pos` in
+ * `buffer`), however the response frames it
+ */
+HTTPClient::Status HTTPClient::read_body(int fd, std::string& buffer,
+                                         size_t pos, HTTPResponse& response,
+                                         bool head, bool& reusable) const
+{
+    std::string connection;
+    find_header(response, "connection", connection);
+    connection = lower(connection);
+    reusable = response.version() == "HTTP/1.1" ? connection != "close"
+                                                : connection == "keep-alive";
+    const std::string& status = response.status();
+    if (head || status == "204" || status == "304")
+    {
+        response.set_body(std::string());
+        reusable = reusable && pos == buffer.size();
+        return OK;
+    }
+    std::string value;
+    if (find_header(response, "transfer-encoding", value) &&
+        lower(value).find("chunked") != std::string::npos)
+    {
+        std::string body;
+        Status result = read_chunked(fd, buffer, pos, body);
+        if (result != OK)
+            return result;
+        response.set_body(body);
+        return OK;
+    }
+    if (find_header(response, "content-length", value))
+    {
+        size_t length;
+        if (!parse_size(value, 10, options_.max_response, length))
+            return BAD_RESPONSE;
+        buffer.reserve(pos + length);
+        while (buffer.size() - pos < length)
+        {
+            Status result = receive(fd, buffer);
+            if (result != OK)
+                return result;
+        }
+        // Anything after the body wasn't asked for
+        reusable = reusable && buffer.size() - pos == length;
+        response.set_body(buffer.substr(pos, length));
+        return OK;
+    }
+    // No length: the body ends when the server closes the connection
+    reusable = false;
+    while (true)
+    {
+        if (buffer.size() - pos > options_.max_response)
+            return BAD_RESPONSE;
+        Status result = receive(fd, buffer);
+        if (result == CONNECTION_CLOSED)
+            break;
+        if (result != OK)
+            return result;
+    }
+    response.set_body(buffer.substr(pos));
+    return OK;
+}
+
+/**
+ * @summary Decodes a chunked body (chunk extensions and trailers are
+ * skipped), reading more into `buffer` as needed
+ */
+HTTPClient::Status HTTPClient::read_chunked(int fd, std::string& buffer,
+                                            size_t pos,
+                                            std::string& body) const
+{
+    bool trailers = false;
+    while (true)
+    {
+        size_t eol = buffer.find("\r\n", pos);
+        if (eol == std::string::npos)
+        {
+            if (buffer.size() - pos > MAX_LINE)
+                return BAD_RESPONSE;
+            Status status = receive(fd, buffer);
+            if (status != OK)
+                return status;
+            continue;
+        }
+        std::string line = buffer.substr(pos, eol - pos);
+        pos = eol + 2;
+        if (trailers)
+        {
+            // An empty line ends the trailers, and the body
+            if (line.empty())
+                return OK;
+            continue;
+        }
+        size_t size;
+        if (!parse_size(line, 16, options_.max_response - body.size(), size))
+            return BAD_RESPONSE;
+        if (size == 0)
+        {
+            trailers = true;
+            continue;
+        }
+        while (buffer.size() < pos + size + 2)
+        {
+            Status status = receive(fd, buffer);
+            if (status != OK)
+                return status;
+        }
+        if (buffer.compare(pos + size, 2, "\r\n") != 0)
+            return BAD_RESPONSE;
+        body.append(buffer, pos, size);
+        // Drop what has been decoded, so the buffer stays small
+        buffer.erase(0, pos + size + 2);
+        pos = 0;
+    }
+}
+
+/**
+ * @summary Appends whatever the socket has (waiting up to the receive
+ * timeout) to `buffer`
+ */
+HTTPClient::Status HTTPClient::receive(int fd, std::string& buffer) const
+{
+    size_t size = buffer.size();
+    buffer.resize(size + RECEIVE_SIZE);
+    ssize_t bytes_read;
+    do
+    {
+        bytes_read = recv(fd, &buffer[size], RECEIVE_SIZE, 0);
+    } while (bytes_read < 0 && errno == EINTR);
+    buffer.resize(size + std::max<ssize_t>(bytes_read, 0));
+    if (bytes_read == 0)
+        return CONNECTION_CLOSED;
+    if (bytes_read < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return TIMEOUT;
+        if (errno == ECONNRESET)
+            return CONNECTION_CLOSED;
+        LOG_ERROR << "recv(): " << std::strerror(errno) << LOG_END;
+        return SOCKET_ERROR;
+    }
+    return OK;
+}
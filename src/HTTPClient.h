@@ -0,0 +1,109 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <sys/socket.h>   // for sockaddr_storage, socklen_t
+
+#include <cstddef>        // for size_t
+#include <cstdint>        // for uint64_t
+#include <mutex>          // for mutex
+#include <string>         // for string
+#include <unordered_map>  // for unordered_map
+#include <vector>         // for vector
+
+class HTTPRequest;
+class HTTPResponse;
+
+/**
+ * @summary An HTTP/1.1 client for tools that make many requests: idle
+ * keep-alive connections are pooled per origin (host and port) and reused,
+ * after a check that the server hasn't closed them, and resolved addresses
+ * are cached for `dns_ttl` seconds, so repeat requests skip both
+ * getaddrinfo and connect. Connecting, sending and receiving are each
+ * bounded by `timeout_ms` on every socket.
+ *
+ * A request that fails on a reused connection before any of the response
+ * arrived (the server closed it while it sat idle) is retried once on a new
+ * connection. Responses may be framed by Content-Length, chunked, or by the
+ * server closing the connection; only the first two leave it reusable.
+ *
+ * One client can be shared by several threads; the pool and the cache are
+ * locked only while a connection is taken or returned.
+ */
+class HTTPClient
+{
+public:
+    enum Status
+    {
+        OK,
+        RESOLVE_ERROR,      // getaddrinfo failed
+        CONNECT_ERROR,      // no address could be connected to
+        SOCKET_ERROR,
+        CONNECTION_CLOSED,  // the server closed before the response ended
+        BAD_RESPONSE,       // the response couldn't be parsed
+        TIMEOUT
+    };
+
+    struct Options
+    {
+        int    timeout_ms = 10000;      // per connect, send and receive
+        int    dns_ttl = 60;            // seconds resolved addresses are kept
+        int    idle_timeout = 30;       // seconds an idle connection is kept
+        size_t max_idle_per_origin = 8; // idle connections kept per origin
+        size_t max_response = 1 << 30;  // largest body read into memory
+    };
+
+    HTTPClient();
+    explicit HTTPClient(const Options& options);
+    HTTPClient(const HTTPClient&) = delete; // prevent copy
+    HTTPClient& operator=(const HTTPClient&) = delete; // prevent assignment
+    ~HTTPClient();
+
+    Status fetch(const std::string& host, const std::string& port,
+                 HTTPRequest request, HTTPResponse& response,
+                 const std::string& body = std::string());
+    void   close_idle();
+
+    static const char* describe(Status status);
+
+private:
+    struct Address
+    {
+        struct sockaddr_storage addr;
+        socklen_t               length;
+        int                     family;
+    };
+
+    struct Resolved
+    {
+        std::vector<Address> addresses;
+        uint64_t             expires_ns;
+    };
+
+    struct Idle
+    {
+        int      fd;
+        uint64_t since_ns;
+    };
+
+    Status resolve(const std::string& host, const std::string& port,
+                   std::vector<Address>& addresses);
+    Status connect_to(const std::vector<Address>& addresses, int& fd) const;
+    int    take_idle(const std::string& origin);
+    void   put_idle(const std::string& origin, int fd);
+    Status exchange(int fd, const std::string& message, bool head,
+                    HTTPResponse& response, bool& reusable,
+                    bool& got_response) const;
+    Status read_body(int fd, std::string& buffer, size_t pos,
+                     HTTPResponse& response, bool head, bool& reusable) const;
+    Status read_chunked(int fd, std::string& buffer, size_t pos,
+                        std::string& body) const;
+    Status receive(int fd, std::string& buffer) const;
+    void   forget_address(const std::string& origin);
+
+    Options options_;
+    std::mutex mutex_;  // guards idle_ and resolved_
+    std::unordered_map<std::string, std::vector<Idle>> idle_;
+    std::unordered_map<std::string, Resolved> resolved_;
+};
+
+#endif
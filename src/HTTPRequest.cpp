@@ -97,6 +97,34 @@ void HTTPRequest::set_header(const std::string& header, const std::string& value
     headers_[header] = value;
 }
 
+const std::unordered_map<std::string, std::string>& HTTPRequest::headers() const
+{
+    return headers_;
+}
+
+/**
+ * @summary Splits a comma-separated header value (Accept-Encoding,
+ * Cache-Control, Vary) into its elements, without surrounding spaces;
+ * empty elements are dropped
+ */
+std::vector<std::string> HTTPRequest::split_list(const std::string& value)
+{
+    std::vector<std::string> result;
+    size_t start = 0;
+    while (start < value.size())
+    {
+        size_t comma = value.find(',', start);
+        if (comma == std::string::npos)
+            comma = value.size();
+        size_t first = value.find_first_not_of(" \t", start);
+        size_t last = value.find_last_not_of(" \t", comma - 1);
+        if (first < comma && last != std::string::npos && last >= first)
+            result.push_back(value.substr(first, last - first + 1));
+        start = comma + 1;
+    }
+    return result;
+}
+
 std::string HTTPRequest::to_string() const
 {
     std::ostringstream oss;
@@ -4,6 +4,7 @@
 #include <iosfwd>         // for ostream
 #include <string>         // for string
 #include <unordered_map>  // for unordered_map
+#include <vector>         // for vector
 
 class HTTPRequest
 {
@@ -22,9 +23,12 @@ public:
 
     const std::string* header_value(const std::string& header) const;
     void set_header(const std::string& header, const std::string& value);
+    const std::unordered_map<std::string, std::string>& headers() const;
 
     std::string to_string() const;
 
+    static std::vector<std::string> split_list(const std::string& value);
+
     friend std::ostream& operator<<(std::ostream&, const HTTPRequest&);
 
 private:
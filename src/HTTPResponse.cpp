@@ -105,6 +105,11 @@ void HTTPResponse::set_header(const std::string& header,
     headers_[header] = value;
 }
 
+const std::unordered_map<std::string, std::string>& HTTPResponse::headers() const
+{
+    return headers_;
+}
+
 std::string HTTPResponse::to_string() const
 {
     std::ostringstream oss;
@@ -153,3 +158,77 @@ void HTTPResponse::make_501()
     set_header("Content-Length", std::to_string(body_.size()));
 
 }
+
+void HTTPResponse::make_429()
+{
+    set_version("HTTP/1.1");
+    set_status("429");
+    set_phrase("Too Many Requests");
+    set_body("<h1>Too Many Requests</h1>");
+    set_header("Content-Length", std::to_string(body_.size()));
+    set_header("Retry-After", "1");
+}
+
+void HTTPResponse::make_201()
+{
+    set_version("HTTP/1.1");
+    set_status("201");
+    set_phrase("Created");
+    set_body("<h1>Created</h1>");
+    set_header("Content-Length", std::to_string(body_.size()));
+}
+
+void HTTPResponse::make_204()
+{
+    set_version("HTTP/1.1");
+    set_status("204");
+    set_phrase("No Content");
+    set_body("");
+}
+
+/**
+ * @summary Makes an error response for any of the 4xx/5xx statuses the
+ * server sends that has no make_ function of its own
+ */
+void HTTPResponse::make_error(const std::string& status)
+{
+    static const std::unordered_map<std::string, std::string> phrases = {
+        {"400", "Bad Request"},
+        {"403", "Forbidden"},
+        {"404", "Not Found"},
+        {"409", "Conflict"},
+        {"411", "Length Required"},
+        {"413", "Content Too Large"},
+        {"500", "Internal Server Error"},
+        {"501", "Not Implemented"},
+        {"502", "Bad Gateway"},
+        {"503", "Service Unavailable"},
+        {"504", "Gateway Timeout"},
+    };
+    auto it = phrases.find(status);
+    const std::string phrase = it != phrases.end() ? it->second : "Error";
+    set_version("HTTP/1.1");
+    set_status(status);
+    set_phrase(phrase);
+    set_body("<h1>" + phrase + "</h1>");
+    set_header("Content-Length", std::to_string(body_.size()));
+}
+
+void HTTPResponse::make_304(const std::string& etag)
+{
+    set_version("HTTP/1.1");
+    set_status("304");
+    set_phrase("Not Modified");
+    set_body("");
+    set_header("ETag", etag);
+}
+
+void HTTPResponse::make_301(const std::string& location)
+{
+    set_version("HTTP/1.1");
+    set_status("301");
+    set_phrase("Moved Permanently");
+    set_body("<h1>Moved Permanently</h1>");
+    set_header("Content-Length", std::to_string(body_.size()));
+    set_header("Location", location);
+}
@@ -26,12 +26,19 @@ public:
 
     const std::string* header_value(const std::string& header) const;
     void set_header(const std::string& header, const std::string& value);
+    const std::unordered_map<std::string, std::string>& headers() const;
 
     std::string to_string() const;
 
     void make_404();
     void make_400();
     void make_501();
+    void make_429();
+    void make_201();
+    void make_204();
+    void make_error(const std::string& status);
+    void make_304(const std::string& etag);
+    void make_301(const std::string& location);
 
     friend std::ostream& operator<<(std::ostream&, const HTTPResponse&);
 
@@ -1,584 +1,2117 @@
 #include "HTTPServer.h"
+#include "CachePolicy.h"   // for CachePolicy
+#include "CoroutineLoop.h" // for HTTPServer::CoroutineLoop
+#include "EventLoop.h"     // for HTTPServer::EventLoop
+#include "FileIndex.h"     // for FileIndex
 #include "HTTPRequest.h"   // for HTTPRequest, operator<<
 #include "HTTPResponse.h"  // for HTTPResponse
+#include "DirectoryListing.h" // for DirectoryListing
+#include "MappedFile.h"    // for MappedFile
+#include "PathResolver.h"  // for PathResolver
+#include "RateLimiter.h"   // for RateLimiter
+#include "TLS.h"           // for TLSConnection, TLSContext
+#include "Metrics.h"       // for Metrics
+#include "Tracing.h"       // for RequestTrace, Tracer
+#include "Upload.h"        // for Upload
 #include "logging.h"       // for LOG_END, LOG_ERROR, LOG_INFO
 
-#ifndef __APPLE__
-#include <sys/sendfile.h>  // for sendfile
-#endif
-
-#include <arpa/inet.h>     // for inet_ntoa
-#include <fcntl.h>         // for open, O_RDONLY
-#include <netdb.h>         // for addrinfo, freeaddrinfo, gai_strerror, geta...
-#include <netinet/in.h>    // for IPPROTO_TCP, sockaddr_in
+#include <fcntl.h>         // for open, openat, O_RDONLY, posix_fadvise
+#include <netdb.h>         // for addrinfo, freeaddrinfo, gai_strerror, getnameinfo
+#include <netinet/in.h>    // for IPPROTO_TCP, IPPROTO_IPV6, IPV6_V6ONLY
+#include <netinet/tcp.h>   // for TCP_NODELAY, TCP_DEFER_ACCEPT
 #include <poll.h>          // for poll
+#include <pthread.h>       // for pthread_sigmask, pthread_setaffinity_np
+#include <sched.h>         // for sched_getaffinity, cpu_set_t, CPU_SET
+#include <strings.h>       // for strcasecmp
 #include <sys/select.h>    // for select
 #include <sys/socket.h>    // for send, accept, bind, listen, recv, setsockopt
+#ifdef __linux__
+#include <sys/prctl.h>     // for prctl, PR_SET_PDEATHSIG
+#endif
 #include <sys/stat.h>      // for fstat, stat
 #include <sys/time.h>      // for timeval
-#include <unistd.h>        // for close, off_t, read, ssize_t
+#include <sys/uio.h>       // for iovec
+#include <sys/un.h>        // for sockaddr_un
+#include <sys/wait.h>      // for waitpid, WIFSIGNALED, WTERMSIG
+#include <unistd.h>        // for close, off_t, read, ssize_t, unlink, fork
 #include <wordexp.h>       // for wordexp
 
-#include <algorithm>       // for transform
-#include <cctype>          // for tolower
-#include <cerrno>          // for errno, EINTR
-#include <csignal>         // for sigaction, SIGINT, SIGTERM, etc
-#include <cstdlib>         // for exit
-#include <cstring>         // for strerror, memset
-#include <exception>       // for exception
-#include <iostream>        // for operator<<, basic_ostream, ostream, cout
-#include <regex>           // for regex_replace, regex, regex_traits
-#include <string>          // for char_traits, string, operator<<, operator==
-#include <thread>          // for thread
-#include <type_traits>     // for move
-#include <vector>          // for vector
+#include <algorithm>       // for transform, max
+#include <chrono>          // for milliseconds
+#include <cctype>          // for tolower
+#include <cerrno>          // for errno, EINTR
+#include <csignal>         // for sigaction, SIGINT, SIGTERM, etc
+#include <cstdlib>         // for exit, strtod
+#include <cstring>         // for strerror, memset
+#include <exception>       // for exception
+#include <iostream>        // for operator<<, basic_ostream, ostream, cout
+#include <memory>          // for make_shared
+#include <regex>           // for regex_replace, regex, regex_traits
+#include <string>          // for char_traits, string, operator<<, operator==
+#include <string_view>     // for string_view
+#include <thread>          // for thread
+#include <type_traits>     // for move
+#include <vector>          // for vector
+
+std::atomic<bool> HTTPServer::keep_running_(true);
+int HTTPServer::shutdown_pipe_[2] = {-1, -1};
+int HTTPServer::restart_pipe_[2] = {-1, -1};
+
+bool HTTPServer::set_conn_type(const HTTPRequest& req, HTTPResponse& resp) const
+{
+    bool keep_alive = req.version() != "HTTP/1.0";
+    auto connection = req.header_value("Connection");
+    if (connection)
+    {
+        std::string conn_str = *connection;
+        std::transform(conn_str.begin(), conn_str.end(),
+                conn_str.begin(), ::tolower);
+        if (conn_str == "close")
+        {
+            keep_alive = false;
+        }
+        else if (conn_str == "keep-alive")
+        {
+            keep_alive = true;
+        }
+    }
+    // Connections are closed after their current response while draining
+    if (keep_alive && keep_running_)
+    {
+        resp.set_header("Connection", "keep-alive");
+        resp.set_header("Keep-Alive", "timeout=" +
+                std::to_string(config_.timeout));
+    }
+    else
+    {
+        resp.set_header("Connection", "close");
+        keep_alive = false;
+    }
+    return keep_alive;
+}
+
+static ServerConfig make_config(const std::string& hostname,
+                                const std::string& port,
+                                const std::string& directory)
+{
+    ServerConfig config;
+    config.hostname = hostname;
+    config.port = port;
+    config.directory = directory;
+    return config;
+}
+
+/**
+ * @summary Fills in `addr` for the Unix domain socket at `path`
+ *
+ * @return false if the path is too long
+ */
+static bool make_unix_address(const std::string& path, struct sockaddr_un& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        LOG_ERROR << "Unix socket path too long: " << path << LOG_END;
+        return false;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+/**
+ * @summary Creates a Unix domain socket bound to `path`, replacing any stale
+ * socket file left there
+ *
+ * @return the socket, or -1 on failure
+ */
+static int bind_unix(const std::string& path)
+{
+    struct sockaddr_un addr;
+    if (!make_unix_address(path, addr))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        LOG_ERROR << "socket(): " << std::strerror(errno) << LOG_END;
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        LOG_ERROR << "bind(): " << std::strerror(errno) << ": " << path << LOG_END;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @summary Creates a listening Unix domain socket at `path`, for the admin
+ * and handoff sockets
+ *
+ * @return the socket, or -1 on failure
+ */
+static int listen_unix(const std::string& path)
+{
+    int fd = bind_unix(path);
+    if (fd != -1 && listen(fd, 8) == -1)
+    {
+        LOG_ERROR << "listen(): " << std::strerror(errno) << ": " << path << LOG_END;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @return the address family (AF_INET, AF_INET6 or AF_UNIX) of a socket
+ */
+static int socket_family(int fd)
+{
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) == -1)
+        return AF_UNSPEC;
+    return address.ss_family;
+}
+
+/**
+ * @summary Describes a listening socket's address for the log, e.g.
+ * "127.0.0.1:4000", "[::1]:4000" or "unix:/run/http.sock"
+ */
+static std::string describe_listener(int fd)
+{
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) == -1)
+        return "?";
+    if (address.ss_family == AF_UNIX)
+    {
+        return std::string("unix:") +
+               reinterpret_cast<sockaddr_un&>(address).sun_path;
+    }
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    if (getnameinfo(reinterpret_cast<sockaddr*>(&address), length, host,
+                    sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+    {
+        return "?";
+    }
+    if (address.ss_family == AF_INET6)
+        return std::string("[") + host + "]:" + port;
+    return std::string(host) + ':' + port;
+}
+
+/**
+ * @summary Creates a pipe whose ends are close-on-exec and non-blocking, so
+ * that signal handlers can write to it without ever blocking
+ */
+static void make_pipe(int fds[2])
+{
+    if (pipe(fds) == -1)
+    {
+        LOG_ERROR << "pipe(): " << std::strerror(errno) << LOG_END;
+        std::exit(1);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/**
+ * @summary Makes a relative path absolute, so it still refers to the same
+ * file after the constructor changes directory
+ */
+static std::string absolute_path(const std::string& path)
+{
+    if (path.empty() || path[0] == '/')
+        return path;
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr)
+        return path;
+    return std::string(cwd) + '/' + path;
+}
+
+/**
+ * @summary Constructs the HTTPServer, performs hostname lookup, binds the
+ * socket, changes directory as necessary.
+ *
+ * @param hostname hostname (or IP) to bind to
+ * @param port the numeric port to attach to
+ * @param directory the directory from which to serve files
+ *                      parses ~ and spaces if possible
+ */
+HTTPServer::HTTPServer(const std::string& hostname,
+                       const std::string& port,
+                       const std::string& directory) :
+    HTTPServer(make_config(hostname, port, directory))
+{
+}
+
+/**
+ * @summary Constructs the HTTPServer from a full configuration; see
+ * ServerConfig for the available options
+ */
+HTTPServer::HTTPServer(const ServerConfig& config) :
+    config_(config), start_dir_(absolute_path(".")), active_threads_(0), handoff_sockfd_(-1), handoff_running_(false),
+    handed_off_(false), admin_sockfd_(-1), admin_running_(false), cpu_offset_(0)
+{
+    if (shutdown_pipe_[0] == -1)
+    {
+        make_pipe(shutdown_pipe_);
+        make_pipe(restart_pipe_);
+    }
+    // Paths in the config are relative to where we were started, not to the
+    // serving directory
+    config_.trace_file = absolute_path(config_.trace_file);
+    config_.admin_socket = absolute_path(config_.admin_socket);
+    config_.handoff_socket = absolute_path(config_.handoff_socket);
+    config_.unix_socket = absolute_path(config_.unix_socket);
+    if (config_.trace_slow_us >= 0)
+    {
+        Tracer::enable(config_.trace_slow_us, config_.trace_file,
+                       config_.trace_chrome);
+    }
+    if (!config_.admin_socket.empty())
+    {
+        serve_admin_socket(config_.admin_socket);
+    }
+
+    // Escape spaces in the directory name so we can cd there
+    std::string directory = std::regex_replace(config_.directory, std::regex(R"(([^\\]) )"), R"($1\ )");
+    // Expand ~ to the user's home directory
+    wordexp_t expansion;
+    if (wordexp(directory.c_str(), &expansion, 0) != 0 || expansion.we_wordc < 1)
+    {
+        LOG_ERROR << "Error expanding directory path given" << LOG_END;
+        std::exit(1);
+    }
+    // cd to `directory`
+    if(chdir(expansion.we_wordv[0]) < 0)
+    {
+        LOG_ERROR << "chdir(): " << std::strerror(errno)
+                  << ": " << expansion.we_wordv[0] << LOG_END;
+        std::exit(1);
+    }
+    LOG_INFO << "Changed directory to " << expansion.we_wordv[0] << LOG_END;
+    wordfree(&expansion);
+    resolver_.reset(new PathResolver("."));
+    if (config_.file_index)
+    {
+        // Worker processes share the index this process keeps up to date
+        file_index_.reset(new FileIndex(config_.index_threads,
+                                        config_.prewarm_max,
+                                        config_.processes > 0
+                                        ? config_.index_slots : 0));
+        file_index_->build();
+        file_index_->watch();
+    }
+    if (!config_.cache_control.empty())
+        policy_.reset(new CachePolicy(config_.cache_control));
+    if (config_.ip_connections > 0 || config_.ip_rate > 0)
+    {
+        limiter_.reset(new RateLimiter(config_.ip_connections,
+                                       config_.ip_rate, config_.ip_burst));
+    }
+    if (!config_.proxy.empty())
+    {
+        // Forwarding is driven from straight-line code, which only these
+        // engines run requests with
+        if (config_.engine != ServerConfig::THREADED &&
+            config_.engine != ServerConfig::COROUTINE)
+        {
+            LOG_ERROR << "--proxy needs --engine threaded or coroutine; the "
+                      << "poll, epoll and multi-reactor engines can't proxy"
+                      << LOG_END;
+            std::exit(1);
+        }
+        proxy_.reset(new Proxy(config_.proxy, config_.proxy_idle));
+    }
+    if (config_.cache_size > 0)
+    {
+        cache_.reset(new ResponseCache(config_.cache_size,
+                                       config_.cache_max_entry));
+    }
+    // Threads aren't forked, so worker processes start their own
+    if (config_.processes == 0)
+        start_helpers();
+    // enable_metrics registers the metrics path as a route
+    std::string metrics_path;
+    metrics_path.swap(config_.metrics_path);
+    if (!metrics_path.empty())
+        enable_metrics(metrics_path);
+    if (!config_.tls_cert.empty())
+    {
+        // HTTP/2 is only spoken by the event loops
+        tls_.reset(new TLSContext(config_.tls_cert, config_.tls_key.empty()
+                                  ? config_.tls_cert : config_.tls_key,
+                                  config_.http2 &&
+                                  config_.engine != ServerConfig::THREADED &&
+                                  config_.engine != ServerConfig::COROUTINE));
+    }
+    LOG_INFO << "Initializing " << (tls_ ? "HTTPS" : "HTTP") << " server at "
+             << config_.hostname << ':' << config_.port
+             << " serving files from " << config_.directory << LOG_END;
+
+    // If a previous server is still running, take over its listening socket
+    // instead of binding a new one
+    if (receive_listeners())
+    {
+        LOG_INFO << "Took over " << listeners_.size()
+                 << " listening sockets from previous server" << LOG_END;
+        serve_handoff_socket();
+        return;
+    }
+
+    // Resolve `hostname` to its IPv4 and IPv6 addresses; "*" means every
+    // local address
+    // `hints` is used to specify what optins we want
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
+    hints.ai_socktype = SOCK_STREAM; // Streaming socket
+    hints.ai_family = AF_UNSPEC; // IPv4 and IPv6
+    hints.ai_flags = AI_NUMERICSERV | AI_PASSIVE; // Port is a number
+
+    struct addrinfo* res;
+    int ret = getaddrinfo(config_.hostname == "*" ? nullptr
+                                                  : config_.hostname.c_str(),
+                          config_.port.c_str(), &hints, &res);
+    if (ret != 0)
+    {
+        LOG_ERROR << gai_strerror(ret) << LOG_END;
+        std::exit(ret);
+    }
+    // getaddrinfo populates res as a linked list of results; we listen on
+    // every one we can bind (e.g. both 127.0.0.1 and ::1 for localhost)
+    for (auto ptr = res; ptr != nullptr; ptr = ptr->ai_next)
+    {
+        // Leaving room for the Unix socket
+        if (listeners_.size() == MAX_LISTENERS - 1)
+        {
+            LOG_ERROR << "Too many addresses for " << config_.hostname
+                      << ", only using the first " << listeners_.size() << LOG_END;
+            break;
+        }
+        // Make the socket file descriptor
+        int fd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+        if (fd == -1)
+        {
+            LOG_ERROR << "socket(): " << std::strerror(errno) << LOG_END;
+            continue;
+        }
+
+        // Tell the file descriptor it's okay to reuse a socket that wasn't
+        // cleaned up properly
+        const int one = 1;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) == -1)
+        {
+            LOG_ERROR << "setsockopt(): " << std::strerror(errno) << LOG_END;
+            std::exit(1);
+        }
+        // Otherwise :: would also take the IPv4 port, and 0.0.0.0 couldn't
+        // be bound alongside it
+        if (ptr->ai_family == AF_INET6 &&
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(int)) == -1)
+        {
+            LOG_ERROR << "setsockopt(IPV6_V6ONLY): " << std::strerror(errno) << LOG_END;
+        }
+
+        // Bind the socket to the address we got from getaddrinfo
+        if (bind(fd, ptr->ai_addr, ptr->ai_addrlen) == -1)
+        {
+            LOG_ERROR << "bind(): " << std::strerror(errno) << LOG_END;
+            close(fd);
+            continue;
+        }
+        LOG_INFO << "Bound to " << describe_listener(fd) << LOG_END;
+        listeners_.push_back(fd);
+    }
+    // Free the linked list created by getaddrinfo
+    freeaddrinfo(res);
+    // If nothing could be bound, there is nothing to serve on
+    if (listeners_.empty())
+    {
+        LOG_ERROR << "Failed to bind socket to " << config_.hostname
+                  << ':' << config_.port << LOG_END;
+        exit(1);
+    }
+    if (!config_.unix_socket.empty())
+    {
+        int fd = bind_unix(config_.unix_socket);
+        if (fd == -1)
+            std::exit(1);
+        LOG_INFO << "Bound to " << describe_listener(fd) << LOG_END;
+        listeners_.push_back(fd);
+    }
+    serve_handoff_socket();
+}
+
+HTTPServer::~HTTPServer()
+{
+    LOG_INFO << "Shutting down HTTP server..." << LOG_END;
+    // Close the file descriptors we were bound to; after a handoff the Unix
+    // socket's path belongs to the new server
+    for (int fd : listeners_)
+        close(fd);
+    if (!config_.unix_socket.empty() && !handed_off_)
+        unlink(config_.unix_socket.c_str());
+    // Stop the handoff and admin socket threads, if they were started.
+    // After a handoff the socket paths belong to the new server.
+    if (handoff_thread_.joinable())
+    {
+        handoff_running_ = false;
+        handoff_thread_.join();
+        close(handoff_sockfd_);
+        if (!handed_off_)
+            unlink(config_.handoff_socket.c_str());
+    }
+    if (admin_thread_.joinable())
+    {
+        admin_running_ = false;
+        admin_thread_.join();
+        close(admin_sockfd_);
+        if (!handed_off_)
+            unlink(admin_path_.c_str());
+    }
+}
+
+/**
+ * @summary Connects to the handoff socket of a server that is already
+ * running, and receives its listening sockets (passed with SCM_RIGHTS) into
+ * listeners_. That server then drains its connections and exits.
+ *
+ * @return true if listening sockets were received
+ */
+bool HTTPServer::receive_listeners()
+{
+    struct sockaddr_un addr;
+    if (config_.handoff_socket.empty() ||
+        !make_unix_address(config_.handoff_socket, addr))
+    {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    // Nobody listening just means we're the first server
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return false;
+    }
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret != 1 || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len <= CMSG_LEN(0))
+    {
+        LOG_ERROR << "No listening socket received from "
+                  << config_.handoff_socket << LOG_END;
+        return false;
+    }
+    listeners_.resize((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    std::memcpy(&listeners_[0], CMSG_DATA(cmsg), sizeof(int) * listeners_.size());
+    return true;
+}
+
+/**
+ * @summary Listens on the configured handoff socket so that a restarted
+ * server can take over listeners_
+ */
+void HTTPServer::serve_handoff_socket()
+{
+    if (config_.handoff_socket.empty())
+        return;
+    handoff_sockfd_ = listen_unix(config_.handoff_socket);
+    if (handoff_sockfd_ == -1)
+        return;
+    handoff_running_ = true;
+    handoff_thread_ = std::thread(&HTTPServer::handoff_loop, this);
+}
+
+/**
+ * @summary Waits for SIGUSR2 (to start a new server) and for a new server to
+ * connect to the handoff socket. Once listeners_ has been passed on, this server
+ * starts shutting down gracefully; connections waiting in the backlog are
+ * accepted by the new server, so none are refused.
+ */
+void HTTPServer::handoff_loop()
+{
+    while (handoff_running_)
+    {
+        struct pollfd pfds[3] = {{handoff_sockfd_, POLLIN, 0},
+                                 {restart_pipe_[0], POLLIN, 0},
+                                 {shutdown_pipe_[0], POLLIN, 0}};
+        if (poll(pfds, 3, 1000) <= 0)
+            continue;
+        if (pfds[2].revents & POLLIN)
+            return;
+        if (pfds[1].revents & POLLIN)
+        {
+            char byte;
+            while (read(restart_pipe_[0], &byte, 1) > 0) {}
+            restart();
+        }
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        int client = accept(handoff_sockfd_, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        char byte = 0;
+        struct iovec iov = {&byte, 1};
+        char control[CMSG_SPACE(sizeof(int) * MAX_LISTENERS)];
+        std::memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * listeners_.size());
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listeners_.size());
+        std::memcpy(CMSG_DATA(cmsg), &listeners_[0],
+                    sizeof(int) * listeners_.size());
+        ssize_t ret = sendmsg(client, &msg, MSG_NOSIGNAL);
+        close(client);
+        if (ret != 1)
+        {
+            LOG_ERROR << "sendmsg(): " << std::strerror(errno) << LOG_END;
+            continue;
+        }
+        LOG_INFO << "Listening sockets handed off, shutting down" << LOG_END;
+        handed_off_ = true;
+        request_shutdown();
+        return;
+    }
+}
+
+/**
+ * @summary Starts a new copy of this server from the original command line
+ * (picking up a new binary at the same path, if there is one). It takes over
+ * the listening socket through the handoff socket.
+ */
+void HTTPServer::restart()
+{
+    if (config_.command_line.empty() || config_.handoff_socket.empty())
+    {
+        LOG_ERROR << "Restart needs a command line and a handoff socket" << LOG_END;
+        return;
+    }
+    // Build everything before forking; only exec-safe calls in the child
+    std::vector<char*> argv;
+    for (const std::string& arg : config_.command_line)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+    sigset_t none;
+    sigemptyset(&none);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        LOG_ERROR << "fork(): " << std::strerror(errno) << LOG_END;
+        return;
+    }
+    if (pid == 0)
+    {
+        // Relative paths on the command line are relative to where we were
+        // started, not the serving directory
+        if (chdir(start_dir_.c_str()) == 0)
+        {
+            sigprocmask(SIG_SETMASK, &none, nullptr);
+            execvp(argv[0], &argv[0]);
+        }
+        _exit(127);
+    }
+    LOG_INFO << "Started new server, pid " << pid << LOG_END;
+}
+
+/**
+ * @summary Serves the Prometheus metrics text on GET requests for `path`
+ * instead of looking for a file there
+ *
+ * @param path the request path to answer, e.g. "/metrics"
+ */
+void HTTPServer::enable_metrics(const std::string& path)
+{
+    if (path == config_.metrics_path)
+        return;
+    config_.metrics_path = path;
+    route(path, [](const HTTPRequest&, const Router::Params&,
+                   HTTPResponse& response, std::string& body)
+    {
+        body = Metrics::render();
+        response.set_header("Content-Type", "text/plain; version=0.0.4");
+    });
+}
+
+/**
+ * @summary Answers GET and HEAD requests for paths matching `pattern` with
+ * `handler` instead of a file (see Router for the pattern syntax). Handlers
+ * run inline on whichever engine thread read the request, so they should
+ * be quick and must be thread-safe. Must be called before serve(); throws
+ * std::runtime_error for a malformed or duplicate pattern.
+ */
+void HTTPServer::route(const std::string& pattern, Router::Handler handler)
+{
+    if (!router_)
+        router_.reset(new Router());
+    router_->add(pattern, std::move(handler));
+}
+
+/**
+ * @summary Listens on a local Unix domain socket and writes the metrics text
+ * to every connection made to it (e.g. `nc -U /tmp/http.sock`), so the
+ * numbers can be read without going through the public listener
+ *
+ * @param socket_path filesystem path at which to create the socket
+ */
+void HTTPServer::serve_admin_socket(const std::string& socket_path)
+{
+    admin_sockfd_ = listen_unix(socket_path);
+    if (admin_sockfd_ == -1)
+        return;
+    admin_path_ = socket_path;
+    admin_running_ = true;
+    admin_thread_ = std::thread(&HTTPServer::admin_loop, this);
+}
+
+/**
+ * @summary Accept loop for the admin socket; wakes up every second to check
+ * whether the server is being destroyed
+ */
+void HTTPServer::admin_loop()
+{
+    while (admin_running_)
+    {
+        struct pollfd pfd = {admin_sockfd_, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0)
+            continue;
+        int client = accept(admin_sockfd_, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        std::string text = Metrics::render();
+        size_t pos = 0;
+        while (pos < text.size())
+        {
+            ssize_t n = send(client, &text[pos], text.size() - pos, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            pos += n;
+        }
+        close(client);
+    }
+}
+
+/**
+ * @summary Starts a graceful shutdown: stops accepting, and lets every engine
+ * finish its in-flight responses. Only async-signal-safe operations, since
+ * this is called from signal handlers.
+ */
+void HTTPServer::request_shutdown()
+{
+    keep_running_ = false;
+    // Wakes up every loop waiting on the pipe; it is never read, so it stays
+    // readable
+    ssize_t ret = write(shutdown_pipe_[1], "x", 1);
+    (void)ret;
+}
+
+/**
+ * @summary Adds a signal handler for SIGINT and SIGTERM to shut down server
+ * (This handles CTRL-C), and for SIGUSR2 to restart it
+ */
+void HTTPServer::install_signal_handler() const
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    // The function be called when a signal is received -- it sets keep_running
+    // to false
+    action.sa_handler = [](int) { request_shutdown(); };
+    // Call that function if we get SIGINT or SIGTERM
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    // SIGUSR2 starts a new server which takes over the listening socket
+    action.sa_handler = [](int)
+    {
+        ssize_t ret = write(restart_pipe_[1], "x", 1);
+        (void)ret;
+    };
+    sigaction(SIGUSR2, &action, nullptr);
+    // SIGUSR1 asks for the slow request traces to be dumped
+    action.sa_handler = [](int) { Tracer::request_dump(); };
+    sigaction(SIGUSR1, &action, nullptr);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, nullptr);
+    sigaction(SIGCHLD, &action, nullptr);
+}
+
+/**
+ * @summary Runs the engine selected by the configuration, in this process or
+ * in `processes` worker processes
+ */
+void HTTPServer::serve()
+{
+    if (config_.processes > 0)
+        run_processes();
+    else
+        run_engine();
+}
+
+/**
+ * @summary Starts the helper threads, if configured; only the event loops
+ * can't afford to wait on the disk
+ */
+void HTTPServer::start_helpers()
+{
+    if (config_.helper_threads > 0 &&
+        (config_.engine == ServerConfig::POLL ||
+         config_.engine == ServerConfig::EPOLL ||
+         config_.engine == ServerConfig::MULTI_REACTOR))
+    {
+        helpers_.reset(new HelperPool(config_.helper_threads));
+    }
+}
+
+void HTTPServer::run_engine()
+{
+    switch (config_.engine)
+    {
+        case ServerConfig::THREADED:      run();               break;
+        case ServerConfig::POLL:          run_async();         break;
+        case ServerConfig::EPOLL:         run_epoll();         break;
+        case ServerConfig::MULTI_REACTOR: run_multi_reactor(); break;
+        case ServerConfig::COROUTINE:     run_coroutines();    break;
+    }
+}
+
+/**
+ * @summary Starts listening on every socket in listeners_ with the
+ * configured backlog and, for TCP, the listening socket options. Listeners
+ * are always non-blocking: after a handoff another process accepts from
+ * them too, and one engine waits on several, so a connection we were woken
+ * for may already be gone.
+ *
+ * @return false if listen() failed
+ */
+bool HTTPServer::start_listening()
+{
+    for (int fd : listeners_)
+    {
+        bool tcp = socket_family(fd) != AF_UNIX;
+#ifdef TCP_DEFER_ACCEPT
+        // Don't wake us up for a connection until the client has sent
+        // something
+        if (tcp && config_.defer_accept > 0 &&
+            setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       &config_.defer_accept, sizeof(int)) == -1)
+        {
+            LOG_ERROR << "setsockopt(TCP_DEFER_ACCEPT): "
+                      << std::strerror(errno) << LOG_END;
+        }
+#endif
+#ifdef TCP_FASTOPEN
+        // Let clients that have connected before send their request in the
+        // SYN
+        if (tcp && config_.fastopen > 0 &&
+            setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+                       &config_.fastopen, sizeof(int)) == -1)
+        {
+            LOG_ERROR << "setsockopt(TCP_FASTOPEN): "
+                      << std::strerror(errno) << LOG_END;
+        }
+#endif
+        (void)tcp;
+        if (listen(fd, config_.backlog) != 0)
+        {
+            LOG_ERROR << "listen(): " << std::strerror(errno) << LOG_END;
+            return false;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        LOG_INFO << "Listening on " << describe_listener(fd) << LOG_END;
+    }
+    return true;
+}
+
+/**
+ * @return whether `fd` is one of the listening sockets
+ */
+bool HTTPServer::is_listener(int fd) const
+{
+    return std::find(listeners_.begin(), listeners_.end(), fd) !=
+           listeners_.end();
+}
+
+/**
+ * @summary Accepts one connection from `listener`, counts it, and applies
+ * the configured client socket options. The new socket is close-on-exec, so
+ * it doesn't leak into a restarted server.
+ *
+ * @param listener one of listeners_
+ * @param nonblocking whether the client socket should be non-blocking
+ * @return the client socket, or -1 with errno set (EAGAIN once the accept
+ *         queue is empty)
+ */
+int HTTPServer::accept_connection(int listener, bool nonblocking,
+                                  int& limit_slot)
+{
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+#ifdef __linux__
+    // accept4 sets both flags atomically, saving two fcntl calls
+    int fd = accept4(listener, reinterpret_cast<sockaddr*>(&address),
+                     &address_len,
+                     SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+    if (fd < 0)
+        return -1;
+#else
+    int fd = accept(listener, reinterpret_cast<sockaddr*>(&address),
+                    &address_len);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    // BSD sockets inherit O_NONBLOCK from the listener, so always set it
+    fcntl(fd, F_SETFL, nonblocking ? O_NONBLOCK : 0);
+#endif
+    Metrics::add(Metrics::CONNECTIONS_ACCEPTED);
+    limit_slot = RateLimiter::NO_SLOT;
+    if (limiter_ && !limiter_->connect(address, limit_slot))
+    {
+        // Refuse with a canned response and no buffering: if the client
+        // isn't ready to read it, it just sees the connection close. TLS
+        // clients just see the close, rather than pay for a handshake.
+        static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                   "Content-Length: 0\r\n"
+                                   "Retry-After: 1\r\n"
+                                   "Connection: close\r\n\r\n";
+        if (!tls_)
+            send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        Metrics::add(Metrics::CONNECTIONS_REJECTED);
+        Metrics::record_status("503");
+        // Callers retry on ECONNABORTED, as for a client that gave up
+        errno = ECONNABORTED;
+        return -1;
+    }
+    Metrics::add(Metrics::CONNECTIONS_ACTIVE);
+    configure_client(fd, address.ss_family != AF_UNIX);
+    return fd;
+}
+
+/**
+ * @summary Charges a request to the client's rate limit, filling in a 429
+ * response (which closes the connection) if the client is over it
+ *
+ * @param limit_slot the client's slot, as set by accept_connection
+ * @return true if the request should be served
+ */
+bool HTTPServer::allow_request(int limit_slot, HTTPResponse& response) const
+{
+    if (!limiter_ || limiter_->allow_request(limit_slot))
+        return true;
+    Metrics::add(Metrics::REQUESTS_LIMITED);
+    response.make_429();
+    response.set_header("Connection", "close");
+    return false;
+}
+
+/**
+ * @summary Releases a closed client's place in the per-client connection cap
+ */
+void HTTPServer::release_client(int limit_slot) const
+{
+    if (limiter_)
+        limiter_->disconnect(limit_slot);
+}
+
+/**
+ * @summary Applies the configured socket options to a newly accepted client
+ *
+ * @param tcp false for Unix domain sockets, which have no TCP options
+ */
+void HTTPServer::configure_client(int socket, bool tcp) const
+{
+    const int one = 1;
+    if (tcp && config_.tcp_nodelay &&
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int)) == -1)
+    {
+        LOG_ERROR << "setsockopt(TCP_NODELAY): " << std::strerror(errno) << LOG_END;
+    }
+    if (config_.send_buffer > 0 &&
+        setsockopt(socket, SOL_SOCKET, SO_SNDBUF,
+                   &config_.send_buffer, sizeof(int)) == -1)
+    {
+        LOG_ERROR << "setsockopt(SO_SNDBUF): " << std::strerror(errno) << LOG_END;
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    // Keeps little unsent data queued in the kernel, so a socket is only
+    // writable once it is nearly drained and the event loops' scheduling,
+    // rather than the send buffer's size, decides what goes out next
+    if (tcp && config_.notsent_lowat > 0 &&
+        setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   &config_.notsent_lowat, sizeof(int)) == -1)
+    {
+        LOG_ERROR << "setsockopt(TCP_NOTSENT_LOWAT): " << std::strerror(errno)
+                  << LOG_END;
+    }
+#endif
+#ifdef SO_BUSY_POLL
+    // Reads that find nothing poll the device queue for a while instead of
+    // sleeping; raising it above net.core.busy_read needs CAP_NET_ADMIN, so
+    // a failure is only reported once
+    static std::atomic<bool> busy_poll_failed(false);
+    const int busy_poll = config_.busy_poll;
+    if (tcp && busy_poll > 0 &&
+        setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                   sizeof(int)) == -1 && !busy_poll_failed.exchange(true))
+    {
+        LOG_ERROR << "setsockopt(SO_BUSY_POLL): " << std::strerror(errno) << LOG_END;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    if (tcp && busy_poll > 0 &&
+        setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                   sizeof(int)) == -1 && !busy_poll_failed.exchange(true))
+    {
+        LOG_ERROR << "setsockopt(SO_PREFER_BUSY_POLL): " << std::strerror(errno)
+                  << LOG_END;
+    }
+#endif
+#endif
+}
+
+/**
+ * @summary With --busy-poll, pins the calling event loop's thread to one
+ * CPU, the `index`th (wrapping around) of those the process may run on, so
+ * a spinning loop keeps its CPU and its caches stay warm
+ */
+void HTTPServer::pin_loop(int index) const
+{
+#ifdef __linux__
+    if (config_.busy_poll <= 0)
+        return;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        LOG_ERROR << "sched_getaffinity(): " << std::strerror(errno) << LOG_END;
+        return;
+    }
+    int skip = (cpu_offset_ + index) % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed) || skip-- > 0)
+            continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+        if (err != 0)
+        {
+            LOG_ERROR << "pthread_setaffinity_np(): " << std::strerror(err)
+                      << LOG_END;
+        }
+        else
+        {
+            LOG_INFO << "Pinned event loop " << index << " to CPU " << cpu
+                     << LOG_END;
+        }
+        return;
+    }
+#else
+    (void)index;
+#endif
+}
+
+/**
+ * @summary Accepts a connection from `listener` and spawns a thread to
+ * process_request on it
+ *
+ * @return false if accept() failed for a reason other than the connection
+ *         having gone (or been taken by another process)
+ */
+bool HTTPServer::start_thread(int listener)
+{
+    // accept a connection from a client
+    int limit_slot;
+    int temp_fd = accept_connection(listener, false, limit_slot);
+    if (temp_fd < 0)
+    {
+        if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN ||
+            errno == ECONNABORTED)
+        {
+            return true;
+        }
+        LOG_ERROR << "accept(): " << strerror(errno) << LOG_END;
+        return false;
+    }
+    active_threads_++;
+    try
+    {
+        // Spawn a thread to process the request on temp_fd and detach the
+        // thread so it can continue working without worrying about its
+        // parent
+        std::thread(&HTTPServer::process_request, this, temp_fd,
+                    limit_slot).detach();
+    } catch (const std::exception& ex)
+    {
+        close(temp_fd);
+        release_client(limit_slot);
+        active_threads_--;
+        Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+        LOG_ERROR << "std::thread(): " << ex.what() << LOG_END;
+    }
+    return true;
+}
+
+/**
+ * @summary Run server synchronously; spawns a new thread to process_request
+ * whenever a new request comes in on accept(). On shutdown, waits up to
+ * `shutdown_timeout` seconds for those threads to finish their responses.
+ */
+void HTTPServer::run()
+{
+    if (!start_listening())
+        return;
+    // The shutdown pipe, then every listener
+    std::vector<struct pollfd> pfds(1, {shutdown_pipe_[0], POLLIN, 0});
+    for (int fd : listeners_)
+        pfds.push_back({fd, POLLIN, 0});
+    // Loop until a signal tells us to stop
+    bool ok = true;
+    while (keep_running_ && ok)
+    {
+        // Wait for a connection, or for the shutdown pipe
+        if (poll(&pfds[0], pfds.size(), -1) < 0)
+        {
+            // errno will be EINTR if poll() was interrupted by a signal
+            // we just try again if that happens
+            if (errno == EINTR)
+            {
+                Tracer::dump_if_requested();
+                continue;
+            }
+            LOG_ERROR << "poll(): " << strerror(errno) << LOG_END;
+            break;
+        }
+        if (pfds[0].revents & POLLIN)
+            break;
+        for (size_t i = 1; i < pfds.size() && ok; i++)
+        {
+            if (pfds[i].revents & POLLIN)
+                ok = start_thread(pfds[i].fd);
+        }
+    }
+    // Idle connections notice the shutdown pipe and close right away; the
+    // rest close once their current response has been sent
+    uint64_t deadline = Metrics::now_ns() + config_.shutdown_timeout * 1000000000ull;
+    while (active_threads_ > 0 && Metrics::now_ns() < deadline)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (active_threads_ > 0)
+    {
+        LOG_ERROR << active_threads_ << " connections still open at shutdown"
+                  << LOG_END;
+    }
+}
+
+/**
+ * @summary Asynchronously run the server with non-blocking sockets.
+ * Uses poll() to check when sockets are ready for read/write and loops through
+ * the ready sockets, reading/writing as necessary
+ * (this is for the extra credit)
+ */
+void HTTPServer::run_async()
+{
+    if (!start_listening())
+        return;
+    pin_loop(0);
+    EventLoop(*this, Poller::POLL).run();
+}
+
+/**
+ * @summary Same as run_async, but waits with epoll instead of poll() so the
+ * cost of each wakeup doesn't grow with the number of idle connections
+ */
+void HTTPServer::run_epoll()
+{
+    if (!start_listening())
+        return;
+    pin_loop(0);
+    EventLoop(*this, Poller::EPOLL).run();
+}
+
+/**
+ * @summary Runs `workers` epoll event loops, each on its own thread, all
+ * accepting from the shared listening socket. The calling thread runs one of
+ * the loops and handles signals; the shutdown pipe stops every loop, and this
+ * thread waits for the others to finish draining.
+ */
+void HTTPServer::run_multi_reactor()
+{
+    if (!start_listening())
+        return;
+    int workers = config_.workers;
+    if (workers <= 0)
+    {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // Block signals in the worker threads so they are always delivered to
+    // this one
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < workers; i++)
+    {
+        threads.emplace_back([this, i]()
+        {
+            pin_loop(i);
+            EventLoop(*this, Poller::EPOLL).run();
+        });
+    }
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    LOG_INFO << "Started " << workers << " event loops" << LOG_END;
+    pin_loop(0);
+    EventLoop(*this, Poller::EPOLL).run();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+/**
+ * @summary Runs every connection as a coroutine on a single epoll reactor:
+ * the connection logic reads like process_request, but waiting for a
+ * socket suspends the coroutine instead of blocking a thread
+ */
+void HTTPServer::run_coroutines()
+{
+    if (!start_listening())
+        return;
+    CoroutineLoop(*this, Poller::EPOLL).run();
+}
+
+/**
+ * @summary Forks `processes` workers which each run the configured engine on
+ * the listeners, and restarts any that exits while the server is running,
+ * so a crash only takes down the connections of one worker. A worker that
+ * died is restarted at most once a second. On shutdown, every worker is
+ * sent SIGTERM, and this waits for them to drain their connections.
+ */
+void HTTPServer::run_processes()
+{
+    if (!start_listening())
+        return;
+    // Ignored SIGCHLD would reap the workers for us; a handler instead
+    // interrupts the poll() below when one exits
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = [](int) {};
+    sigaction(SIGCHLD, &action, nullptr);
+    std::vector<pid_t> workers(config_.processes, -1);
+    std::vector<uint64_t> started(config_.processes, 0);
+    while (keep_running_)
+    {
+        uint64_t now = Metrics::now_ns();
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            if (workers[i] == -1 && now - started[i] >= 1000000000ull)
+            {
+                started[i] = now;
+                workers[i] = start_worker(i);
+            }
+        }
+        struct pollfd pfd = {shutdown_pipe_[0], POLLIN, 0};
+        poll(&pfd, 1, 1000);
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            // Also reaps servers started by restart()
+            auto it = std::find(workers.begin(), workers.end(), pid);
+            if (it == workers.end())
+                continue;
+            *it = -1;
+            if (!keep_running_)
+                continue;
+            if (WIFSIGNALED(status))
+            {
+                LOG_ERROR << "Worker " << pid << " killed by signal "
+                          << WTERMSIG(status) << ", restarting" << LOG_END;
+            }
+            else
+            {
+                LOG_ERROR << "Worker " << pid << " exited with status "
+                          << WEXITSTATUS(status) << ", restarting" << LOG_END;
+            }
+        }
+    }
+    for (pid_t pid : workers)
+    {
+        if (pid != -1)
+            kill(pid, SIGTERM);
+    }
+    for (pid_t pid : workers)
+    {
+        while (pid != -1 && waitpid(pid, nullptr, 0) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+/**
+ * @summary Forks worker process number `index`, which runs the engine and
+ * exits when it returns
+ *
+ * @return the worker's pid, or -1 if fork() failed
+ */
+pid_t HTTPServer::start_worker(int index)
+{
+    // Only the calling thread is forked: hold the logging lock so no other
+    // thread has it in the middle of a line
+    _mutex.lock();
+    pid_t pid = fork();
+    _mutex.unlock();
+    if (pid == -1)
+    {
+        LOG_ERROR << "fork(): " << std::strerror(errno) << LOG_END;
+        return -1;
+    }
+    if (pid > 0)
+    {
+        LOG_INFO << "Started worker " << index << ", pid " << pid << LOG_END;
+        return pid;
+    }
+#ifdef __linux__
+    // Don't outlive the master
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    // Our own pipes, so SIGTERM sent to one worker only stops that worker
+    for (int i = 0; i < 2; i++)
+    {
+        close(shutdown_pipe_[i]);
+        close(restart_pipe_[i]);
+    }
+    make_pipe(shutdown_pipe_);
+    make_pipe(restart_pipe_);
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGCHLD, &action, nullptr);
+    // Restarts are done by the master
+    sigaction(SIGUSR2, &action, nullptr);
+    // Give each worker's event loops CPUs of their own
+    int loops = 1;
+    if (config_.engine == ServerConfig::MULTI_REACTOR)
+    {
+        loops = config_.workers > 0
+                ? config_.workers
+                : std::max(1u, std::thread::hardware_concurrency());
+    }
+    cpu_offset_ = index * loops;
+    start_helpers();
+    run_engine();
+    // The master's threads (the index watcher, the handoff and admin
+    // sockets) weren't forked, so this process can't run the destructors
+    // that stop them
+    std::cout.flush();
+    _exit(0);
+}
+
+/**
+ * @summary Whether an If-None-Match header value matches the current `etag`
+ * of a file: "*", or a list of entity tags of which one is equal to it
+ * under the weak comparison (RFC 9110, section 13.1.2), i.e. ignoring any
+ * "W/" prefix
+ */
+static bool etag_matches(const std::string* if_none_match,
+                         const std::string& etag)
+{
+    if (if_none_match == nullptr)
+        return false;
+    const std::string& value = *if_none_match;
+    std::string_view current(etag);
+    if (current.compare(0, 2, "W/") == 0)
+        current.remove_prefix(2);
+    size_t pos = value.find_first_not_of(" \t");
+    if (pos != std::string::npos && value[pos] == '*')
+        return true;
+    while (pos < value.size())
+    {
+        pos = value.find_first_not_of(" \t,", pos);
+        if (pos == std::string::npos)
+            break;
+        if (value.compare(pos, 2, "W/") == 0)
+            pos += 2;
+        // Entity tags are quoted, and may contain commas
+        if (value[pos] != '"')
+            return false;
+        size_t close = value.find('"', pos + 1);
+        if (close == std::string::npos)
+            return false;
+        if (std::string_view(value).substr(pos, close + 1 - pos) == current)
+            return true;
+        pos = close + 1;
+    }
+    return false;
+}
+
+/**
+ * @summary Whether an Accept-Encoding header value allows `coding`: named
+ * with a nonzero q, or else covered by a "*" with a nonzero q
+ */
+static bool accepts_encoding(const std::string* accept, const char* coding)
+{
+    if (accept == nullptr)
+        return false;
+    double named = -1;
+    double any = -1;
+    for (const std::string& element : HTTPRequest::split_list(*accept))
+    {
+        size_t semicolon = element.find(';');
+        std::string name = element.substr(0, semicolon);
+        name.erase(name.find_last_not_of(" \t") + 1);
+        double q = 1;
+        if (semicolon != std::string::npos)
+        {
+            size_t param = element.find_first_not_of(" \t", semicolon + 1);
+            if (param != std::string::npos &&
+                (element[param] == 'q' || element[param] == 'Q') &&
+                element.compare(param + 1, 1, "=") == 0)
+            {
+                q = std::strtod(element.c_str() + param + 2, nullptr);
+            }
+        }
+        if (strcasecmp(name.c_str(), coding) == 0)
+            named = q;
+        else if (name == "*")
+            any = q;
+    }
+    return named >= 0 ? named > 0 : any > 0;
+}
+
+/**
+ * @summary Replaces the open directory `fd` (with status `st`) by its index
+ * file `name`, if it has one, opened with `flags`
+ *
+ * @return false if there is no such regular file; `fd` and `st` are left
+ *         alone
+ */
+static bool open_index_file(const std::string& name, int flags, int& fd,
+                            struct stat& st)
+{
+    if (name.empty())
+        return false;
+    int index_fd = openat(fd, name.c_str(), flags | O_CLOEXEC);
+    if (index_fd == -1)
+        return false;
+    struct stat index_st;
+    if (fstat(index_fd, &index_st) == -1 || !S_ISREG(index_st.st_mode))
+    {
+        close(index_fd);
+        return false;
+    }
+    close(fd);
+    fd = index_fd;
+    st = index_st;
+    return true;
+}
+
+bool HTTPServer::is_upload(const HTTPRequest& request)
+{
+    return request.verb() == "PUT" || request.verb() == "POST";
+}
+
+/**
+ * @summary Checks an upload (PUT or POST) request and, if it can be
+ * accepted, creates the temporary file its body will be streamed into.
+ * Bodies may be sent with a Content-Length or chunked; either way the
+ * result is stored at the request path, replacing any existing file.
+ *
+ * @return nullptr if the request is refused, with `response` filled in;
+ *         the connection must then be closed, since its body wasn't read
+ */
+std::unique_ptr<Upload> HTTPServer::start_upload(const HTTPRequest& request,
+                                                 HTTPResponse& response) const
+{
+    if (!config_.uploads)
+    {
+        LOG_ERROR << "Upload received with uploads disabled" << LOG_END;
+        response.make_501();
+        return nullptr;
+    }
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(request.path(), normalized, length))
+    {
+        LOG_ERROR << "Bad request path: " << request.path() << LOG_END;
+        response.make_400();
+        return nullptr;
+    }
+    const std::string uri(normalized, length);
+    size_t slash = uri.rfind('/');
+    if (slash == uri.size() - 1)
+    {
+        // Can't upload to a directory
+        response.make_error("409");
+        return nullptr;
+    }
+    // Work out how the body is framed
+    const std::string* transfer_encoding = request.header_value("Transfer-Encoding");
+    const std::string* content_length = request.header_value("Content-Length");
+    bool chunked = false;
+    off_t body_length = 0;
+    if (transfer_encoding)
+    {
+        std::string coding = *transfer_encoding;
+        std::transform(coding.begin(), coding.end(), coding.begin(), ::tolower);
+        if (coding != "chunked")
+        {
+            response.make_501();
+            return nullptr;
+        }
+        chunked = true;
+    }
+    else if (content_length)
+    {
+        if (content_length->empty() ||
+            content_length->find_first_not_of("0123456789") != std::string::npos ||
+            content_length->size() > 18)
+        {
+            response.make_400();
+            return nullptr;
+        }
+        body_length = std::stoll(*content_length);
+    }
+    else
+    {
+        response.make_error("411");
+        return nullptr;
+    }
+    if (config_.max_upload > 0 && body_length > config_.max_upload)
+    {
+        response.make_error("413");
+        return nullptr;
+    }
+    int dirfd = resolver_->open(uri.c_str(), slash + 1, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1)
+    {
+        LOG_ERROR << "Upload directory: " << std::strerror(errno) << LOG_END;
+        response.make_404();
+        return nullptr;
+    }
+    std::unique_ptr<Upload> upload(new Upload(dirfd, uri.substr(slash + 1),
+                                              body_length, chunked,
+                                              config_.max_upload));
+    if (!upload->start())
+    {
+        LOG_ERROR << "Upload file: " << std::strerror(errno) << LOG_END;
+        response.make_error(errno == EACCES || errno == EROFS ? "403" : "500");
+        return nullptr;
+    }
+    return upload;
+}
+
+/**
+ * @summary Fills in the response to an upload whose body has been received
+ * (`status` DONE) or has failed, moving a complete file into place
+ */
+void HTTPServer::finish_upload(Upload& upload, Upload::Status status,
+                               HTTPResponse& response) const
+{
+    if (status == Upload::FAILED)
+    {
+        // The rest of the body is still coming, so the connection can't be
+        // used for another request
+        response.make_error(upload.error_status());
+        response.set_header("Connection", "close");
+        return;
+    }
+    bool created = false;
+    if (!upload.commit(created))
+    {
+        LOG_ERROR << "rename(): " << std::strerror(errno) << LOG_END;
+        response.make_error(errno == EISDIR ? "409" : "500");
+        return;
+    }
+    LOG_INFO << "Stored upload of " << upload.received() << " bytes" << LOG_END;
+    if (created)
+        response.make_201();
+    else
+        response.make_204();
+}
+
+/**
+ * @summary Receives an upload's body on a blocking socket, for the threaded
+ * engine; `remainder` holds what was read after the headers, and is left
+ * holding whatever follows the body
+ */
+void HTTPServer::receive_upload(int socket, TLSConnection* tls,
+                                const HTTPRequest& request,
+                                HTTPResponse& response,
+                                std::string& remainder) const
+{
+    std::unique_ptr<Upload> upload = start_upload(request, response);
+    if (!upload)
+    {
+        response.set_header("Connection", "close");
+        return;
+    }
+    send_continue(socket, tls, request, remainder);
+    Upload::Status status = upload->consume(remainder);
+    while (status == Upload::MORE)
+    {
+        status = upload->receive(socket, tls, remainder);
+    }
+    finish_upload(*upload, status, response);
+}
+
+/**
+ * @summary Forwards a request to the route's upstream and relays the
+ * response, blocking this thread until it is done. The exchange needs a
+ * non-blocking socket, so the client's is made non-blocking meanwhile.
+ *
+ * @param cached the request's cache lookup, which the response may fill
+ * @param status receives the status the client was sent
+ * @return DONE if the connection can take another request
+ */
+ProxyExchange::Result HTTPServer::forward_request(int socket,
+                                                  TLSConnection* tls,
+                                                  const HTTPRequest& request,
+                                                  const Proxy::Route& route,
+                                                  ResponseCache::Lookup& cached,
+                                                  std::string& remainder,
+                                                  bool keep_alive,
+                                                  std::string& status) const
+{
+    send_continue(socket, tls, request, remainder);
+    int flags = fcntl(socket, F_GETFL);
+    fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+    ProxyExchange exchange(*proxy_, route, socket, tls, request, remainder,
+                           keep_alive, &cached);
+    ProxyExchange::Result result = exchange.step();
+    while (result == ProxyExchange::WAIT)
+    {
+        struct pollfd pfd = {exchange.fd(), exchange.events(), 0};
+        int ret = poll(&pfd, 1, config_.proxy_timeout * 1000);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        result = ret == 0 ? exchange.timed_out() : exchange.step();
+    }
+    fcntl(socket, F_SETFL, flags);
+    status = exchange.status();
+    return result;
+}
+
+/**
+ * @summary Sends "100 Continue" to a client that is waiting for one before
+ * it sends its request body, i.e. one that sent `Expect: 100-continue` and
+ * nothing else yet (`buffered` is what has been read after the headers).
+ * Best effort: a client that doesn't get it sends the body anyway after a
+ * short wait.
+ */
+void HTTPServer::send_continue(int socket, TLSConnection* tls,
+                               const HTTPRequest& request,
+                               const std::string& buffered)
+{
+    const std::string* expect = request.header_value("Expect");
+    if (!expect || !buffered.empty() || request.version() != "HTTP/1.1")
+        return;
+    std::string value = *expect;
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    if (value != "100-continue")
+        return;
+    static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    if (tls)
+        TLSConnection::send(tls, socket, interim, sizeof(interim) - 1);
+    else
+        send(socket, interim, sizeof(interim) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+ * @summary Fills in the response for a directory without an index file:
+ * a generated listing if autoindex is on, otherwise a 404. Cached listings
+ * are sent from memory; others are generated while they are sent, as a
+ * chunked response (or all at once for HTTP/1.0 clients).
+ *
+ * @param path the normalized request path of the directory
+ * @param body holds the open directory, which becomes owned by the listing
+ * @return true if `body` should be sent after the headers
+ */
+bool HTTPServer::prepare_listing(const HTTPRequest& request,
+                                 const std::string& path,
+                                 HTTPResponse& response, ResponseBody& body,
+                                 const struct stat& st) const
+{
+    if (!config_.autoindex)
+    {
+        body.clear();
+        LOG_INFO << "Response: HTTP/1.1 404 Not Found" << LOG_END;
+        response.make_404();
+        return false;
+    }
+    response.set_status("200");
+    response.set_phrase("OK");
+    response.set_header("Content-Type", "text/html; charset=utf-8");
+    body.text = DirectoryListing::cached(st);
+    // HTTP/2 frames the body itself
+    bool chunked = request.version() != "HTTP/1.0" &&
+                   request.version() != "HTTP/2";
+    if (request.verb() == "HEAD")
+    {
+        // Only a cached listing has a known length
+        if (body.text)
+            response.set_header("Content-Length", std::to_string(body.text->size()));
+        else if (chunked)
+            response.set_header("Transfer-Encoding", "chunked");
+        body.clear();
+        return false;
+    }
+    if (!body.text && request.version() == "HTTP/1.0")
+    {
+        body.text = DirectoryListing::generate(body.fd, st, path);
+        body.fd = -1;
+    }
+    if (body.text)
+    {
+        if (body.fd != -1)
+            close(body.fd);
+        body.fd = -1;
+        body.size = body.text->size();
+        response.set_header("Content-Length", std::to_string(body.size));
+        return true;
+    }
+    body.listing.reset(new DirectoryListing(body.fd, st, path, chunked));
+    body.fd = -1;
+    if (chunked)
+        response.set_header("Transfer-Encoding", "chunked");
+    return true;
+}
 
-static bool keep_running = true;
-int HTTPServer::timeout = 10;
+/**
+ * @summary Sets the headers of a 200 response for a file
+ */
+static void set_file_headers(HTTPResponse& response, off_t size,
+                             const char* mime, const std::string& etag)
+{
+    LOG_INFO << "Response: HTTP/1.1 200 OK" << LOG_END;
+    response.set_status("200");
+    response.set_phrase("OK");
+    response.set_header("Content-Length", std::to_string(size));
+    response.set_header("Content-Type", mime);
+    response.set_header("ETag", etag);
+}
 
 /**
- * @summary struct used by run_async to keep track of each client's connection
+ * @return the value of the Allow header: the methods this server handles
  */
-struct ClientState
+std::string HTTPServer::allowed_methods() const
 {
-    enum {
-        READ,
-        WRITE_RESPONSE,
-        WRITE_FILE
-    }           state_ = READ;
-    std::string buf_;
-    std::string remainder_;
-    off_t       pos_ = 0;
-    int         filefd_ = -1;
-    bool        file_ok_ = true;
-    bool        keep_alive_ = false;
-};
+    return config_.uploads ? "GET, HEAD, OPTIONS, PUT, POST"
+                           : "GET, HEAD, OPTIONS";
+}
 
-bool HTTPServer::set_conn_type(const HTTPRequest& req, HTTPResponse& resp)
+/**
+ * @summary Fills in `response` for a successfully parsed `request`; shared by
+ * every engine. When the response has a body it is returned through `body`:
+ * an open file, a file in the configured mmap size range as a shared
+ * mapping, or a directory listing. HEAD requests get the same headers as
+ * GET but never a body, so they skip sending one entirely.
+ *
+ * @return true if `body` should be sent after the headers
+ */
+bool HTTPServer::prepare_response(const HTTPRequest& request,
+                                  HTTPResponse& response,
+                                  ResponseBody& body) const
 {
-    bool keep_alive = req.version() != "HTTP/1.0";
-    auto connection = req.header_value("Connection");
-    if (connection)
+    body.clear();
+    // Routes are answered before anything is looked up on disk
+    bool send_body = false;
+    if (router_ && prepare_route(request, response, body, send_body))
+        return send_body;
+    if (request.verb() == "OPTIONS")
     {
-        std::string conn_str = *connection;
-        std::transform(conn_str.begin(), conn_str.end(),
-                conn_str.begin(), ::tolower);
-        if (conn_str == "close")
-        {
-            keep_alive = false;
-        }
-        else if (conn_str == "keep-alive")
-        {
-            keep_alive = true;
-        }
+        response.make_204();
+        response.set_header("Allow", allowed_methods());
+        return false;
     }
-    if (keep_alive)
+    bool head = request.verb() == "HEAD";
+    if (request.verb() != "GET" && !head)
     {
-        resp.set_header("Connection", "keep-alive");
-        resp.set_header("Keep-Alive", "timeout=" +
-                std::to_string(HTTPServer::timeout));
+        LOG_ERROR << "Unsupported request received" << LOG_END;
+        LOG_INFO << request.verb() << LOG_END;
+        response.make_501();
+        response.set_header("Allow", allowed_methods());
+        return false;
     }
-    else
+    send_body = prepare_get(request, response, body, head);
+    // Files (and their 304s) get the caching headers of their path
+    if (policy_ && (response.status() == "200" || response.status() == "304"))
+        policy_->apply(request.path(), response);
+    if (head)
     {
-        resp.set_header("Connection", "close");
+        // Content-Length still describes what GET would send
+        response.set_body("");
     }
-    return keep_alive;
+    return send_body;
 }
 
 /**
- * @summary Constructs the HTTPServer, performs hostname lookup, binds the
- * socket, changes directory as necessary.
+ * @summary prepare_response for requests matching a route: GET and HEAD
+ * run its handler, whose body is handed to the engine as text to send
+ * straight from memory, and OPTIONS lists those methods
  *
- * @param hostname hostname (or IP) to bind to
- * @param port the numeric port to attach to
- * @param directory the directory from which to serve files
- *                      parses ~ and spaces if possible
+ * @param send_body set to whether `body` should be sent after the headers
+ * @return false if no route matches, leaving the response alone
  */
-HTTPServer::HTTPServer(const std::string& hostname,
-                       const std::string& port,
-                       const std::string& directory) :
-    hostname_(hostname), port_(port), directory_(directory), sockfd_(-1)
+bool HTTPServer::prepare_route(const HTTPRequest& request,
+                               HTTPResponse& response, ResponseBody& body,
+                               bool& send_body) const
 {
-    // Escape spaces in the directory name so we can cd there
-    directory_ = std::regex_replace(directory_, std::regex(R"(([^\\]) )"), R"($1\ )");
-    // Expand ~ to the user's home directory
-    wordexp_t expansion;
-    if (wordexp(directory_.c_str(), &expansion, 0) != 0 || expansion.we_wordc < 1)
+    const std::string& verb = request.verb();
+    bool head = verb == "HEAD";
+    if (verb != "GET" && !head && verb != "OPTIONS")
+        return false;
+    // Malformed paths are left for prepare_get to refuse
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(request.path(), normalized, length))
+        return false;
+    Router::Params params;
+    const Router::Handler* handler =
+        router_->match(std::string_view(normalized, length), params);
+    if (!handler)
+        return false;
+    send_body = false;
+    if (verb == "OPTIONS")
     {
-        LOG_ERROR << "Error expanding directory path given" << LOG_END;
-        std::exit(1);
+        response.make_204();
+        response.set_header("Allow", "GET, HEAD, OPTIONS");
+        return true;
     }
-    // cd to `directory`
-    if(chdir(expansion.we_wordv[0]) < 0)
+    // Handlers run inline, so a miss runs this one rather than waiting for
+    // another request's
+    ResponseCache::Lookup cached;
+    if (cache_)
     {
-        LOG_ERROR << "chdir(): " << std::strerror(errno)
-                  << ": " << expansion.we_wordv[0] << LOG_END;
-        std::exit(1);
+        ResponseCache::Status found = lookup_cache(request, cached, false,
+                                                   response, body, send_body);
+        if (found == ResponseCache::HIT || found == ResponseCache::STALE)
+            return true;
     }
-    LOG_INFO << "Changed directory to " << expansion.we_wordv[0] << LOG_END;
-    wordfree(&expansion);
-    LOG_INFO << "Initializing HTTP server at "
-             << hostname << ':' << port
-             << " serving files from " << directory << LOG_END;
-
-    // Resolve `hostname` to an IP address
-    // `hints` is used to specify what optins we want
-    struct addrinfo hints;
-    std::memset(&hints, 0, sizeof(hints));
-    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
-    hints.ai_socktype = SOCK_STREAM; // Streaming socket
-    hints.ai_family = AF_INET; // IPv4
-    hints.ai_flags = AI_NUMERICSERV; // Port is a number
-
-    struct addrinfo* res;
-    int ret = getaddrinfo(hostname_.c_str(), port_.c_str(), &hints, &res);
-    if (ret != 0)
+    response.set_status("200");
+    response.set_phrase("OK");
+    std::string text;
+    (*handler)(request, params, response, text);
+    // A handler that used one of HTTPResponse's make_ functions has its
+    // body in the response already
+    if (!text.empty() || !response.header_value("Content-Length"))
     {
-        LOG_ERROR << gai_strerror(ret) << LOG_END;
-        std::exit(ret);
+        response.set_header("Content-Length", std::to_string(text.size()));
+        if (!response.header_value("Content-Type"))
+            response.set_header("Content-Type", "text/plain; charset=utf-8");
     }
-    // getaddrinfo populates res as a linked list of results
-    // we iterate through them until we find one that we can use
-    auto ptr = res;
-    for (; ptr != nullptr; ptr = ptr->ai_next)
+    if (response.status()[0] == '5' && cached.stale_on_error(Metrics::now_ns()))
     {
-        // Make the socket file descriptor
-        sockfd_ = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
-        if (sockfd_ == -1)
-        {
-            LOG_ERROR << "socket(): " << std::strerror(errno) << LOG_END;
-            continue;
-        }
-
-        // Tell the file descriptor it's okay to reuse a socket that wasn't
-        // cleaned up properly
-        const int one = 1;
-        if (setsockopt(sockfd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int)) == -1)
+        LOG_INFO << "Serving a stale response instead of "
+                 << response.status() << LOG_END;
+        cached.entry->to_response(response, Metrics::now_ns());
+        if (!head && cached.entry->body && !cached.entry->body->empty())
         {
-            LOG_ERROR << "setsockopt(): " << std::strerror(errno) << LOG_END;
-            std::exit(1);
+            body.size = cached.entry->body->size();
+            body.text = cached.entry->body;
+            send_body = true;
         }
-
-        // Bind the socket to the address we got from getaddrinfo
-        int ret = bind(sockfd_, ptr->ai_addr, ptr->ai_addrlen);
-        if (ret == -1)
+        return true;
+    }
+    std::shared_ptr<const std::string> shared;
+    if (!text.empty())
+        shared = std::make_shared<const std::string>(std::move(text));
+    if (cached.filling())
+    {
+        std::vector<std::pair<std::string, std::string>> headers(
+            response.headers().begin(), response.headers().end());
+        std::shared_ptr<ResponseCache::Entry> entry = cached.admit(
+            response.status(), response.phrase(), headers,
+            shared ? shared->size() : response.body().size());
+        if (entry)
         {
-            LOG_ERROR << "bind(): " << std::strerror(errno) << LOG_END;
-            close(sockfd_);
-            continue;
+            entry->body = shared ? shared
+                : std::make_shared<const std::string>(response.body());
+            cached.store(std::move(entry));
         }
-        break;
     }
-    // If we make it to the end of the linked list, we couldn't bind to anything
-    if (ptr == nullptr)
+    if (head)
     {
-        LOG_ERROR << "Failed to bind socket to " << hostname_
-                  << ':' << port_ << LOG_END;
-        exit(1);
+        response.set_body("");
+        return true;
     }
-    LOG_INFO << "Hostname resolved to "
-              << inet_ntoa(((sockaddr_in*)ptr->ai_addr)->sin_addr)
-              << LOG_END;
-
-    // Free the linked list created by getaddrinfo
-    freeaddrinfo(res);
+    if (shared)
+    {
+        body.size = shared->size();
+        body.text = std::move(shared);
+        send_body = true;
+    }
+    return true;
 }
 
-HTTPServer::~HTTPServer()
+/**
+ * @summary Looks a request up in the response cache, filling in `response`
+ * and `body` from the entry found on a HIT or STALE. A WAIT (only if
+ * `may_wait`) is left to the caller, which waits for `cached.wait_fd()` to
+ * become readable and then looks it up again without waiting.
+ */
+ResponseCache::Status HTTPServer::lookup_cache(const HTTPRequest& request,
+                                               ResponseCache::Lookup& cached,
+                                               bool may_wait,
+                                               HTTPResponse& response,
+                                               ResponseBody& body,
+                                               bool& send_body) const
 {
-    LOG_INFO << "Shutting down HTTP server..." << LOG_END;
-    // Close the file descriptor we were bound to
-    close(sockfd_);
+    ResponseCache::Status found = cache_->lookup(request, cached, may_wait);
+    if (found != ResponseCache::HIT && found != ResponseCache::STALE)
+        return found;
+    cached.entry->to_response(response, Metrics::now_ns());
+    send_body = false;
+    if (request.verb() != "HEAD" && cached.entry->body &&
+        !cached.entry->body->empty())
+    {
+        body.size = cached.entry->body->size();
+        body.text = cached.entry->body;
+        send_body = true;
+    }
+    return found;
 }
 
 /**
- * @summary Adds a signal handler for SIGINT and SIGTERM to shut down server
- * (This handles CTRL-C)
+ * @summary Whether prepare_response will look on disk for `request`: a GET
+ * or HEAD for a valid path that no route answers. The event loops hand
+ * those to a helper thread.
  */
-void HTTPServer::install_signal_handler() const
+bool HTTPServer::needs_disk(const HTTPRequest& request) const
 {
-    struct sigaction action;
-    std::memset(&action, 0, sizeof(action));
-    // The function be called when a signal is received -- it sets keep_running
-    // to false
-    action.sa_handler = [](int) { keep_running = false; };
-    // Call that function if we get SIGINT or SIGTERM
-    sigaction(SIGINT, &action, nullptr);
-    sigaction(SIGTERM, &action, nullptr);
-    action.sa_handler = SIG_IGN;
-    sigaction(SIGPIPE, &action, nullptr);
-    sigaction(SIGCHLD, &action, nullptr);
+    const std::string& verb = request.verb();
+    if (verb != "GET" && verb != "HEAD")
+        return false;
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(request.path(), normalized, length))
+        return false;
+    Router::Params params;
+    return !router_ ||
+           !router_->match(std::string_view(normalized, length), params);
 }
 
 /**
- * @summary Run server synchronously; spawns a new thread to process_request
- * whenever a new request comes in on accept()
+ * @summary prepare_response for GET and HEAD requests. For HEAD the file
+ * isn't opened for reading: indexed files are answered from the index
+ * alone, and others from an O_PATH descriptor's fstat.
  */
-void HTTPServer::run()
+bool HTTPServer::prepare_get(const HTTPRequest& request,
+                             HTTPResponse& response, ResponseBody& body,
+                             bool head) const
 {
-    // Listen on sockfd_ with a maximum of 64 requests in the backlog
-    if(listen(sockfd_, 64) != 0)
+    LOG_INFO << "Request recieved:\n"
+        << request << LOG_END;
+    // Decode and normalize the path, refusing any that climbs out of the
+    // serving directory
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(request.path(), normalized, length))
     {
-        LOG_ERROR << "listen(): " << std::strerror(errno) << LOG_END;
-        return;
+        LOG_ERROR << "Bad request path: " << request.path() << LOG_END;
+        response.make_400();
+        return false;
     }
-    LOG_INFO << "Listening on port " << port_ << LOG_END;
-    // Loop until a signal tells us to stop
-    while (keep_running)
+    const std::string uri(normalized, length);
+    std::string path = uri;
+    const std::string* if_none_match = request.header_value("If-None-Match");
+    std::string etag;
+    FileIndex::Entry entry;
+    bool indexed = false;
+    if (file_index_)
     {
-        // accept a connection from a client
-        int temp_fd = accept(sockfd_, nullptr, nullptr);
-        if (temp_fd < 0)
+        // A directory's entry is its index file's; its own, under "/dir/",
+        // is only for redirecting "/dir"
+        std::string key = uri;
+        if (key.back() == '/')
+            key += config_.index_file;
+        indexed = file_index_->lookup(key, entry);
+        if (!indexed && key.back() != '/' &&
+            file_index_->lookup(key + '/', entry))
         {
-            // errno will be EINTR if accept() was interrupted by a signal
-            // we just try again if that happens
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            LOG_ERROR << "accept(): " << strerror(errno) << LOG_END;
-            return;
+            response.make_301(uri + "/");
+            return false;
         }
-        try
+        // The index knows every file and directory (unless its shared table
+        // filled up), so anything missing from it is a 404 without touching
+        // the filesystem; only directory listings need to look further
+        if (!indexed && !(config_.autoindex && uri.back() == '/') &&
+            file_index_->complete())
         {
-            // Spawn a thread to process the request on temp_fd and detach the
-            // thread so it can continue working without worrying about its
-            // parent
-            std::thread(process_request, temp_fd).detach();
-        } catch (const std::exception& ex)
+            LOG_INFO << "Response: HTTP/1.1 404 Not Found" << LOG_END;
+            response.make_404();
+            return false;
+        }
+    }
+    if (indexed)
+    {
+        if (path.back() == '/')
+            path += config_.index_file;
+        etag = entry.etag;
+        // Send a precompressed variant if the client accepts it
+        const std::string* accept = request.header_value("Accept-Encoding");
+        const char* encoding = nullptr;
+        if (entry.has_brotli && accepts_encoding(accept, "br"))
+            encoding = "br";
+        else if (entry.has_gzip && accepts_encoding(accept, "gzip"))
+            encoding = "gzip";
+        if (encoding)
+        {
+            path += (encoding[0] == 'b') ? ".br" : ".gz";
+            etag.insert(etag.size() - 1, std::string("-") + encoding);
+            response.set_header("Content-Encoding", encoding);
+        }
+        if (entry.has_gzip || entry.has_brotli)
+            response.set_header("Vary", "Accept-Encoding");
+        if (etag_matches(if_none_match, etag))
+        {
+            response.make_304(etag);
+            return false;
+        }
+        FileIndex::Entry variant;
+        if (head && (!encoding || file_index_->lookup(path, variant)))
         {
-            close(temp_fd);
-            LOG_ERROR << "std::thread(): " << ex.what() << LOG_END;
+            set_file_headers(response, encoding ? variant.size : entry.size,
+                             entry.mime, etag);
+            return false;
         }
     }
-}
-
-/**
- * @summary Asynchronously run the server with non-blocking sockets.
- * Uses poll() to check when sockets are ready for read/write and loops through
- * the ready sockets, reading/writing as necessary
- * (this is for the extra credit)
- */
-void HTTPServer::run_async()
-{
-    // Put the socket in non-blocking mode
-    fcntl(sockfd_, F_SETFL, O_NONBLOCK);
-
-    // vector of pollfd used to tell poll() when to notify us
-    std::vector<struct pollfd> fds(std::max(256, sockfd_), {-1, POLLIN, 0});
-
-    // vector of ClientState used to keep track of a client's connection state
-    // (so we know when to write, read, etc)
-    std::vector<ClientState> clientstates(fds.size());
-
-    // Initialize with the server's main socket, set to notify when ready to
-    // read
-    fds[sockfd_] = {sockfd_, POLLIN, 0};
-    if (listen(sockfd_, 64) != 0)
+#ifdef O_PATH
+    // HEAD only needs the file's metadata
+    const int open_flags = head ? O_PATH : O_RDONLY;
+#else
+    const int open_flags = O_RDONLY;
+#endif
+    LOG_INFO << "Attempting to open file at " << path << LOG_END;
+    body.fd = resolver_->open(path.c_str(), path.size(), open_flags);
+    if (body.fd < 0)
     {
-        LOG_ERROR << "listen(): " << std::strerror(errno) << LOG_END;
-        return;
+        LOG_ERROR << "open(): " << std::strerror(errno) << " opening file "
+            << path << LOG_END;
+        LOG_INFO << "Response: HTTP/1.1 404 Not Found" << LOG_END;
+        response.make_404();
+        return false;
     }
-    LOG_INFO << "Listening on port " << port_ << LOG_END;
-    while (keep_running)
+    // Get the filesize, and make sure we opened a regular file (or a
+    // directory to serve the index file or listing of); if not, send a 404
+    struct stat filestat;
+    if (fstat(body.fd, &filestat) == -1)
     {
-        // Wait until an fd is ready for read or write
-        int ret = poll(&fds[0], fds.size(), -1);
-        if (ret == -1)
+        body.clear();
+        LOG_INFO << "Response: HTTP/1.1 404 Not Found" << LOG_END;
+        response.make_404();
+        return false;
+    }
+    const char* mime = indexed ? entry.mime : FileIndex::mime_type(path);
+    if (S_ISDIR(filestat.st_mode))
+    {
+        // Redirect so that relative links resolve inside the directory
+        if (uri.back() != '/')
         {
-            if (errno == EINTR)
-            {
-                continue;
-            }
-            LOG_ERROR << "poll(): " << std::strerror(errno) << LOG_END;
+            body.clear();
+            response.make_301(uri + "/");
+            return false;
         }
-        // Iterate over all sockets
-        for (const struct pollfd & poll_fd : fds)
+        // Serve the directory's index file, or else a listing of it
+        if (!open_index_file(config_.index_file, open_flags, body.fd, filestat))
+            return prepare_listing(request, uri, response, body, filestat);
+        mime = FileIndex::mime_type(config_.index_file);
+    }
+    if (!S_ISREG(filestat.st_mode))
+    {
+        body.clear();
+        LOG_INFO << "Response: HTTP/1.1 404 Not Found" << LOG_END;
+        response.make_404();
+        return false;
+    }
+    body.size = filestat.st_size;
+    if (!indexed)
+    {
+        etag = FileIndex::make_etag(filestat);
+        if (etag_matches(if_none_match, etag))
         {
-            // socket is ready for read
-            if (poll_fd.fd > -1 && poll_fd.revents & POLLIN)
-            {
-                // it's the main server socket
-                if (poll_fd.fd == sockfd_)
-                {
-                    // accept the connection, set the new fd to nonblocking
-                    // mode, and store it in the fds array.
-                    int temp_fd = accept(sockfd_, nullptr, nullptr);
-                    if (temp_fd < 0)
-                    {
-                        LOG_ERROR << "accept(): " << strerror(errno) << LOG_END;
-                    }
-                    fcntl(temp_fd, F_SETFL, O_NONBLOCK);
-                    // resize if we have to
-                    if (fds.size() < (unsigned)temp_fd)
-                    {
-                        fds.resize(temp_fd + 64, {-1, POLLIN, 0});
-                        clientstates.resize(temp_fd + 64);
-                        fds[temp_fd] = {temp_fd, POLLIN, 0};
-                        break;
-                    }
-                    // POLLIN so we know when to read from that socket
-                    fds[temp_fd] = {temp_fd, POLLIN, 0};
-                }
-                else // Ready to read from a client socket
-                {
-                    // Use 'state' as local variable to avoid long typing
-                    ClientState& state = clientstates[poll_fd.fd];
-                    // Get the remainder of a incomplete request, if necessary
-                    state.buf_ = std::move(state.remainder_);
-                    // Start writing where we left off
-                    state.pos_ = state.buf_.size();
-                    if (state.buf_.find("\r\n\r\n") == std::string::npos)
-                    {
-                        // Make sure we have some room to read
-                        state.buf_.resize(256 + state.buf_.size());
-                        // Read as much as we can
-                        int bytes_read = recv(poll_fd.fd, &state.buf_[state.pos_],
-                                state.buf_.size() - state.pos_, 0);
-                        state.pos_ += bytes_read;
-                        // If recv returned 0, the client disconnected
-                        if (bytes_read == 0)
-                        {
-                            LOG_INFO << "Connection closed by peer" << LOG_END;
-                            close(poll_fd.fd);
-                            fds[poll_fd.fd].fd = -1;
-                            state = ClientState();
-                            continue;
-                        }
-                        // Error check
-                        if (bytes_read < 0)
-                        {
-                            // EWOULDBLOCK means the client wasn't actually ready
-                            // so try again later
-                            if (errno == EWOULDBLOCK)
-                            {
-                                LOG_INFO << "Read would block" << LOG_END;
-                                continue;
-                            }
-                            LOG_ERROR << "read(): " << std::strerror(errno) << LOG_END;
-                            close(poll_fd.fd);
-                            fds[poll_fd.fd].fd = -1;
-                            state = ClientState();
-                            break;
-                        }
-                    }
-                    state.buf_.resize(state.pos_);
-                    // Check if we've read a full request in now
-                    if (state.buf_.find("\r\n\r\n") != std::string::npos)
-                    {
-                        // If so, try to parse it
-                       HTTPRequest request;
-                       HTTPResponse response;
-                       response.set_version("HTTP/1.1");
-                       try
-                       {
-                           HTTPRequest _request(state.buf_, &state.remainder_);
-                           request = std::move(_request);
-                       } catch (const std::exception& ex)
-                       {
-                           LOG_ERROR << "HTTPRequest construction failed: "
-                                     << ex.what() << LOG_END;
-                           response.make_400();
-                           state.keep_alive_ = true;
-                           response.set_header("Connection", "keep-alive");
-                           state.file_ok_ = false;
-                           // Store the prepared response to send on our next cycle
-                           state.buf_ = response.to_string();
-                           state.pos_ = 0;
-                           // Set the state to WRITE_RESPONSE so we know what to do
-                           state.state_ = ClientState::WRITE_RESPONSE;
-                           // We want to be notified when the client is ready to
-                           // receive data
-                           fds[poll_fd.fd].events = POLLOUT;
-                           continue;
-                       }
-                       // Set persistent connection as necessary
-                       state.keep_alive_ = set_conn_type(request, response);
-                       if (request.verb() != "GET")
-                       {
-                            LOG_ERROR << "Non-GET request received" << LOG_END;
-                            LOG_INFO << request.verb() << LOG_END;
-                            response.make_501();
-                            state.file_ok_ = false;
-                            // Store the prepared response to send on our next cycle
-                            state.buf_ = response.to_string();
-                            state.pos_ = 0;
-                            // Set the state to WRITE_RESPONSE so we know what to do
-                            state.state_ = ClientState::WRITE_RESPONSE;
-                            // We want to be notified when the client is ready to
-                            // receive data
-                            fds[poll_fd.fd].events = POLLOUT;
-                            continue;
-                       }
-                       LOG_INFO << "Request recieved:\n"
-                           << request << LOG_END;
-                       // Start working on the response
-                       // Try to open the file
-                       state.filefd_ = open(("." + request.path()).c_str(), O_RDONLY);
-                       if (state.filefd_ < 0)
-                       {
-                           LOG_ERROR << "open(): " << std::strerror(errno)
-                                     << " opening file ." << request.path()
-                                     << LOG_END;
-                           state.file_ok_ = false;
-                       }
-                       // Get the file size, if we succeeded
-                       off_t filesize = 0;
-                       if (state.file_ok_)
-                       {
-                           struct stat filestat;
-                           if (fstat(state.filefd_, &filestat) != -1)
-                           {
-                               // Make sure it's a regular file
-                               if (!S_ISREG(filestat.st_mode))
-                                   state.file_ok_ = false;
-                               filesize = filestat.st_size;
-                           }
-                           else
-                               state.file_ok_ = false;
-                       }
-                       // If we failed to open/stat/anything the file at any
-                       // point, send back a 404
-                       if (!state.file_ok_)
-                       {
-                           LOG_INFO << "Response: HTTP/1.1 404 Not Found"
-                                    << LOG_END;
-                           response.make_404();
-                       }
-                       // Otherwise prepare the 200 response
-                       else
-                       {
-                           LOG_INFO << "Response: HTTP/1.1 200 OK" << LOG_END;
-                           response.set_status("200");
-                           response.set_phrase("OK");
-                           if (state.file_ok_)
-                           {
-                               // Set the content-length header
-                               response.set_header("Content-Length",
-                                                   std::to_string(filesize));
-                           }
-                       }
-                       // Store the prepared response to send on our next cycle
-                       state.buf_ = response.to_string();
-                       state.pos_ = 0;
-                       // Set the state to WRITE_RESPONSE so we know what to do
-                       state.state_ = ClientState::WRITE_RESPONSE;
-                       // We want to be notified when the client is ready to
-                       // receive data
-                       fds[poll_fd.fd].events = POLLOUT;
-                    }
-                    else // We don't have a full request yet
-                    {
-                        // So save what we have and continue next cycle
-                        state.buf_.resize(state.pos_);
-                        state.remainder_ = std::move(state.buf_);
-                    }
-                }
+            body.clear();
+            response.make_304(etag);
+            return false;
+        }
+    }
+    if (head)
+    {
+        body.clear();
+        set_file_headers(response, filestat.st_size, mime, etag);
+        return false;
+    }
+    if (config_.mmap_max > 0 && body.size >= config_.mmap_min &&
+        body.size <= config_.mmap_max)
+    {
+        // The mapping stays valid after the file is closed
+        body.mapping = MappedFile::get(body.fd, filestat);
+        if (body.mapping)
+        {
+            close(body.fd);
+            body.fd = -1;
+        }
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    // Start reading large files from disk now, so cold reads overlap with
+    // sending the first parts
+    if (body.fd != -1 && config_.readahead_min > 0 &&
+        body.size >= config_.readahead_min)
+    {
+        posix_fadvise(body.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(body.fd, 0, body.size, POSIX_FADV_WILLNEED);
+    }
+#endif
+    set_file_headers(response, body.size, mime, etag);
+    return true;
+}
 
-            }
-            // A client is ready to receive data from us
-            else if (poll_fd.fd > -1 && poll_fd.revents & POLLOUT)
-            {
-                ClientState& state = clientstates[poll_fd.fd];
-                // If we are currently writing the response headers
-                if (state.state_ == ClientState::WRITE_RESPONSE)
-                {
-                    // Send from the buffer, keeping track of how much has been
-                    // sent so we can continue next cycle, if necessary
-                    ssize_t bytes_written = send(poll_fd.fd,
-                                                 &state.buf_[state.pos_],
-                                                 state.buf_.size() - state.pos_,
-                                                 0);
-                    state.pos_ += bytes_written;
-                    if (bytes_written < 0)
-                    {
-                        // Again, EWOULDBLOCK means client wasn't ready, so try
-                        // again later
-                        if (errno == EWOULDBLOCK)
-                        {
-                            continue;
-                        }
-                        LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
-                        close(poll_fd.fd);
-                        close(state.filefd_);
-                        state = ClientState();
-                        fds[poll_fd.fd].fd = -1;
-                    }
-                    // If there's nothing else to write, now we can start
-                    // writing the file instead (if there is one)
-                    else if (bytes_written == 0 || state.pos_ == (off_t)state.buf_.size())
-                    {
-                        if (state.file_ok_)
-                        {
-                            // Set state to WRITE_FILE, and get ready to write
-                            // the file
-                            state.state_ = ClientState::WRITE_FILE;
-                            state.pos_ = 0;
-                            state.buf_.clear();
-                            state.buf_.resize(2048);
-                        }
-                        else // No file to be sent, just finish up now
-                        {
-                            // Get back into READ mode if keep-alive
-                            if (state.keep_alive_)
-                            {
-                                fds[poll_fd.fd].events = POLLIN;
-                                state.state_ = ClientState::READ;
-                                state.pos_ = 0;
-                                state.filefd_ = -1;
-                            }
-                            // Otherwise close the connection
-                            else
-                            {
-                                close(poll_fd.fd);
-                                close(state.filefd_);
-                                state = ClientState();
-                                fds[poll_fd.fd].fd = -1;
-                            }
-                        }
-                    }
-                }
-                // We are ready to write the file
-                else if (state.state_ == ClientState::WRITE_FILE)
-                {
-                    // Read as much into the buffer as we can
-                    ssize_t bytes_read = read(state.filefd_, &state.buf_[0], state.buf_.size());
-                    // Then write it to the client
-                    ssize_t bytes_written = send(poll_fd.fd, &state.buf_[0], bytes_read, 0);
-                    if (bytes_read < 0 || bytes_written < 0)
-                    {
-                        LOG_ERROR << "read()/send(): "
-                                  << std::strerror(errno) << LOG_END;
-                        close(poll_fd.fd);
-                        close(state.filefd_);
-                        fds[poll_fd.fd].fd = -1;
-                        state = ClientState();
-                    }
-                    // If there's nothing else to read from the file
-                    if (bytes_read == 0)
-                    {
-                        // Close the file
-                        close(state.filefd_);
-                        // Go back in READ mode if keep-alive
-                        if (state.keep_alive_)
-                        {
-                            fds[poll_fd.fd].events = POLLIN;
-                            state.state_ = ClientState::READ;
-                            state.pos_ = 0;
-                            state.filefd_ = -1;
-                        }
-                        // Else close the connection
-                        else
-                        {
-                            close(poll_fd.fd);
-                            fds[poll_fd.fd].fd = -1;
-                            state = ClientState();
-                        }
-                    }
-                }
-            }
+/**
+ * @summary Sends `size` bytes of response body on a blocking socket
+ *
+ * @return false if the connection failed
+ */
+static bool send_body(int socket, TLSConnection* tls, const char* data,
+                      size_t size)
+{
+    size_t pos = 0;
+    while (pos != size)
+    {
+        ssize_t bytes_written = TLSConnection::send(tls, socket, data + pos,
+                                                    size - pos);
+        if (bytes_written < 0)
+        {
+            LOG_ERROR << "send(): " << std::strerror(errno) << LOG_END;
+            return false;
         }
+        pos += bytes_written;
+        Metrics::add(Metrics::BODY_BYTES_SENT, bytes_written);
     }
+    return true;
 }
 
 /**
@@ -588,8 +2121,38 @@ void HTTPServer::run_async()
  *
  * @param socket the file descriptor returned by accept()
  */
-void HTTPServer::process_request(int socket)
+void HTTPServer::process_request(int socket, int limit_slot)
 {
+    // Updates the connection statistics however this function returns
+    struct ConnectionStats
+    {
+        HTTPServer& server_;
+        int limit_slot_;
+        uint64_t requests_;
+        ~ConnectionStats()
+        {
+            Metrics::add(Metrics::CONNECTIONS_ACTIVE, -1);
+            Metrics::observe_requests_per_connection(requests_);
+            server_.release_client(limit_slot_);
+            server_.active_threads_--;
+        }
+    } stats{*this, limit_slot, 0};
+    // On an HTTPS listener, do the handshake first; the socket is blocking,
+    // so bound how long a silent client can hold this thread
+    std::unique_ptr<TLSConnection> tls;
+    if (tls_)
+    {
+        struct timeval timeout = {config_.timeout, 0};
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        tls = tls_->accept(socket);
+        if (!tls || tls->handshake() != TLSConnection::OK)
+        {
+            close(socket);
+            return;
+        }
+        timeout.tv_sec = 0;
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
     // String to hold partial requests in between read/write cycles
     std::string remainder;
     while(true)
@@ -601,16 +2164,28 @@ void HTTPServer::process_request(int socket)
         fd_set fdset;
         FD_ZERO(&fdset);
         FD_SET(socket, &fdset);
+        // Between requests, also wake up if the server starts shutting down
+        int maxfd = socket;
+        if (remainder.empty())
+        {
+            FD_SET(shutdown_pipe_[0], &fdset);
+            maxfd = std::max(socket, shutdown_pipe_[0]);
+        }
         struct timeval timeout;
         int ret;
         // if we don't have a complete request yet, wait at most
-        // HTTPServer::timeout seconds for data from the client
-        if (!have_complete_request)
+        // config_.timeout seconds for data from the client. Data OpenSSL
+        // has already decrypted is ready, though select() can't see it.
+        if (!have_complete_request && tls && tls->pending() > 0)
+        {
+            ret = 1;
+        }
+        else if (!have_complete_request)
         {
-            timeout.tv_sec = HTTPServer::timeout;
+            timeout.tv_sec = config_.timeout;
             timeout.tv_usec = 0;
             // Monitor the socket, waiting `timeout` seconds for data
-            ret = select(socket+1, &fdset, nullptr, nullptr, &timeout);
+            ret = select(maxfd+1, &fdset, nullptr, nullptr, &timeout);
         }
         else
         {
@@ -620,14 +2195,30 @@ void HTTPServer::process_request(int socket)
         if (ret == 0 && remainder.empty()) // keepalive timeout only applies between requests
         {
             LOG_INFO << "Keepalive timeout, closing connection" << LOG_END;
+            if (tls)
+                tls->shutdown();
             close(socket);
             return;
         }
         if (ret < 0)
         {
+            // Signals may be delivered to any thread
+            if (errno == EINTR)
+                continue;
             LOG_ERROR << "select(): " << std::strerror(errno) << LOG_END;
+            close(socket);
             return;
         }
+        if (ret > 0 && remainder.empty() && !FD_ISSET(socket, &fdset))
+        {
+            LOG_INFO << "Shutting down, closing idle connection" << LOG_END;
+            if (tls)
+                tls->shutdown();
+            close(socket);
+            return;
+        }
+        RequestTrace trace;
+        trace.mark(RequestTrace::START);
         // Start with what remains from the previous cycle, if any
         std::string buf = remainder;
         // Start writing where we left off
@@ -638,7 +2229,8 @@ void HTTPServer::process_request(int socket)
             // Make some room
             buf.resize(256 + buf.size());
             do {
-                bytes_read = recv(socket, &buf[pos], buf.size() - pos, 0);
+                bytes_read = TLSConnection::recv(tls.get(), socket, &buf[pos],
+                                                 buf.size() - pos);
                 pos += bytes_read;
                 if (buf.size() - pos < 8)
                 {
@@ -651,6 +2243,7 @@ void HTTPServer::process_request(int socket)
             if (bytes_read < 0)
             {
                 LOG_ERROR << "recv(): " << std::strerror(errno) << LOG_END;
+                close(socket);
                 return;
             }
             // recv returning 0 means client disconnected
@@ -663,95 +2256,120 @@ void HTTPServer::process_request(int socket)
             // Shrink buffer to fit
             buf.resize(pos);
         }
+        uint64_t start_ns = Metrics::now_ns();
+        stats.requests_++;
+        Metrics::add(Metrics::REQUESTS);
         // Try to parse the request
-        bool request_ok = true;
         bool file_ok = false;
-        int filefd = -1;
-        off_t filesize = 0;
+        ResponseBody body;
         HTTPRequest request;
         HTTPResponse response;
+        response.set_version("HTTP/1.1");
+        const Proxy::Route* upstream = nullptr;
+        bool keep_alive = false;
+        ResponseCache::Lookup cached;
         try
         {
             HTTPRequest _request(buf, &remainder);
             // If we succesfully constructed the request, move it back to the
             // original variable
             request = std::move(_request);
+            trace.mark(RequestTrace::PARSED);
+            if (allow_request(limit_slot, response))
+            {
+                // Set persistent if necessary
+                keep_alive = set_conn_type(request, response);
+                // Proxied requests are answered by the upstream, below
+                if (proxy_)
+                    upstream = proxy_->match(request.path());
+                if (!upstream && is_upload(request))
+                    receive_upload(socket, tls.get(), request, response,
+                                   remainder);
+                else if (!upstream)
+                    file_ok = prepare_response(request, response, body);
+            }
         } catch (const std::exception& ex)
         {
             LOG_ERROR << "HTTPRequest construction failed: " << ex.what() << LOG_END;
-            request_ok = false;
             response.make_400();
+            response.set_header("Connection", keep_running_ ? "keep-alive" : "close");
         }
-        // Set persistent if necessary
-        response.set_version("HTTP/1.1");
-        set_conn_type(request, response);
-        if (request.verb() != "GET")
+        // Proxied responses may be in the cache, or on their way into it
+        if (upstream && cache_)
         {
-            LOG_ERROR << "Non-GET request received" << LOG_END;
-            request_ok = false;
-            response.make_501();
-        }
-        if (request_ok)
-        {
-            LOG_INFO << "Request recieved:\n"
-                << request << LOG_END;
-            response.set_version("HTTP/1.1");
-            LOG_INFO << "Attempting to open file at " << '.'
-                << request.path() << LOG_END;
-            // Flag that we set to false if file opening fails at any point
-            file_ok = true;
-            // Prepend '.' because the path starts with a '/'
-            filefd = open(("." + request.path()).c_str(), O_RDONLY);
-            if (filefd < 0)
-            {
-                LOG_ERROR << "open(): " << std::strerror(errno) << " opening file "
-                    << "." << request.path() << LOG_END;
-                file_ok = false;
-            }
-            // Try to get the filesize, if it opened correctly
-            if (file_ok) {
-                struct stat filestat;
-                if (fstat(filefd, &filestat) != -1)
-                {
-                    // Make sure we opened a regular file
-                    if (!S_ISREG(filestat.st_mode))
-                        file_ok = false;
-                    filesize = filestat.st_size;
-                }
-                else
-                    file_ok = false;
-            }
-            // If finding a file fails at any point, send a 404
-            if (!file_ok)
+            ResponseCache::Status found = lookup_cache(request, cached, true,
+                                                       response, body, file_ok);
+            if (found == ResponseCache::WAIT)
             {
-                LOG_INFO << "Response: HTTP/1.1 404 Not Found" << LOG_END;
-                response.make_404();
-            }
-            else
-            {
-                LOG_INFO << "Response: HTTP/1.1 200 OK" << LOG_END;
-                response.set_status("200");
-                response.set_phrase("OK");
-                // Set the content-length header if we opened a file
-                if (file_ok)
-                {
-                    response.set_header("Content-Length", std::to_string(filesize));
-                }
+                struct pollfd pfd = {cached.wait_fd(), POLLIN, 0};
+                poll(&pfd, 1, config_.proxy_timeout * 1000);
+                found = lookup_cache(request, cached, false, response, body,
+                                     file_ok);
             }
+            if (found == ResponseCache::HIT || found == ResponseCache::STALE)
+                upstream = nullptr;
+        }
+        if (upstream)
+        {
+            std::string status;
+            ProxyExchange::Result result = forward_request(
+                socket, tls.get(), request, *upstream, cached, remainder,
+                keep_alive, status);
+            Metrics::record_status(status);
+            Metrics::observe_latency(Metrics::now_ns() - start_ns);
+            trace.finish(socket, request.path(), status);
+            Tracer::dump_if_requested();
+            if (result == ProxyExchange::DONE)
+                continue;
+            if (tls)
+                tls->shutdown();
+            close(socket);
+            return;
         }
+        trace.mark(RequestTrace::OPENED);
         // Generate the response text we're sending back
+        Metrics::record_status(response.status());
         std::string response_text = response.to_string();
         // Loop and write it to the client
         pos = 0;
         ssize_t bytes_written = 0;
         do
         {
-            bytes_written = send(socket, &response_text[pos],
-                                response_text.size() - pos, 0);
+            bytes_written = TLSConnection::send(tls.get(), socket,
+                                                &response_text[pos],
+                                                response_text.size() - pos);
             pos += bytes_written;
         } while (bytes_written > 0);
+        Metrics::add(Metrics::HEADER_BYTES_SENT, pos);
+        trace.mark(RequestTrace::HEADERS_SENT);
+        // Bodies already in memory (mapped files, cached listings) are sent
+        // straight from it
+        if (file_ok && body.memory())
+        {
+            if (!send_body(socket, tls.get(), body.memory(), body.size))
+            {
+                close(socket);
+                return;
+            }
+            trace.mark(RequestTrace::BODY_SENT);
+        }
+        // Listings are sent a chunk at a time as they are generated
+        else if (file_ok && body.listing)
+        {
+            std::string chunk;
+            while (body.listing->next(chunk))
+            {
+                if (!send_body(socket, tls.get(), chunk.data(), chunk.size()))
+                {
+                    close(socket);
+                    return;
+                }
+                chunk.clear();
+            }
+            trace.mark(RequestTrace::BODY_SENT);
+        }
         // Now send the file, if we opened it succesfully
-        if (file_ok)
+        else if (file_ok)
         {
             bytes_written = 0;
             pos = 0;
@@ -760,36 +2378,50 @@ void HTTPServer::process_request(int socket)
             {
                 char buf[8192];
                 do {
-                    bytes_read = read(filefd, buf, 8192);
-                    bytes_written = send(socket, buf, bytes_read, 0);
+                    bytes_read = read(body.fd, buf, 8192);
+                    bytes_written = TLSConnection::send(tls.get(), socket,
+                                                        buf, bytes_read);
+                    Metrics::add(Metrics::BODY_BYTES_SENT, bytes_written);
                 } while (bytes_read > 0 && bytes_written > 0);
                 if (bytes_read < 0 || bytes_written < 0)
                 {
                     LOG_ERROR << "read()/send(): "
                             << std::strerror(errno) << LOG_END;
+                    body.clear();
                     close(socket);
                     return;
                 }
             }
             #else
             // sendfile, if it works, is a fast way to send data from a file to
-            // a socket without much effort
+            // a socket without much effort; with kernel TLS it is encrypted
+            // on the way, otherwise TLS falls back to a read and SSL_write
             do
             {
-                bytes_written = sendfile(socket, filefd, &pos, filesize - pos);
+                bytes_written = TLSConnection::sendfile(tls.get(), socket,
+                                                        body.fd, &pos,
+                                                        body.size - pos);
                 if (bytes_written < 0)
                 {
                     LOG_ERROR << "sendfile(): " << std::strerror(errno) << LOG_END;
+                    body.clear();
                     close(socket);
                     return;
                 }
-            } while (pos != filesize);
+                Metrics::add(Metrics::BODY_BYTES_SENT, bytes_written);
+            } while (pos != body.size);
             #endif
-            close(filefd);
+            trace.mark(RequestTrace::BODY_SENT);
         }
+        body.clear();
+        Metrics::observe_latency(Metrics::now_ns() - start_ns);
+        trace.finish(socket, request.path(), response.status());
+        Tracer::dump_if_requested();
         // Close the connection if we should
         if (*response.header_value("Connection") == "close")
         {
+            if (tls)
+                tls->shutdown();
             close(socket);
             return;
         }
@@ -1,9 +1,30 @@
 #ifndef HTTPSERVER_H
 #define HTTPSERVER_H
-#include <string>  // for string
+#include "HelperPool.h"    // for HelperPool
+#include "Proxy.h"         // for Proxy, ProxyExchange
+#include "ResponseBody.h"  // for ResponseBody
+#include "ResponseCache.h" // for ResponseCache
+#include "Router.h"        // for Router
+#include "ServerConfig.h"  // for ServerConfig
+#include "Upload.h"        // for Upload
 
+#include <sys/stat.h>      // for stat
+#include <sys/types.h>     // for pid_t
+
+#include <atomic>          // for atomic
+#include <memory>          // for unique_ptr
+#include <string>          // for string
+#include <thread>          // for thread
+#include <vector>          // for vector
+
+class CachePolicy;
 class HTTPRequest;
+class FileIndex;
 class HTTPResponse;
+class PathResolver;
+class RateLimiter;
+class TLSConnection;
+class TLSContext;
 
 class HTTPServer
 {
@@ -11,22 +32,109 @@ public:
     HTTPServer(const std::string& hostname,
                const std::string& port,
                const std::string& directory);
+    explicit HTTPServer(const ServerConfig& config);
     HTTPServer(const HTTPServer&) = delete; // prevent copy
     HTTPServer& operator=(const HTTPServer&) = delete; // prevent assignment
     ~HTTPServer();
 
     void install_signal_handler() const;
+    void serve();
     void run();
     void run_async();
+    void run_epoll();
+    void run_multi_reactor();
+    void run_coroutines();
+
+    void route(const std::string& pattern, Router::Handler handler);
+    void enable_metrics(const std::string& path);
+    void serve_admin_socket(const std::string& socket_path);
 
 private:
-    static void process_request(int socket);
-    static bool set_conn_type(const HTTPRequest& req, HTTPResponse& resp);
-    static int  timeout;
-    std::string hostname_;
-    std::string port_;
-    std::string directory_;
-    int         sockfd_;
+    class EventLoop;
+    class CoroutineLoop;
+
+    void run_engine();
+    void run_processes();
+    pid_t start_worker(int index);
+    void start_helpers();
+    bool start_listening();
+    bool is_listener(int fd) const;
+    int  accept_connection(int listener, bool nonblocking, int& limit_slot);
+    bool start_thread(int listener);
+    bool receive_listeners();
+    void serve_handoff_socket();
+    void handoff_loop();
+    void restart();
+    void configure_client(int socket, bool tcp) const;
+    void pin_loop(int index) const;
+    void process_request(int socket, int limit_slot);
+    bool allow_request(int limit_slot, HTTPResponse& response) const;
+    void release_client(int limit_slot) const;
+    bool prepare_response(const HTTPRequest& request, HTTPResponse& response,
+                          ResponseBody& body) const;
+    bool prepare_route(const HTTPRequest& request, HTTPResponse& response,
+                       ResponseBody& body, bool& send_body) const;
+    ResponseCache::Status lookup_cache(const HTTPRequest& request,
+                                       ResponseCache::Lookup& cached,
+                                       bool may_wait, HTTPResponse& response,
+                                       ResponseBody& body,
+                                       bool& send_body) const;
+    bool prepare_get(const HTTPRequest& request, HTTPResponse& response,
+                     ResponseBody& body, bool head) const;
+    bool needs_disk(const HTTPRequest& request) const;
+    std::string allowed_methods() const;
+    bool prepare_listing(const HTTPRequest& request, const std::string& path,
+                         HTTPResponse& response, ResponseBody& body,
+                         const struct stat& st) const;
+    std::unique_ptr<Upload> start_upload(const HTTPRequest& request,
+                                         HTTPResponse& response) const;
+    void finish_upload(Upload& upload, Upload::Status status,
+                       HTTPResponse& response) const;
+    void receive_upload(int socket, TLSConnection* tls,
+                        const HTTPRequest& request, HTTPResponse& response,
+                        std::string& remainder) const;
+    static bool is_upload(const HTTPRequest& request);
+    ProxyExchange::Result forward_request(int socket, TLSConnection* tls,
+                                          const HTTPRequest& request,
+                                          const Proxy::Route& route,
+                                          ResponseCache::Lookup& cached,
+                                          std::string& remainder,
+                                          bool keep_alive,
+                                          std::string& status) const;
+    static void send_continue(int socket, TLSConnection* tls,
+                              const HTTPRequest& request,
+                              const std::string& buffered);
+    bool set_conn_type(const HTTPRequest& req, HTTPResponse& resp) const;
+    void admin_loop();
+    static void request_shutdown();
+    static std::atomic<bool> keep_running_;
+    static int  shutdown_pipe_[2]; // readable once we start shutting down
+    static int  restart_pipe_[2];  // readable when SIGUSR2 asks to restart
+    ServerConfig config_;
+    std::string start_dir_;
+    std::unique_ptr<PathResolver> resolver_;
+    std::unique_ptr<FileIndex> file_index_;
+    std::unique_ptr<CachePolicy> policy_;
+    std::unique_ptr<RateLimiter> limiter_;
+    std::unique_ptr<TLSContext> tls_;
+    std::unique_ptr<Router> router_;
+    std::unique_ptr<Proxy> proxy_;
+    std::unique_ptr<ResponseCache> cache_;
+    // Largest number of listening sockets, so they fit in one handoff
+    static const size_t MAX_LISTENERS = 16;
+    std::vector<int> listeners_;  // TCP (IPv4 and IPv6), then Unix
+    std::atomic<int>  active_threads_;
+    int         handoff_sockfd_;
+    std::atomic<bool> handoff_running_;
+    std::atomic<bool> handed_off_;
+    std::thread handoff_thread_;
+    std::string admin_path_;
+    int         admin_sockfd_;
+    std::atomic<bool> admin_running_;
+    std::thread admin_thread_;
+    int         cpu_offset_;  // where this worker process's loops are pinned
+    // Last, so the helpers stop before anything they use is destroyed
+    std::unique_ptr<HelperPool> helpers_;
 };
 
 #endif
@@ -0,0 +1,144 @@
+#include "HelperPool.h"
+#include "logging.h"       // for LOG_END, LOG_ERROR
+
+#include <fcntl.h>         // for fcntl, O_NONBLOCK, FD_CLOEXEC
+#ifdef __linux__
+#include <sys/eventfd.h>   // for eventfd, EFD_NONBLOCK, EFD_CLOEXEC
+#endif
+#include <unistd.h>        // for close, pipe, read, write
+
+#include <cerrno>          // for errno
+#include <cstdint>         // for uint64_t
+#include <cstdlib>         // for exit
+#include <cstring>         // for strerror
+#include <utility>         // for move
+
+HelperPool::Completions::Completions()
+{
+#ifdef __linux__
+    fd_[0] = fd_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd_[0] == -1)
+    {
+        LOG_ERROR << "eventfd(): " << std::strerror(errno) << LOG_END;
+        std::exit(1);
+    }
+#else
+    if (pipe(fd_) == -1)
+    {
+        LOG_ERROR << "pipe(): " << std::strerror(errno) << LOG_END;
+        std::exit(1);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(fd_[i], F_SETFL, O_NONBLOCK);
+        fcntl(fd_[i], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+}
+
+HelperPool::Completions::~Completions()
+{
+    close(fd_[0]);
+    if (fd_[1] != fd_[0])
+        close(fd_[1]);
+}
+
+/**
+ * @summary Queues a task for the loop, waking it up unless earlier tasks
+ * already have; called from helper threads
+ */
+void HelperPool::Completions::push(Task task)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake = tasks_.empty();
+        tasks_.push_back(std::move(task));
+    }
+    if (wake)
+    {
+        uint64_t one = 1;
+        if (write(fd_[1], &one, sizeof(one)) == -1 && errno != EAGAIN)
+        {
+            LOG_ERROR << "write(): " << std::strerror(errno) << LOG_END;
+        }
+    }
+}
+
+/**
+ * @summary Runs the queued tasks on the calling (loop) thread, once fd()
+ * is readable. The fd is drained before the queue is taken, so a task
+ * pushed meanwhile either is taken too or wakes the loop again.
+ */
+void HelperPool::Completions::run()
+{
+    uint64_t count[8];
+    while (read(fd_[0], count, sizeof(count)) > 0)
+        ;
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks.swap(tasks_);
+    }
+    for (Task& task : tasks)
+        task();
+}
+
+/**
+ * @param threads the number of helpers to start
+ */
+HelperPool::HelperPool(int threads) :
+    stopping_(false)
+{
+    for (int i = 0; i < threads; i++)
+        threads_.emplace_back(&HelperPool::work, this);
+}
+
+/**
+ * @summary Stops the helpers once the task each is running returns; queued
+ * tasks are dropped
+ */
+HelperPool::~HelperPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cond_.notify_all();
+    for (std::thread& thread : threads_)
+        thread.join();
+}
+
+/**
+ * @summary Queues a task to run on a helper thread
+ */
+void HelperPool::submit(Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+}
+
+/**
+ * @summary A helper thread: runs queued tasks, oldest first, until the pool
+ * is destroyed
+ */
+void HelperPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true)
+    {
+        cond_.wait(lock, [this]() { return !queue_.empty() || stopping_; });
+        if (stopping_)
+            return;
+        {
+            Task task = std::move(queue_.front());
+            queue_.pop_front();
+            lock.unlock();
+            task();
+        }
+        lock.lock();
+    }
+}
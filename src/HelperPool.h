@@ -0,0 +1,66 @@
+#ifndef HELPERPOOL_H
+#define HELPERPOOL_H
+
+#include <condition_variable> // for condition_variable
+#include <deque>              // for deque
+#include <functional>         // for function
+#include <mutex>              // for mutex
+#include <thread>             // for thread
+#include <vector>             // for vector
+
+/**
+ * @summary A few threads for the file operations an event loop can't afford
+ * to block on: opening and stat()ing a file whose metadata isn't cached, or
+ * reading a part of it that isn't in the page cache. One cold file would
+ * otherwise stall every connection on the loop.
+ *
+ * Work is queued with submit() and taken by whichever helper is free. Each
+ * event loop owns a Completions, an eventfd it polls alongside its sockets;
+ * a helper push()es the rest of the work there when it is done, and the
+ * loop runs it on its own thread.
+ */
+class HelperPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    /**
+     * @summary Tasks to run on one event loop, queued by helpers. fd() is
+     * readable while any are waiting, and run() runs them.
+     */
+    class Completions
+    {
+    public:
+        Completions();
+        Completions(const Completions&) = delete; // prevent copy
+        Completions& operator=(const Completions&) = delete; // prevent assignment
+        ~Completions();
+
+        int  fd() const { return fd_[0]; }
+        void push(Task task);
+        void run();
+
+    private:
+        int               fd_[2];  // the eventfd twice, or a pipe
+        std::mutex        mutex_;  // guards tasks_
+        std::vector<Task> tasks_;
+    };
+
+    explicit HelperPool(int threads);
+    HelperPool(const HelperPool&) = delete; // prevent copy
+    HelperPool& operator=(const HelperPool&) = delete; // prevent assignment
+    ~HelperPool();
+
+    void submit(Task task);
+
+private:
+    void work();
+
+    std::mutex               mutex_;   // guards queue_ and stopping_
+    std::condition_variable  cond_;
+    std::deque<Task>         queue_;
+    bool                     stopping_;
+    std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include "MappedFile.h"
+#include "logging.h"     // for LOG_END, LOG_ERROR
+
+#include <sys/mman.h>    // for mmap, munmap, madvise, MAP_FAILED
+
+#include <cerrno>        // for errno
+#include <cstring>       // for strerror
+
+std::mutex MappedFile::mutex_;
+std::unordered_map<MappedFile::Key, std::weak_ptr<const MappedFile>,
+                   MappedFile::KeyHash> MappedFile::cache_;
+
+MappedFile::MappedFile(const Key& key, const char* data, off_t size,
+                       time_t mtime) :
+    key_(key), data_(data), size_(size), mtime_(mtime)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    munmap(const_cast<char*>(data_), size_);
+}
+
+/**
+ * @summary Returns the shared mapping of the open file `fd`, mapping it if no
+ * connection is currently sending it
+ *
+ * @param st the result of fstat on `fd`
+ * @return the mapping, or null if the file could not be mapped (the caller
+ *         should fall back to reading it)
+ */
+std::shared_ptr<const MappedFile> MappedFile::get(int fd, const struct stat& st)
+{
+    if (st.st_size <= 0)
+        return nullptr;
+    Key key = {st.st_dev, st.st_ino};
+    // Declared before the lock so a mapping we replace is released (which
+    // takes the lock again) only after it is dropped
+    std::shared_ptr<const MappedFile> file;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = cache_.find(key);
+    if (it != cache_.end())
+    {
+        file = it->second.lock();
+        if (file && file->size_ == st.st_size && file->mtime_ == st.st_mtime)
+            return file;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        LOG_ERROR << "mmap(): " << std::strerror(errno) << LOG_END;
+        return nullptr;
+    }
+    // Bodies are sent front to back: read ahead aggressively, and start
+    // reading the whole file in now so later sends don't wait on the disk
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    madvise(data, st.st_size, MADV_WILLNEED);
+    std::shared_ptr<const MappedFile> mapped(
+        new MappedFile(key, static_cast<const char*>(data), st.st_size,
+                       st.st_mtime),
+        release);
+    cache_[key] = mapped;
+    return mapped;
+}
+
+/**
+ * @summary shared_ptr deleter; forgets the mapping (unless it has already
+ * been replaced by a newer one) and unmaps it
+ */
+void MappedFile::release(MappedFile* file)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cache_.find(file->key_);
+        if (it != cache_.end() && it->second.expired())
+            cache_.erase(it);
+    }
+    delete file;
+}
@@ -0,0 +1,62 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <sys/stat.h>     // for stat
+#include <sys/types.h>    // for dev_t, ino_t, off_t, time_t
+
+#include <cstddef>        // for size_t
+#include <functional>     // for hash
+#include <memory>         // for shared_ptr, weak_ptr
+#include <mutex>          // for mutex
+#include <unordered_map>  // for unordered_map
+
+/**
+ * @summary A read-only mmap of a whole file, shared by every connection that
+ * is sending it. Mappings are reference counted through shared_ptr and
+ * unmapped as soon as the last connection has finished with them; a file
+ * that changes (size or mtime) gets a fresh mapping. Files must not be
+ * truncated while they are being served.
+ */
+class MappedFile
+{
+public:
+    static std::shared_ptr<const MappedFile> get(int fd, const struct stat& st);
+
+    MappedFile(const MappedFile&) = delete; // prevent copy
+    MappedFile& operator=(const MappedFile&) = delete; // prevent assignment
+    ~MappedFile();
+
+    const char* data() const { return data_; }
+    off_t       size() const { return size_; }
+
+private:
+    struct Key
+    {
+        dev_t dev;
+        ino_t ino;
+        bool operator==(const Key& other) const
+        {
+            return dev == other.dev && ino == other.ino;
+        }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<ino_t>()(key.ino) ^ std::hash<dev_t>()(key.dev);
+        }
+    };
+
+    MappedFile(const Key& key, const char* data, off_t size, time_t mtime);
+    static void release(MappedFile* file);
+
+    Key         key_;
+    const char* data_;
+    off_t       size_;
+    time_t      mtime_;
+
+    static std::mutex mutex_;
+    static std::unordered_map<Key, std::weak_ptr<const MappedFile>, KeyHash> cache_;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "Metrics.h"
+
+#include <chrono>   // for steady_clock, duration_cast, nanoseconds
+#include <sstream>  // for ostringstream
+
+namespace
+{
+const int NUM_SHARDS = 32;
+
+/**
+ * @summary One thread's slice of the statistics, padded out to its own cache
+ * lines so that increments from different threads never false-share
+ */
+struct alignas(64) Shard
+{
+    std::atomic<int64_t> counters_[Metrics::NUM_COUNTERS];
+    Histogram            latency_;
+    Histogram            requests_per_conn_;
+};
+
+// Static storage, so everything starts zeroed
+Shard shards[NUM_SHARDS];
+std::atomic<unsigned> next_shard(0);
+
+Shard& local_shard()
+{
+    thread_local Shard& shard =
+        shards[next_shard.fetch_add(1, std::memory_order_relaxed) % NUM_SHARDS];
+    return shard;
+}
+
+/**
+ * @summary Snapshot of a histogram summed across all shards
+ */
+struct HistogramTotals
+{
+    uint64_t buckets_[Histogram::NUM_BUCKETS] = {};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+
+    uint64_t percentile(double p) const
+    {
+        uint64_t target = static_cast<uint64_t>(p * count_);
+        uint64_t seen = 0;
+        for (int i = 0; i < Histogram::NUM_BUCKETS; i++)
+        {
+            seen += buckets_[i];
+            if (seen > target)
+                return Histogram::bucket_upper_bound(i);
+        }
+        return 0;
+    }
+};
+
+HistogramTotals collect(Histogram Shard::* member)
+{
+    HistogramTotals totals;
+    for (const Shard& shard : shards)
+    {
+        const Histogram& hist = shard.*member;
+        for (int i = 0; i < Histogram::NUM_BUCKETS; i++)
+        {
+            uint64_t n = hist.buckets_[i].load(std::memory_order_relaxed);
+            totals.buckets_[i] += n;
+            totals.count_ += n;
+        }
+        totals.sum_ += hist.sum_.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+int64_t collect(Metrics::Counter counter)
+{
+    int64_t total = 0;
+    for (const Shard& shard : shards)
+    {
+        total += shard.counters_[counter].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void write_header(std::ostream& os, const char* name, const char* type,
+                  const char* help)
+{
+    os << "# HELP " << name << ' ' << help << '\n'
+       << "# TYPE " << name << ' ' << type << '\n';
+}
+}
+
+int Histogram::bucket_index(uint64_t value)
+{
+    if (value < static_cast<uint64_t>(SUB_COUNT))
+        return static_cast<int>(value);
+    int msb = 63 - __builtin_clzll(value);
+    int sub = static_cast<int>((value >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+    return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+uint64_t Histogram::bucket_upper_bound(int index)
+{
+    if (index < SUB_COUNT)
+        return static_cast<uint64_t>(index);
+    int msb = index / SUB_COUNT + SUB_BITS - 1;
+    uint64_t sub = static_cast<uint64_t>(index % SUB_COUNT);
+    uint64_t width = 1ULL << (msb - SUB_BITS);
+    return ((SUB_COUNT + sub) << (msb - SUB_BITS)) + width - 1;
+}
+
+void Histogram::record(uint64_t value)
+{
+    buckets_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+void Metrics::add(Counter counter, int64_t amount)
+{
+    local_shard().counters_[counter].fetch_add(amount, std::memory_order_relaxed);
+}
+
+/**
+ * @summary Counts a response by its status class (2xx, 4xx, ...)
+ *
+ * @param status the three digit status code of the response
+ */
+void Metrics::record_status(const std::string& status)
+{
+    if (status.empty() || status[0] < '1' || status[0] > '5')
+        return;
+    add(static_cast<Counter>(RESPONSES_1XX + (status[0] - '1')));
+}
+
+void Metrics::observe_latency(uint64_t nanos)
+{
+    local_shard().latency_.record(nanos);
+}
+
+void Metrics::observe_requests_per_connection(uint64_t requests)
+{
+    local_shard().requests_per_conn_.record(requests);
+}
+
+uint64_t Metrics::now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @summary Aggregates every shard and formats the result in the Prometheus
+ * text exposition format (version 0.0.4)
+ */
+std::string Metrics::render()
+{
+    std::ostringstream os;
+    write_header(os, "http_connections_accepted_total", "counter",
+                 "Connections accepted on the listening socket");
+    os << "http_connections_accepted_total "
+       << collect(CONNECTIONS_ACCEPTED) << '\n';
+    write_header(os, "http_connections_active", "gauge",
+                 "Connections currently open");
+    os << "http_connections_active " << collect(CONNECTIONS_ACTIVE) << '\n';
+    write_header(os, "http_connections_rejected_total", "counter",
+                 "Connections refused by the per-client connection cap");
+    os << "http_connections_rejected_total "
+       << collect(CONNECTIONS_REJECTED) << '\n';
+    write_header(os, "http_requests_total", "counter",
+                 "Requests parsed from clients");
+    os << "http_requests_total " << collect(REQUESTS) << '\n';
+    write_header(os, "http_requests_rate_limited_total", "counter",
+                 "Requests refused by the per-client rate limit");
+    os << "http_requests_rate_limited_total "
+       << collect(REQUESTS_LIMITED) << '\n';
+    write_header(os, "http_proxy_requests_total", "counter",
+                 "Requests forwarded to upstream servers");
+    os << "http_proxy_requests_total " << collect(PROXY_REQUESTS) << '\n';
+    write_header(os, "http_proxy_connections_total", "counter",
+                 "Upstream connections opened (the rest were reused)");
+    os << "http_proxy_connections_total "
+       << collect(PROXY_CONNECTIONS) << '\n';
+    write_header(os, "http_cache_lookups_total", "counter",
+                 "Response cache lookups, by result");
+    os << "http_cache_lookups_total{result=\"hit\"} "
+       << collect(CACHE_HITS) << '\n'
+       << "http_cache_lookups_total{result=\"stale\"} "
+       << collect(CACHE_STALE) << '\n'
+       << "http_cache_lookups_total{result=\"miss\"} "
+       << collect(CACHE_MISSES) << '\n'
+       << "http_cache_lookups_total{result=\"wait\"} "
+       << collect(CACHE_WAITS) << '\n';
+    write_header(os, "http_helper_tasks_total", "counter",
+                 "File operations the event loops handed to helper threads");
+    os << "http_helper_tasks_total{task=\"open\"} "
+       << collect(HELPER_OPENS) << '\n'
+       << "http_helper_tasks_total{task=\"read\"} "
+       << collect(HELPER_READS) << '\n';
+    write_header(os, "http_sent_bytes_total", "counter",
+                 "Bytes written to client sockets");
+    os << "http_sent_bytes_total{part=\"header\"} "
+       << collect(HEADER_BYTES_SENT) << '\n'
+       << "http_sent_bytes_total{part=\"body\"} "
+       << collect(BODY_BYTES_SENT) << '\n';
+    write_header(os, "http_responses_total", "counter",
+                 "Responses sent, by status class");
+    for (int i = 0; i < 5; i++)
+    {
+        os << "http_responses_total{code=\"" << i + 1 << "xx\"} "
+           << collect(static_cast<Counter>(RESPONSES_1XX + i)) << '\n';
+    }
+
+    // Latency is exported as a conventional histogram with power-of-two
+    // bucket bounds, plus quantiles taken at full HDR resolution
+    HistogramTotals latency = collect(&Shard::latency_);
+    write_header(os, "http_request_duration_seconds", "histogram",
+                 "Time from a parsed request until its response is sent");
+    uint64_t cumulative = 0;
+    int index = 0;
+    for (uint64_t bound = 1000; bound <= (1ULL << 36); bound *= 2)
+    {
+        while (index < Histogram::NUM_BUCKETS &&
+               Histogram::bucket_upper_bound(index) < bound)
+        {
+            cumulative += latency.buckets_[index++];
+        }
+        os << "http_request_duration_seconds_bucket{le=\""
+           << bound / 1e9 << "\"} " << cumulative << '\n';
+    }
+    os << "http_request_duration_seconds_bucket{le=\"+Inf\"} "
+       << latency.count_ << '\n'
+       << "http_request_duration_seconds_sum " << latency.sum_ / 1e9 << '\n'
+       << "http_request_duration_seconds_count " << latency.count_ << '\n';
+    write_header(os, "http_request_duration_quantile_seconds", "gauge",
+                 "Request latency quantiles since startup");
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (double q : quantiles)
+    {
+        os << "http_request_duration_quantile_seconds{quantile=\"" << q
+           << "\"} " << latency.percentile(q) / 1e9 << '\n';
+    }
+
+    HistogramTotals per_conn = collect(&Shard::requests_per_conn_);
+    write_header(os, "http_connection_requests", "summary",
+                 "Requests served per closed connection");
+    for (double q : quantiles)
+    {
+        os << "http_connection_requests{quantile=\"" << q << "\"} "
+           << per_conn.percentile(q) << '\n';
+    }
+    os << "http_connection_requests_sum " << per_conn.sum_ << '\n'
+       << "http_connection_requests_count " << per_conn.count_ << '\n';
+    return os.str();
+}
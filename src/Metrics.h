@@ -0,0 +1,73 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>   // for atomic
+#include <cstdint>  // for uint64_t, int64_t
+#include <string>   // for string
+
+/**
+ * @summary Log-linear ("HDR") histogram. Every power of two is split into
+ * 2^SUB_BITS linear sub-buckets, giving ~12% relative precision over the full
+ * uint64_t range in a fixed 496-slot array, so recording is a couple of bit
+ * operations and one relaxed atomic add.
+ */
+class Histogram
+{
+public:
+    static const int SUB_BITS = 3;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    static int bucket_index(uint64_t value);
+    static uint64_t bucket_upper_bound(int index);
+
+    void record(uint64_t value);
+
+    std::atomic<uint64_t> buckets_[NUM_BUCKETS];
+    std::atomic<uint64_t> sum_;
+};
+
+/**
+ * @summary Process-wide server statistics.
+ * Every thread writes to its own cache-line aligned shard using relaxed
+ * atomics, so the hot path never contends; shards are only summed when
+ * render() is called by a scrape.
+ */
+class Metrics
+{
+public:
+    enum Counter
+    {
+        CONNECTIONS_ACCEPTED,
+        CONNECTIONS_ACTIVE,
+        REQUESTS,
+        HEADER_BYTES_SENT,
+        BODY_BYTES_SENT,
+        RESPONSES_1XX,
+        RESPONSES_2XX,
+        RESPONSES_3XX,
+        RESPONSES_4XX,
+        RESPONSES_5XX,
+        CONNECTIONS_REJECTED,
+        REQUESTS_LIMITED,
+        PROXY_REQUESTS,
+        PROXY_CONNECTIONS,   // new upstream connections opened
+        CACHE_HITS,
+        CACHE_STALE,         // stale entries served while revalidating
+        CACHE_MISSES,
+        CACHE_WAITS,         // misses that waited for another's fetch
+        HELPER_OPENS,        // requests the event loops had prepared by helpers
+        HELPER_READS,        // file reads they left to helpers (not cached)
+        NUM_COUNTERS
+    };
+
+    static void add(Counter counter, int64_t amount = 1);
+    static void record_status(const std::string& status);
+    static void observe_latency(uint64_t nanos);
+    static void observe_requests_per_connection(uint64_t requests);
+
+    static uint64_t now_ns();
+    static std::string render();
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "PathResolver.h"
+#include "Metrics.h"         // for Metrics
+#include "logging.h"         // for LOG_END, LOG_ERROR
+
+#include <fcntl.h>           // for openat, O_RDONLY, O_DIRECTORY, O_CLOEXEC
+#include <unistd.h>          // for close, syscall
+
+#if defined(__linux__)
+#include <sys/syscall.h>     // for SYS_openat2
+#if defined(SYS_openat2)
+#include <linux/openat2.h>   // for open_how, RESOLVE_BENEATH
+#endif
+#endif
+
+#include <cerrno>            // for errno, ENOSYS, EXDEV
+#include <cstdlib>           // for exit
+#include <cstring>           // for strerror
+#include <functional>        // for hash
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+namespace
+{
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+}
+
+PathResolver::DirFd::~DirFd()
+{
+    close(fd_);
+}
+
+/**
+ * @param root the serving directory; exits if it can't be opened
+ */
+PathResolver::PathResolver(const std::string& root) :
+    rootfd_(-1), have_openat2_(false)
+{
+    rootfd_ = ::open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd_ == -1)
+    {
+        LOG_ERROR << "open(): " << std::strerror(errno) << ": " << root << LOG_END;
+        std::exit(1);
+    }
+#if defined(SYS_openat2)
+    // Probe once; kernels before 5.6 don't have openat2
+    have_openat2_ = true;
+    int fd = open_beneath(rootfd_, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOSYS)
+        have_openat2_ = false;
+    if (fd != -1)
+        close(fd);
+#endif
+}
+
+PathResolver::~PathResolver()
+{
+    close(rootfd_);
+}
+
+/**
+ * @summary Decodes and normalizes a request path into `out`, which must hold
+ * MAX_PATH bytes. The query string is dropped, %XX escapes are decoded,
+ * empty and "." segments are removed and ".." removes the segment before it.
+ * A trailing '/' is kept. Nothing is allocated.
+ *
+ * @return false if the path is malformed, too long, contains a NUL, or climbs
+ *         above the root
+ */
+bool PathResolver::normalize(const std::string& uri, char* out, size_t& length)
+{
+    if (uri.empty() || uri[0] != '/')
+        return false;
+    size_t n = 0;
+    out[n++] = '/';
+    // Start of the segment currently being written to `out`
+    size_t segment = 1;
+    for (size_t i = 1; i <= uri.size(); i++)
+    {
+        char c = i < uri.size() ? uri[i] : '\0';
+        if (c == '?' || c == '#')
+            c = '\0';
+        else if (c == '%')
+        {
+            int high = i + 2 < uri.size() ? hex_value(uri[i + 1]) : -1;
+            int low = i + 2 < uri.size() ? hex_value(uri[i + 2]) : -1;
+            if (high < 0 || low < 0 || (high == 0 && low == 0))
+                return false;
+            c = static_cast<char>(high * 16 + low);
+            i += 2;
+        }
+        if (c != '/' && c != '\0')
+        {
+            if (n + 1 >= MAX_PATH)
+                return false;
+            out[n++] = c;
+            continue;
+        }
+        // End of a segment
+        size_t segment_length = n - segment;
+        if (segment_length == 1 && out[segment] == '.')
+        {
+            n = segment;
+        }
+        else if (segment_length == 2 && out[segment] == '.' &&
+                 out[segment + 1] == '.')
+        {
+            if (segment == 1)
+                return false;
+            // Back up over the '/' ending the previous segment, then over
+            // the segment itself
+            n = segment - 1;
+            while (out[n - 1] != '/')
+                n--;
+        }
+        else if (c == '/' && segment_length > 0)
+        {
+            if (n + 1 >= MAX_PATH)
+                return false;
+            out[n++] = '/';
+        }
+        segment = n;
+        if (c == '\0')
+            break;
+    }
+    out[n] = '\0';
+    length = n;
+    return true;
+}
+
+/**
+ * @summary Opens a path returned by normalize()
+ *
+ * @return the file descriptor, or -1 with errno set
+ */
+int PathResolver::open(const char* path, size_t length, int flags)
+{
+    // Split "/dir/sub/name[/]" into "dir/sub" and "name"
+    size_t end = length;
+    if (end > 1 && path[end - 1] == '/')
+        end--;
+    size_t slash = end;
+    while (slash > 0 && path[slash - 1] != '/')
+        slash--;
+    if (slash == end)
+    {
+        // The root itself
+        return open_beneath(rootfd_, ".", flags);
+    }
+    std::string name(path + slash, end - slash);
+    if (slash <= 1)
+        return open_beneath(rootfd_, name.c_str(), flags);
+    std::shared_ptr<const DirFd> dir = directory(path + 1, slash - 2);
+    if (!dir)
+        return -1;
+    int fd = open_beneath(dir->fd_, name.c_str(), flags);
+    // A symlink pointing elsewhere under the root: fine, but only the root
+    // can tell
+    if (fd == -1 && errno == EXDEV)
+    {
+        std::string full(path + 1, end - 1);
+        fd = open_beneath(rootfd_, full.c_str(), flags);
+    }
+    return fd;
+}
+
+/**
+ * @summary Returns a dirfd for `path` (relative to the root), opening it if
+ * it isn't cached or its cache entry is too old to trust; entries expire so
+ * that renamed and replaced directories are noticed
+ */
+std::shared_ptr<const PathResolver::DirFd>
+PathResolver::directory(const char* path, size_t length)
+{
+    std::string key(path, length);
+    Shard& shard = shards_[std::hash<std::string>()(key) % NUM_SHARDS];
+    uint64_t now = Metrics::now_ns();
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        auto it = shard.dirs_.find(key);
+        if (it != shard.dirs_.end() && now - it->second.opened_ns < DIR_TTL_NS)
+            return it->second.dir;
+    }
+    int fd = open_beneath(rootfd_, key.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+    std::shared_ptr<const DirFd> dir = std::make_shared<const DirFd>(fd);
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    if (shard.dirs_.size() >= MAX_SHARD_ENTRIES)
+        shard.dirs_.clear();
+    shard.dirs_[key] = CachedDir{dir, now};
+    return dir;
+}
+
+/**
+ * @summary openat(), confined to `dirfd` with RESOLVE_BENEATH when openat2 is
+ * available. Without it, normalize() has already removed every "..", but
+ * symlinks are followed wherever they lead.
+ */
+int PathResolver::open_beneath(int dirfd, const char* path, int flags)
+{
+#if defined(SYS_openat2)
+    if (have_openat2_)
+    {
+        struct open_how how = {};
+        how.flags = flags | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        return syscall(SYS_openat2, dirfd, path, &how, sizeof(how));
+    }
+#endif
+    return openat(dirfd, path, flags | O_CLOEXEC);
+}
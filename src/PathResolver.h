@@ -0,0 +1,63 @@
+#ifndef PATHRESOLVER_H
+#define PATHRESOLVER_H
+
+#include <cstddef>        // for size_t
+#include <cstdint>        // for uint64_t
+#include <memory>         // for shared_ptr
+#include <mutex>          // for mutex
+#include <string>         // for string
+#include <unordered_map>  // for unordered_map
+
+/**
+ * @summary Turns request paths into open files under the serving directory.
+ * normalize() percent-decodes the path and removes "." and ".." segments
+ * (rejecting any that would climb above the root) into a caller-supplied
+ * buffer. open() then opens the result relative to a dirfd for its parent
+ * directory, taken from a small cache, so the kernel only walks the last
+ * component. Where openat2 is available every open uses RESOLVE_BENEATH, so
+ * symlinks can't lead outside the serving directory either.
+ */
+class PathResolver
+{
+public:
+    static const size_t MAX_PATH = 4096;
+
+    explicit PathResolver(const std::string& root);
+    PathResolver(const PathResolver&) = delete; // prevent copy
+    PathResolver& operator=(const PathResolver&) = delete; // prevent assignment
+    ~PathResolver();
+
+    static bool normalize(const std::string& uri, char* out, size_t& length);
+    int open(const char* path, size_t length, int flags);
+
+private:
+    static const int NUM_SHARDS = 16;
+    static const size_t MAX_SHARD_ENTRIES = 256;
+    static const uint64_t DIR_TTL_NS = 1000000000; // reopen directories after 1s
+
+    struct DirFd
+    {
+        explicit DirFd(int fd) : fd_(fd) {}
+        ~DirFd();
+        int fd_;
+    };
+    struct CachedDir
+    {
+        std::shared_ptr<const DirFd> dir;
+        uint64_t opened_ns;
+    };
+    struct Shard
+    {
+        std::mutex mutex_;
+        std::unordered_map<std::string, CachedDir> dirs_;
+    };
+
+    std::shared_ptr<const DirFd> directory(const char* path, size_t length);
+    int open_beneath(int dirfd, const char* path, int flags);
+
+    int   rootfd_;
+    bool  have_openat2_;
+    Shard shards_[NUM_SHARDS];
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "Poller.h"
+#include "logging.h"  // for LOG_END, LOG_ERROR
+
+#include <unistd.h>   // for close
+
+#include <cerrno>     // for errno
+#include <cstdlib>    // for exit
+#include <cstring>    // for strerror
+
+Poller::Poller(Backend backend) :
+    backend_(backend), epollfd_(-1), pollfds_(256, {-1, 0, 0})
+{
+#ifdef __linux__
+    if (backend_ == EPOLL)
+    {
+        epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd_ == -1)
+        {
+            LOG_ERROR << "epoll_create1(): " << std::strerror(errno) << LOG_END;
+            std::exit(1);
+        }
+        epoll_events_.resize(256);
+    }
+#else
+    backend_ = POLL;
+#endif
+}
+
+Poller::~Poller()
+{
+    if (epollfd_ != -1)
+        close(epollfd_);
+}
+
+#ifdef __linux__
+static unsigned to_epoll(short events)
+{
+    unsigned result = 0;
+    if (events & POLLIN)
+        result |= EPOLLIN;
+    if (events & POLLOUT)
+        result |= EPOLLOUT;
+    return result;
+}
+
+static short from_epoll(unsigned events)
+{
+    short result = 0;
+    if (events & EPOLLIN)
+        result |= POLLIN;
+    if (events & EPOLLOUT)
+        result |= POLLOUT;
+    if (events & EPOLLERR)
+        result |= POLLERR;
+    if (events & EPOLLHUP)
+        result |= POLLHUP;
+    return result;
+}
+#endif
+
+/**
+ * @summary Starts watching `fd` for `events`
+ *
+ * @param exclusive wake only one of several pollers sharing `fd`
+ *                  (EPOLLEXCLUSIVE), used for a listening socket shared by
+ *                  several event loops
+ */
+void Poller::add(int fd, short events, bool exclusive)
+{
+#ifdef __linux__
+    if (backend_ == EPOLL)
+    {
+        struct epoll_event ev;
+        ev.events = to_epoll(events) | (exclusive ? (unsigned)EPOLLEXCLUSIVE : 0u);
+        ev.data.fd = fd;
+        if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            LOG_ERROR << "epoll_ctl(): " << std::strerror(errno) << LOG_END;
+        }
+        return;
+    }
+#endif
+    (void)exclusive;
+    // resize if we have to
+    if (pollfds_.size() <= (unsigned)fd)
+    {
+        pollfds_.resize(fd + 64, {-1, 0, 0});
+    }
+    pollfds_[fd] = {fd, events, 0};
+}
+
+void Poller::modify(int fd, short events)
+{
+#ifdef __linux__
+    if (backend_ == EPOLL)
+    {
+        struct epoll_event ev;
+        ev.events = to_epoll(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(epollfd_, EPOLL_CTL_MOD, fd, &ev) == -1)
+        {
+            LOG_ERROR << "epoll_ctl(): " << std::strerror(errno) << LOG_END;
+        }
+        return;
+    }
+#endif
+    pollfds_[fd].events = events;
+}
+
+/**
+ * @summary Stops watching `fd`; must be called before `fd` is closed
+ */
+void Poller::remove(int fd)
+{
+#ifdef __linux__
+    if (backend_ == EPOLL)
+    {
+        epoll_ctl(epollfd_, EPOLL_CTL_DEL, fd, nullptr);
+        return;
+    }
+#endif
+    pollfds_[fd].fd = -1;
+}
+
+/**
+ * @summary Waits until at least one fd is ready, or `timeout_ms` passes
+ * (-1 waits forever). The ready fds are then available from ready().
+ *
+ * @return the number of ready fds, or -1 with errno set
+ */
+int Poller::wait(int timeout_ms)
+{
+    ready_.clear();
+#ifdef __linux__
+    if (backend_ == EPOLL)
+    {
+        int ret = epoll_wait(epollfd_, &epoll_events_[0],
+                             epoll_events_.size(), timeout_ms);
+        for (int i = 0; i < ret; i++)
+        {
+            ready_.push_back({epoll_events_[i].data.fd,
+                              from_epoll(epoll_events_[i].events)});
+        }
+        return ret;
+    }
+#endif
+    int ret = poll(&pollfds_[0], pollfds_.size(), timeout_ms);
+    if (ret > 0)
+    {
+        for (const struct pollfd& poll_fd : pollfds_)
+        {
+            if (poll_fd.fd > -1 && poll_fd.revents)
+            {
+                ready_.push_back({poll_fd.fd, poll_fd.revents});
+            }
+        }
+    }
+    return ret;
+}
+
+const std::vector<Poller::Event>& Poller::ready() const
+{
+    return ready_;
+}
@@ -0,0 +1,56 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <poll.h>       // for pollfd, POLLIN, POLLOUT
+
+#include <vector>       // for vector
+
+#ifdef __linux__
+#include <sys/epoll.h>  // for epoll_event
+#endif
+
+/**
+ * @summary Readiness notification for the async engines, backed by either
+ * poll() or epoll. Interest is expressed with the poll() event bits (POLLIN,
+ * POLLOUT), which are also what ready() reports, so callers don't care which
+ * backend is in use. Without epoll (i.e. not on Linux) EPOLL falls back to
+ * poll().
+ */
+class Poller
+{
+public:
+    enum Backend
+    {
+        POLL,
+        EPOLL
+    };
+
+    struct Event
+    {
+        int   fd;
+        short events;
+    };
+
+    explicit Poller(Backend backend);
+    Poller(const Poller&) = delete; // prevent copy
+    Poller& operator=(const Poller&) = delete; // prevent assignment
+    ~Poller();
+
+    void add(int fd, short events, bool exclusive = false);
+    void modify(int fd, short events);
+    void remove(int fd);
+
+    int wait(int timeout_ms);
+    const std::vector<Event>& ready() const;
+
+private:
+    Backend                          backend_;
+    int                              epollfd_;
+    std::vector<struct pollfd>       pollfds_; // indexed by fd (POLL only)
+    std::vector<Event>               ready_;
+#ifdef __linux__
+    std::vector<struct epoll_event>  epoll_events_;
+#endif
+};
+
+#endif
@@ -0,0 +1,1183 @@
+#include "Proxy.h"
+#include "HTTPRequest.h"   // for HTTPRequest
+#include "HTTPResponse.h"  // for HTTPResponse
+#include "Metrics.h"       // for Metrics
+#include "PathResolver.h"  // for PathResolver
+#include "TLS.h"           // for TLSConnection
+#include "logging.h"       // for LOG_END, LOG_ERROR, LOG_INFO
+
+#include <arpa/inet.h>     // for inet_ntop
+#include <fcntl.h>         // for pipe2, splice, O_NONBLOCK, O_CLOEXEC
+#include <netdb.h>         // for addrinfo, freeaddrinfo, getaddrinfo
+#include <netinet/in.h>    // for sockaddr_in, sockaddr_in6, IPPROTO_TCP
+#include <netinet/tcp.h>   // for TCP_NODELAY
+#include <strings.h>       // for strcasecmp
+#include <unistd.h>        // for close, pipe
+
+#include <algorithm>       // for min, sort
+#include <cctype>          // for isalnum
+#include <cerrno>          // for errno, EAGAIN, EINPROGRESS, EINTR
+#include <cstdlib>         // for exit, strtoull
+#include <cstring>         // for memcpy, strchr, strerror
+
+// Apple doesn't have MSG_NOSIGNAL for some reason...
+#ifdef __APPLE__
+#define MSG_NOSIGNAL SO_NOSIGPIPE
+#endif
+
+/**
+ * @summary Headers that only apply to one connection, so aren't forwarded.
+ * Transfer-Encoding is one too, but chunked responses are relayed as they
+ * are, so it is kept on responses.
+ */
+static bool is_hop_by_hop(const std::string& name, bool response)
+{
+    static const char* const names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+        "Upgrade",
+    };
+    for (const char* hop : names)
+    {
+        if (strcasecmp(name.c_str(), hop) == 0)
+            return true;
+    }
+    return !response && strcasecmp(name.c_str(), "Transfer-Encoding") == 0;
+}
+
+/**
+ * @return `text` without leading and trailing spaces and tabs
+ */
+static std::string trim(const std::string& text)
+{
+    size_t start = text.find_first_not_of(" \t");
+    if (start == std::string::npos)
+        return std::string();
+    return text.substr(start, text.find_last_not_of(" \t") - start + 1);
+}
+
+/**
+ * @return whether `text` is a valid Content-Length, stored in `length`
+ */
+static bool parse_length(const std::string& text, off_t& length)
+{
+    if (text.empty() || text.size() > 18 ||
+        text.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return false;
+    }
+    length = std::strtoull(text.c_str(), nullptr, 10);
+    return true;
+}
+
+/**
+ * @param routes "PREFIX=HOST:PORT[,HOST:PORT...]" each, already checked by
+ *        ServerConfig
+ * @param max_idle the most idle connections kept per upstream
+ */
+Proxy::Proxy(const std::vector<std::string>& routes, size_t max_idle) :
+    max_idle_(max_idle), next_(0)
+{
+    for (const std::string& text : routes)
+    {
+        size_t equals = text.find('=');
+        Route route;
+        route.prefix = text.substr(0, equals);
+        // "/api/" and "/api" both mean the /api subtree
+        while (route.prefix.size() > 1 && route.prefix.back() == '/')
+            route.prefix.pop_back();
+        size_t start = equals + 1;
+        while (start <= text.size())
+        {
+            size_t comma = std::min(text.find(',', start), text.size());
+            route.upstreams.push_back(&upstream(text.substr(start, comma - start)));
+            start = comma + 1;
+        }
+        routes_.push_back(std::move(route));
+    }
+    std::sort(routes_.begin(), routes_.end(),
+              [](const Route& a, const Route& b)
+              {
+                  return a.prefix.size() > b.prefix.size();
+              });
+}
+
+Proxy::~Proxy()
+{
+    for (auto& upstream : upstreams_)
+    {
+        for (const auto& entry : upstream->idle)
+            close(entry.first);
+    }
+}
+
+/**
+ * @return the Upstream for HOST:PORT (or [HOST]:PORT for IPv6), resolved
+ *         and added if it is new; exits if it can't be resolved
+ */
+Proxy::Upstream& Proxy::upstream(const std::string& address)
+{
+    for (auto& upstream : upstreams_)
+    {
+        if (upstream->name == address)
+            return *upstream;
+    }
+    size_t colon = address.rfind(':');
+    std::string host = address.substr(0, colon);
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = nullptr;
+    int ret = getaddrinfo(host.c_str(), address.c_str() + colon + 1, &hints,
+                          &res);
+    if (ret != 0)
+    {
+        LOG_ERROR << "Couldn't resolve upstream " << address << ": "
+                  << gai_strerror(ret) << LOG_END;
+        std::exit(1);
+    }
+    std::unique_ptr<Upstream> upstream(new Upstream());
+    upstream->name = address;
+    std::memcpy(&upstream->addr, res->ai_addr, res->ai_addrlen);
+    upstream->length = res->ai_addrlen;
+    upstream->outstanding = 0;
+    freeaddrinfo(res);
+    upstreams_.push_back(std::move(upstream));
+    return *upstreams_.back();
+}
+
+/**
+ * @return the route for a request path, or null if it isn't proxied (or
+ *         isn't a valid path, which the server then refuses)
+ */
+const Proxy::Route* Proxy::match(const std::string& path) const
+{
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(path, normalized, length))
+        return nullptr;
+    for (const Route& route : routes_)
+    {
+        const std::string& prefix = route.prefix;
+        if (length >= prefix.size() &&
+            std::memcmp(normalized, prefix.data(), prefix.size()) == 0 &&
+            (prefix.back() == '/' || length == prefix.size() ||
+             normalized[prefix.size()] == '/'))
+        {
+            return &route;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @return the request target to forward for a request path: the normalized
+ *         path that match() saw, so the upstream can't resolve it to some
+ *         other route's files, with the bytes a path can't hold
+ *         percent-encoded again, then the query string; empty if the path
+ *         isn't valid
+ */
+std::string Proxy::target(const std::string& path)
+{
+    char normalized[PathResolver::MAX_PATH];
+    size_t length = 0;
+    if (!PathResolver::normalize(path, normalized, length))
+        return std::string();
+    static const char hex[] = "0123456789ABCDEF";
+    std::string target;
+    target.reserve(path.size());
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = normalized[i];
+        if (std::isalnum(c) ||
+            (c != '\0' && std::strchr("/-._~!$&'()*+,;=:@", c) != nullptr))
+        {
+            target += static_cast<char>(c);
+        }
+        else
+        {
+            target += '%';
+            target += hex[c >> 4];
+            target += hex[c & 15];
+        }
+    }
+    size_t query = path.find('?');
+    if (query != std::string::npos)
+        target.append(path, query, path.find('#', query) - query);
+    return target;
+}
+
+/**
+ * @summary Picks the route's upstream with the fewest requests in flight,
+ * rotating between those that are tied, and counts one more for it; the
+ * ProxyExchange counts it back down
+ */
+Proxy::Upstream& Proxy::choose(const Route& route)
+{
+    const size_t count = route.upstreams.size();
+    const size_t first = next_++ % count;
+    Upstream* best = route.upstreams[first];
+    for (size_t i = 1; i < count; i++)
+    {
+        Upstream* candidate = route.upstreams[(first + i) % count];
+        if (candidate->outstanding < best->outstanding)
+            best = candidate;
+    }
+    best->outstanding++;
+    return *best;
+}
+
+/**
+ * @summary Takes the most recently used idle connection to `upstream`,
+ * closing any that have been idle too long or that the upstream has closed
+ * (or sent something unasked on) in the meantime
+ *
+ * @return the connection, or -1 if there isn't one to reuse
+ */
+int Proxy::take_idle(Upstream& upstream)
+{
+    const uint64_t oldest = Metrics::now_ns() - IDLE_SECONDS * 1000000000ull;
+    std::lock_guard<std::mutex> lock(upstream.mutex);
+    while (!upstream.idle.empty())
+    {
+        auto entry = upstream.idle.back();
+        upstream.idle.pop_back();
+        char byte;
+        if (entry.second >= oldest &&
+            recv(entry.first, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return entry.first;
+        }
+        close(entry.first);
+    }
+    return -1;
+}
+
+/**
+ * @summary Keeps a connection whose response has been read in full for
+ * reuse, or closes it if the pool is full
+ */
+void Proxy::put_idle(Upstream& upstream, int fd)
+{
+    {
+        std::lock_guard<std::mutex> lock(upstream.mutex);
+        if (upstream.idle.size() < max_idle_)
+        {
+            upstream.idle.emplace_back(fd, Metrics::now_ns());
+            return;
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @summary Starts a non-blocking connection to `upstream`
+ *
+ * @return the socket, which becomes writable once connected, or -1
+ */
+int Proxy::connect_to(const Upstream& upstream)
+{
+    int fd = socket(upstream.addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    // Requests are written whole, so there is nothing to wait for
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(fd, reinterpret_cast<const struct sockaddr*>(&upstream.addr),
+                upstream.length) < 0 && errno != EINPROGRESS)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    Metrics::add(Metrics::PROXY_CONNECTIONS);
+    return fd;
+}
+
+/**
+ * @param client the client's socket, which must be non-blocking
+ * @param tls the client's TLS state, or nullptr for plaintext
+ * @param remainder what was read after the request head; body bytes are
+ *        taken from it, and whatever follows them (a pipelined request) is
+ *        left
+ * @param keep_alive whether the client's connection would stay open after
+ *        the response (see HTTPServer::set_conn_type)
+ * @param cached the request's cache lookup, or nullptr without a cache
+ */
+ProxyExchange::ProxyExchange(Proxy& proxy, const Proxy::Route& route,
+                             int client, TLSConnection* tls,
+                             const HTTPRequest& request,
+                             std::string& remainder, bool keep_alive,
+                             ResponseCache::Lookup* cached) :
+    proxy_(proxy),
+    upstream_(proxy.choose(route)),
+    client_(client),
+    tls_(tls),
+    remainder_(remainder),
+    keep_alive_(keep_alive),
+    head_request_(request.verb() == "HEAD"),
+    state_(CONNECT),
+    upstream_fd_(-1),
+    reused_(false),
+    retried_(false),
+    request_pos_(0),
+    body_left_(0),
+    body_taken_(false),
+    buffer_pos_(0),
+    head_size_(0),
+    framing_(NO_BODY),
+    response_left_(0),
+    upstream_keep_alive_(false),
+    chunk_state_(CHUNK_SIZE),
+    chunk_left_(0),
+    pipe_{-1, -1},
+    piped_(0),
+    wait_fd_(-1),
+    wait_events_(0),
+    cached_(cached)
+{
+    Metrics::add(Metrics::PROXY_REQUESTS);
+    // HTTP/1.0 clients can't take a chunked response, so the upstream is
+    // asked in HTTP/1.0 too
+    const bool http10 = request.version() == "HTTP/1.0";
+    request_ = request.verb() + " " + Proxy::target(request.path())
+               + (http10 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n");
+    const std::string* forwarded_for = nullptr;
+    bool has_host = false;
+    for (const auto& header : request.headers())
+    {
+        const std::string& name = header.first;
+        if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+        {
+            // Chunked request bodies would have to be re-framed
+            LOG_ERROR << "Proxy: chunked request body refused" << LOG_END;
+            keep_alive_ = false;
+            fail("411");
+            return;
+        }
+        if (strcasecmp(name.c_str(), "Content-Length") == 0 &&
+            !parse_length(header.second, body_left_))
+        {
+            LOG_ERROR << "Proxy: bad Content-Length: " << header.second
+                      << LOG_END;
+            keep_alive_ = false;
+            fail("400");
+            return;
+        }
+        // 100 Continue comes from this server, not the upstream
+        if (strcasecmp(name.c_str(), "Expect") == 0 ||
+            is_hop_by_hop(name, false))
+        {
+            continue;
+        }
+        if (strcasecmp(name.c_str(), "X-Forwarded-For") == 0)
+        {
+            forwarded_for = &header.second;
+            continue;
+        }
+        if (strcasecmp(name.c_str(), "X-Forwarded-Proto") == 0)
+            continue;
+        has_host |= strcasecmp(name.c_str(), "Host") == 0;
+        request_ += name + ": " + header.second + "\r\n";
+    }
+    if (!has_host)
+        request_ += "Host: " + upstream_.name + "\r\n";
+    // Who the client is, appended to whatever proxies in front of us said
+    struct sockaddr_storage peer;
+    socklen_t length = sizeof(peer);
+    char address[INET6_ADDRSTRLEN] = "";
+    if (getpeername(client, reinterpret_cast<struct sockaddr*>(&peer),
+                    &length) == 0)
+    {
+        if (peer.ss_family == AF_INET)
+        {
+            inet_ntop(AF_INET, &reinterpret_cast<struct sockaddr_in&>(peer).sin_addr,
+                      address, sizeof(address));
+        }
+        else if (peer.ss_family == AF_INET6)
+        {
+            inet_ntop(AF_INET6, &reinterpret_cast<struct sockaddr_in6&>(peer).sin6_addr,
+                      address, sizeof(address));
+        }
+    }
+    if (forwarded_for || address[0])
+    {
+        request_ += "X-Forwarded-For: ";
+        if (forwarded_for)
+            request_ += *forwarded_for + (address[0] ? ", " : "");
+        request_ += std::string(address) + "\r\n";
+    }
+    request_ += tls ? "X-Forwarded-Proto: https\r\n"
+                    : "X-Forwarded-Proto: http\r\n";
+    request_ += http10 ? "Connection: keep-alive\r\n\r\n" : "\r\n";
+    // Body bytes read along with the head go with it
+    size_t buffered = std::min<off_t>(remainder_.size(), body_left_);
+    request_.append(remainder_, 0, buffered);
+    remainder_.erase(0, buffered);
+    body_left_ -= buffered;
+    if (!start_upstream(false))
+        fail("502");
+}
+
+ProxyExchange::~ProxyExchange()
+{
+    if (upstream_fd_ >= 0)
+        close(upstream_fd_);
+    if (pipe_[0] >= 0)
+    {
+        close(pipe_[0]);
+        close(pipe_[1]);
+    }
+    upstream_.outstanding--;
+}
+
+/**
+ * @summary Takes a pooled connection to the upstream (unless `fresh`), or
+ * starts a new one
+ *
+ * @return false if no connection could be started
+ */
+bool ProxyExchange::start_upstream(bool fresh)
+{
+    request_pos_ = 0;
+    reused_ = false;
+    upstream_fd_ = fresh ? -1 : proxy_.take_idle(upstream_);
+    if (upstream_fd_ >= 0)
+    {
+        reused_ = true;
+        state_ = SEND_REQUEST;
+        return true;
+    }
+    state_ = CONNECT;
+    upstream_fd_ = Proxy::connect_to(upstream_);
+    if (upstream_fd_ < 0)
+    {
+        LOG_ERROR << "Proxy: connect() to " << upstream_.name << ": "
+                  << std::strerror(errno) << LOG_END;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @summary Creates the pipe bodies are spliced through, the first time
+ *
+ * @return false if bodies have to be copied instead
+ */
+bool ProxyExchange::open_pipe()
+{
+#ifdef __linux__
+    return pipe_[0] >= 0 || pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) == 0;
+#else
+    return false;
+#endif
+}
+
+ProxyExchange::Result ProxyExchange::wait(int fd, short events)
+{
+    wait_fd_ = fd;
+    wait_events_ = events;
+    return WAIT;
+}
+
+/**
+ * @summary Moves the exchange on as far as it can go without blocking.
+ * Each state's function either waits (returning WAIT with wait_fd_ set),
+ * finishes, or moves to another state and returns WAIT without waiting,
+ * which goes round again.
+ */
+ProxyExchange::Result ProxyExchange::step()
+{
+    while (true)
+    {
+        wait_fd_ = -1;
+        Result result;
+        switch (state_)
+        {
+            case CONNECT:
+                result = connect_upstream();
+                break;
+            case SEND_REQUEST:
+                result = send_request();
+                break;
+            case SEND_BODY:
+                result = send_body();
+                break;
+            case READ_HEAD:
+                result = read_head();
+                break;
+            case SEND_HEAD:
+                result = send_head();
+                break;
+            case RELAY_BODY:
+                result = relay_body();
+                break;
+            case SEND_ERROR:
+                result = send_error();
+                break;
+            default:
+                return keep_alive_ ? DONE : CLOSE;
+        }
+        if (result != WAIT || wait_fd_ >= 0)
+            return result;
+    }
+}
+
+/**
+ * @summary Called when the wait step() asked for took too long. The client
+ * gets a 504 if the upstream was slow to take the request or answer it; a
+ * slow client, or an upstream that stalls partway through its response,
+ * just has the connection closed.
+ */
+ProxyExchange::Result ProxyExchange::timed_out()
+{
+    if (wait_fd_ == upstream_fd_ && state_ < SEND_HEAD)
+    {
+        LOG_ERROR << "Proxy: " << upstream_.name << " timed out" << LOG_END;
+        fail("504");
+        return step();
+    }
+    LOG_ERROR << "Proxy: timed out relaying response from "
+              << upstream_.name << LOG_END;
+    return CLOSE;
+}
+
+/**
+ * @summary Handles a failure on the upstream connection before any of the
+ * response has arrived. A pooled connection may have been closed by the
+ * upstream just as it was taken, so the request is retried once on a new
+ * one, as long as it can be sent again in full.
+ */
+ProxyExchange::Result ProxyExchange::upstream_error(const char* what)
+{
+    int error = errno;
+    close(upstream_fd_);
+    upstream_fd_ = -1;
+    if (reused_ && !retried_ && !body_taken_ && buffer_.empty())
+    {
+        retried_ = true;
+        if (start_upstream(true))
+            return WAIT;
+    }
+    else
+    {
+        LOG_ERROR << "Proxy: " << what << " " << upstream_.name << ": "
+                  << (error ? std::strerror(error) : "connection closed")
+                  << LOG_END;
+    }
+    return fail("502");
+}
+
+ProxyExchange::Result ProxyExchange::connect_upstream()
+{
+    struct pollfd pfd = {upstream_fd_, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) == 0)
+        return wait(upstream_fd_, POLLOUT);
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(upstream_fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error)
+    {
+        LOG_ERROR << "Proxy: connect() to " << upstream_.name << ": "
+                  << std::strerror(error) << LOG_END;
+        return fail("502");
+    }
+    state_ = SEND_REQUEST;
+    return WAIT;
+}
+
+ProxyExchange::Result ProxyExchange::send_request()
+{
+    while (request_pos_ < request_.size())
+    {
+        ssize_t sent = send(upstream_fd_, &request_[request_pos_],
+                            request_.size() - request_pos_, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return wait(upstream_fd_, POLLOUT);
+        if (sent < 0)
+            return upstream_error("send() to");
+        request_pos_ += sent;
+    }
+    state_ = body_left_ > 0 ? SEND_BODY : READ_HEAD;
+    return WAIT;
+}
+
+/**
+ * @summary Moves the rest of the request body from the client to the
+ * upstream: spliced through the pipe for plaintext clients, otherwise
+ * decrypted into buffer_ and sent from there
+ */
+ProxyExchange::Result ProxyExchange::send_body()
+{
+#ifdef __linux__
+    if (!tls_ && open_pipe())
+    {
+        while (true)
+        {
+            if (piped_ > 0)
+            {
+                ssize_t moved = splice(pipe_[0], nullptr, upstream_fd_, nullptr,
+                                       piped_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (moved < 0 && errno == EINTR)
+                    continue;
+                if (moved < 0 && errno == EAGAIN)
+                    return wait(upstream_fd_, POLLOUT);
+                if (moved < 0)
+                    return upstream_error("splice() to");
+                piped_ -= moved;
+                continue;
+            }
+            if (body_left_ == 0)
+                break;
+            ssize_t moved = splice(client_, nullptr, pipe_[1], nullptr,
+                                   std::min<off_t>(body_left_, BUFFER_SIZE),
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && errno == EINTR)
+                continue;
+            if (moved < 0 && errno == EAGAIN)
+                return wait(client_, POLLIN);
+            if (moved <= 0)
+            {
+                LOG_ERROR << "Proxy: client closed during request body"
+                          << LOG_END;
+                return CLOSE;
+            }
+            body_taken_ = true;
+            body_left_ -= moved;
+            piped_ += moved;
+        }
+        state_ = READ_HEAD;
+        return WAIT;
+    }
+#endif
+    while (true)
+    {
+        if (buffer_pos_ < buffer_.size())
+        {
+            ssize_t sent = send(upstream_fd_, &buffer_[buffer_pos_],
+                                buffer_.size() - buffer_pos_, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return wait(upstream_fd_, POLLOUT);
+            if (sent < 0)
+                return upstream_error("send() to");
+            buffer_pos_ += sent;
+            continue;
+        }
+        buffer_.clear();
+        buffer_pos_ = 0;
+        if (body_left_ == 0)
+            break;
+        // Only the body is read, even from TLS: the rest of a record stays
+        // with OpenSSL for the next request
+        buffer_.resize(std::min<off_t>(body_left_, BUFFER_SIZE));
+        ssize_t bytes_read = TLSConnection::recv(tls_, client_, &buffer_[0],
+                                                 buffer_.size());
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                               errno == EINTR))
+        {
+            buffer_.clear();
+            return wait(client_, POLLIN);
+        }
+        if (bytes_read <= 0)
+        {
+            LOG_ERROR << "Proxy: client closed during request body" << LOG_END;
+            return CLOSE;
+        }
+        buffer_.resize(bytes_read);
+        body_taken_ = true;
+        body_left_ -= bytes_read;
+    }
+    state_ = READ_HEAD;
+    return WAIT;
+}
+
+ProxyExchange::Result ProxyExchange::read_head()
+{
+    while (true)
+    {
+        size_t end = buffer_.find("\r\n\r\n");
+        if (end != std::string::npos)
+        {
+            if (!parse_head(end + 4))
+                return fail("502");
+            // Interim responses (e.g. 103 Early Hints) are dropped
+            if (state_ == READ_HEAD)
+                continue;
+            return WAIT;
+        }
+        if (buffer_.size() >= MAX_HEAD)
+        {
+            LOG_ERROR << "Proxy: response head from " << upstream_.name
+                      << " too large" << LOG_END;
+            return fail("502");
+        }
+        size_t pos = buffer_.size();
+        buffer_.resize(pos + 4096);
+        ssize_t bytes_read = recv(upstream_fd_, &buffer_[pos], 4096, 0);
+        buffer_.resize(pos + std::max<ssize_t>(bytes_read, 0));
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return wait(upstream_fd_, POLLIN);
+        if (bytes_read <= 0)
+        {
+            if (bytes_read == 0)
+                errno = 0;
+            return upstream_error("recv() from");
+        }
+    }
+}
+
+/**
+ * @summary Parses the upstream's response head (the first `end` bytes of
+ * buffer_), works out how its body is framed, and replaces the head with
+ * the one the client gets: the same status and headers, minus this hop's,
+ * plus our own Connection header. Interim (1xx) responses are removed and
+ * leave the state as it is.
+ *
+ * @return false if the head is malformed
+ */
+bool ProxyExchange::parse_head(size_t end)
+{
+    std::string head = buffer_.substr(0, end);
+    size_t line_end = head.find("\r\n");
+    std::string line = head.substr(0, line_end);
+    if (line.compare(0, 7, "HTTP/1.") != 0 || line.size() < 12 ||
+        line[8] != ' ' || line.find_first_not_of("0123456789", 9) < 12 ||
+        (line.size() > 12 && line[12] != ' '))
+    {
+        LOG_ERROR << "Proxy: bad response from " << upstream_.name << ": "
+                  << line << LOG_END;
+        return false;
+    }
+    const std::string status = line.substr(9, 3);
+    if (status[0] == '1')
+    {
+        if (status == "101")
+        {
+            LOG_ERROR << "Proxy: unexpected 101 from " << upstream_.name
+                      << LOG_END;
+            return false;
+        }
+        buffer_.erase(0, end);
+        return true;
+    }
+    const bool http10 = line[7] == '0';
+    const std::string phrase = line.size() > 13 ? line.substr(13) : "";
+    std::string rewritten = "HTTP/1.1" + line.substr(8) + "\r\n";
+    std::string connection;
+    std::string length;
+    bool chunked = false;
+    std::vector<std::pair<std::string, std::string>> fields;
+    size_t pos = line_end + 2;
+    while (pos < end - 2)
+    {
+        size_t next = head.find("\r\n", pos);
+        line = head.substr(pos, next - pos);
+        pos = next + 2;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            continue;
+        const std::string name = line.substr(0, colon);
+        const std::string value = trim(line.substr(colon + 1));
+        if (strcasecmp(name.c_str(), "Connection") == 0)
+            connection = value;
+        else if (strcasecmp(name.c_str(), "Content-Length") == 0)
+            length = value;
+        else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+            chunked = strcasecmp(value.c_str(), "chunked") == 0;
+        if (!is_hop_by_hop(name, true))
+            rewritten += name + ": " + value + "\r\n";
+        if (cached_ && cached_->filling())
+            fields.emplace_back(name, value);
+    }
+    // fail() sends the stale copy instead
+    if (status[0] == '5' && cached_ &&
+        cached_->stale_on_error(Metrics::now_ns()))
+    {
+        return false;
+    }
+    if (head_request_ || status == "204" || status == "304")
+    {
+        framing_ = NO_BODY;
+    }
+    else if (chunked)
+    {
+        framing_ = CHUNKED;
+    }
+    else if (!length.empty())
+    {
+        if (!parse_length(length, response_left_))
+        {
+            LOG_ERROR << "Proxy: bad Content-Length from " << upstream_.name
+                      << ": " << length << LOG_END;
+            return false;
+        }
+        framing_ = LENGTH;
+    }
+    else
+    {
+        framing_ = UNTIL_CLOSE;
+    }
+    upstream_keep_alive_ = framing_ != UNTIL_CLOSE &&
+        (http10 ? strcasecmp(connection.c_str(), "keep-alive") == 0
+                : strcasecmp(connection.c_str(), "close") != 0);
+    // Without a length, the end of the body is the end of the connection
+    keep_alive_ = keep_alive_ && framing_ != UNTIL_CLOSE;
+    rewritten += keep_alive_ ? "Connection: keep-alive\r\n\r\n"
+                             : "Connection: close\r\n\r\n";
+    head_size_ = rewritten.size();
+    if (cached_ && (framing_ == LENGTH || framing_ == NO_BODY))
+    {
+        entry_ = cached_->admit(status, phrase, fields,
+                                framing_ == LENGTH ? response_left_ : 0);
+    }
+    // Body bytes that arrived with the head follow it; anything past the
+    // end of the body means the connection can't be reused
+    size_t extra = buffer_.size() - end;
+    size_t body = extra;
+    if (framing_ == NO_BODY)
+    {
+        body = 0;
+    }
+    else if (framing_ == LENGTH)
+    {
+        body = std::min<off_t>(extra, response_left_);
+        response_left_ -= body;
+    }
+    else if (framing_ == CHUNKED)
+    {
+        body = chunk_bytes(buffer_.data() + end, extra);
+    }
+    if (body < extra)
+        upstream_keep_alive_ = false;
+    if (entry_)
+        captured_.assign(buffer_, end, body);
+    rewritten.append(buffer_, end, body);
+    buffer_ = std::move(rewritten);
+    buffer_pos_ = 0;
+    status_ = status;
+    state_ = SEND_HEAD;
+    return true;
+}
+
+ProxyExchange::Result ProxyExchange::send_head()
+{
+    while (buffer_pos_ < buffer_.size())
+    {
+        ssize_t sent = TLSConnection::send(tls_, client_, &buffer_[buffer_pos_],
+                                           buffer_.size() - buffer_pos_,
+                                           MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                         errno == EINTR))
+        {
+            return wait(client_, POLLOUT);
+        }
+        if (sent < 0)
+        {
+            LOG_ERROR << "Proxy: send(): " << std::strerror(errno) << LOG_END;
+            return CLOSE;
+        }
+        buffer_pos_ += sent;
+    }
+    Metrics::add(Metrics::HEADER_BYTES_SENT, head_size_);
+    Metrics::add(Metrics::BODY_BYTES_SENT, buffer_.size() - head_size_);
+    buffer_.clear();
+    buffer_pos_ = 0;
+    state_ = RELAY_BODY;
+    return WAIT;
+}
+
+/**
+ * @summary Relays the rest of the response body, spliced straight from one
+ * socket to the other where the client's socket can take it
+ */
+ProxyExchange::Result ProxyExchange::relay_body()
+{
+    if (framing_ == NO_BODY || (framing_ == LENGTH && response_left_ == 0) ||
+        (framing_ == CHUNKED && chunk_state_ == CHUNKS_DONE))
+    {
+        return finish(upstream_keep_alive_);
+    }
+    // A body being stored has to pass through here
+    if (framing_ != CHUNKED && !entry_ && (!tls_ || tls_->kernel_send()) &&
+        open_pipe())
+        return relay_spliced();
+    return relay_copied();
+}
+
+ProxyExchange::Result ProxyExchange::relay_spliced()
+{
+#ifdef __linux__
+    while (true)
+    {
+        if (piped_ > 0)
+        {
+            ssize_t moved = splice(pipe_[0], nullptr, client_, nullptr, piped_,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && errno == EINTR)
+                continue;
+            if (moved < 0 && errno == EAGAIN)
+                return wait(client_, POLLOUT);
+            if (moved < 0)
+            {
+                LOG_ERROR << "Proxy: splice(): " << std::strerror(errno)
+                          << LOG_END;
+                return CLOSE;
+            }
+            piped_ -= moved;
+            Metrics::add(Metrics::BODY_BYTES_SENT, moved);
+            continue;
+        }
+        if (framing_ == LENGTH && response_left_ == 0)
+            return finish(upstream_keep_alive_);
+        size_t want = framing_ == LENGTH
+                      ? std::min<off_t>(response_left_, BUFFER_SIZE)
+                      : BUFFER_SIZE;
+        ssize_t moved = splice(upstream_fd_, nullptr, pipe_[1], nullptr, want,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved < 0 && errno == EAGAIN)
+            return wait(upstream_fd_, POLLIN);
+        if (moved == 0 && framing_ == UNTIL_CLOSE)
+            return finish(false);
+        if (moved <= 0)
+        {
+            LOG_ERROR << "Proxy: " << upstream_.name
+                      << " closed during response body" << LOG_END;
+            return CLOSE;
+        }
+        piped_ += moved;
+        if (framing_ == LENGTH)
+            response_left_ -= moved;
+    }
+#else
+    return relay_copied();
+#endif
+}
+
+ProxyExchange::Result ProxyExchange::relay_copied()
+{
+    while (true)
+    {
+        if (buffer_pos_ < buffer_.size())
+        {
+            ssize_t sent = TLSConnection::send(tls_, client_,
+                                               &buffer_[buffer_pos_],
+                                               buffer_.size() - buffer_pos_,
+                                               MSG_NOSIGNAL);
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                             errno == EINTR))
+            {
+                return wait(client_, POLLOUT);
+            }
+            if (sent < 0)
+            {
+                LOG_ERROR << "Proxy: send(): " << std::strerror(errno)
+                          << LOG_END;
+                return CLOSE;
+            }
+            buffer_pos_ += sent;
+            Metrics::add(Metrics::BODY_BYTES_SENT, sent);
+            continue;
+        }
+        buffer_.clear();
+        buffer_pos_ = 0;
+        if ((framing_ == LENGTH && response_left_ == 0) ||
+            (framing_ == CHUNKED && chunk_state_ == CHUNKS_DONE))
+        {
+            return finish(upstream_keep_alive_);
+        }
+        // A TLS record's worth, so SSL_write sends it whole
+        size_t want = tls_ ? TLSConnection::RECORD_SIZE : BUFFER_SIZE;
+        if (framing_ == LENGTH)
+            want = std::min<off_t>(want, response_left_);
+        buffer_.resize(want);
+        ssize_t bytes_read = recv(upstream_fd_, &buffer_[0], want, 0);
+        buffer_.resize(std::max<ssize_t>(bytes_read, 0));
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return wait(upstream_fd_, POLLIN);
+        if (bytes_read == 0 && framing_ == UNTIL_CLOSE)
+            return finish(false);
+        if (bytes_read <= 0)
+        {
+            LOG_ERROR << "Proxy: " << upstream_.name
+                      << " closed during response body" << LOG_END;
+            return CLOSE;
+        }
+        if (framing_ == LENGTH)
+        {
+            response_left_ -= bytes_read;
+            if (entry_)
+                captured_.append(buffer_);
+        }
+        else if (framing_ == CHUNKED)
+        {
+            size_t used = chunk_bytes(buffer_.data(), bytes_read);
+            if (used < size_t(bytes_read))
+            {
+                upstream_keep_alive_ = false;
+                buffer_.resize(used);
+            }
+        }
+    }
+}
+
+/**
+ * @summary Follows a chunked body through `data`, just far enough to find
+ * where it ends; chunk_state_ is CHUNKS_DONE once it has
+ *
+ * @return how many bytes of `data` belong to the body
+ */
+size_t ProxyExchange::chunk_bytes(const char* data, size_t size)
+{
+    size_t pos = 0;
+    while (pos < size && chunk_state_ != CHUNKS_DONE)
+    {
+        char c = data[pos];
+        switch (chunk_state_)
+        {
+            case CHUNK_SIZE:
+                if (c >= '0' && c <= '9')
+                    chunk_left_ = chunk_left_ * 16 + (c - '0');
+                else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+                    chunk_left_ = chunk_left_ * 16 + ((c | 0x20) - 'a' + 10);
+                else if (c == '\n')
+                    chunk_state_ = chunk_left_ > 0 ? CHUNK_DATA : TRAILER_START;
+                else if (c != '\r')
+                    chunk_state_ = CHUNK_EXTENSION;
+                pos++;
+                break;
+            case CHUNK_EXTENSION:
+                if (c == '\n')
+                    chunk_state_ = chunk_left_ > 0 ? CHUNK_DATA : TRAILER_START;
+                pos++;
+                break;
+            case CHUNK_DATA:
+            {
+                size_t take = std::min<off_t>(chunk_left_, size - pos);
+                chunk_left_ -= take;
+                pos += take;
+                if (chunk_left_ == 0)
+                    chunk_state_ = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (c == '\n')
+                    chunk_state_ = CHUNK_SIZE;
+                pos++;
+                break;
+            case TRAILER_START:
+                if (c == '\n')
+                    chunk_state_ = CHUNKS_DONE;
+                else if (c != '\r')
+                    chunk_state_ = TRAILER;
+                pos++;
+                break;
+            case TRAILER:
+                if (c == '\n')
+                    chunk_state_ = TRAILER_START;
+                pos++;
+                break;
+            case CHUNKS_DONE:
+                break;
+        }
+    }
+    return pos;
+}
+
+/**
+ * @summary Gives up on the upstream and answers the client with an error
+ * (or a stale cached copy) instead; only possible before any of the
+ * response has been sent
+ */
+ProxyExchange::Result ProxyExchange::fail(const char* status)
+{
+    if (upstream_fd_ >= 0)
+    {
+        close(upstream_fd_);
+        upstream_fd_ = -1;
+    }
+    // The rest of the request body is still on its way
+    if (body_left_ > 0)
+        keep_alive_ = false;
+    HTTPResponse response;
+    response.set_header("Connection", keep_alive_ ? "keep-alive" : "close");
+    const uint64_t now = Metrics::now_ns();
+    if (status[0] == '5' && cached_ && cached_->stale_on_error(now))
+    {
+        LOG_INFO << "Proxy: serving a stale response instead of " << status
+                 << LOG_END;
+        const ResponseCache::Entry& entry = *cached_->entry;
+        entry.to_response(response, now);
+        buffer_ = response.to_string();
+        if (!head_request_ && entry.body)
+            buffer_ += *entry.body;
+        status_ = entry.status;
+    }
+    else
+    {
+        response.make_error(status);
+        buffer_ = response.to_string();
+        status_ = status;
+    }
+    buffer_pos_ = 0;
+    state_ = SEND_ERROR;
+    return WAIT;
+}
+
+ProxyExchange::Result ProxyExchange::send_error()
+{
+    while (buffer_pos_ < buffer_.size())
+    {
+        ssize_t sent = TLSConnection::send(tls_, client_, &buffer_[buffer_pos_],
+                                           buffer_.size() - buffer_pos_,
+                                           MSG_NOSIGNAL);
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                         errno == EINTR))
+        {
+            return wait(client_, POLLOUT);
+        }
+        if (sent < 0)
+        {
+            LOG_ERROR << "Proxy: send(): " << std::strerror(errno) << LOG_END;
+            return CLOSE;
+        }
+        buffer_pos_ += sent;
+    }
+    Metrics::add(Metrics::HEADER_BYTES_SENT, buffer_.size());
+    state_ = FINISHED;
+    return keep_alive_ ? DONE : CLOSE;
+}
+
+/**
+ * @summary Ends the exchange once the whole response has been relayed,
+ * pooling the upstream connection if it can take another request
+ */
+ProxyExchange::Result ProxyExchange::finish(bool reusable)
+{
+    if (entry_)
+    {
+        entry_->body = std::make_shared<const std::string>(std::move(captured_));
+        cached_->store(std::move(entry_));
+    }
+    if (reusable)
+        proxy_.put_idle(upstream_, upstream_fd_);
+    else
+        close(upstream_fd_);
+    upstream_fd_ = -1;
+    state_ = FINISHED;
+    return keep_alive_ ? DONE : CLOSE;
+}
@@ -0,0 +1,216 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "ResponseCache.h" // for ResponseCache
+
+#include <poll.h>         // for POLLIN, POLLOUT
+#include <sys/socket.h>   // for sockaddr_storage, socklen_t
+#include <sys/types.h>    // for off_t
+
+#include <atomic>         // for atomic
+#include <cstddef>        // for size_t
+#include <cstdint>        // for uint64_t
+#include <memory>         // for unique_ptr
+#include <mutex>          // for mutex
+#include <string>         // for string
+#include <utility>        // for pair
+#include <vector>         // for vector
+
+class HTTPRequest;
+class TLSConnection;
+
+/**
+ * @summary Reverse proxy routes: requests whose normalized path starts with
+ * a configured prefix are forwarded to one of that prefix's upstream
+ * servers, the one with the fewest requests in flight. Routes are given as
+ * "PREFIX=HOST:PORT[,HOST:PORT...]"; the longest matching prefix wins, and
+ * the path is forwarded normalized, as it was matched (see target()).
+ *
+ * Each upstream keeps a pool of idle keep-alive connections. A pooled
+ * connection is checked before reuse, and one the upstream closed while it
+ * was idle is replaced (see ProxyExchange). Upstream addresses are resolved
+ * once, at startup; an upstream that can't be resolved is fatal.
+ */
+class Proxy
+{
+public:
+    struct Upstream
+    {
+        std::string             name;         // HOST:PORT, for logging
+        struct sockaddr_storage addr;
+        socklen_t               length;
+        std::atomic<int>        outstanding;  // requests in flight
+        std::mutex              mutex;        // guards idle
+        std::vector<std::pair<int, uint64_t>> idle; // fd, idle since (ns)
+    };
+
+    struct Route
+    {
+        std::string            prefix;
+        std::vector<Upstream*> upstreams;
+    };
+
+    Proxy(const std::vector<std::string>& routes, size_t max_idle);
+    Proxy(const Proxy&) = delete; // prevent copy
+    Proxy& operator=(const Proxy&) = delete; // prevent assignment
+    ~Proxy();
+
+    const Route* match(const std::string& path) const;
+    static std::string target(const std::string& path);
+    Upstream&    choose(const Route& route);
+    int          take_idle(Upstream& upstream);
+    void         put_idle(Upstream& upstream, int fd);
+    static int   connect_to(const Upstream& upstream);
+
+private:
+    // Idle connections older than this are closed rather than reused, so
+    // they are retired before upstreams with a keep-alive timeout of a few
+    // seconds (this server's default is 10) close them
+    static const int IDLE_SECONDS = 4;
+
+    Upstream& upstream(const std::string& address);
+
+    std::vector<Route>                     routes_; // longest prefix first
+    std::vector<std::unique_ptr<Upstream>> upstreams_;
+    size_t                                 max_idle_;
+    std::atomic<unsigned>                  next_;   // breaks ties in choose
+};
+
+/**
+ * @summary One request forwarded through the Proxy, driven by whichever
+ * engine received it: step() does everything it can without blocking, and
+ * returns WAIT when it needs fd() to be ready for events(). The request
+ * head (and any body bytes already read) go to the upstream, the rest of a
+ * Content-Length body follows, and the response is relayed back with its
+ * headers rewritten for this hop.
+ *
+ * Bodies are moved between the sockets with splice() through a pipe, so
+ * they never pass through user space. Request bodies from TLS clients,
+ * responses to TLS clients without kernel TLS, and chunked responses are
+ * copied through a buffer instead; chunked responses are relayed as they
+ * are, just parsed enough to find their end. Chunked request bodies are
+ * refused (411).
+ *
+ * If the upstream can't be reached or fails before responding, the client
+ * gets a 502 (504 on timeout) instead. A reused connection that fails
+ * before any of the response arrives is retried once on a new one, unless
+ * part of the request body was already taken from the client.
+ *
+ * When the request is filling the ResponseCache and the response may be
+ * stored, its body is copied rather than spliced, and kept. A stale entry
+ * the lookup found is sent instead of a 502 or 504, or of a 5xx from the
+ * upstream, while its stale-if-error allows.
+ */
+class ProxyExchange
+{
+public:
+    enum Result
+    {
+        WAIT,   // wait for fd() to be ready for events(), then step() again
+        DONE,   // the response has been sent; the client may send another
+        CLOSE   // close the client's connection
+    };
+
+    ProxyExchange(Proxy& proxy, const Proxy::Route& route, int client,
+                  TLSConnection* tls, const HTTPRequest& request,
+                  std::string& remainder, bool keep_alive,
+                  ResponseCache::Lookup* cached = nullptr);
+    ProxyExchange(const ProxyExchange&) = delete; // prevent copy
+    ProxyExchange& operator=(const ProxyExchange&) = delete; // prevent assignment
+    ~ProxyExchange();
+
+    Result step();
+    Result timed_out();
+
+    int                fd() const { return wait_fd_; }
+    short              events() const { return wait_events_; }
+    const std::string& status() const { return status_; }
+
+private:
+    enum State
+    {
+        CONNECT,        // waiting for a new upstream connection
+        SEND_REQUEST,   // head and buffered body bytes to the upstream
+        SEND_BODY,      // the rest of the request body
+        READ_HEAD,      // the upstream's response head
+        SEND_HEAD,      // the rewritten head (and buffered body) to the client
+        RELAY_BODY,     // the rest of the response body
+        SEND_ERROR,     // a 502 or 504 to the client
+        FINISHED
+    };
+
+    enum Framing
+    {
+        NO_BODY,
+        LENGTH,
+        CHUNKED,
+        UNTIL_CLOSE
+    };
+
+    // Where chunk_bytes() is in a chunked body
+    enum ChunkState
+    {
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_DATA,
+        CHUNK_DATA_END,  // the CRLF after a chunk's data
+        TRAILER_START,   // the start of a trailer line, or the final CRLF
+        TRAILER,
+        CHUNKS_DONE
+    };
+
+    static const size_t BUFFER_SIZE = 65536;
+    static const size_t MAX_HEAD = 65536;
+
+    bool   start_upstream(bool fresh);
+    bool   open_pipe();
+    Result wait(int fd, short events);
+    Result connect_upstream();
+    Result send_request();
+    Result send_body();
+    Result read_head();
+    bool   parse_head(size_t end);
+    Result send_head();
+    Result relay_body();
+    Result relay_spliced();
+    Result relay_copied();
+    size_t chunk_bytes(const char* data, size_t size);
+    Result upstream_error(const char* what);
+    Result fail(const char* status);
+    Result send_error();
+    Result finish(bool reusable);
+
+    Proxy&           proxy_;
+    Proxy::Upstream& upstream_;
+    int              client_;
+    TLSConnection*   tls_;
+    std::string&     remainder_;   // client bytes after the request head
+    bool             keep_alive_;  // whether the client's connection stays open
+    bool             head_request_;
+    State            state_;
+    int              upstream_fd_;
+    bool             reused_;      // upstream_fd_ came from the pool
+    bool             retried_;
+    std::string      request_;     // head and buffered body, until answered
+    size_t           request_pos_;
+    off_t            body_left_;   // request body still to come from client
+    bool             body_taken_;  // some came straight from the client
+    std::string      buffer_;      // response head, then copied body data
+    size_t           buffer_pos_;
+    size_t           head_size_;   // of the rewritten head, at buffer_'s start
+    Framing          framing_;
+    off_t            response_left_; // LENGTH body bytes still to relay
+    bool             upstream_keep_alive_;
+    ChunkState       chunk_state_;
+    off_t            chunk_left_;
+    int              pipe_[2];
+    size_t           piped_;       // bytes in the pipe, not yet sent on
+    int              wait_fd_;
+    short            wait_events_;
+    std::string      status_;
+    ResponseCache::Lookup* cached_;
+    std::shared_ptr<ResponseCache::Entry> entry_; // being stored
+    std::string      captured_;    // entry_'s body so far
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "RateLimiter.h"
+#include "Metrics.h"       // for Metrics
+
+#include <netinet/in.h>    // for sockaddr_in, sockaddr_in6, IN6_IS_ADDR_V4MAPPED
+
+#include <algorithm>       // for min
+#include <cstring>         // for memcpy
+
+/**
+ * @param max_connections open connections allowed per client, 0 = no cap
+ * @param rate requests allowed per second per client, 0 = no limit
+ * @param burst requests a client may make at once, 0 = `rate`
+ */
+RateLimiter::RateLimiter(int max_connections, long rate, long burst)
+    : max_connections_(max_connections),
+      rate_(rate),
+      burst_(burst > 0 ? burst : rate),
+      shards_(new Shard[NUM_SHARDS])
+{
+}
+
+/**
+ * @summary Reduces a peer address to the key clients are tracked by: the
+ * IPv4 address (including IPv4-mapped IPv6 addresses), or the first 64 bits
+ * of an IPv6 address, since a single host usually owns a whole /64
+ *
+ * @return 0 for addresses that aren't tracked (e.g. Unix sockets)
+ */
+uint64_t RateLimiter::make_key(const struct sockaddr_storage& address)
+{
+    uint64_t key = 0;
+    if (address.ss_family == AF_INET)
+    {
+        const sockaddr_in& in = reinterpret_cast<const sockaddr_in&>(address);
+        key = 0xffffffff00000000ull | ntohl(in.sin_addr.s_addr);
+    }
+    else if (address.ss_family == AF_INET6)
+    {
+        const sockaddr_in6& in6 = reinterpret_cast<const sockaddr_in6&>(address);
+        if (IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr))
+        {
+            uint32_t v4;
+            std::memcpy(&v4, &in6.sin6_addr.s6_addr[12], sizeof(v4));
+            key = 0xffffffff00000000ull | ntohl(v4);
+        }
+        else
+        {
+            std::memcpy(&key, in6.sin6_addr.s6_addr, sizeof(key));
+            // ::1 and the rest of ::/64 would otherwise look like a free slot
+            if (key == 0)
+                key = 1;
+        }
+    }
+    return key;
+}
+
+void RateLimiter::refill(Bucket& bucket, uint64_t now) const
+{
+    if (now > bucket.updated_ns)
+    {
+        bucket.tokens = std::min(burst_, bucket.tokens +
+                                 (now - bucket.updated_ns) * rate_ / 1e9);
+        bucket.updated_ns = now;
+    }
+}
+
+bool RateLimiter::is_idle(const Bucket& bucket) const
+{
+    return bucket.connections == 0 && bucket.tokens >= burst_;
+}
+
+/**
+ * @summary Registers a new connection from `address`
+ *
+ * @param slot set to the client's slot, to be passed to allow_request and
+ *             disconnect; NO_SLOT if the client isn't tracked
+ * @return false if the client already has its maximum number of connections
+ *         open (nothing is registered)
+ */
+bool RateLimiter::connect(const struct sockaddr_storage& address, int& slot)
+{
+    slot = NO_SLOT;
+    uint64_t key = make_key(address);
+    if (key == 0)
+        return true;
+    // Fibonacci hashing; the high bits are the well mixed ones
+    uint64_t hash = key * 0x9e3779b97f4a7c15ull;
+    int shard_index = hash >> 60;
+    uint64_t start = hash >> 32;
+    Shard& shard = shards_[shard_index];
+    uint64_t now = Metrics::now_ns();
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    int free_index = -1;
+    for (int i = 0; i < MAX_PROBE; i++)
+    {
+        int index = (start + i) % SHARD_SLOTS;
+        Bucket& bucket = shard.buckets_[index];
+        if (bucket.key == key)
+        {
+            if (max_connections_ > 0 && bucket.connections >= max_connections_)
+                return false;
+            bucket.connections++;
+            slot = shard_index * SHARD_SLOTS + index;
+            return true;
+        }
+        if (bucket.key != 0)
+            refill(bucket, now);
+        if (free_index == -1 && (bucket.key == 0 || is_idle(bucket)))
+            free_index = index;
+    }
+    // Every probed slot belongs to a client with connections open or a
+    // partly spent bucket; let this one through untracked
+    if (free_index == -1)
+        return true;
+    Bucket& bucket = shard.buckets_[free_index];
+    bucket.key = key;
+    bucket.connections = 1;
+    bucket.tokens = burst_;
+    bucket.updated_ns = now;
+    slot = shard_index * SHARD_SLOTS + free_index;
+    return true;
+}
+
+/**
+ * @summary Unregisters a connection accepted by connect()
+ */
+void RateLimiter::disconnect(int slot)
+{
+    if (slot == NO_SLOT)
+        return;
+    Shard& shard = shards_[slot / SHARD_SLOTS];
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    shard.buckets_[slot % SHARD_SLOTS].connections--;
+}
+
+/**
+ * @summary Takes a token for one request from the client in `slot`
+ *
+ * @return false if the client is over its request rate
+ */
+bool RateLimiter::allow_request(int slot)
+{
+    if (slot == NO_SLOT || rate_ <= 0)
+        return true;
+    Shard& shard = shards_[slot / SHARD_SLOTS];
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    Bucket& bucket = shard.buckets_[slot % SHARD_SLOTS];
+    refill(bucket, Metrics::now_ns());
+    if (bucket.tokens < 1)
+        return false;
+    bucket.tokens--;
+    return true;
+}
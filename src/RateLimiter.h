@@ -0,0 +1,63 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <sys/socket.h>   // for sockaddr_storage
+
+#include <cstdint>        // for uint64_t
+#include <memory>         // for unique_ptr
+#include <mutex>          // for mutex
+
+/**
+ * @summary Per-client connection caps and request rate limits.
+ * Clients are identified by their IPv4 address, or the /64 prefix of their
+ * IPv6 address, and each gets a slot in a fixed-size table holding its open
+ * connection count and a token bucket refilled at `rate` requests per second
+ * up to `burst`. The table is split into shards, each behind its own mutex,
+ * and a client's slot is found by hashing and probing a few neighbours, so
+ * every operation is O(1) and memory use doesn't grow with the number of
+ * clients. A slot is only reused once its client has no connections and a
+ * full bucket, i.e. when forgetting it changes nothing. If every probed slot
+ * is in use the client is let through unlimited rather than turned away.
+ */
+class RateLimiter
+{
+public:
+    static const int NO_SLOT = -1; // a client that isn't being tracked
+
+    RateLimiter(int max_connections, long rate, long burst);
+    RateLimiter(const RateLimiter&) = delete; // prevent copy
+    RateLimiter& operator=(const RateLimiter&) = delete; // prevent assignment
+
+    bool connect(const struct sockaddr_storage& address, int& slot);
+    void disconnect(int slot);
+    bool allow_request(int slot);
+
+private:
+    static const int NUM_SHARDS = 16;
+    static const int SHARD_SLOTS = 1024;
+    static const int MAX_PROBE = 8;
+
+    struct Bucket
+    {
+        uint64_t key = 0;         // 0 marks a free slot
+        int      connections = 0;
+        double   tokens = 0;
+        uint64_t updated_ns = 0;
+    };
+    struct Shard
+    {
+        std::mutex mutex_;
+        Bucket     buckets_[SHARD_SLOTS];
+    };
+
+    static uint64_t make_key(const struct sockaddr_storage& address);
+    void refill(Bucket& bucket, uint64_t now) const;
+    bool is_idle(const Bucket& bucket) const;
+
+    int    max_connections_; // 0 means no cap
+    double rate_;            // tokens added per second, 0 means no limit
+    double burst_;           // bucket capacity
+    std::unique_ptr<Shard[]> shards_;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef RESPONSEBODY_H
+#define RESPONSEBODY_H
+
+#include "DirectoryListing.h"  // for DirectoryListing
+#include "MappedFile.h"        // for MappedFile
+
+#include <sys/types.h>         // for off_t
+#include <unistd.h>            // for close
+
+#include <memory>              // for shared_ptr, unique_ptr
+#include <string>              // for string
+
+/**
+ * @summary What prepare_response found to send after the headers: an open
+ * file, a file or text already in memory, or a directory listing that is
+ * generated while it is sent. At most one of them is set.
+ */
+struct ResponseBody
+{
+    int   fd = -1;    // file to send with sendfile/read
+    off_t size = 0;   // size of the file or of memory(); unknown for listings
+    std::shared_ptr<const MappedFile>  mapping; // file served from mmap
+    std::shared_ptr<const std::string> text;    // body already in memory
+    std::unique_ptr<DirectoryListing>  listing; // chunked, generated as sent
+
+    /**
+     * @summary The body's bytes if it is in memory, otherwise null
+     */
+    const char* memory() const
+    {
+        if (mapping)
+            return mapping->data();
+        if (text)
+            return text->data();
+        return nullptr;
+    }
+
+    /**
+     * @summary Closes the file and drops everything else
+     */
+    void clear()
+    {
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+        size = 0;
+        mapping.reset();
+        text.reset();
+        listing.reset();
+    }
+};
+
+#endif
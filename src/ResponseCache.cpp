@@ -0,0 +1,465 @@
+#include "ResponseCache.h"
+#include "HTTPRequest.h"   // for HTTPRequest
+#include "HTTPResponse.h"  // for HTTPResponse
+#include "Metrics.h"       // for Metrics
+
+#include <fcntl.h>         // for fcntl, FD_CLOEXEC
+#include <strings.h>       // for strcasecmp
+#include <unistd.h>        // for close, pipe
+
+#include <algorithm>       // for find_if, max, transform
+#include <cctype>          // for tolower
+#include <cstdlib>         // for strtoull
+#include <ctime>           // for time, tm, timegm, strptime
+#include <functional>      // for hash
+#include <iterator>        // for begin, end
+
+/**
+ * @summary The pipe a collapsed miss's followers wait on: it is only
+ * created once a follower arrives, and the write end is closed (making the
+ * read end readable) when the fetch is done
+ */
+struct ResponseCache::Fill
+{
+    int pipe_[2] = {-1, -1};
+
+    ~Fill()
+    {
+        for (int fd : pipe_)
+        {
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+};
+
+static std::string lower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+    return text;
+}
+
+/**
+ * @return the value of the request header `name`, matched without regard
+ *         to case, or "" if there isn't one
+ */
+static const std::string& header(const HTTPRequest& request, const char* name)
+{
+    static const std::string none;
+    for (const auto& entry : request.headers())
+    {
+        if (strcasecmp(entry.first.c_str(), name) == 0)
+            return entry.second;
+    }
+    return none;
+}
+
+/**
+ * @summary Splits a comma-separated header value (Cache-Control, Vary)
+ * into lowercase tokens, without spaces
+ */
+static std::vector<std::string> tokens(const std::string& value)
+{
+    std::vector<std::string> result = HTTPRequest::split_list(value);
+    for (std::string& token : result)
+        token = lower(std::move(token));
+    return result;
+}
+
+/**
+ * @return the seconds in a Cache-Control directive like "max-age=60" if
+ *         `token` is `name`, otherwise -1
+ */
+static long directive(const std::string& token, const char* name)
+{
+    size_t length = std::char_traits<char>::length(name);
+    if (token.compare(0, length, name) != 0 || token.size() <= length + 1 ||
+        token[length] != '=')
+    {
+        return -1;
+    }
+    std::string value = token.substr(length + 1);
+    if (value.size() > 2 && value.front() == '"' && value.back() == '"')
+        value = value.substr(1, value.size() - 2);
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+        return -1;
+    return std::strtoull(value.c_str(), nullptr, 10);
+}
+
+/**
+ * @return an HTTP-date as a time_t, or -1 if it isn't one
+ */
+static time_t http_date(const std::string& value)
+{
+    struct tm tm = {};
+    const char* end = strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S", &tm);
+    if (!end)
+        return -1;
+    return timegm(&tm);
+}
+
+/**
+ * @return the key of a path's variant: `primary` plus the values of the
+ *         request headers it varies on
+ */
+static std::string variant_key(const std::string& primary,
+                               const std::vector<std::string>& vary,
+                               const HTTPRequest& request)
+{
+    std::string key = primary;
+    for (const std::string& name : vary)
+        key += '\n' + name + ':' + header(request, name.c_str());
+    return key;
+}
+
+/**
+ * @summary Fills in `response` (which keeps its Connection and Keep-Alive
+ * headers) to send this entry; the body is sent from `body`
+ */
+void ResponseCache::Entry::to_response(HTTPResponse& response,
+                                       uint64_t now) const
+{
+    response.set_version("HTTP/1.1");
+    response.set_status(status);
+    response.set_phrase(phrase);
+    response.set_body("");
+    for (const auto& entry : headers)
+        response.set_header(entry.first, entry.second);
+    response.set_header("Age", std::to_string(age_s
+                                              + (now - stored_ns) / 1000000000));
+}
+
+/**
+ * @summary Roughly how much memory the entry takes, for the size limit
+ */
+size_t ResponseCache::Entry::size() const
+{
+    size_t size = sizeof(Entry) + status.size() + phrase.size()
+                  + (body ? body->size() : 0);
+    for (const auto& entry : headers)
+        size += entry.first.size() + entry.second.size() + 64;
+    return size;
+}
+
+ResponseCache::Lookup::~Lookup()
+{
+    if (filling_)
+        cache_->complete(*this);
+}
+
+int ResponseCache::Lookup::wait_fd() const
+{
+    return fill_ ? fill_->pipe_[0] : -1;
+}
+
+/**
+ * @return whether the stale entry found may be served instead of an error
+ */
+bool ResponseCache::Lookup::stale_on_error(uint64_t now) const
+{
+    return entry && now < entry->error_ns;
+}
+
+std::shared_ptr<ResponseCache::Entry> ResponseCache::Lookup::admit(
+    const std::string& status, const std::string& phrase,
+    const std::vector<std::pair<std::string, std::string>>& headers,
+    size_t length) const
+{
+    if (!filling_)
+        return nullptr;
+    return cache_->admit(status, phrase, headers, length);
+}
+
+void ResponseCache::Lookup::store(std::shared_ptr<Entry> entry)
+{
+    if (filling_)
+        cache_->store(*this, std::move(entry));
+}
+
+/**
+ * @param max_bytes the most memory entries may take, in all
+ * @param max_entry the largest body stored
+ */
+ResponseCache::ResponseCache(size_t max_bytes, size_t max_entry) :
+    shard_bytes_(max_bytes / NUM_SHARDS), max_entry_(max_entry)
+{
+}
+
+/**
+ * @summary Looks a request up. GET and HEAD requests without credentials
+ * use the cache, unless they ask not to with Cache-Control: no-store;
+ * no-cache makes them fetch a new response to store.
+ *
+ * @param may_wait whether WAIT may be returned; a request that has already
+ *        waited once passes false, and fetches for itself if the response
+ *        still isn't stored (it wasn't cacheable after all)
+ */
+ResponseCache::Status ResponseCache::lookup(const HTTPRequest& request,
+                                            Lookup& lookup, bool may_wait)
+{
+    if (lookup.filling_)
+        complete(lookup);
+    lookup.entry.reset();
+    lookup.fill_.reset();
+    lookup.cache_ = this;
+    lookup.request_ = &request;
+    const bool get = request.verb() == "GET";
+    if ((!get && request.verb() != "HEAD") ||
+        !header(request, "Authorization").empty())
+    {
+        return MISS;
+    }
+    bool refresh = false;
+    for (const std::string& token : tokens(header(request, "Cache-Control")))
+    {
+        if (token == "no-store")
+            return MISS;
+        refresh |= token == "no-cache";
+    }
+    lookup.primary_ = header(request, "Host") + ' ' + request.path();
+    lookup.shard_ = std::hash<std::string>()(lookup.primary_) % NUM_SHARDS;
+    Shard& shard = shards_[lookup.shard_];
+    const uint64_t now = Metrics::now_ns();
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    auto vary = shard.vary_.find(lookup.primary_);
+    const std::string key = vary == shard.vary_.end()
+        ? lookup.primary_
+        : variant_key(lookup.primary_, vary->second.first, request);
+    auto it = shard.entries_.find(key);
+    if (it != shard.entries_.end())
+    {
+        const Entry& entry = *it->second.entry;
+        if (now >= entry.stale_ns && now >= entry.error_ns)
+        {
+            remove(shard, key);
+        }
+        else
+        {
+            lookup.entry = it->second.entry;
+            shard.lru_.splice(shard.lru_.begin(), shard.lru_, it->second.lru);
+            if (!refresh && now < entry.fresh_ns)
+            {
+                Metrics::add(Metrics::CACHE_HITS);
+                return HIT;
+            }
+        }
+    }
+    auto fill = shard.fills_.find(key);
+    if (fill != shard.fills_.end())
+    {
+        if (lookup.entry && !refresh && now < lookup.entry->stale_ns)
+        {
+            Metrics::add(Metrics::CACHE_STALE);
+            return STALE;
+        }
+        Fill& pending = *fill->second;
+        if (may_wait && pending.pipe_[0] < 0 && pipe(pending.pipe_) == 0)
+        {
+            fcntl(pending.pipe_[0], F_SETFD, FD_CLOEXEC);
+            fcntl(pending.pipe_[1], F_SETFD, FD_CLOEXEC);
+        }
+        if (may_wait && pending.pipe_[0] >= 0)
+        {
+            lookup.fill_ = fill->second;
+            Metrics::add(Metrics::CACHE_WAITS);
+            return WAIT;
+        }
+        Metrics::add(Metrics::CACHE_MISSES);
+        return MISS;
+    }
+    Metrics::add(Metrics::CACHE_MISSES);
+    // A HEAD response has no body to store
+    if (!get)
+        return MISS;
+    lookup.fill_ = std::make_shared<Fill>();
+    shard.fills_.emplace(key, lookup.fill_);
+    lookup.key_ = key;
+    lookup.filling_ = true;
+    return MISS;
+}
+
+/**
+ * @summary Decides whether a response may be stored, from its status and
+ * headers, before its body (`length` bytes) is read
+ *
+ * @return a new Entry with its lifetimes filled in, to which the caller
+ *         adds the body and then stores; null if the response can't be
+ *         stored
+ */
+std::shared_ptr<ResponseCache::Entry> ResponseCache::admit(
+    const std::string& status, const std::string& phrase,
+    const std::vector<std::pair<std::string, std::string>>& headers,
+    size_t length) const
+{
+    // Statuses that are cacheable by default (RFC 9110 15.1)
+    static const char* const cacheable[] = {
+        "200", "203", "204", "300", "301", "308", "404", "405", "410", "414",
+        "501",
+    };
+    if (length > max_entry_ ||
+        std::find_if(std::begin(cacheable), std::end(cacheable),
+                     [&](const char* code) { return status == code; })
+            == std::end(cacheable))
+    {
+        return nullptr;
+    }
+    long max_age = -1;
+    long shared_max_age = -1;
+    long while_revalidate = 0;
+    long if_error = 0;
+    bool revalidate = false;
+    time_t date = -1;
+    time_t expires = -2;
+    long age = 0;
+    std::shared_ptr<Entry> entry(new Entry());
+    for (const auto& field : headers)
+    {
+        const char* name = field.first.c_str();
+        if (strcasecmp(name, "Cache-Control") == 0)
+        {
+            for (const std::string& token : tokens(field.second))
+            {
+                if (token == "no-store" || token == "private" ||
+                    token == "no-cache")
+                {
+                    return nullptr;
+                }
+                revalidate |= token == "must-revalidate" ||
+                              token == "proxy-revalidate";
+                if (directive(token, "max-age") >= 0)
+                    max_age = directive(token, "max-age");
+                if (directive(token, "s-maxage") >= 0)
+                    shared_max_age = directive(token, "s-maxage");
+                if (directive(token, "stale-while-revalidate") >= 0)
+                    while_revalidate = directive(token, "stale-while-revalidate");
+                if (directive(token, "stale-if-error") >= 0)
+                    if_error = directive(token, "stale-if-error");
+            }
+        }
+        else if (strcasecmp(name, "Set-Cookie") == 0 ||
+                 (strcasecmp(name, "Vary") == 0 &&
+                  field.second.find('*') != std::string::npos))
+        {
+            return nullptr;
+        }
+        else if (strcasecmp(name, "Expires") == 0)
+            expires = http_date(field.second);
+        else if (strcasecmp(name, "Date") == 0)
+            date = http_date(field.second);
+        else if (strcasecmp(name, "Age") == 0)
+            age = std::strtoull(field.second.c_str(), nullptr, 10);
+        // These are per connection, or recomputed when served
+        if (strcasecmp(name, "Connection") == 0 ||
+            strcasecmp(name, "Keep-Alive") == 0 ||
+            strcasecmp(name, "Proxy-Connection") == 0 ||
+            strcasecmp(name, "TE") == 0 || strcasecmp(name, "Trailer") == 0 ||
+            strcasecmp(name, "Upgrade") == 0 ||
+            strcasecmp(name, "Transfer-Encoding") == 0 ||
+            strcasecmp(name, "Age") == 0)
+        {
+            continue;
+        }
+        entry->headers.push_back(field);
+    }
+    long lifetime = shared_max_age >= 0 ? shared_max_age : max_age;
+    if (lifetime < 0 && expires != -2)
+    {
+        // An invalid Expires means already expired
+        if (date < 0)
+            date = time(nullptr);
+        lifetime = expires > date ? expires - date : 0;
+    }
+    if (lifetime < 0)
+        return nullptr;
+    if (revalidate)
+        while_revalidate = if_error = 0;
+    long fresh = std::max(lifetime - age, 0L);
+    if (fresh == 0 && while_revalidate == 0 && if_error == 0)
+        return nullptr;
+    entry->status = status;
+    entry->phrase = phrase;
+    entry->stored_ns = Metrics::now_ns();
+    entry->age_s = age;
+    entry->fresh_ns = entry->stored_ns + fresh * 1000000000ull;
+    entry->stale_ns = entry->fresh_ns + while_revalidate * 1000000000ull;
+    entry->error_ns = entry->fresh_ns + if_error * 1000000000ull;
+    return entry;
+}
+
+/**
+ * @summary Stores an entry from admit(), with its body, under the variant
+ * key its Vary header gives, evicting the least recently used entries as
+ * needed; then wakes up the requests waiting for it
+ */
+void ResponseCache::store(Lookup& lookup, std::shared_ptr<Entry> entry)
+{
+    std::vector<std::string> vary;
+    for (const auto& field : entry->headers)
+    {
+        if (strcasecmp(field.first.c_str(), "Vary") == 0)
+        {
+            for (const std::string& name : tokens(field.second))
+                vary.push_back(name);
+        }
+    }
+    const std::string key = variant_key(lookup.primary_, vary,
+                                        *lookup.request_);
+    const size_t size = entry->size() + key.size();
+    Shard& shard = shards_[lookup.shard_];
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    if (size <= shard_bytes_)
+    {
+        if (shard.entries_.count(key))
+            remove(shard, key);
+        auto& variants = shard.vary_[lookup.primary_];
+        variants.first = std::move(vary);
+        variants.second++;
+        shard.lru_.push_front(key);
+        shard.entries_[key] = Slot{std::move(entry), shard.lru_.begin()};
+        shard.bytes_ += size;
+        while (shard.bytes_ > shard_bytes_)
+        {
+            // A copy, since removing it frees the list's
+            const std::string oldest = shard.lru_.back();
+            remove(shard, oldest);
+        }
+    }
+    release_fill(shard, lookup);
+}
+
+/**
+ * @summary Gives up filling the cache, and wakes up the requests waiting
+ */
+void ResponseCache::complete(Lookup& lookup)
+{
+    Shard& shard = shards_[lookup.shard_];
+    std::lock_guard<std::mutex> lock(shard.mutex_);
+    release_fill(shard, lookup);
+}
+
+void ResponseCache::release_fill(Shard& shard, Lookup& lookup)
+{
+    auto it = shard.fills_.find(lookup.key_);
+    if (it != shard.fills_.end() && it->second == lookup.fill_)
+        shard.fills_.erase(it);
+    // Closing the write end makes the read end readable
+    if (lookup.fill_->pipe_[1] >= 0)
+    {
+        close(lookup.fill_->pipe_[1]);
+        lookup.fill_->pipe_[1] = -1;
+    }
+    lookup.fill_.reset();
+    lookup.filling_ = false;
+}
+
+void ResponseCache::remove(Shard& shard, const std::string& key)
+{
+    auto it = shard.entries_.find(key);
+    shard.bytes_ -= it->second.entry->size() + key.size();
+    shard.lru_.erase(it->second.lru);
+    shard.entries_.erase(it);
+    // Keys start with the primary key, then each Vary header on a new line
+    auto variants = shard.vary_.find(key.substr(0, key.find('\n')));
+    if (variants != shard.vary_.end() && --variants->second.second == 0)
+        shard.vary_.erase(variants);
+}
@@ -0,0 +1,147 @@
+#ifndef RESPONSECACHE_H
+#define RESPONSECACHE_H
+
+#include <cstddef>        // for size_t
+#include <cstdint>        // for uint64_t
+#include <list>           // for list
+#include <memory>         // for shared_ptr
+#include <mutex>          // for mutex
+#include <string>         // for string
+#include <unordered_map>  // for unordered_map
+#include <utility>        // for pair
+#include <vector>         // for vector
+
+class HTTPRequest;
+class HTTPResponse;
+
+/**
+ * @summary A shared HTTP cache for responses that don't come from local
+ * files: route handlers' and upstream servers'. Responses are stored when
+ * their Cache-Control (s-maxage, max-age) or Expires gives them a lifetime
+ * and nothing forbids it (no-store, private, no-cache, Set-Cookie,
+ * "Vary: *"); they are keyed on the Host and request path plus the request
+ * headers their Vary names.
+ *
+ * Once an entry is stale, the first request for it fetches a new one while
+ * requests that arrive meanwhile are served the stale copy, for as long as
+ * its stale-while-revalidate allows. If the fetch fails (an error, or a 5xx
+ * answer) the stale copy is served instead, for as long as stale-if-error
+ * allows. Concurrent misses are collapsed: one request fetches, and the
+ * others wait on a pipe that becomes readable when it is done, so both
+ * threads and coroutines can wait for it, and then take its result.
+ *
+ * Entries are spread over NUM_SHARDS shards by key, each with its own lock
+ * and least-recently-used list, and each shard holds at most its share of
+ * `max_bytes`.
+ */
+class ResponseCache
+{
+public:
+    struct Entry
+    {
+        std::string status;
+        std::string phrase;
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::shared_ptr<const std::string> body;
+        uint64_t stored_ns;   // Metrics::now_ns() when stored
+        uint64_t age_s;       // the Age it arrived with
+        uint64_t fresh_ns;    // fresh until
+        uint64_t stale_ns;    // may be served while revalidating until
+        uint64_t error_ns;    // may be served instead of an error until
+
+        void to_response(HTTPResponse& response, uint64_t now) const;
+        size_t size() const;
+    };
+
+    enum Status
+    {
+        HIT,    // `entry` is fresh
+        STALE,  // `entry` is stale, and another request is replacing it
+        MISS,   // fetch the response; store it if filling()
+        WAIT    // another request is fetching it: wait for wait_fd()
+    };
+
+    struct Fill;
+
+    /**
+     * @summary One request's use of the cache. A request that is filling
+     * the cache must store() what it fetched; if it doesn't, destroying the
+     * Lookup gives up, and wakes up the requests waiting for it.
+     */
+    class Lookup
+    {
+    public:
+        Lookup() = default;
+        Lookup(const Lookup&) = delete; // prevent copy
+        Lookup& operator=(const Lookup&) = delete; // prevent assignment
+        ~Lookup();
+
+        bool filling() const { return filling_; }
+        int  wait_fd() const;
+        bool stale_on_error(uint64_t now) const;
+        std::shared_ptr<Entry> admit(const std::string& status,
+                                     const std::string& phrase,
+                                     const std::vector<std::pair<std::string,
+                                                                 std::string>>& headers,
+                                     size_t length) const;
+        void store(std::shared_ptr<Entry> entry);
+
+        // To serve (HIT, STALE), or to fall back on if a MISS fails
+        std::shared_ptr<const Entry> entry;
+
+    private:
+        friend class ResponseCache;
+
+        ResponseCache*        cache_ = nullptr;
+        const HTTPRequest*    request_ = nullptr; // must outlive the Lookup
+        size_t                shard_ = 0;
+        std::string           primary_; // Host and path
+        std::string           key_;     // ...and the Vary headers' values
+        std::shared_ptr<Fill> fill_;
+        bool                  filling_ = false;
+    };
+
+    ResponseCache(size_t max_bytes, size_t max_entry);
+    ResponseCache(const ResponseCache&) = delete; // prevent copy
+    ResponseCache& operator=(const ResponseCache&) = delete; // prevent assignment
+
+    Status lookup(const HTTPRequest& request, Lookup& lookup, bool may_wait);
+
+private:
+    static const int NUM_SHARDS = 16;
+
+    struct Slot
+    {
+        std::shared_ptr<const Entry>     entry;
+        std::list<std::string>::iterator lru; // this slot's key
+    };
+    struct Shard
+    {
+        std::mutex mutex_;
+        std::unordered_map<std::string, Slot> entries_;
+        // Most recently used first
+        std::list<std::string> lru_;
+        // The header names a path's responses Vary on, and how many are
+        // stored
+        std::unordered_map<std::string,
+                           std::pair<std::vector<std::string>, size_t>> vary_;
+        std::unordered_map<std::string, std::shared_ptr<Fill>> fills_;
+        size_t bytes_ = 0;
+    };
+
+    std::shared_ptr<Entry> admit(const std::string& status,
+                                 const std::string& phrase,
+                                 const std::vector<std::pair<std::string,
+                                                             std::string>>& headers,
+                                 size_t length) const;
+    void store(Lookup& lookup, std::shared_ptr<Entry> entry);
+    void complete(Lookup& lookup);
+    static void release_fill(Shard& shard, Lookup& lookup);
+    static void remove(Shard& shard, const std::string& key);
+
+    size_t shard_bytes_;
+    size_t max_entry_;
+    Shard  shards_[NUM_SHARDS];
+};
+
+#endif
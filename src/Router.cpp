@@ -0,0 +1,144 @@
+#include "Router.h"
+
+#include <algorithm>  // for lower_bound, min
+#include <stdexcept>  // for runtime_error
+
+/**
+ * @return the next segment of `path`, which is advanced past it; empty once
+ *         only slashes are left
+ */
+static std::string_view next_segment(std::string_view& path)
+{
+    size_t start = path.find_first_not_of('/');
+    if (start == std::string_view::npos)
+    {
+        path = std::string_view();
+        return path;
+    }
+    path.remove_prefix(start);
+    size_t end = std::min(path.find('/'), path.size());
+    std::string_view segment = path.substr(0, end);
+    path.remove_prefix(end);
+    return segment;
+}
+
+/**
+ * @return the literal child of `node` for `segment`, created if needed
+ */
+Router::Node& Router::child(Node& node, std::string_view segment)
+{
+    auto it = std::lower_bound(node.children.begin(), node.children.end(),
+                               segment, [](const auto& entry, std::string_view key)
+                               {
+                                   return entry.first < key;
+                               });
+    if (it == node.children.end() || it->first != segment)
+    {
+        it = node.children.emplace(it, std::string(segment),
+                                   std::unique_ptr<Node>(new Node()));
+    }
+    return *it->second;
+}
+
+/**
+ * @summary Adds a route; throws std::runtime_error if the pattern is
+ * malformed, or conflicts with a route already added
+ */
+void Router::add(const std::string& pattern, Handler handler)
+{
+    if (pattern.empty() || pattern[0] != '/' || !handler)
+        throw std::runtime_error("Invalid route: " + pattern);
+    Node* node = &root_;
+    std::string_view rest = pattern;
+    while (true)
+    {
+        std::string_view segment = next_segment(rest);
+        if (segment.empty())
+            break;
+        if (segment == "*")
+        {
+            if (next_segment(rest).size() > 0 || node->prefix)
+                throw std::runtime_error("Invalid route: " + pattern);
+            node->prefix = std::move(handler);
+            return;
+        }
+        if (segment[0] == ':')
+        {
+            segment.remove_prefix(1);
+            if (segment.empty() ||
+                (node->param && node->param_name != segment))
+            {
+                throw std::runtime_error("Invalid route: " + pattern);
+            }
+            if (!node->param)
+            {
+                node->param.reset(new Node());
+                node->param_name = segment;
+            }
+            node = node->param.get();
+            continue;
+        }
+        node = &child(*node, segment);
+    }
+    if (node->handler)
+        throw std::runtime_error("Duplicate route: " + pattern);
+    node->handler = std::move(handler);
+}
+
+/**
+ * @summary Finds the handler for a normalized request path (see
+ * PathResolver::normalize), filling in `params`
+ *
+ * @return the handler, or null if no route matches
+ */
+const Router::Handler* Router::match(std::string_view path,
+                                     Params& params) const
+{
+    params.clear();
+    return match_node(root_, path, params);
+}
+
+const Router::Handler* Router::match_node(const Node& node,
+                                          std::string_view path,
+                                          Params& params)
+{
+    std::string_view rest = path;
+    std::string_view segment = next_segment(rest);
+    if (segment.empty())
+    {
+        if (node.handler)
+            return &node.handler;
+        if (node.prefix)
+        {
+            params.emplace_back("*", std::string_view());
+            return &node.prefix;
+        }
+        return nullptr;
+    }
+    auto it = std::lower_bound(node.children.begin(), node.children.end(),
+                               segment, [](const auto& entry, std::string_view key)
+                               {
+                                   return entry.first < key;
+                               });
+    if (it != node.children.end() && it->first == segment)
+    {
+        const Handler* handler = match_node(*it->second, rest, params);
+        if (handler)
+            return handler;
+    }
+    if (node.param)
+    {
+        params.emplace_back(node.param_name, segment);
+        const Handler* handler = match_node(*node.param, rest, params);
+        if (handler)
+            return handler;
+        params.pop_back();
+    }
+    if (node.prefix)
+    {
+        // Everything from this segment on
+        params.emplace_back("*", path.substr(path.find_first_not_of('/')));
+        return &node.prefix;
+    }
+    return nullptr;
+}
@@ -0,0 +1,65 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <functional>   // for function
+#include <memory>       // for unique_ptr
+#include <string>       // for string
+#include <string_view>  // for string_view
+#include <utility>      // for pair
+#include <vector>       // for vector
+
+class HTTPRequest;
+class HTTPResponse;
+
+/**
+ * @summary Maps request paths to in-process handlers. Patterns are split
+ * into '/'-separated segments and compiled into a trie as they are added:
+ *   /health          exactly that path
+ *   /users/:id       any single segment, passed to the handler as "id"
+ * and a last segment of just "*" matches the path before it and everything
+ * below that, which is passed as "*" (e.g. "css/site.css" under "/static").
+ * Literal segments win over parameters, which win over prefixes, and a
+ * match backtracks if the more specific branch dead-ends. Empty segments
+ * are ignored, so "/health/" matches "/health".
+ *
+ * Matching walks the normalized request path in place: children are kept
+ * sorted and searched by string_view, and parameters are views into the
+ * path, so no part of it is copied. Routes must all be added before the
+ * server starts; handlers may then run on several threads at once.
+ */
+class Router
+{
+public:
+    typedef std::vector<std::pair<std::string_view, std::string_view>> Params;
+    // Fills in the response's status and headers, and writes its body (if
+    // any) to `body`; the server sets Content-Length
+    typedef std::function<void(const HTTPRequest& request, const Params& params,
+                               HTTPResponse& response, std::string& body)>
+        Handler;
+
+    Router() = default;
+    Router(const Router&) = delete; // prevent copy
+    Router& operator=(const Router&) = delete; // prevent assignment
+
+    void add(const std::string& pattern, Handler handler);
+    const Handler* match(std::string_view path, Params& params) const;
+
+private:
+    struct Node
+    {
+        // Sorted by segment
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> children;
+        std::unique_ptr<Node> param;       // the ":name" child, if any
+        std::string           param_name;
+        Handler               handler;     // a route ending here
+        Handler               prefix;      // a "*" route ending here
+    };
+
+    static Node& child(Node& node, std::string_view segment);
+    static const Handler* match_node(const Node& node, std::string_view path,
+                                     Params& params);
+
+    Node root_;
+};
+
+#endif
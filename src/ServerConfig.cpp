@@ -0,0 +1,386 @@
+#include "ServerConfig.h"
+
+#include <algorithm>  // for transform, min
+#include <cctype>     // for tolower, isspace
+#include <climits>    // for INT_MAX, LONG_MAX
+#include <fstream>    // for ifstream
+#include <sstream>    // for ostringstream
+#include <stdexcept>  // for runtime_error
+#include <string>     // for string, stol, getline
+
+namespace
+{
+std::string trim(const std::string& str)
+{
+    size_t begin = 0;
+    size_t end = str.size();
+    while (begin < end && std::isspace(static_cast<unsigned char>(str[begin])))
+        begin++;
+    while (end > begin && std::isspace(static_cast<unsigned char>(str[end - 1])))
+        end--;
+    return str.substr(begin, end - begin);
+}
+
+long to_long(const std::string& key, const std::string& value, long min,
+             long max = LONG_MAX)
+{
+    size_t used = 0;
+    long result = 0;
+    try
+    {
+        result = std::stol(value, &used);
+    } catch (const std::exception&)
+    {
+        used = 0;
+    }
+    if (used == 0 || used != value.size() || result < min || result > max)
+    {
+        throw std::runtime_error("Invalid value for " + key + ": " + value);
+    }
+    return result;
+}
+
+// For the options stored in an int
+int to_int(const std::string& key, const std::string& value, long min)
+{
+    return static_cast<int>(to_long(key, value, min, INT_MAX));
+}
+
+bool to_bool(const std::string& key, const std::string& value)
+{
+    std::string lower = value;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if (lower == "1" || lower == "true" || lower == "yes" || lower == "on")
+        return true;
+    if (lower == "0" || lower == "false" || lower == "no" || lower == "off")
+        return false;
+    throw std::runtime_error("Invalid value for " + key + ": " + value);
+}
+
+bool is_flag(const std::string& key)
+{
+    return key == "tcp-nodelay" || key == "trace-chrome" || key == "file-index" ||
+           key == "autoindex" || key == "uploads" || key == "http2";
+}
+}
+
+/**
+ * @summary Sets a single option by name
+ *
+ * @param key option name, as used in config files and (after --) on the
+ *            command line
+ * @param value the option's value; throws std::runtime_error if either is
+ *              not valid
+ */
+void ServerConfig::set(const std::string& key, const std::string& value)
+{
+    if (key == "host")
+        hostname = value;
+    else if (key == "port")
+    {
+        to_long(key, value, 0, 65535);
+        port = value;
+    }
+    else if (key == "unix-socket")
+        unix_socket = value;
+    else if (key == "root")
+        directory = value;
+    else if (key == "engine")
+    {
+        if (value == "threaded")
+            engine = THREADED;
+        else if (value == "poll")
+            engine = POLL;
+        else if (value == "epoll")
+            engine = EPOLL;
+        else if (value == "multi-reactor")
+            engine = MULTI_REACTOR;
+        else if (value == "coroutine")
+            engine = COROUTINE;
+        else
+            throw std::runtime_error("Unknown engine: " + value);
+    }
+    else if (key == "workers")
+        workers = to_int(key, value, 0);
+    else if (key == "processes")
+        processes = to_int(key, value, 0);
+    else if (key == "backlog")
+        backlog = to_int(key, value, 1);
+    else if (key == "timeout")
+        timeout = to_int(key, value, 1);
+    else if (key == "shutdown-timeout")
+        shutdown_timeout = to_int(key, value, 0);
+    else if (key == "handoff-socket")
+        handoff_socket = value;
+    else if (key == "file-buffer")
+        file_buffer_size = to_long(key, value, 1);
+    else if (key == "write-quantum")
+        write_quantum = to_long(key, value, 0);
+    else if (key == "mmap-min")
+        mmap_min = to_long(key, value, 1);
+    else if (key == "mmap-max")
+        mmap_max = to_long(key, value, 0);
+    else if (key == "readahead-min")
+        readahead_min = to_long(key, value, 0);
+    else if (key == "helper-threads")
+        helper_threads = to_int(key, value, 0);
+    else if (key == "index-file")
+        index_file = value;
+    else if (key == "autoindex")
+        autoindex = to_bool(key, value);
+    else if (key == "cache-control")
+    {
+        // PREFIX=DIRECTIVES
+        size_t equals = value.find('=');
+        if (equals == std::string::npos || value[0] != '/' ||
+            equals + 1 == value.size())
+        {
+            throw std::runtime_error("Invalid value for " + key + ": " + value);
+        }
+        cache_control.push_back(value);
+    }
+    else if (key == "file-index")
+        file_index = to_bool(key, value);
+    else if (key == "index-threads")
+        index_threads = to_int(key, value, 0);
+    else if (key == "index-slots")
+        index_slots = to_long(key, value, 1);
+    else if (key == "prewarm-max")
+        prewarm_max = to_long(key, value, 0);
+    else if (key == "uploads")
+        uploads = to_bool(key, value);
+    else if (key == "max-upload")
+        max_upload = to_long(key, value, 0);
+    else if (key == "tcp-nodelay")
+        tcp_nodelay = to_bool(key, value);
+    else if (key == "send-buffer")
+        send_buffer = to_int(key, value, 0);
+    else if (key == "notsent-lowat")
+        notsent_lowat = to_int(key, value, 0);
+    else if (key == "defer-accept")
+        defer_accept = to_int(key, value, 0);
+    else if (key == "tcp-fastopen")
+        fastopen = to_int(key, value, 0);
+    else if (key == "busy-poll")
+        busy_poll = to_int(key, value, 0);
+    else if (key == "tls-cert")
+        tls_cert = value;
+    else if (key == "tls-key")
+        tls_key = value;
+    else if (key == "http2")
+        http2 = to_bool(key, value);
+    else if (key == "ip-connections")
+        ip_connections = to_int(key, value, 0);
+    else if (key == "ip-rate")
+        ip_rate = to_long(key, value, 0);
+    else if (key == "ip-burst")
+        ip_burst = to_long(key, value, 0);
+    else if (key == "proxy")
+    {
+        // PREFIX=HOST:PORT[,HOST:PORT...]; resolved when the server starts
+        size_t equals = value.find('=');
+        if (equals == std::string::npos || value[0] != '/')
+            throw std::runtime_error("Invalid value for " + key + ": " + value);
+        size_t start = equals + 1;
+        while (start <= value.size())
+        {
+            size_t comma = std::min(value.find(',', start), value.size());
+            size_t colon = value.rfind(':', comma - 1);
+            if (colon == std::string::npos || colon <= start ||
+                colon + 1 >= comma)
+            {
+                throw std::runtime_error("Invalid value for " + key + ": "
+                                         + value);
+            }
+            start = comma + 1;
+        }
+        proxy.push_back(value);
+    }
+    else if (key == "proxy-idle")
+        proxy_idle = to_long(key, value, 0);
+    else if (key == "proxy-timeout")
+        proxy_timeout = to_int(key, value, 1);
+    else if (key == "cache-size")
+        cache_size = to_long(key, value, 0);
+    else if (key == "cache-max-entry")
+        cache_max_entry = to_long(key, value, 0);
+    else if (key == "metrics-path")
+        metrics_path = value;
+    else if (key == "admin-socket")
+        admin_socket = value;
+    else if (key == "trace-slow-us")
+        trace_slow_us = to_long(key, value, -1);
+    else if (key == "trace-file")
+        trace_file = value;
+    else if (key == "trace-chrome")
+        trace_chrome = to_bool(key, value);
+    else
+        throw std::runtime_error("Unknown option: " + key);
+}
+
+/**
+ * @summary Applies every `key = value` line of a config file
+ *
+ * @param path the file to read; throws std::runtime_error if it can't be
+ *             opened or contains an invalid line
+ */
+void ServerConfig::load_file(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        throw std::runtime_error("Unable to open config file " + path);
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(file, line))
+    {
+        line_number++;
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+        size_t equals = line.find('=');
+        if (equals == std::string::npos)
+        {
+            throw std::runtime_error(path + ":" + std::to_string(line_number)
+                                     + ": expected key = value");
+        }
+        set(trim(line.substr(0, equals)), trim(line.substr(equals + 1)));
+    }
+}
+
+/**
+ * @summary Applies the command line. Accepts `--config FILE`,
+ * `--key=value`, `--key value`, a bare `--flag` for boolean options, and the
+ * original positional `[hostname] [port] [file-dir]` arguments.
+ */
+void ServerConfig::parse_args(int argc, char** argv)
+{
+    command_line.assign(argv, argv + argc);
+    int positional = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            switch (positional++)
+            {
+                case 0: hostname = arg; break;
+                case 1: set("port", arg); break;
+                case 2: directory = arg; break;
+                default:
+                    throw std::runtime_error("Unexpected argument: " + arg);
+            }
+            continue;
+        }
+        std::string key = arg.substr(2);
+        std::string value;
+        size_t equals = key.find('=');
+        if (equals != std::string::npos)
+        {
+            value = key.substr(equals + 1);
+            key.erase(equals);
+        }
+        else if (is_flag(key))
+        {
+            value = "true";
+        }
+        else if (i + 1 < argc)
+        {
+            value = argv[++i];
+        }
+        else
+        {
+            throw std::runtime_error("Missing value for --" + key);
+        }
+        if (key == "config")
+            load_file(value);
+        else
+            set(key, value);
+    }
+}
+
+std::string ServerConfig::usage(const char* program)
+{
+    std::ostringstream oss;
+    oss << "Usage: " << program << " [options] [hostname] [port] [file-dir]\n"
+        << "Options (also usable as `key = value` lines in a config file):\n"
+        << "  --config FILE         read options from FILE\n"
+        << "  --host NAME           hostname or IP to bind, every IPv4 and\n"
+        << "                        IPv6 address it has (localhost; * = all)\n"
+        << "  --port PORT           port to bind (4000)\n"
+        << "  --unix-socket FILE    also listen on the Unix socket FILE\n"
+        << "  --root DIR            directory to serve files from (.)\n"
+        << "  --engine NAME         threaded, poll, epoll, multi-reactor or\n"
+        << "                        coroutine\n"
+        << "  --workers N           event loops for multi-reactor (one per CPU)\n"
+        << "  --processes N         fork N worker processes that each run the\n"
+        << "                        engine, restarting any that die (0 = off)\n"
+        << "  --backlog N           listen() backlog (511)\n"
+        << "  --timeout SECS        keep-alive timeout (10)\n"
+        << "  --shutdown-timeout S  time allowed to drain connections (10)\n"
+        << "  --handoff-socket FILE hand the listeners to a restarted server\n"
+        << "                        through the Unix socket FILE (SIGUSR2)\n"
+        << "  --file-buffer BYTES   async engine file read buffer (2048)\n"
+        << "  --write-quantum BYTES body bytes each event loop client may send\n"
+        << "                        per round (65536, 0 = no cap)\n"
+        << "  --mmap-min BYTES      smallest file to serve from mmap (16384)\n"
+        << "  --mmap-max BYTES      largest file to serve from mmap (0 = off)\n"
+        << "  --readahead-min BYTES fadvise readahead for larger files (1 MiB)\n"
+        << "  --helper-threads N    threads that open and stat files, and read\n"
+        << "                        them when not cached, for the event loops\n"
+        << "                        (0 = off)\n"
+        << "  --index-file NAME     file served for a directory (index.html)\n"
+        << "  --autoindex           list directories without an index file\n"
+        << "  --cache-control PREFIX=DIRECTIVES\n"
+        << "                        send Cache-Control: DIRECTIVES (and Expires,\n"
+        << "                        with max-age) for files under PREFIX\n"
+        << "                        (repeatable)\n"
+        << "  --file-index          index the served files at startup, keep the\n"
+        << "                        index current with inotify, and answer\n"
+        << "                        requests from it\n"
+        << "  --index-threads N     threads for the startup scan (one per CPU)\n"
+        << "  --index-slots N       files the index can hold when it is shared\n"
+        << "                        with --processes (65536)\n"
+        << "  --prewarm-max BYTES   read files up to BYTES into the page cache\n"
+        << "                        during the startup scan (0 = off)\n"
+        << "  --uploads             store PUT and POST bodies at the request\n"
+        << "                        path, replacing any existing file\n"
+        << "  --max-upload BYTES    largest body accepted (64 MiB, 0 = no limit)\n"
+        << "  --tcp-nodelay         set TCP_NODELAY on client sockets\n"
+        << "  --send-buffer BYTES   set SO_SNDBUF on client sockets\n"
+        << "  --notsent-lowat BYTES set TCP_NOTSENT_LOWAT on client sockets\n"
+        << "  --defer-accept SECS   set TCP_DEFER_ACCEPT on the listener\n"
+        << "  --tcp-fastopen N      enable TCP_FASTOPEN with a queue of N\n"
+        << "  --busy-poll USECS     spin up to USECS in the event loops before\n"
+        << "                        sleeping, set SO_BUSY_POLL and\n"
+        << "                        SO_PREFER_BUSY_POLL on client sockets, and\n"
+        << "                        pin each loop to a CPU (0 = off)\n"
+        << "  --tls-cert FILE       serve HTTPS with the PEM certificate chain\n"
+        << "                        in FILE, using kernel TLS when available\n"
+        << "  --tls-key FILE        PEM private key (default: in --tls-cert)\n"
+        << "  --http2               speak HTTP/2 (ALPN h2, or h2c by prior\n"
+        << "                        knowledge or Upgrade) in the event loops\n"
+        << "  --ip-connections N    connections allowed per client IP; more\n"
+        << "                        are answered 503 and closed (0 = no cap)\n"
+        << "  --ip-rate N           requests per second allowed per client IP;\n"
+        << "                        more are answered 429 (0 = no limit)\n"
+        << "  --ip-burst N          requests a client IP may make at once\n"
+        << "                        before --ip-rate applies (--ip-rate)\n"
+        << "  --proxy PREFIX=HOST:PORT[,HOST:PORT...]\n"
+        << "                        forward requests under PREFIX to these\n"
+        << "                        upstreams (repeatable); needs --engine\n"
+        << "                        threaded or coroutine, the poll, epoll and\n"
+        << "                        multi-reactor engines can't proxy\n"
+        << "  --proxy-idle N        idle connections kept per upstream (32)\n"
+        << "  --proxy-timeout SECS  time to wait on an upstream (60)\n"
+        << "  --cache-size BYTES    cache responses from routes and upstreams\n"
+        << "                        that allow it, in up to BYTES (0 = off)\n"
+        << "  --cache-max-entry B   largest response body cached (1 MiB)\n"
+        << "  --metrics-path PATH   serve Prometheus metrics at PATH\n"
+        << "  --admin-socket FILE   serve metrics on a Unix socket at FILE\n"
+        << "  --trace-slow-us N     trace requests taking at least N us\n"
+        << "  --trace-file FILE     write trace dumps (SIGUSR1) to FILE\n"
+        << "  --trace-chrome        dump traces as Chrome trace-event JSON\n";
+    return oss.str();
+}
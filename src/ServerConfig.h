@@ -0,0 +1,88 @@
+#ifndef SERVERCONFIG_H
+#define SERVERCONFIG_H
+
+#include <cstddef>  // for size_t
+#include <string>   // for string
+#include <vector>   // for vector
+
+/**
+ * @summary Every tunable of HTTPServer, filled in from defaults, then an
+ * optional config file, then command-line flags (later sources win).
+ * Config files hold one `key = value` per line ('#' starts a comment), and
+ * each key can also be given on the command line as `--key=value`.
+ */
+struct ServerConfig
+{
+    enum Engine
+    {
+        THREADED,      // one std::thread per connection
+        POLL,          // single poll() event loop
+        EPOLL,         // single epoll event loop
+        MULTI_REACTOR, // `workers` epoll event loops sharing the listeners
+        COROUTINE      // one epoll reactor running a coroutine per connection
+    };
+
+    std::string hostname = "localhost";  // "*" = every local address
+    std::string port = "4000";
+    std::string unix_socket;             // also listen on this Unix socket
+    std::string directory = ".";
+
+    Engine      engine = THREADED;
+    int         workers = 0;             // 0 means one per CPU
+    int         processes = 0;           // worker processes running the engine, 0 = none
+    int         backlog = 511;           // listen() backlog, capped by somaxconn
+    int         timeout = 10;            // keep-alive timeout, in seconds
+    int         shutdown_timeout = 10;   // seconds to drain connections on exit
+    size_t      file_buffer_size = 2048; // per-connection async read buffer
+    long        write_quantum = 65536;   // body bytes an event-loop client sends per round, 0 = no cap
+    long        mmap_min = 16384;        // serve files this big or bigger...
+    long        mmap_max = 0;            // ...up to this size from mmap, 0 = off
+    long        readahead_min = 1 << 20; // fadvise files this big or bigger, 0 = off
+    int         helper_threads = 0;      // event loops' threads for disk I/O, 0 = off
+    std::string index_file = "index.html"; // served for directories, "" = none
+    bool        autoindex = false;       // list directories without an index file
+    std::vector<std::string> cache_control; // "PREFIX=DIRECTIVES" policies for files
+    bool        file_index = false;      // index the serving directory at startup
+    int         index_threads = 0;       // threads for the startup scan, 0 = one per CPU
+    long        index_slots = 65536;     // capacity of the index shared with `processes`
+    long        prewarm_max = 0;         // read files up to this size into cache, 0 = off
+    bool        uploads = false;         // accept PUT/POST into the serving directory
+    long        max_upload = 64 << 20;   // largest request body, 0 = no limit
+
+    bool        tcp_nodelay = false;     // TCP_NODELAY on client sockets
+    int         send_buffer = 0;         // SO_SNDBUF on client sockets, 0 = OS default
+    int         notsent_lowat = 0;       // TCP_NOTSENT_LOWAT on client sockets, 0 = OS default
+    int         defer_accept = 0;        // TCP_DEFER_ACCEPT seconds, 0 = off
+    int         fastopen = 0;            // TCP_FASTOPEN queue length, 0 = off
+    long        busy_poll = 0;           // usecs to busy-poll before sleeping, 0 = off
+    std::string tls_cert;                // serve HTTPS with this PEM certificate
+    std::string tls_key;                 // ...and this PEM key, "" = in tls_cert
+    bool        http2 = false;           // HTTP/2 in the event loop engines
+
+    int         ip_connections = 0;      // open connections per client IP, 0 = no cap
+    long        ip_rate = 0;             // requests per second per client IP, 0 = no limit
+    long        ip_burst = 0;            // requests a client IP may burst, 0 = ip_rate
+
+    std::vector<std::string> proxy;      // "PREFIX=HOST:PORT[,HOST:PORT...]" routes
+    size_t      proxy_idle = 32;         // idle connections kept per upstream
+    int         proxy_timeout = 60;      // seconds to wait on an upstream
+    size_t      cache_size = 0;          // response cache for routes and proxying, 0 = off
+    size_t      cache_max_entry = 1 << 20; // largest body the cache stores
+
+    std::string handoff_socket;          // Unix socket for listener handoff
+    std::string metrics_path;            // serve metrics on this path if set
+    std::string admin_socket;            // Unix socket serving metrics if set
+    long        trace_slow_us = -1;      // trace requests slower than this, -1 = off
+    std::string trace_file;              // trace dump destination, stderr if empty
+    bool        trace_chrome = false;    // dump Chrome trace-event JSON
+
+    std::vector<std::string> command_line; // argv, for re-executing on restart
+
+    void set(const std::string& key, const std::string& value);
+    void load_file(const std::string& path);
+    void parse_args(int argc, char** argv);
+
+    static std::string usage(const char* program);
+};
+
+#endif
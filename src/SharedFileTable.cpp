@@ -0,0 +1,391 @@
+#include "SharedFileTable.h"
+#include "logging.h"       // for LOG_END, LOG_ERROR
+
+#include <sched.h>         // for sched_yield
+#include <sys/mman.h>      // for mmap, munmap, MAP_SHARED, MAP_ANONYMOUS
+
+#include <algorithm>       // for min
+#include <cerrno>          // for errno
+#include <cstdlib>         // for exit
+#include <cstring>         // for memcpy, memcmp, strerror
+#include <functional>      // for hash
+#include <new>             // for placement new
+#include <utility>         // for move
+#include <vector>          // for vector
+
+namespace
+{
+const uint8_t HAS_GZIP = 1;
+const uint8_t HAS_BROTLI = 2;
+const size_t HEADER_SIZE = 64;
+
+/**
+ * @summary Waits a moment before rereading a slot that is being written,
+ * without taking the core's pipeline (or, with SMT, its sibling running
+ * the writer) away from the writer
+ */
+inline void relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    sched_yield();
+#endif
+}
+
+uint64_t path_hash(const std::string& path)
+{
+    // The same in every worker, since they are forked from one binary
+    return std::hash<std::string>()(path);
+}
+}
+
+/**
+ * @param slots the table's capacity, rounded up to a power of two; each
+ *              slot takes 512 bytes, but pages are only allocated as they
+ *              are first written
+ */
+SharedFileTable::SharedFileTable(size_t slots) :
+    mask_(0), bytes_(0), header_(nullptr), slots_(nullptr)
+{
+    size_t capacity = 1;
+    while (capacity < slots)
+        capacity *= 2;
+    mask_ = capacity - 1;
+    bytes_ = HEADER_SIZE + capacity * sizeof(Slot);
+    // Anonymous memory is zeroed: every slot starts EMPTY with an even
+    // sequence number
+    void* memory = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        LOG_ERROR << "mmap(): " << std::strerror(errno) << LOG_END;
+        std::exit(1);
+    }
+    header_ = new (memory) Header();
+    slots_ = reinterpret_cast<Slot*>(static_cast<char*>(memory) + HEADER_SIZE);
+}
+
+SharedFileTable::~SharedFileTable()
+{
+    munmap(header_, bytes_);
+}
+
+/**
+ * @summary Looks up the entry for a request path, without locking; safe
+ * from any thread of any process sharing the table
+ *
+ * @return false if the path isn't in the table
+ */
+bool SharedFileTable::lookup(const std::string& path,
+                             FileIndex::Entry& entry) const
+{
+    if (path.size() > PATH_SIZE)
+        return false;
+    const uint64_t hash = path_hash(path);
+    while (true)
+    {
+        uint32_t generation = header_->generation.load(std::memory_order_acquire);
+        if (generation & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        if (probe(path, hash, entry))
+            return true;
+        // A rehash may have moved the entry past where we looked
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header_->generation.load(std::memory_order_relaxed) == generation)
+            return false;
+    }
+}
+
+/**
+ * @summary Looks for `path` along its probe sequence, reading each slot
+ * under its seqlock
+ */
+bool SharedFileTable::probe(const std::string& path, uint64_t hash,
+                            FileIndex::Entry& entry) const
+{
+    for (size_t i = 0; i <= mask_; i++)
+    {
+        const Slot& slot = slots_[(hash + i) & mask_];
+        uint8_t state;
+        bool found;
+        uint8_t flags = 0;
+        char etag[ETAG_SIZE];
+        size_t etag_length = 0;
+        while (true)
+        {
+            uint32_t before = slot.seq.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+                relax();
+                continue;
+            }
+            // The slot may change under us; nothing read here is trusted
+            // (or used to index memory) until the sequence number confirms
+            // it didn't
+            state = slot.state;
+            found = state == LIVE && slot.hash == hash &&
+                    slot.path_length == path.size() &&
+                    std::memcmp(slot.path, path.data(), path.size()) == 0;
+            if (found)
+            {
+                entry.ino = slot.ino;
+                entry.size = slot.size;
+                entry.mtime = slot.mtime;
+                flags = slot.flags;
+                etag_length = std::min<size_t>(slot.etag_length, ETAG_SIZE);
+                std::memcpy(etag, slot.etag, etag_length);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == before)
+                break;
+        }
+        if (state == EMPTY)
+            return false;
+        if (found)
+        {
+            entry.mime = FileIndex::mime_type(path);
+            entry.etag.assign(etag, etag_length);
+            entry.has_gzip = (flags & HAS_GZIP) != 0;
+            entry.has_brotli = (flags & HAS_BROTLI) != 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @summary Adds or replaces the entry for a path. An entry that doesn't fit
+ * (the path or ETag is too long, or the table is full) is left out, and the
+ * table is no longer complete().
+ */
+void SharedFileTable::store(const std::string& path,
+                            const FileIndex::Entry& entry)
+{
+    if (path.size() > PATH_SIZE || entry.etag.size() > ETAG_SIZE)
+    {
+        header_->incomplete = 1;
+        return;
+    }
+    const uint64_t hash = path_hash(path);
+    std::lock_guard<std::mutex> lock(writer_);
+    Slot* slot = find(path, hash);
+    if (slot == nullptr)
+    {
+        // The first free slot on the path's probe sequence
+        for (size_t i = 0; i <= mask_ && slot == nullptr; i++)
+        {
+            Slot& candidate = slots_[(hash + i) & mask_];
+            if (candidate.state != LIVE)
+                slot = &candidate;
+        }
+        if (slot == nullptr)
+        {
+            header_->incomplete = 1;
+            return;
+        }
+        if (slot->state == REMOVED)
+            header_->removed--;
+        header_->live++;
+    }
+    write(*slot, LIVE, path, hash, &entry);
+}
+
+/**
+ * @summary Removes the entry for a path, if there is one
+ */
+void SharedFileTable::erase(const std::string& path)
+{
+    if (path.size() > PATH_SIZE)
+        return;
+    const uint64_t hash = path_hash(path);
+    std::lock_guard<std::mutex> lock(writer_);
+    Slot* slot = find(path, hash);
+    if (slot != nullptr)
+        remove(*slot);
+    if (header_->removed > (mask_ + 1) / 4)
+        rehash();
+}
+
+/**
+ * @summary Removes every entry whose path starts with `prefix`
+ */
+void SharedFileTable::erase_prefix(const std::string& prefix)
+{
+    std::lock_guard<std::mutex> lock(writer_);
+    for (size_t i = 0; i <= mask_; i++)
+    {
+        Slot& slot = slots_[i];
+        if (slot.state == LIVE && slot.path_length >= prefix.size() &&
+            std::memcmp(slot.path, prefix.data(), prefix.size()) == 0)
+        {
+            remove(slot);
+        }
+    }
+    if (header_->removed > (mask_ + 1) / 4)
+        rehash();
+}
+
+/**
+ * @summary Empties the table, tombstones included
+ */
+void SharedFileTable::clear()
+{
+    std::lock_guard<std::mutex> lock(writer_);
+    for (size_t i = 0; i <= mask_; i++)
+    {
+        if (slots_[i].state != EMPTY)
+            write(slots_[i], EMPTY, std::string(), 0, nullptr);
+    }
+    header_->live = 0;
+    header_->removed = 0;
+    header_->incomplete = 0;
+}
+
+size_t SharedFileTable::size() const
+{
+    return header_->live;
+}
+
+/**
+ * @summary Whether every entry stored since the last clear() fit, and the
+ * table isn't being refilled, so that a path missing from the table is
+ * known not to be a file
+ */
+bool SharedFileTable::complete() const
+{
+    return header_->incomplete == 0 && header_->rebuilding == 0;
+}
+
+/**
+ * @summary Marks the table as missing entries that weren't store()d, until
+ * the next clear()
+ */
+void SharedFileTable::mark_incomplete()
+{
+    header_->incomplete = 1;
+}
+
+/**
+ * @summary Marks the table as being refilled after a clear(), so readers in
+ * every process treat it as incomplete until it is done
+ */
+void SharedFileTable::set_rebuilding(bool rebuilding)
+{
+    header_->rebuilding = rebuilding ? 1 : 0;
+}
+
+/**
+ * @summary The LIVE slot holding `path`, or nullptr; only called by the
+ * writer, which the table can't change under
+ */
+SharedFileTable::Slot* SharedFileTable::find(const std::string& path,
+                                             uint64_t hash) const
+{
+    for (size_t i = 0; i <= mask_; i++)
+    {
+        Slot& slot = slots_[(hash + i) & mask_];
+        if (slot.state == EMPTY)
+            return nullptr;
+        if (slot.state == LIVE && slot.hash == hash &&
+            slot.path_length == path.size() &&
+            std::memcmp(slot.path, path.data(), path.size()) == 0)
+        {
+            return &slot;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * @summary Turns a LIVE slot into a tombstone
+ */
+void SharedFileTable::remove(Slot& slot)
+{
+    write(slot, REMOVED, std::string(slot.path, slot.path_length), slot.hash,
+          nullptr);
+    header_->live--;
+    header_->removed++;
+}
+
+/**
+ * @summary Empties the table and stores its live entries again, so their
+ * probe sequences no longer run through tombstones. Entries move while
+ * this runs, so the generation is odd until it is done, which lookups that
+ * miss check for.
+ */
+void SharedFileTable::rehash()
+{
+    struct Saved
+    {
+        std::string      path;
+        uint64_t         hash;
+        FileIndex::Entry entry;
+    };
+    std::vector<Saved> saved;
+    saved.reserve(header_->live);
+    for (size_t i = 0; i <= mask_; i++)
+    {
+        const Slot& slot = slots_[i];
+        if (slot.state != LIVE)
+            continue;
+        Saved item;
+        item.path.assign(slot.path, slot.path_length);
+        item.hash = slot.hash;
+        item.entry.ino = slot.ino;
+        item.entry.size = slot.size;
+        item.entry.mtime = slot.mtime;
+        item.entry.etag.assign(slot.etag, slot.etag_length);
+        item.entry.has_gzip = (slot.flags & HAS_GZIP) != 0;
+        item.entry.has_brotli = (slot.flags & HAS_BROTLI) != 0;
+        saved.push_back(std::move(item));
+    }
+    header_->generation.fetch_add(1, std::memory_order_acq_rel);
+    for (size_t i = 0; i <= mask_; i++)
+    {
+        if (slots_[i].state != EMPTY)
+            write(slots_[i], EMPTY, std::string(), 0, nullptr);
+    }
+    // Every entry fits, since there are no more of them than before
+    for (const Saved& item : saved)
+    {
+        size_t i = item.hash & mask_;
+        while (slots_[i].state != EMPTY)
+            i = (i + 1) & mask_;
+        write(slots_[i], LIVE, item.path, item.hash, &item.entry);
+    }
+    header_->removed = 0;
+    header_->generation.fetch_add(1, std::memory_order_release);
+}
+
+/**
+ * @summary Rewrites a slot, making its sequence number odd meanwhile so
+ * readers retry instead of seeing half of it
+ */
+void SharedFileTable::write(Slot& slot, State state, const std::string& path,
+                            uint64_t hash, const FileIndex::Entry* entry)
+{
+    uint32_t seq = slot.seq.load(std::memory_order_relaxed);
+    slot.seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.state = state;
+    slot.hash = hash;
+    slot.path_length = static_cast<uint16_t>(path.size());
+    std::memcpy(slot.path, path.data(), path.size());
+    if (entry != nullptr)
+    {
+        slot.ino = entry->ino;
+        slot.size = entry->size;
+        slot.mtime = entry->mtime;
+        slot.flags = (entry->has_gzip ? HAS_GZIP : 0) |
+                     (entry->has_brotli ? HAS_BROTLI : 0);
+        slot.etag_length = static_cast<uint8_t>(entry->etag.size());
+        std::memcpy(slot.etag, entry->etag.data(), entry->etag.size());
+    }
+    slot.seq.store(seq + 2, std::memory_order_release);
+}
@@ -0,0 +1,94 @@
+#ifndef SHAREDFILETABLE_H
+#define SHAREDFILETABLE_H
+#include "FileIndex.h"    // for FileIndex::Entry
+
+#include <atomic>         // for atomic
+#include <cstddef>        // for size_t
+#include <cstdint>        // for uint8_t, uint16_t, uint32_t, uint64_t
+#include <mutex>          // for mutex
+#include <string>         // for string
+
+/**
+ * @summary FileIndex entries kept in a fixed-size hash table in shared
+ * memory (an anonymous MAP_SHARED mapping), so the worker processes forked
+ * by --processes all read the one table that the master keeps up to date,
+ * and a restarted worker finds it already filled.
+ *
+ * Only the process that created the table writes to it, one thread at a
+ * time (a process-local mutex). Readers take no lock: each slot carries a
+ * sequence number that is odd while the slot is being written, and a reader
+ * retries if it changed while the slot was being copied (a seqlock). Slots
+ * use linear probing; a removed entry leaves a tombstone, which later
+ * insertions reuse. Once tombstones fill a quarter of the table, so that
+ * misses would probe long runs of them, the live entries are rehashed in
+ * place; the table's generation is odd meanwhile, and a lookup that misses
+ * during a rehash waits for it and looks again.
+ */
+class SharedFileTable
+{
+public:
+    explicit SharedFileTable(size_t slots);
+    SharedFileTable(const SharedFileTable&) = delete; // prevent copy
+    SharedFileTable& operator=(const SharedFileTable&) = delete; // prevent assignment
+    ~SharedFileTable();
+
+    bool lookup(const std::string& path, FileIndex::Entry& entry) const;
+    void store(const std::string& path, const FileIndex::Entry& entry);
+    void erase(const std::string& path);
+    void erase_prefix(const std::string& prefix);
+    void clear();
+    size_t size() const;
+    bool complete() const;
+    void mark_incomplete();
+    void set_rebuilding(bool rebuilding);
+
+private:
+    enum State : uint8_t { EMPTY, LIVE, REMOVED };
+    static constexpr size_t SLOT_SIZE = 512;
+    static constexpr size_t ETAG_SIZE = 63;
+    static constexpr size_t PATH_SIZE = SLOT_SIZE - 40 - 1 - ETAG_SIZE;
+
+    struct Slot
+    {
+        std::atomic<uint32_t> seq;  // odd while being written
+        uint8_t  state;
+        uint8_t  flags;             // HAS_GZIP | HAS_BROTLI
+        uint16_t path_length;
+        uint64_t hash;
+        uint64_t ino;
+        int64_t  size;
+        int64_t  mtime;
+        uint8_t  etag_length;
+        char     etag[ETAG_SIZE];
+        char     path[PATH_SIZE];
+    };
+    static_assert(sizeof(Slot) == SLOT_SIZE, "slots should fill cache lines");
+    static_assert(std::atomic<uint32_t>::is_always_lock_free,
+                  "shared memory needs address-free atomics");
+
+    // At the start of the mapping, on its own cache line
+    struct Header
+    {
+        std::atomic<uint64_t> live;        // LIVE slots
+        std::atomic<uint32_t> incomplete;  // an entry didn't fit
+        std::atomic<uint32_t> rebuilding;  // cleared and being refilled
+        std::atomic<uint32_t> generation;  // odd while rehashing
+        std::atomic<uint64_t> removed;     // REMOVED slots
+    };
+
+    bool probe(const std::string& path, uint64_t hash,
+               FileIndex::Entry& entry) const;
+    Slot* find(const std::string& path, uint64_t hash) const;
+    void remove(Slot& slot);
+    void rehash();
+    static void write(Slot& slot, State state, const std::string& path,
+                      uint64_t hash, const FileIndex::Entry* entry);
+
+    size_t     mask_;      // slots - 1; slots is a power of two
+    size_t     bytes_;
+    Header*    header_;
+    Slot*      slots_;
+    std::mutex writer_;
+};
+
+#endif
@@ -0,0 +1,312 @@
+#include "TLS.h"
+#include "logging.h"       // for LOG_END, LOG_ERROR, LOG_INFO
+
+#ifndef HTTP_NO_TLS
+#include <openssl/bio.h>   // for BIO_get_ktls_send, BIO_get_ktls_recv
+#include <openssl/err.h>   // for ERR_clear_error, ERR_get_error, ERR_error_string_n
+#include <openssl/ssl.h>   // for SSL_read, SSL_write, SSL_sendfile, etc
+#endif
+
+#ifndef __APPLE__
+#include <sys/sendfile.h>  // for sendfile
+#endif
+#include <sys/socket.h>    // for recv, send
+#include <unistd.h>        // for pread
+
+#include <algorithm>       // for min
+#include <cerrno>          // for errno, EAGAIN, EIO
+#include <cstdlib>         // for exit
+#include <cstring>         // for memcmp
+#include <string>          // for string
+
+#ifndef HTTP_NO_TLS
+/**
+ * @return the oldest error on OpenSSL's (per-thread) error queue, as text
+ */
+static std::string ssl_error()
+{
+    char text[256];
+    ERR_error_string_n(ERR_get_error(), text, sizeof(text));
+    return text;
+}
+#endif
+
+TLSConnection::TLSConnection(SSL* ssl)
+    : ssl_(ssl),
+      kernel_send_(false),
+      http2_(false)
+{
+}
+
+TLSConnection::~TLSConnection()
+{
+#ifndef HTTP_NO_TLS
+    SSL_free(ssl_);
+#endif
+}
+
+/**
+ * @summary Advances the server side of the handshake; call again once the
+ * socket is ready for what the returned status asks for. Once it returns OK,
+ * kernel_send() tells whether the kernel is doing the encryption.
+ */
+TLSConnection::Status TLSConnection::handshake()
+{
+#ifndef HTTP_NO_TLS
+    ERR_clear_error();
+    int ret = SSL_accept(ssl_);
+    if (ret == 1)
+    {
+        kernel_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+        const unsigned char* protocol;
+        unsigned int length;
+        SSL_get0_alpn_selected(ssl_, &protocol, &length);
+        http2_ = length == 2 && std::memcmp(protocol, "h2", 2) == 0;
+        LOG_INFO << "TLS handshake done with " << SSL_get_cipher_name(ssl_)
+                 << ", kernel TLS send " << (kernel_send_ ? "on" : "off")
+                 << ", receive "
+                 << (BIO_get_ktls_recv(SSL_get_rbio(ssl_)) ? "on" : "off")
+                 << LOG_END;
+        return OK;
+    }
+    switch (SSL_get_error(ssl_, ret))
+    {
+        case SSL_ERROR_WANT_READ: return WANT_READ;
+        case SSL_ERROR_WANT_WRITE: return WANT_WRITE;
+        default:
+            LOG_ERROR << "TLS handshake failed: " << ssl_error() << LOG_END;
+            return FAILED;
+    }
+#else
+    return FAILED;
+#endif
+}
+
+/**
+ * @summary Sends close_notify before the connection is closed; best effort,
+ * without waiting for the client's reply
+ */
+void TLSConnection::shutdown()
+{
+#ifndef HTTP_NO_TLS
+    ERR_clear_error();
+    if (SSL_is_init_finished(ssl_))
+        SSL_shutdown(ssl_);
+#endif
+}
+
+/**
+ * @return the number of decrypted bytes OpenSSL holds that haven't been read
+ */
+size_t TLSConnection::pending() const
+{
+#ifndef HTTP_NO_TLS
+    return SSL_pending(ssl_);
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @summary Turns the result of an SSL_read/SSL_write style call into a
+ * system call style one
+ */
+ssize_t TLSConnection::result(int ret)
+{
+#ifndef HTTP_NO_TLS
+    if (ret > 0)
+        return ret;
+    switch (SSL_get_error(ssl_, ret))
+    {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            // errno is already set
+            if (errno == 0)
+                errno = EIO;
+            return -1;
+        default:
+            LOG_ERROR << "TLS: " << ssl_error() << LOG_END;
+            errno = EIO;
+            return -1;
+    }
+#else
+    return ret;
+#endif
+}
+
+ssize_t TLSConnection::recv(TLSConnection* tls, int socket, void* buf,
+                            size_t len)
+{
+#ifndef HTTP_NO_TLS
+    if (tls)
+    {
+        ERR_clear_error();
+        errno = 0;
+        return tls->result(SSL_read(tls->ssl_, buf, std::min(len, size_t(1) << 30)));
+    }
+#else
+    (void)tls;
+#endif
+    return ::recv(socket, buf, len, 0);
+}
+
+/**
+ * @param flags for send(), e.g. MSG_MORE; SSL_write has none
+ */
+ssize_t TLSConnection::send(TLSConnection* tls, int socket, const void* buf,
+                            size_t len, int flags)
+{
+#ifndef HTTP_NO_TLS
+    // With kernel TLS a plain send() is encrypted, and saves a copy
+    if (tls && !tls->kernel_send_)
+    {
+        ERR_clear_error();
+        errno = 0;
+        return tls->result(SSL_write(tls->ssl_, buf, std::min(len, size_t(1) << 30)));
+    }
+#else
+    (void)tls;
+#endif
+    return ::send(socket, buf, len, flags);
+}
+
+/**
+ * @summary sendfile(), encrypted by the kernel if possible, and otherwise a
+ * record's worth of the file read and sent with SSL_write
+ */
+ssize_t TLSConnection::sendfile(TLSConnection* tls, int socket, int fd,
+                                off_t* offset, size_t count)
+{
+#ifndef HTTP_NO_TLS
+    if (tls && !tls->kernel_send_)
+    {
+        char buffer[RECORD_SIZE];
+        ssize_t bytes_read = pread(fd, buffer, std::min(count, sizeof(buffer)),
+                                   *offset);
+        if (bytes_read <= 0)
+            return bytes_read;
+        ssize_t bytes_written = send(tls, socket, buffer, bytes_read);
+        if (bytes_written > 0)
+            *offset += bytes_written;
+        return bytes_written;
+    }
+#else
+    (void)tls;
+#endif
+#ifdef __APPLE__
+    char buffer[RECORD_SIZE];
+    ssize_t bytes_read = pread(fd, buffer, std::min(count, sizeof(buffer)),
+                               *offset);
+    if (bytes_read <= 0)
+        return bytes_read;
+    ssize_t bytes_written = ::send(socket, buffer, bytes_read, 0);
+    if (bytes_written > 0)
+        *offset += bytes_written;
+    return bytes_written;
+#else
+    return ::sendfile(socket, fd, offset, count);
+#endif
+}
+
+/**
+ * @param cert_file PEM certificate chain, leaf certificate first
+ * @param key_file PEM private key; may be the same file as `cert_file`
+ * @param http2 whether to offer h2 in ALPN
+ */
+TLSContext::TLSContext(const std::string& cert_file, const std::string& key_file,
+                       bool http2)
+    : ctx_(nullptr),
+      http2_(http2)
+{
+#ifndef HTTP_NO_TLS
+    ctx_ = SSL_CTX_new(TLS_server_method());
+    if (!ctx_)
+    {
+        LOG_ERROR << "SSL_CTX_new(): " << ssl_error() << LOG_END;
+        std::exit(1);
+    }
+    SSL_CTX_set_min_proto_version(ctx_, TLS1_2_VERSION);
+    // SSL_OP_ENABLE_KTLS makes OpenSSL move the session to the kernel after
+    // the handshake if the kernel and cipher allow it; clients that close
+    // without close_notify are common and harmless for HTTP/1.1 framing
+    SSL_CTX_set_options(ctx_, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Let non-blocking writes complete partially, and be retried from a
+    // different address (the async engine's buffer may be reallocated)
+    SSL_CTX_set_mode(ctx_, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                           SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(ctx_, cert_file.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx_, key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx_) != 1)
+    {
+        LOG_ERROR << "Loading TLS certificate " << cert_file << " and key "
+                  << key_file << ": " << ssl_error() << LOG_END;
+        std::exit(1);
+    }
+    SSL_CTX_set_alpn_select_cb(ctx_, select_alpn, this);
+#else
+    LOG_ERROR << "Built without TLS support; can't use " << cert_file
+              << " and " << key_file << LOG_END;
+    std::exit(1);
+#endif
+}
+
+/**
+ * @summary Picks the protocol from the client's ALPN list: h2 if we offer
+ * it, otherwise http/1.1; clients offering neither get no ALPN answer
+ */
+int TLSContext::select_alpn(SSL* ssl, const unsigned char** out,
+                            unsigned char* out_len, const unsigned char* in,
+                            unsigned int in_len, void* arg)
+{
+#ifndef HTTP_NO_TLS
+    (void)ssl;
+    static const unsigned char h2_first[] = "\x02h2\x08http/1.1";
+    static const unsigned char http1[] = "\x08http/1.1";
+    bool http2 = static_cast<const TLSContext*>(arg)->http2_;
+    const unsigned char* ours = http2 ? h2_first : http1;
+    unsigned int ours_len = http2 ? sizeof(h2_first) - 1 : sizeof(http1) - 1;
+    unsigned char* selected;
+    if (SSL_select_next_proto(&selected, out_len, ours, ours_len, in,
+                              in_len) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+#else
+    (void)ssl; (void)out; (void)out_len; (void)in; (void)in_len; (void)arg;
+    return 0;
+#endif
+}
+
+TLSContext::~TLSContext()
+{
+#ifndef HTTP_NO_TLS
+    SSL_CTX_free(ctx_);
+#endif
+}
+
+/**
+ * @return the TLS state for a newly accepted client, ready for handshake()
+ */
+std::unique_ptr<TLSConnection> TLSContext::accept(int socket) const
+{
+#ifndef HTTP_NO_TLS
+    SSL* ssl = SSL_new(ctx_);
+    if (!ssl)
+    {
+        LOG_ERROR << "SSL_new(): " << ssl_error() << LOG_END;
+        return nullptr;
+    }
+    SSL_set_fd(ssl, socket);
+    return std::unique_ptr<TLSConnection>(new TLSConnection(ssl));
+#else
+    (void)socket;
+    return nullptr;
+#endif
+}
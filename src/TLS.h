@@ -0,0 +1,93 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>  // for off_t, ssize_t
+
+#include <cstddef>      // for size_t
+#include <memory>       // for unique_ptr
+#include <string>       // for string
+
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+
+/**
+ * @summary One TLS connection. OpenSSL does the handshake in user space and
+ * then, where the kernel supports it, hands the session keys to the kernel
+ * (kTLS). With kernel encryption on, plain send() and sendfile() on the
+ * socket produce TLS records, so file bodies keep their zero-copy path;
+ * otherwise writes go through SSL_write, and sendfile() becomes pread() and
+ * SSL_write(). Reads always go through SSL_read, which uses kernel
+ * decryption when it is on.
+ *
+ * The static recv/send/sendfile functions take a null `tls` for plaintext
+ * connections, and report errors like the system calls they replace:
+ * -1 with errno set, EAGAIN when the socket isn't ready.
+ */
+class TLSConnection
+{
+public:
+    enum Status
+    {
+        OK,
+        WANT_READ,
+        WANT_WRITE,
+        FAILED
+    };
+
+    // Largest TLS record payload: reading at least this much at a time
+    // leaves nothing decrypted but unread inside OpenSSL, where poll()
+    // can't see it
+    static const size_t RECORD_SIZE = 16384;
+
+    explicit TLSConnection(SSL* ssl);
+    TLSConnection(const TLSConnection&) = delete; // prevent copy
+    TLSConnection& operator=(const TLSConnection&) = delete; // prevent assignment
+    ~TLSConnection();
+
+    Status handshake();
+    void   shutdown();
+    size_t pending() const;
+    bool   kernel_send() const { return kernel_send_; }
+    bool   http2() const { return http2_; }
+
+    static ssize_t recv(TLSConnection* tls, int socket, void* buf, size_t len);
+    static ssize_t send(TLSConnection* tls, int socket, const void* buf,
+                        size_t len, int flags = 0);
+    static ssize_t sendfile(TLSConnection* tls, int socket, int fd,
+                            off_t* offset, size_t count);
+
+private:
+    ssize_t result(int ret);
+
+    SSL* ssl_;
+    bool kernel_send_;
+    bool http2_;       // ALPN chose h2
+};
+
+/**
+ * @summary The server's certificate and TLS settings, from which every
+ * connection's TLSConnection is made. Exits if the certificate or key can't
+ * be loaded, or if the server was built without TLS (`make notls`).
+ * ALPN offers http/1.1, and h2 first if `http2`.
+ */
+class TLSContext
+{
+public:
+    TLSContext(const std::string& cert_file, const std::string& key_file,
+               bool http2);
+    TLSContext(const TLSContext&) = delete; // prevent copy
+    TLSContext& operator=(const TLSContext&) = delete; // prevent assignment
+    ~TLSContext();
+
+    std::unique_ptr<TLSConnection> accept(int socket) const;
+
+private:
+    static int select_alpn(SSL* ssl, const unsigned char** out,
+                           unsigned char* out_len, const unsigned char* in,
+                           unsigned int in_len, void* arg);
+
+    SSL_CTX* ctx_;
+    bool     http2_;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "Tracing.h"
+#include "logging.h"  // for LOG_END, LOG_ERROR, LOG_INFO
+
+#include <cerrno>     // for errno
+#include <cstring>    // for strerror
+#include <fstream>    // for ofstream
+#include <iostream>   // for cerr, ostream
+#include <mutex>      // for mutex, lock_guard
+#include <string>     // for string
+#include <vector>     // for vector
+
+std::atomic<bool> Tracer::enabled_(false);
+std::atomic<bool> Tracer::dump_requested_(false);
+
+namespace
+{
+/**
+ * @summary A slow request as stored in the ring buffer
+ */
+struct TraceEntry
+{
+    int         conn_ = -1;
+    std::string path_;
+    std::string status_;
+    uint64_t    stamps_[RequestTrace::NUM_PHASES] = {};
+};
+
+// Names of the interval that ends at each phase
+const char* const phase_names[RequestTrace::NUM_PHASES] = {
+    "request", "parse", "open", "send headers", "send body"
+};
+
+// Configuration is written once by Tracer::enable() before serving starts
+uint64_t slow_threshold_ns = 0;
+std::string dump_path;
+bool chrome_format = false;
+
+// Only slow requests get here, so a plain mutex is cheap enough
+std::mutex ring_mutex;
+TraceEntry ring[Tracer::RING_SIZE];
+uint64_t ring_next = 0;
+
+uint64_t last_stamp(const uint64_t* stamps)
+{
+    for (int i = RequestTrace::NUM_PHASES - 1; i >= 0; i--)
+    {
+        if (stamps[i])
+            return stamps[i];
+    }
+    return 0;
+}
+
+void write_text(std::ostream& os, const TraceEntry& entry)
+{
+    uint64_t start = entry.stamps_[RequestTrace::START];
+    os << entry.status_ << ' ' << entry.path_ << " conn=" << entry.conn_
+       << " total=" << (last_stamp(entry.stamps_) - start) / 1000 << "us";
+    for (int i = RequestTrace::PARSED; i < RequestTrace::NUM_PHASES; i++)
+    {
+        if (entry.stamps_[i] && entry.stamps_[i - 1])
+        {
+            os << ' ' << phase_names[i] << '='
+               << (entry.stamps_[i] - entry.stamps_[i - 1]) / 1000 << "us";
+        }
+    }
+    os << '\n';
+}
+
+void write_event(std::ostream& os, bool& first, const std::string& name,
+                 int tid, uint64_t begin, uint64_t end)
+{
+    os << (first ? "\n" : ",\n")
+       << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+       << ",\"ts\":" << begin / 1000.0 << ",\"dur\":" << (end - begin) / 1000.0
+       << '}';
+    first = false;
+}
+
+/**
+ * @summary Writes the ring in the Chrome trace-event format, loadable in
+ * chrome://tracing or Perfetto; each request is a complete ("X") event with
+ * its phases nested underneath, on a track per connection
+ */
+void write_chrome(std::ostream& os, const TraceEntry* entries, size_t count)
+{
+    bool first = true;
+    os << "{\"traceEvents\":[";
+    for (size_t n = 0; n < count; n++)
+    {
+        const TraceEntry& entry = entries[n];
+        uint64_t start = entry.stamps_[RequestTrace::START];
+        std::string name;
+        for (char c : entry.status_ + ' ' + entry.path_)
+        {
+            // Keep the JSON valid whatever the client asked for
+            if (c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20)
+                c = '_';
+            name += c;
+        }
+        write_event(os, first, name, entry.conn_, start,
+                    last_stamp(entry.stamps_));
+        for (int i = RequestTrace::PARSED; i < RequestTrace::NUM_PHASES; i++)
+        {
+            if (entry.stamps_[i] && entry.stamps_[i - 1])
+            {
+                write_event(os, first, phase_names[i], entry.conn_,
+                            entry.stamps_[i - 1], entry.stamps_[i]);
+            }
+        }
+    }
+    os << "\n]}\n";
+}
+}
+
+/**
+ * @summary Turns on request tracing
+ *
+ * @param slow_threshold_us only requests taking at least this long are kept
+ * @param path file to write dumps to; standard error if empty
+ * @param chrome write Chrome trace-event JSON instead of one line per request
+ */
+void Tracer::enable(uint64_t slow_threshold_us, const std::string& path,
+                    bool chrome)
+{
+    slow_threshold_ns = slow_threshold_us * 1000;
+    dump_path = path;
+    chrome_format = chrome;
+    enabled_ = true;
+}
+
+void Tracer::record(const RequestTrace& trace, int conn,
+                    const std::string& path, const std::string& status)
+{
+    uint64_t start = trace.stamps_[RequestTrace::START];
+    if (!start || last_stamp(trace.stamps_) - start < slow_threshold_ns)
+        return;
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    TraceEntry& entry = ring[ring_next++ % RING_SIZE];
+    entry.conn_ = conn;
+    entry.path_ = path;
+    entry.status_ = status;
+    for (int i = 0; i < RequestTrace::NUM_PHASES; i++)
+        entry.stamps_[i] = trace.stamps_[i];
+}
+
+void Tracer::request_dump()
+{
+    dump_requested_.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * @summary Called from the serving loops; performs a dump requested by the
+ * signal handler outside of signal context
+ */
+void Tracer::dump_if_requested()
+{
+    if (dump_requested_.load(std::memory_order_relaxed) &&
+        dump_requested_.exchange(false))
+    {
+        dump();
+    }
+}
+
+/**
+ * @summary Writes every trace currently in the ring buffer, oldest first
+ */
+void Tracer::dump()
+{
+    std::vector<TraceEntry> entries;
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        uint64_t first = ring_next > RING_SIZE ? ring_next - RING_SIZE : 0;
+        for (uint64_t i = first; i < ring_next; i++)
+            entries.push_back(ring[i % RING_SIZE]);
+    }
+    std::ofstream file;
+    if (!dump_path.empty())
+    {
+        // Chrome traces must be a single JSON document, so they replace the
+        // previous dump; text dumps accumulate
+        file.open(dump_path, chrome_format ? std::ios::trunc : std::ios::app);
+        if (!file)
+        {
+            LOG_ERROR << "Opening trace dump " << dump_path << ": "
+                      << std::strerror(errno) << LOG_END;
+            return;
+        }
+    }
+    std::ostream& os = dump_path.empty() ? std::cerr : file;
+    if (chrome_format)
+    {
+        write_chrome(os, entries.data(), entries.size());
+    }
+    else
+    {
+        os << "--- " << entries.size() << " slow requests ---\n";
+        for (const TraceEntry& entry : entries)
+            write_text(os, entry);
+    }
+    os.flush();
+    LOG_INFO << "Dumped " << entries.size() << " request traces" << LOG_END;
+}
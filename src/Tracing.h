@@ -0,0 +1,92 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+#include "Metrics.h"  // for Metrics
+
+#include <atomic>     // for atomic
+#include <cstdint>    // for uint64_t
+#include <string>     // for string
+
+/**
+ * @summary Timestamps for the phases of a single request/response.
+ * Building with -DHTTP_NO_TRACING compiles every call down to nothing;
+ * otherwise each mark() costs one branch on Tracer::enabled() and, when
+ * tracing is on, one clock read.
+ */
+class RequestTrace
+{
+public:
+    enum Phase
+    {
+        START,        // first byte of the request seen
+        PARSED,       // HTTPRequest constructed
+        OPENED,       // file opened and fstat'd (or response prepared)
+        HEADERS_SENT, // response headers fully written (WRITE_RESPONSE done)
+        BODY_SENT,    // body fully written (WRITE_FILE done)
+        NUM_PHASES
+    };
+
+    void reset();
+    void mark(Phase phase);
+    void finish(int conn, const std::string& path, const std::string& status);
+
+    uint64_t stamps_[NUM_PHASES] = {};
+};
+
+/**
+ * @summary Collects traces of requests slower than a threshold into a fixed
+ * size ring buffer, which is written out when a dump is requested (SIGUSR1)
+ */
+class Tracer
+{
+public:
+    static const int RING_SIZE = 1024;
+
+    static void enable(uint64_t slow_threshold_us, const std::string& dump_path,
+                       bool chrome_format);
+    static bool enabled();
+
+    static void record(const RequestTrace& trace, int conn,
+                       const std::string& path, const std::string& status);
+
+    // Async-signal-safe: only sets a flag for dump_if_requested()
+    static void request_dump();
+    static void dump_if_requested();
+    static void dump();
+
+private:
+    static std::atomic<bool> enabled_;
+    static std::atomic<bool> dump_requested_;
+};
+
+inline bool Tracer::enabled()
+{
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+#ifdef HTTP_NO_TRACING
+inline void RequestTrace::reset() {}
+inline void RequestTrace::mark(Phase) {}
+inline void RequestTrace::finish(int, const std::string&, const std::string&) {}
+#else
+inline void RequestTrace::reset()
+{
+    for (uint64_t& stamp : stamps_)
+        stamp = 0;
+}
+
+inline void RequestTrace::mark(Phase phase)
+{
+    if (Tracer::enabled())
+        stamps_[phase] = Metrics::now_ns();
+}
+
+inline void RequestTrace::finish(int conn, const std::string& path,
+                                 const std::string& status)
+{
+    if (Tracer::enabled())
+        Tracer::record(*this, conn, path, status);
+}
+#endif
+
+#endif
@@ -0,0 +1,397 @@
+#include "Upload.h"
+#include "TLS.h"           // for TLSConnection
+#include "logging.h"       // for LOG_END, LOG_ERROR
+
+#include <fcntl.h>         // for openat, splice, O_CREAT, O_TMPFILE, etc
+#include <sys/socket.h>    // for recv
+#include <sys/stat.h>      // for fstatat
+#include <unistd.h>        // for close, getpid, linkat, pipe2, read, write
+
+#include <algorithm>       // for min
+#include <atomic>          // for atomic
+#include <cctype>          // for isxdigit, tolower
+#include <cerrno>          // for errno, EINTR, EAGAIN, EEXIST, EOPNOTSUPP
+#include <cstdio>          // for renameat
+#include <cstring>         // for memchr, strerror
+#include <string>          // for string, to_string
+
+/**
+ * @param dirfd the directory the file goes in; owned by the upload
+ * @param name the file's name within `dirfd`
+ * @param length the Content-Length of the body, if not `chunked`
+ * @param max_size largest body accepted, 0 = no limit
+ */
+Upload::Upload(int dirfd, const std::string& name, off_t length, bool chunked,
+               off_t max_size)
+    : dirfd_(dirfd),
+      name_(name),
+      fd_(-1),
+      remaining_(chunked ? 0 : length),
+      chunked_(chunked),
+      chunk_state_(CHUNK_SIZE),
+      max_size_(max_size),
+      received_(0),
+      pipe_{-1, -1},
+      use_splice_(true),
+      error_status_(nullptr)
+{
+}
+
+Upload::~Upload()
+{
+    if (fd_ != -1)
+        close(fd_);
+    // Never finished, so the partial file goes
+    if (!temp_name_.empty())
+        unlinkat(dirfd_, temp_name_.c_str(), 0);
+    if (pipe_[0] != -1)
+    {
+        close(pipe_[0]);
+        close(pipe_[1]);
+    }
+    close(dirfd_);
+}
+
+/**
+ * @summary Creates the temporary file the body is written to
+ *
+ * @return false (with errno set) if it can't be created
+ */
+bool Upload::start()
+{
+#ifdef O_TMPFILE
+    // Nameless until commit(), so nobody can request or index it meanwhile
+    fd_ = openat(dirfd_, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd_ != -1)
+        return true;
+    // Not every filesystem supports it
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+        return false;
+#endif
+    return create_temp();
+}
+
+/**
+ * @summary Creates a new hidden file with a unique TEMP_PREFIX name in the
+ * target directory, opening it as fd_ unless `linked` is given, in which
+ * case `linked` (an open O_TMPFILE file) is linked there instead
+ *
+ * @return false (with errno set) if it can't be created
+ */
+bool Upload::create_temp(int linked)
+{
+    static std::atomic<unsigned> counter(0);
+    for (int attempt = 0; attempt < 16; attempt++)
+    {
+        temp_name_ = TEMP_PREFIX + std::to_string(getpid()) + "-" +
+                     std::to_string(counter++);
+        if (linked == -1)
+        {
+            fd_ = openat(dirfd_, temp_name_.c_str(),
+                         O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd_ != -1)
+                return true;
+        }
+        else
+        {
+            // AT_EMPTY_PATH would need CAP_DAC_READ_SEARCH
+            std::string proc = "/proc/self/fd/" + std::to_string(linked);
+            if (linkat(AT_FDCWD, proc.c_str(), dirfd_, temp_name_.c_str(),
+                       AT_SYMLINK_FOLLOW) == 0)
+            {
+                return true;
+            }
+        }
+        if (errno != EEXIST)
+            break;
+    }
+    int saved = errno;
+    temp_name_.clear();
+    errno = saved;
+    return false;
+}
+
+/**
+ * @return whether a directory entry is an upload's temporary file
+ */
+bool Upload::is_temp_name(const std::string& name)
+{
+    return name.compare(0, sizeof(TEMP_PREFIX) - 1, TEMP_PREFIX) == 0;
+}
+
+/**
+ * @summary Takes as much of the body as `data` holds (e.g. what was read
+ * along with the request headers) off its front; anything after the end of
+ * the body is left there
+ */
+Upload::Status Upload::consume(std::string& data)
+{
+    size_t used = 0;
+    Status status = feed(data.data(), data.size(), used);
+    data.erase(0, used);
+    return status;
+}
+
+/**
+ * @summary Reads the next piece of the body from `socket`. Blocking sockets
+ * wait for it; non-blocking ones return MORE if there is nothing to read.
+ *
+ * @param tls the connection's TLS state, or nullptr for plaintext
+ * @param leftover receives whatever was read past the end of the body
+ */
+Upload::Status Upload::receive(int socket, TLSConnection* tls,
+                               std::string& leftover)
+{
+    if (error_status_)
+        return FAILED;
+    if (!chunked_ && remaining_ == 0)
+        return DONE;
+#ifdef __linux__
+    if (!chunked_ && use_splice_ && !tls)
+    {
+        Status status;
+        if (splice_body(socket, status))
+            return status;
+        // splice doesn't work for this socket or file, so fall back to
+        // copying through a buffer
+        use_splice_ = false;
+    }
+#endif
+    char buffer[BUFFER_SIZE];
+    size_t want = BUFFER_SIZE;
+    // Never read past a Content-Length body, into the next request; TLS
+    // reads whole records instead, so none is left half read
+    if (!chunked_ && !tls)
+        want = std::min<off_t>(want, remaining_);
+    ssize_t bytes_read = TLSConnection::recv(tls, socket, buffer, want);
+    if (bytes_read < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return MORE;
+        LOG_ERROR << "recv(): " << std::strerror(errno) << LOG_END;
+        return fail("400");
+    }
+    if (bytes_read == 0)
+    {
+        LOG_ERROR << "Connection closed during upload" << LOG_END;
+        return fail("400");
+    }
+    size_t used = 0;
+    Status status = feed(buffer, bytes_read, used);
+    if (status == DONE)
+        leftover.append(buffer + used, bytes_read - used);
+    return status;
+}
+
+/**
+ * @summary Closes the finished file and renames it over the target
+ *
+ * @param created set to whether the target didn't exist before
+ * @return false (with errno set) if the rename failed
+ */
+bool Upload::commit(bool& created)
+{
+    // An O_TMPFILE file gets a (temporary) name first, since linkat() can't
+    // replace an existing target the way renameat() does
+    if (temp_name_.empty() && !create_temp(fd_))
+        return false;
+    close(fd_);
+    fd_ = -1;
+    struct stat st;
+    created = fstatat(dirfd_, name_.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1;
+    if (renameat(dirfd_, temp_name_.c_str(), dirfd_, name_.c_str()) == -1)
+        return false;
+    temp_name_.clear();
+    return true;
+}
+
+Upload::Status Upload::feed(const char* data, size_t size, size_t& used)
+{
+    if (error_status_)
+        return FAILED;
+    if (chunked_)
+        return feed_chunked(data, size, used);
+    used = std::min<off_t>(size, remaining_);
+    if (!write_file(data, used))
+        return fail("500");
+    received_ += used;
+    remaining_ -= used;
+    return remaining_ == 0 ? DONE : MORE;
+}
+
+/**
+ * @summary Decodes a chunked body: chunk-size lines (extensions are
+ * ignored), chunk data, and after the last chunk the trailers, which are
+ * skipped. Lines are collected in `line_`, which is never allowed to grow
+ * past MAX_LINE.
+ */
+Upload::Status Upload::feed_chunked(const char* data, size_t size,
+                                    size_t& used)
+{
+    used = 0;
+    while (used < size && chunk_state_ != FINISHED)
+    {
+        if (chunk_state_ == CHUNK_DATA)
+        {
+            size_t length = std::min<off_t>(size - used, remaining_);
+            if (!write_file(data + used, length))
+                return fail("500");
+            received_ += length;
+            used += length;
+            remaining_ -= length;
+            if (remaining_ == 0)
+                chunk_state_ = CHUNK_CRLF;
+            continue;
+        }
+        // Every other state reads a line
+        const char* newline = static_cast<const char*>(
+            std::memchr(data + used, '\n', size - used));
+        size_t length = newline ? newline - (data + used) + 1 : size - used;
+        if (line_.size() + length > MAX_LINE)
+            return fail("400");
+        line_.append(data + used, length);
+        used += length;
+        if (!newline)
+            break;
+        line_.pop_back();
+        if (!line_.empty() && line_.back() == '\r')
+            line_.pop_back();
+        if (chunk_state_ == CHUNK_CRLF)
+        {
+            if (!line_.empty())
+                return fail("400");
+            chunk_state_ = CHUNK_SIZE;
+        }
+        else if (chunk_state_ == TRAILERS)
+        {
+            if (line_.empty())
+                chunk_state_ = FINISHED;
+        }
+        else // CHUNK_SIZE
+        {
+            off_t chunk = 0;
+            size_t digits = 0;
+            for (; digits < line_.size() && std::isxdigit(
+                       static_cast<unsigned char>(line_[digits])); digits++)
+            {
+                // 15 hex digits is already far beyond any size limit
+                if (digits == 15)
+                    return fail("413");
+                char c = std::tolower(line_[digits]);
+                chunk = chunk * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+            }
+            if (digits == 0 ||
+                (digits < line_.size() && line_[digits] != ';' &&
+                 line_[digits] != ' ' && line_[digits] != '\t'))
+            {
+                return fail("400");
+            }
+            if (chunk == 0)
+            {
+                chunk_state_ = TRAILERS;
+            }
+            else
+            {
+                if (max_size_ > 0 && received_ + chunk > max_size_)
+                    return fail("413");
+                remaining_ = chunk;
+                chunk_state_ = CHUNK_DATA;
+            }
+        }
+        line_.clear();
+    }
+    return chunk_state_ == FINISHED ? DONE : MORE;
+}
+
+bool Upload::write_file(const char* data, size_t size)
+{
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t ret = write(fd_, data + written, size - written);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR << "write(): " << std::strerror(errno) << LOG_END;
+            return false;
+        }
+        written += ret;
+    }
+    return true;
+}
+
+Upload::Status Upload::fail(const char* status)
+{
+    error_status_ = status;
+    return FAILED;
+}
+
+#ifdef __linux__
+/**
+ * @summary Moves the next piece of a Content-Length body from the socket to
+ * the file through a pipe, without copying it to user space
+ *
+ * @return false, having moved nothing, if splice isn't supported here
+ */
+bool Upload::splice_body(int socket, Status& status)
+{
+    if (pipe_[0] == -1 && pipe2(pipe_, O_CLOEXEC) == -1)
+    {
+        pipe_[0] = pipe_[1] = -1;
+        return false;
+    }
+    // The pipe is always empty here, and holds BUFFER_SIZE bytes
+    size_t want = std::min<off_t>(remaining_, BUFFER_SIZE);
+    ssize_t moved = splice(socket, nullptr, pipe_[1], nullptr, want,
+                           SPLICE_F_MOVE);
+    if (moved < 0)
+    {
+        if (errno == EINVAL)
+            return false;
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            status = MORE;
+            return true;
+        }
+        LOG_ERROR << "splice(): " << std::strerror(errno) << LOG_END;
+        status = fail("400");
+        return true;
+    }
+    if (moved == 0)
+    {
+        LOG_ERROR << "Connection closed during upload" << LOG_END;
+        status = fail("400");
+        return true;
+    }
+    ssize_t left = moved;
+    while (left > 0)
+    {
+        ssize_t ret = splice(pipe_[0], nullptr, fd_, nullptr, left,
+                             SPLICE_F_MOVE);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EINVAL)
+        {
+            // The file system can't splice; copy out what the pipe holds
+            // and use the buffer from now on
+            use_splice_ = false;
+            char buffer[BUFFER_SIZE];
+            ret = read(pipe_[0], buffer, left);
+            if (ret > 0 && !write_file(buffer, ret))
+                ret = -1;
+        }
+        if (ret <= 0)
+        {
+            LOG_ERROR << "splice(): " << std::strerror(errno) << LOG_END;
+            status = fail("500");
+            return true;
+        }
+        left -= ret;
+    }
+    received_ += moved;
+    remaining_ -= moved;
+    status = remaining_ == 0 ? DONE : MORE;
+    return true;
+}
+#endif
@@ -0,0 +1,86 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <sys/types.h>  // for off_t
+
+#include <cstddef>      // for size_t
+#include <string>       // for string
+
+class TLSConnection;
+
+/**
+ * @summary A request body being streamed into a file. The body is written
+ * to an unnamed O_TMPFILE file in the target's directory, which is linked
+ * and renamed over the target once the whole body has arrived (and simply
+ * closed if it never does), so readers only ever see complete files. Where
+ * O_TMPFILE isn't supported, the temporary file is a hidden TEMP_PREFIX
+ * file next to the target instead, which the FileIndex leaves out.
+ * Bodies framed by Content-Length are moved from the socket to the file
+ * with splice where available; chunked bodies go through a fixed-size
+ * buffer. Either way memory use doesn't depend on the size of the upload.
+ */
+class Upload
+{
+public:
+    enum Status
+    {
+        MORE,   // waiting for more of the body
+        DONE,   // the whole body has been written
+        FAILED  // see error_status()
+    };
+
+    Upload(int dirfd, const std::string& name, off_t length, bool chunked,
+           off_t max_size);
+    Upload(const Upload&) = delete; // prevent copy
+    Upload& operator=(const Upload&) = delete; // prevent assignment
+    ~Upload();
+
+    bool   start();
+    Status consume(std::string& data);
+    Status receive(int socket, TLSConnection* tls, std::string& leftover);
+    bool   commit(bool& created);
+
+    static bool is_temp_name(const std::string& name);
+
+    off_t       received() const { return received_; }
+    const char* error_status() const { return error_status_; }
+
+private:
+    static const size_t BUFFER_SIZE = 65536;
+    static const size_t MAX_LINE = 1024;
+    static constexpr char TEMP_PREFIX[] = ".upload-";
+
+    enum ChunkState
+    {
+        CHUNK_SIZE,   // reading a chunk-size line
+        CHUNK_DATA,   // copying chunk data
+        CHUNK_CRLF,   // skipping the CRLF after chunk data
+        TRAILERS,     // skipping trailer lines after the last chunk
+        FINISHED
+    };
+
+    Status feed(const char* data, size_t size, size_t& used);
+    Status feed_chunked(const char* data, size_t size, size_t& used);
+    bool   write_file(const char* data, size_t size);
+    bool   create_temp(int linked = -1);
+    Status fail(const char* status);
+#ifdef __linux__
+    bool   splice_body(int socket, Status& status);
+#endif
+
+    int         dirfd_;
+    std::string name_;
+    std::string temp_name_;    // empty while the file is nameless
+    int         fd_;
+    off_t       remaining_;    // body (or current chunk) bytes still to come
+    bool        chunked_;
+    ChunkState  chunk_state_;
+    std::string line_;         // partial chunk-size or trailer line
+    off_t       max_size_;
+    off_t       received_;
+    int         pipe_[2];      // for splicing from the socket to the file
+    bool        use_splice_;
+    const char* error_status_;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include "HTTPClient.h"           // for HTTPClient
+#include "HTTPRequest.h"          // for HTTPRequest
+#include "HTTPResponse.h"         // for HTTPResponse
+
+#include <algorithm>              // for sort
+#include <atomic>                 // for atomic
+#include <chrono>                 // for steady_clock, duration_cast
+#include <cstdint>                // for uint64_t
+#include <cstdio>                 // for printf
+#include <cstdlib>                // for atoi, exit
+#include <cstring>                // for strcmp
+#include <iostream>               // for operator<<, cout
+#include <regex>                  // for regex, smatch, regex_search
+#include <string>                 // for string
+#include <thread>                 // for thread
+#include <vector>                 // for vector
+
+/**
+ * A closed-loop latency benchmark: each of `connections` threads sends GETs
+ * for a URL one after another over a keep-alive connection, and the
+ * latency percentiles of every request after the warmup are printed. With
+ * several URLs (e.g. the same server started with and without --busy-poll,
+ * on two ports) each is run in turn and gets a row, for comparison.
+ */
+
+struct Options
+{
+    int connections = 1;
+    int seconds = 10;
+    int warmup = 1;
+};
+
+struct URL
+{
+    std::string hostname_;
+    std::string port_;
+    std::string path_;
+};
+
+static uint64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static URL parse_url(const char* input)
+{
+    const std::regex url_regex(R"(^(?:http:\/\/)?([^\/:]+)(?::(\d+))?(.*)$)");
+    std::string url_string(input);
+    std::smatch regex_match;
+    if (!std::regex_search(url_string, regex_match, url_regex))
+    {
+        std::cout << "URL could not be parsed: " << url_string << '\n';
+        std::exit(1);
+    }
+    URL parsed;
+    parsed.hostname_ = regex_match[1];
+    parsed.port_ = (regex_match[2] == "" ? std::string("80") : regex_match[2]);
+    parsed.path_ = (regex_match[3] == "" ? std::string("/") : regex_match[3]);
+    return parsed;
+}
+
+/**
+ * @summary Runs the benchmark against one URL and prints its row
+ */
+static void run(const char* url, const Options& options)
+{
+    const URL target = parse_url(url);
+    HTTPRequest request;
+    request.set_verb("GET");
+    request.set_path(target.path_);
+    request.set_version("HTTP/1.1");
+    request.set_header("Connection", "keep-alive");
+    request.set_header("Host", target.hostname_);
+    HTTPClient::Options client_options;
+    client_options.max_idle_per_origin = options.connections;
+    HTTPClient client(client_options);
+
+    const uint64_t start = now_us() + options.warmup * 1000000ull;
+    const uint64_t end = start + options.seconds * 1000000ull;
+    std::atomic<uint64_t> errors(0);
+    std::vector<std::vector<uint64_t>> latencies(options.connections);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < options.connections; i++)
+    {
+        threads.emplace_back([&, i]()
+        {
+            std::vector<uint64_t>& mine = latencies[i];
+            uint64_t now = now_us();
+            while (now < end)
+            {
+                HTTPResponse response;
+                HTTPClient::Status status = client.fetch(target.hostname_,
+                                                         target.port_,
+                                                         request, response);
+                uint64_t done = now_us();
+                if (status != HTTPClient::OK || response.status() != "200")
+                    errors++;
+                else if (now >= start)
+                    mine.push_back(done - now);
+                now = done;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    std::vector<uint64_t> all;
+    for (const std::vector<uint64_t>& mine : latencies)
+        all.insert(all.end(), mine.begin(), mine.end());
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) -> uint64_t
+    {
+        return all.empty() ? 0 : all[static_cast<size_t>(p * (all.size() - 1))];
+    };
+    std::printf("%-40s %10zu %10.0f %8lu %8lu %8lu %8lu %8lu %8lu\n", url,
+                all.size(), all.size() / static_cast<double>(options.seconds),
+                (unsigned long)percentile(0.5), (unsigned long)percentile(0.9),
+                (unsigned long)percentile(0.99), (unsigned long)percentile(0.999),
+                (unsigned long)(all.empty() ? 0 : all.back()),
+                (unsigned long)errors.load());
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2)
+    {
+        if (std::strcmp(argv[first], "-c") == 0)
+            options.connections = std::max(1, std::atoi(argv[first + 1]));
+        else if (std::strcmp(argv[first], "-d") == 0)
+            options.seconds = std::max(1, std::atoi(argv[first + 1]));
+        else if (std::strcmp(argv[first], "-w") == 0)
+            options.warmup = std::max(0, std::atoi(argv[first + 1]));
+        else
+            break;
+    }
+    if (first >= argc || argv[first][0] == '-')
+    {
+        std::cout << "Usage: " << argv[0]
+                  << " [-c CONNECTIONS] [-d SECONDS] [-w WARMUP_SECONDS] URL ...\n"
+                  << "Requests each URL in turn from CONNECTIONS (1) keep-alive\n"
+                  << "connections for SECONDS (10) after a warmup (1), and prints\n"
+                  << "the request latency percentiles in microseconds.\n";
+        std::exit(1);
+    }
+    std::printf("%-40s %10s %10s %8s %8s %8s %8s %8s %8s\n", "url", "requests",
+                "req/s", "p50", "p90", "p99", "p99.9", "max", "errors");
+    for (int i = first; i < argc; i++)
+        run(argv[i], options);
+}
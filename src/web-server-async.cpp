@@ -1,21 +1,34 @@
-#include "HTTPServer.h"  // for HTTPServer
+#include "HTTPServer.h"    // for HTTPServer
+#include "ServerConfig.h"  // for ServerConfig
 
-#include <cstdlib>       // for exit
-#include <iostream>      // for operator<<, basic_ostream, char_traits, cout
-#include <string>        // for string
+#include <cstdlib>         // for exit
+#include <cstring>         // for strcmp
+#include <exception>       // for exception
+#include <iostream>        // for operator<<, basic_ostream, char_traits, cout
 
 
 int main(int argc, char** argv)
 {
-    if (argc > 4)
+    ServerConfig config;
+    // This executable defaults to the poll() engine
+    config.engine = ServerConfig::POLL;
+    for (int i = 1; i < argc; i++)
     {
-        std::cout << "Usage: " << argv[0] << " [hostname] [port] [file-dir]\n";
+        if (std::strcmp(argv[i], "-h") == 0 || std::strcmp(argv[i], "--help") == 0)
+        {
+            std::cout << ServerConfig::usage(argv[0]);
+            std::exit(0);
+        }
+    }
+    try
+    {
+        config.parse_args(argc, argv);
+    } catch (const std::exception& ex)
+    {
+        std::cout << ex.what() << '\n' << ServerConfig::usage(argv[0]);
         std::exit(1);
     }
-    std::string hostname(argc >= 2 ? argv[1] : "localhost");
-    std::string port(argc >= 3 ? argv[2] : "4000");
-    std::string filedir(argc == 4 ? argv[3] : ".");
-    HTTPServer server(hostname, port, filedir);
+    HTTPServer server(config);
     server.install_signal_handler();
-    server.run_async();
+    server.serve();
 }